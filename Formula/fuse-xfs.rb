@@ -30,6 +30,7 @@ class FuseXfs < Formula
       bin.install "#{buildpath}/build/bin/fuse-xfs"
       bin.install "#{buildpath}/build/bin/xfs-cli"
       bin.install "#{buildpath}/build/bin/xfs-rcopy"
+      bin.install "#{buildpath}/build/bin/xfs-defrag"
       
       # Install mkfs.xfs if built
       if File.exist?("#{buildpath}/build/bin/mkfs.xfs")
@@ -82,5 +83,6 @@ class FuseXfs < Formula
     # Check fuse-xfs binary exists
     assert_predicate bin/"fuse-xfs", :exist?
     assert_predicate bin/"xfs-rcopy", :exist?
+    assert_predicate bin/"xfs-defrag", :exist?
   end
 end
\ No newline at end of file
@@ -37,7 +37,7 @@ log_error() {
 
 # Check if binaries exist
 check_binaries() {
-    local binaries=("fuse-xfs" "xfs-cli" "xfs-rcopy")
+    local binaries=("fuse-xfs" "xfs-cli" "xfs-rcopy" "xfs-defrag")
     local missing=0
     
     for binary in "${binaries[@]}"; do
@@ -75,6 +75,7 @@ copy_binaries() {
     cp "$BUILD_DIR/bin/fuse-xfs" "$STAGE_DIR/usr/local/bin/"
     cp "$BUILD_DIR/bin/xfs-cli" "$STAGE_DIR/usr/local/bin/"
     cp "$BUILD_DIR/bin/xfs-rcopy" "$STAGE_DIR/usr/local/bin/"
+    cp "$BUILD_DIR/bin/xfs-defrag" "$STAGE_DIR/usr/local/bin/"
     
     # Also copy mkfs.xfs if it exists
     if [ -f "$BUILD_DIR/bin/mkfs.xfs" ]; then
@@ -188,6 +189,7 @@ create_resources() {
         <li><code>/usr/local/bin/fuse-xfs</code> - FUSE filesystem driver</li>
         <li><code>/usr/local/bin/xfs-cli</code> - Command-line interface</li>
         <li><code>/usr/local/bin/xfs-rcopy</code> - Recursive copy utility</li>
+        <li><code>/usr/local/bin/xfs-defrag</code> - Offline defragmenter</li>
         <li>Man pages in <code>/usr/local/share/man/</code></li>
     </ul>
     
@@ -308,6 +310,7 @@ print_summary() {
     echo "  - /usr/local/bin/fuse-xfs"
     echo "  - /usr/local/bin/xfs-cli"
     echo "  - /usr/local/bin/xfs-rcopy"
+    echo "  - /usr/local/bin/xfs-defrag"
     if [ -f "$BUILD_DIR/bin/mkfs.xfs" ]; then
         echo "  - /usr/local/bin/mkfs.xfs"
     fi
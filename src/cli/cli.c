@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 
 #define BUFSIZE 16384
+#define BMAP_EXTENTS 1024
 
 struct filldir_data {
     xfs_mount_t *mp;
@@ -149,6 +150,62 @@ void strip(char *buffer, char c) {
     }
 }
 
+/*
+ * Print where a file's blocks are, in 512 byte units as xfs_bmap does.
+ * The map is fetched a page of extents at a time.
+ */
+void cli_bmap(xfs_inode_t *inode) {
+    struct xfs_fiemap_extent *ext;
+    uint64_t start = 0;
+    uint64_t pos = 0;
+    int index = 0;
+    int i, n;
+
+    ext = malloc(BMAP_EXTENTS * sizeof(*ext));
+    if (ext == NULL) {
+        printf("Out of memory\n");
+        return;
+    }
+    do {
+        n = xfs_fiemap(inode, start, ~0ULL - start, ext, BMAP_EXTENTS);
+        if (n < 0) {
+            printf("Failed to map file: %s\n", strerror(-n));
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (ext[i].fe_logical > pos) {
+                printf("\t%d: [%llu..%llu]: hole\n", index++,
+                       (unsigned long long)BTOBBT(pos),
+                       (unsigned long long)BTOBBT(ext[i].fe_logical) - 1);
+            }
+            if (ext[i].fe_flags & XFS_FIEMAP_EXTENT_DATA_INLINE) {
+                printf("\t%d: [%llu..%llu]: inline\n", index++,
+                       (unsigned long long)BTOBBT(ext[i].fe_logical),
+                       (unsigned long long)BTOBB(ext[i].fe_logical +
+                                                 ext[i].fe_length) - 1);
+            } else {
+                printf("\t%d: [%llu..%llu]: %llu..%llu%s\n", index++,
+                       (unsigned long long)BTOBBT(ext[i].fe_logical),
+                       (unsigned long long)BTOBBT(ext[i].fe_logical +
+                                                  ext[i].fe_length) - 1,
+                       (unsigned long long)BTOBBT(ext[i].fe_physical),
+                       (unsigned long long)BTOBBT(ext[i].fe_physical +
+                                                  ext[i].fe_length) - 1,
+                       (ext[i].fe_flags & XFS_FIEMAP_EXTENT_UNWRITTEN) ?
+                       " unwritten" : "");
+            }
+            pos = ext[i].fe_logical + ext[i].fe_length;
+        }
+        start = pos;
+    } while (n == BMAP_EXTENTS);
+    if (n >= 0 && pos < inode->i_d.di_size) {
+        printf("\t%d: [%llu..%llu]: hole\n", index,
+               (unsigned long long)BTOBBT(pos),
+               (unsigned long long)BTOBB(inode->i_d.di_size) - 1);
+    }
+    free(ext);
+}
+
 int main(int argc, char *argv[]) {
     xfs_mount_t	*mp;
     xfs_inode_t *inode = NULL;
@@ -274,6 +331,17 @@ int main(int argc, char *argv[]) {
                     printf("Not a regular file\n");
             }
         }
+        else if (strncmp(line, "bmap ", 5) == 0) {
+            strcpy(newpath, path);
+            strcat(newpath, line+5);
+            r = find_path(mp, newpath, &inode);
+            if (r) {
+                printf("File not found\n");
+            } else {
+                printf("%s:\n", newpath);
+                cli_bmap(inode);
+            }
+        }
         else if (strcmp(line, "exit") == 0) {
             libxfs_umount(mp);
             return 0;
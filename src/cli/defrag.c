@@ -0,0 +1,75 @@
+#include <xfsutil.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DEFAULT_EXTENTS_PER_GB 16
+
+void usage(char *progname) {
+    printf("Usage: %s [-v] [-e extents_per_gb] raw_device [path]\n", progname);
+    printf("Defragments the files below path (default /) in an unmounted XFS file system\n");
+    printf("  -e n   only rewrite files with more than n extents per GB (default %d)\n",
+           DEFAULT_EXTENTS_PER_GB);
+    printf("  -v     list the files rewritten\n");
+}
+
+int main(int argc, char *argv[]) {
+    xfs_mount_t *mp;
+    struct xfs_defrag_opts opts;
+    struct xfs_defrag_stats stats;
+    char *progname;
+    char *source_name;
+    char *path = "/";
+    int c, r;
+
+    progname = argv[0];
+    memset(&opts, 0, sizeof(opts));
+    opts.max_extents_per_gb = DEFAULT_EXTENTS_PER_GB;
+
+    while ((c = getopt(argc, argv, "e:v")) != -1) {
+        switch (c) {
+        case 'e':
+            opts.max_extents_per_gb = atoi(optarg);
+            break;
+        case 'v':
+            opts.verbose = 1;
+            break;
+        default:
+            usage(progname);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage(progname);
+        return 1;
+    }
+    source_name = argv[optind];
+    if (optind == argc - 2)
+        path = argv[optind + 1];
+
+    mp = mount_xfs_ex(progname, source_name, 0);
+    if (mp == NULL)
+        return 1;
+
+    r = xfs_defrag(mp, path, &opts, &stats);
+    if (r) {
+        printf("Defragmenting %s failed: %s\n", path, strerror(-r));
+        unmount_xfs(mp);
+        return 1;
+    }
+
+    printf("%llu files scanned, %llu defragmented, %llu skipped\n",
+           (unsigned long long)stats.files_scanned,
+           (unsigned long long)stats.files_defragged,
+           (unsigned long long)stats.files_skipped);
+    if (stats.files_defragged) {
+        printf("%llu extents reduced to %llu, %llu MB moved\n",
+               (unsigned long long)stats.extents_before,
+               (unsigned long long)stats.extents_after,
+               (unsigned long long)stats.bytes_moved >> 20);
+    }
+
+    unmount_xfs(mp);
+    return 0;
+}
@@ -1,43 +1,94 @@
 #include <xfsutil.h>
-#include <readline/history.h>
-#include <readline/readline.h>
+#include <pthread.h>
 #include <string.h>
+#include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
-#define BUFSIZE 16384
+/*
+ * The tree is walked once up front, on one thread since libxfs is not
+ * thread safe: directories are made, every file is created at its full
+ * size, and the written extents of the files are collected as chunks.
+ * The chunks are then sorted by disk address and copied by a pool of
+ * worker threads straight from the device, so the source is read almost
+ * sequentially and holes in the files are never written.
+ */
 
-struct filldir_data {
-    xfs_mount_t *mp;
-    char *base;
+#define CHUNKSIZE (1024 * 1024)
+#define DEFAULT_THREADS 4
+
+struct copy_file {
     char *local;
+    int fd;
+    unsigned int pending;       /* chunks not yet written */
 };
 
-void copy_tree(xfs_mount_t *mp, char *parent, char *local, xfs_inode_t *inode);
+struct copy_chunk {
+    off_t daddr;                /* byte offset on the device */
+    off_t offset;               /* byte offset in the file */
+    size_t readlen;             /* whole blocks */
+    size_t len;                 /* bytes to write, up to EOF */
+    struct copy_file *file;
+};
 
-int copy_filldir(void *dirents, const char *name, int namelen, off_t offset, uint64_t inumber, unsigned flags) {
-    char dname[256];
-    char lname[256];
-    int r;
-    xfs_inode_t *inode=NULL;
-    struct stat fstats;
-    char mode[]="rwxrwxrwx";
-    int tests[]={S_IRUSR,S_IWUSR,S_IXUSR,S_IRGRP,S_IWGRP,S_IXGRP,S_IROTH,S_IWOTH,S_IXOTH};
+struct copy_state {
+    xfs_mount_t *mp;
+    int quiet;
+    int metadump;               /* no file data to copy */
+    struct copy_chunk *chunks;
+    size_t nchunks;
+    size_t maxchunks;
+    __uint64_t files;
+    int errors;
+
+    /* shared by the workers */
+    pthread_mutex_t lock;
+    size_t next;
+    int source_fd;
+    __uint64_t bytes;
+};
 
-    struct filldir_data *data = (struct filldir_data *) dirents;
+struct copy_dirents {
+    xfs_ino_t *inos;
+    char **names;
+    size_t count;
+    size_t size;
+};
 
-    strcpy(dname, data->base);
-    strcat(dname, "/");
-    strncat(dname, name, namelen);
+void copy_tree(struct copy_state *state, char *parent, char *local, xfs_inode_t *inode);
+
+int copy_filldir(void *priv, const char *name, int namelen, off_t offset, uint64_t inumber, unsigned flags) {
+    struct copy_dirents *de = priv;
+
+    if ((namelen == 1 && name[0] == '.') ||
+        (namelen == 2 && name[0] == '.' && name[1] == '.')) {
+        return 0;
+    }
+    if (de->count == de->size) {
+        de->size = de->size ? de->size * 2 : 64;
+        de->inos = realloc(de->inos, de->size * sizeof(xfs_ino_t));
+        de->names = realloc(de->names, de->size * sizeof(char *));
+        if (de->inos == NULL || de->names == NULL) {
+            return ENOMEM;
+        }
+    }
+    de->inos[de->count] = inumber;
+    de->names[de->count] = strndup(name, namelen);
+    if (de->names[de->count] == NULL) {
+        return ENOMEM;
+    }
+    de->count++;
+    return 0;
+}
 
-    strcpy(lname, data->local);
-    strcat(lname, "/");
-    strncat(lname, name, namelen);
+void print_entry(xfs_inode_t *inode, char *parent, char *local) {
+    struct stat fstats;
+    char mode[]="rwxrwxrwx";
+    int tests[]={S_IRUSR,S_IWUSR,S_IXUSR,S_IRGRP,S_IWGRP,S_IXGRP,S_IROTH,S_IWOTH,S_IXOTH};
+    int r;
 
-    r = libxfs_iget(data->mp, NULL, inumber, 0, &inode, 0);
-    if (r) printf("Panic! %d\n", r);
-    r = xfs_stat(inode, &fstats);
-    if (r) printf("Panic! stats %d\n", r);
+    xfs_stat(inode, &fstats);
     if (xfs_is_dir(inode)) {
         printf("d");
     } else if (xfs_is_link(inode)) {
@@ -51,53 +102,253 @@ int copy_filldir(void *dirents, const char *name, int namelen, off_t offset, uin
             printf("-");
         }
     }
-    
-    printf(" %s -> %s\n", dname, lname);
-    if (strncmp(name, ".", namelen) == 0)
-        libxfs_iput(inode, 0);
-    else if (strncmp(name, "..", namelen) == 0)
-        libxfs_iput(inode, 0);
-    else {
-        copy_tree(data->mp, dname, lname, inode);
-        libxfs_iput(inode, 0);
+    printf(" %s -> %s\n", parent, local);
+}
+
+char *join_path(char *dir, char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+    if (path != NULL) {
+        sprintf(path, "%s/%s", strcmp(dir, "/") ? dir : "", name);
     }
-    return 0;
+    return path;
 }
 
-void copy_tree(xfs_mount_t *mp, char *parent, char *local, xfs_inode_t *inode) {
-    xfs_off_t ofs;
-    int r, fd;
-    struct filldir_data filldata;
-    char *buffer[BUFSIZE];
-    off_t offset;
+void copy_dir(struct copy_state *state, char *parent, char *local, xfs_inode_t *inode) {
+    struct copy_dirents de;
+    xfs_inode_t *child;
+    xfs_off_t ofs = 0;
+    char *dname;
+    char *lname;
+    size_t i;
+    int r;
+
+    if (mkdir(local, 0770) != 0 && errno != EEXIST) {
+        printf("Failed to create %s: %s\n", local, strerror(errno));
+        state->errors++;
+        return;
+    }
 
-    if (xfs_is_dir(inode)) {
-        mkdir(local, 0770);
-        filldata.mp = mp;
-        filldata.base = parent;
-        filldata.local = local;
-        ofs = 0;
-        r = xfs_readdir(inode, (void *)&filldata, 102400, &ofs, copy_filldir);
-        if (r != 0) {
-            printf("Not a directory\n");
+    /* Read the whole directory first; the copy recurses into it */
+    memset(&de, 0, sizeof(de));
+    r = xfs_readdir(inode, (void *)&de, 102400, &ofs, copy_filldir);
+    if (r != 0) {
+        printf("Failed to read directory %s\n", parent);
+        state->errors++;
+    }
+
+    for (i = 0; i < de.count && de.inos && de.names; i++) {
+        dname = join_path(parent, de.names[i]);
+        lname = join_path(local, de.names[i]);
+        if (dname == NULL || lname == NULL) {
+            printf("Out of memory\n");
+            exit(1);
         }
-    } else if (!xfs_is_link(inode)) {
-        r = 10;
-        offset = 0;
-        fd = open(local, O_WRONLY|O_CREAT, 0660);
-        if (fd < 0) {
-            printf("Failed to open local file\n");
+        r = libxfs_iget(state->mp, NULL, de.inos[i], 0, &child, 0);
+        if (r) {
+            printf("Failed to read inode %llu for %s\n",
+                   (unsigned long long)de.inos[i], dname);
+            state->errors++;
         } else {
-            while (r) {
-                r = xfs_readfile(inode, buffer, offset, BUFSIZE, NULL);
-                if (r) {
-                    write(fd, buffer, r);
-                    offset += r;
-                }
-           }
+            copy_tree(state, dname, lname, child);
+            libxfs_iput(child, 0);
+        }
+        free(dname);
+        free(lname);
+    }
+
+    for (i = 0; i < de.count && de.names; i++) {
+        free(de.names[i]);
+    }
+    free(de.names);
+    free(de.inos);
+}
+
+void add_chunk(struct copy_state *state, struct copy_chunk *chunk) {
+    if (state->nchunks == state->maxchunks) {
+        state->maxchunks = state->maxchunks ? state->maxchunks * 2 : 4096;
+        state->chunks = realloc(state->chunks,
+                                state->maxchunks * sizeof(struct copy_chunk));
+        if (state->chunks == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    state->chunks[state->nchunks++] = *chunk;
+}
+
+/*
+ * Create the file at its full size, then queue its written extents in
+ * chunks.  Unwritten extents and holes stay holes in the copy.
+ */
+void copy_file(struct copy_state *state, char *local, xfs_inode_t *inode) {
+    xfs_mount_t *mp = state->mp;
+    xfs_ifork_t *ifp = XFS_IFORK_PTR(inode, XFS_DATA_FORK);
+    xfs_fsize_t size = inode->i_d.di_size;
+    struct copy_file *file;
+    struct copy_chunk chunk;
+    xfs_bmbt_irec_t rec;
+    xfs_extnum_t nextents;
+    xfs_extnum_t i;
+    off_t start;
+    off_t end;
+    int fd;
+
+    fd = open(local, O_WRONLY|O_CREAT|O_TRUNC, 0660);
+    if (fd < 0) {
+        printf("Failed to open local file %s\n", local);
+        state->errors++;
+        return;
+    }
+    if (ftruncate(fd, size) != 0) {
+        printf("Failed to size local file %s\n", local);
+        state->errors++;
+    }
+    close(fd);
+    state->files++;
+
+    if (state->metadump || size == 0) {
+        return;
+    }
+    if (XFS_IFORK_FORMAT(inode, XFS_DATA_FORK) != XFS_DINODE_FMT_EXTENTS &&
+        XFS_IFORK_FORMAT(inode, XFS_DATA_FORK) != XFS_DINODE_FMT_BTREE) {
+        return;
+    }
+    if (!(ifp->if_flags & XFS_IFEXTENTS) &&
+        xfs_iread_extents(NULL, inode, XFS_DATA_FORK)) {
+        printf("Failed to read the extents of %s\n", local);
+        state->errors++;
+        return;
+    }
+
+    file = malloc(sizeof(struct copy_file));
+    if (file == NULL || (file->local = strdup(local)) == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    file->fd = -1;
+    file->pending = 0;
+    chunk.file = file;
+
+    nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
+    for (i = 0; i < nextents; i++) {
+        xfs_bmbt_get_all(xfs_iext_get_ext(ifp, i), &rec);
+        if (rec.br_state == XFS_EXT_UNWRITTEN) {
+            continue;
+        }
+        start = XFS_FSB_TO_B(mp, rec.br_startoff);
+        end = XFS_FSB_TO_B(mp, rec.br_startoff + rec.br_blockcount);
+        chunk.daddr = BBTOB(XFS_FSB_TO_DADDR(mp, rec.br_startblock));
+        for (chunk.offset = start; chunk.offset < end && chunk.offset < size;
+             chunk.offset += CHUNKSIZE, chunk.daddr += CHUNKSIZE) {
+            chunk.readlen = MIN(CHUNKSIZE, end - chunk.offset);
+            chunk.len = MIN(chunk.readlen, size - chunk.offset);
+            add_chunk(state, &chunk);
+            file->pending++;
+        }
+    }
+
+    if (file->pending == 0) {
+        free(file->local);
+        free(file);
+    }
+}
+
+void copy_tree(struct copy_state *state, char *parent, char *local, xfs_inode_t *inode) {
+    if (!state->quiet) {
+        print_entry(inode, parent, local);
+    }
+    if (xfs_is_dir(inode)) {
+        copy_dir(state, parent, local, inode);
+    } else if (xfs_is_regular(inode)) {
+        copy_file(state, local, inode);
+    }
+}
+
+int chunk_cmp(const void *a, const void *b) {
+    const struct copy_chunk *ca = a;
+    const struct copy_chunk *cb = b;
+
+    if (ca->daddr != cb->daddr)
+        return ca->daddr < cb->daddr ? -1 : 1;
+    return 0;
+}
+
+void *copy_worker(void *arg) {
+    struct copy_state *state = arg;
+    struct copy_chunk *chunk;
+    struct copy_file *file;
+    char *buffer;
+    int fd;
+    int ok;
+
+    buffer = memalign(getpagesize(), CHUNKSIZE);
+    if (buffer == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        if (state->next == state->nchunks) {
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+        chunk = &state->chunks[state->next++];
+        file = chunk->file;
+        if (file->fd < 0) {
+            file->fd = open(file->local, O_WRONLY);
+            if (file->fd < 0) {
+                printf("Failed to open local file %s\n", file->local);
+                state->errors++;
+            }
+        }
+        fd = file->fd;
+        pthread_mutex_unlock(&state->lock);
+
+        ok = fd >= 0 &&
+             pread(state->source_fd, buffer, chunk->readlen,
+                   chunk->daddr) == (ssize_t)chunk->readlen &&
+             pwrite(fd, buffer, chunk->len,
+                    chunk->offset) == (ssize_t)chunk->len;
+
+        pthread_mutex_lock(&state->lock);
+        if (fd >= 0 && !ok) {
+            printf("Failed to copy %s at offset %lld\n", file->local,
+                   (long long)chunk->offset);
+            state->errors++;
+        } else if (ok) {
+            state->bytes += chunk->len;
+        }
+        if (--file->pending == 0) {
+            if (file->fd >= 0) {
+                close(file->fd);
+            }
+            free(file->local);
+            free(file);
         }
-        close(fd);
+        pthread_mutex_unlock(&state->lock);
     }
+
+    free(buffer);
+    return NULL;
+}
+
+int is_metadump(char *path) {
+    char magic[4];
+    int fd;
+    int r = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (read(fd, magic, 4) == 4 &&
+        (!strncmp(magic, "XFSM", 4) || !strncmp(magic, "XFM2", 4))) {
+        r = 1;
+    }
+    close(fd);
+    return r;
 }
 
 char *last(char *path) {
@@ -109,28 +360,66 @@ char *last(char *path) {
     return ret;
 }
 
+void usage(char *progname) {
+    printf("Usage: %s [-q] [-j threads] raw_device directory\n", progname);
+    printf("Copies the named directory from an XFS file system to the current directory\n");
+    printf("  -j n   copy file data with n threads (default %d)\n", DEFAULT_THREADS);
+    printf("  -q     don't list the files copied\n");
+}
+
 int main(int argc, char *argv[]) {
     xfs_mount_t	*mp;
     xfs_inode_t *inode = NULL;
+    struct copy_state state;
+    struct timeval start, end;
+    pthread_t *threads;
     char *progname;
     char *source_name;
     char *parent;
-    int r;
+    char *local;
+    double secs;
+    int nthreads = DEFAULT_THREADS;
+    int c, i, r;
+
+    progname = argv[0];
+    memset(&state, 0, sizeof(state));
+
+    while ((c = getopt(argc, argv, "j:q")) != -1) {
+        switch (c) {
+        case 'j':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                usage(progname);
+                return 1;
+            }
+            break;
+        case 'q':
+            state.quiet = 1;
+            break;
+        default:
+            usage(progname);
+            return 1;
+        }
+    }
 
-    if (argc != 3) {
-        printf("Usage: xfs-rcopy raw_device directory\n");
-        printf("Copies the named directory from an XFS file system to the current directory\n");
+    if (optind != argc - 2) {
+        usage(progname);
         return 1;
     }
-    progname = argv[0];
-    source_name = argv[1];
-    parent = argv[2];
-    
+    source_name = argv[optind];
+    parent = argv[optind + 1];
+
+    /* Copying the root fills the current directory */
+    local = last(parent);
+    if (*local == '\0') {
+        local = ".";
+    }
+
     mp = mount_xfs(progname, source_name);
-    
-    if (mp == NULL) 
+
+    if (mp == NULL)
         return 1;
-    
+
     r = find_path(mp, parent, &inode);
     if (r) {
         printf("Can't find %s\n", parent);
@@ -138,8 +427,51 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    copy_tree(mp, parent, last(parent), inode);
+    gettimeofday(&start, NULL);
+
+    state.mp = mp;
+    state.metadump = is_metadump(source_name);
+    copy_tree(&state, parent, local, inode);
     libxfs_iput(inode, 0);
+
+    qsort(state.chunks, state.nchunks, sizeof(struct copy_chunk), chunk_cmp);
+
+    pthread_mutex_init(&state.lock, NULL);
+    state.source_fd = libxfs_device_to_fd(mp->m_dev);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    if (threads == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, copy_worker, &state) != 0) {
+            break;
+        }
+    }
+    if (i == 0) {
+        /* No threads, copy on this one */
+        copy_worker(&state);
+    }
+    while (i > 0) {
+        pthread_join(threads[--i], NULL);
+    }
+    free(threads);
+    free(state.chunks);
+
+    gettimeofday(&end, NULL);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    if (secs <= 0) {
+        secs = 1e-6;
+    }
+    printf("Copied %llu files, %llu MB in %.1f seconds (%.1f MB/s, %.0f files/s)\n",
+           (unsigned long long)state.files,
+           (unsigned long long)(state.bytes >> 20), secs,
+           state.bytes / 1048576.0 / secs, state.files / secs);
+    if (state.metadump) {
+        printf("%s is a metadump: file contents are not in it, files were created as holes\n",
+               source_name);
+    }
+
     libxfs_umount(mp);
-    return 0;
+    return state.errors ? 1 : 0;
 }
@@ -9,7 +9,10 @@
 #include <fuse.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
 #include <fuse_xfs.h>
 #include <xfsutil.h>
 
@@ -24,6 +27,28 @@ xfs_mount_t *fuse_xfs_mp = NULL;
 /* Global read-only flag - default to read-only for safety */
 static int g_xfs_readonly = 1;
 
+/*
+ * The image opened again, without O_DIRECT, for read_buf to hand file
+ * data to the kernel by splice.  Only read-only mounts of a real image
+ * have one: on read-write mounts the latest data may be in libxfs
+ * buffers not yet written back, and a metadump holds no file data.
+ */
+static int g_data_fd = -1;
+
+/*
+ * libxfs is not thread safe against changes, so on read-write mounts every
+ * operation goes through fuse_xfs_locked_operations and takes g_xfs_lock.
+ * The background defragmenter takes it for each step it makes.
+ */
+static pthread_mutex_t g_xfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t g_defrag_thread;
+static int g_defrag_running = 0;
+static volatile int g_defrag_stop = 0;
+static struct xfs_defrag_opts g_defrag_opts;
+#if FUSE_USE_VERSION >= 30
+static struct fuse *g_fuse = NULL;
+#endif
+
 /* Helper function to check if filesystem is read-only */
 static int check_readonly(void) {
     if (g_xfs_readonly || xfs_is_readonly(fuse_xfs_mp)) {
@@ -36,6 +61,64 @@ xfs_mount_t *current_xfs_mount() {
     return fuse_xfs_mp;
 }
 
+/*
+ * The usage file.  Each open takes a snapshot of the report, which is read
+ * with direct_io as getattr can't know how long it will be.
+ */
+#define FUSE_XFS_USAGE_THREADS 4
+
+struct fuse_xfs_usage_file {
+    char *buf;
+    size_t len;
+};
+
+static int is_usage_path(const char *path) {
+    return strcmp(path, FUSE_XFS_USAGE_PATH) == 0;
+}
+
+static int fuse_xfs_usage_open(struct fuse_file_info *fi) {
+    struct fuse_xfs_usage_file *uf;
+    int r;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    uf = malloc(sizeof(*uf));
+    if (uf == NULL) {
+        return -ENOMEM;
+    }
+    r = xfs_usage_report(current_xfs_mount(), FUSE_XFS_USAGE_THREADS,
+                         &uf->buf, &uf->len);
+    if (r) {
+        free(uf);
+        return r;
+    }
+    fi->fh = (uint64_t)uf;
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int fuse_xfs_usage_read(char *buf, size_t size, off_t offset,
+                               struct fuse_file_info *fi) {
+    struct fuse_xfs_usage_file *uf = (struct fuse_xfs_usage_file *)fi->fh;
+
+    if (offset >= uf->len) {
+        return 0;
+    }
+    if (size > uf->len - offset) {
+        size = uf->len - offset;
+    }
+    memcpy(buf, uf->buf + offset, size);
+    return size;
+}
+
+static void fuse_xfs_usage_release(struct fuse_file_info *fi) {
+    struct fuse_xfs_usage_file *uf = (struct fuse_xfs_usage_file *)fi->fh;
+
+    free(uf->buf);
+    free(uf);
+}
+
 static int
 fuse_xfs_fgetattr(const char *path, struct stat *stbuf,
                   struct fuse_file_info *fi) {
@@ -44,6 +127,13 @@ fuse_xfs_fgetattr(const char *path, struct stat *stbuf,
     int r;
     xfs_inode_t *inode=NULL;
     
+    if (is_usage_path(path)) {
+        memset(stbuf, 0, sizeof(*stbuf));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        return 0;
+    }
+    
     r = find_path(current_xfs_mount(), path, &inode);
     if (r) {
         return -ENOENT;
@@ -66,11 +156,13 @@ fuse_xfs_fgetattr(const char *path, struct stat *stbuf,
     return 0;
 }
 
+#if FUSE_USE_VERSION < 30
 static int
 fuse_xfs_getattr(const char *path, struct stat *stbuf) {
     log_debug("getattr %s\n", path);
     return fuse_xfs_fgetattr(path, stbuf, NULL);
 }
+#endif
 
 static int
 fuse_xfs_readlink(const char *path, char *buf, size_t size) {
@@ -99,6 +191,7 @@ fuse_xfs_readlink(const char *path, char *buf, size_t size) {
 struct filler_info_struct {
     void *buf;
     fuse_fill_dir_t filler;
+    int fill_flags;         /* libfuse 3: FUSE_FILL_DIR_PLUS for readdirplus */
 };
 
 int fuse_xfs_filldir(void *filler_info, const char *name, int namelen, off_t offset, uint64_t inumber, unsigned flags) {
@@ -118,17 +211,20 @@ int fuse_xfs_filldir(void *filler_info, const char *name, int namelen, off_t off
         stats = &stbuf;
     }
     log_debug("Direntry %s\n", dir_entry);
+#if FUSE_USE_VERSION >= 30
+    r = filler_data->filler(filler_data->buf, dir_entry, stats, 0,
+                            stats ? filler_data->fill_flags : 0);
+#else
     r = filler_data->filler(filler_data->buf, dir_entry, stats, 0);
+#endif
     libxfs_iput(inode, 0);
     return r;
 }
 
 static int
-fuse_xfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                 off_t offset, struct fuse_file_info *fi) {
-    log_debug("readdir %s\n", path);
+fuse_xfs_fill_dir(const char *path, struct filler_info_struct *filler_info,
+                  off_t offset) {
     int r;
-    struct filler_info_struct filler_info;
     xfs_inode_t *inode=NULL;
     
     r = find_path(current_xfs_mount(), path, &inode);
@@ -136,13 +232,25 @@ fuse_xfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         return -ENOENT;
     }
     
-    filler_info.buf = buf;
-    filler_info.filler = filler;
-    xfs_readdir(inode, (void *)&filler_info, 1024000, &offset, fuse_xfs_filldir);
+    xfs_readdir(inode, (void *)filler_info, 1024000, &offset, fuse_xfs_filldir);
     libxfs_iput(inode, 0);
     return 0;
 }
 
+#if FUSE_USE_VERSION < 30
+static int
+fuse_xfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info *fi) {
+    struct filler_info_struct filler_info;
+
+    log_debug("readdir %s\n", path);
+    filler_info.buf = buf;
+    filler_info.filler = filler;
+    filler_info.fill_flags = 0;
+    return fuse_xfs_fill_dir(path, &filler_info, offset);
+}
+#endif
+
 /*
  * Create a special file (device node, FIFO, socket)
  */
@@ -573,12 +681,20 @@ fuse_xfs_open(const char *path, struct fuse_file_info *fi) {
     
     log_debug("open %s\n", path); 
     
+    if (is_usage_path(path)) {
+        return fuse_xfs_usage_open(fi);
+    }
+    
     r = find_path(current_xfs_mount(), path, &inode);
     if (r) {
         return -ENOENT;
     }
     
     fi->fh = (uint64_t)inode;
+    /* Nothing changes the data of a read-only mount between opens */
+    if (check_readonly()) {
+        fi->keep_cache = 1;
+    }
     return 0;
 }
 
@@ -587,6 +703,9 @@ fuse_xfs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
     int r;
     log_debug("read %s\n", path); 
+    if (is_usage_path(path)) {
+        return fuse_xfs_usage_read(buf, size, offset, fi);
+    }
     r = xfs_readfile((xfs_inode_t *)fi->fh, buf, offset, size, NULL);
     return r;
 }
@@ -627,14 +746,19 @@ fuse_xfs_write(const char *path, const char *buf, size_t size,
 static int
 fuse_xfs_statfs(const char *path, struct statvfs *stbuf) {
     xfs_mount_t *mount = current_xfs_mount();
+    __uint64_t fdblocks, icount, ifree;
+    
+    /* A statfs is a point to fold the per-AG counters into the sb */
+    xfs_sync_fs(mount);
+    libxfs_icsb_read(mount, &fdblocks, &icount, &ifree);
     
     memset(stbuf, 0, sizeof(*stbuf));
     stbuf->f_bsize = mount->m_sb.sb_blocksize;
     stbuf->f_frsize = mount->m_sb.sb_blocksize;
     stbuf->f_blocks =  mount->m_sb.sb_dblocks;
-    stbuf->f_bfree =  mount->m_sb.sb_fdblocks;
+    stbuf->f_bfree =  fdblocks;
     stbuf->f_files = mount->m_maxicount;
-    stbuf->f_ffree = mount->m_sb.sb_ifree + mount->m_maxicount - mount->m_sb.sb_icount;
+    stbuf->f_ffree = ifree + mount->m_maxicount - icount;
     stbuf->f_favail = stbuf->f_ffree;
     stbuf->f_namemax = MAXNAMELEN;
     stbuf->f_fsid = *((unsigned long*)mount->m_sb.sb_uuid);
@@ -658,6 +782,10 @@ fuse_xfs_flush(const char *path, struct fuse_file_info *fi) {
 static int
 fuse_xfs_release(const char *path, struct fuse_file_info *fi) {
     log_debug("release %s\n", path); 
+    if (is_usage_path(path)) {
+        fuse_xfs_usage_release(fi);
+        return 0;
+    }
     libxfs_iput((xfs_inode_t *)fi->fh, 0);
     return 0;
 }
@@ -685,29 +813,232 @@ fuse_xfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
     return error;
 }
 
+/*
+ * Extended attributes.  The resource fork and Finder info arrive as
+ * attributes with a position, which only matters for resource forks
+ * larger than one request; those are refused rather than stored in
+ * pieces.
+ */
 static int
 fuse_xfs_setxattr(const char *path, const char *name, const char *value,
-                  size_t size, int flags, uint32_t a) {
-    return -ENOTSUP;
- }
+                  size_t size, int flags, uint32_t position) {
+    xfs_inode_t *ip = NULL;
+    int xflags = 0;
+    int error;
+    
+    log_debug("setxattr %s %s size=%zu\n", path, name, size);
+    
+    if (check_readonly()) {
+        return -EROFS;
+    }
+    if (position != 0) {
+        return -EINVAL;
+    }
+    if (is_usage_path(path)) {
+        return -EACCES;
+    }
+    
+    error = find_path(current_xfs_mount(), path, &ip);
+    if (error) {
+        return -ENOENT;
+    }
+    
+    if (flags & XATTR_CREATE) {
+        xflags |= XFS_XATTR_CREATE;
+    }
+    if (flags & XATTR_REPLACE) {
+        xflags |= XFS_XATTR_REPLACE;
+    }
+    error = xfs_setxattr(ip, name, value, size, xflags);
+    
+    libxfs_iput(ip, 0);
+    return error;
+}
 
 static int
-fuse_xfs_getxattr(const char *path, const char *name, char *value, size_t size, uint32_t a) {
-    return -ENOATTR;
+fuse_xfs_getxattr(const char *path, const char *name, char *value, size_t size,
+                  uint32_t position) {
+    xfs_inode_t *ip = NULL;
+    int error;
+    
+    log_debug("getxattr %s %s size=%zu\n", path, name, size);
+    
+    if (position != 0) {
+        return -EINVAL;
+    }
+    if (is_usage_path(path)) {
+        return -ENOATTR;
+    }
+    
+    error = find_path(current_xfs_mount(), path, &ip);
+    if (error) {
+        return -ENOENT;
+    }
+    
+    error = xfs_getxattr(ip, name, value, size);
+    
+    libxfs_iput(ip, 0);
+    return error;
 }
 
 static int
 fuse_xfs_listxattr(const char *path, char *list, size_t size) {
-    return 0;
+    xfs_inode_t *ip = NULL;
+    int error;
+    
+    log_debug("listxattr %s size=%zu\n", path, size);
+    
+    if (is_usage_path(path)) {
+        return 0;
+    }
+    
+    error = find_path(current_xfs_mount(), path, &ip);
+    if (error) {
+        return -ENOENT;
+    }
+    
+    error = xfs_listxattr(ip, list, size);
+    
+    libxfs_iput(ip, 0);
+    return error;
 }
 
 static int
 fuse_xfs_removexattr(const char *path, const char *name) {
-    return -ENOATTR;
+    xfs_inode_t *ip = NULL;
+    int error;
+    
+    log_debug("removexattr %s %s\n", path, name);
+    
+    if (check_readonly()) {
+        return -EROFS;
+    }
+    if (is_usage_path(path)) {
+        return -ENOATTR;
+    }
+    
+    error = find_path(current_xfs_mount(), path, &ip);
+    if (error) {
+        return -ENOENT;
+    }
+    
+    error = xfs_removexattr(ip, name);
+    
+    libxfs_iput(ip, 0);
+    return error;
+}
+
+#ifdef FUSE_IOCTL_COMPAT
+static int
+fuse_xfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+               unsigned int flags, void *data) {
+    struct fuse_xfs_fiemap *fm = data;
+    struct xfs_fiemap_extent ext[FUSE_XFS_FIEMAP_EXTENTS];
+    xfs_inode_t *ip = NULL;
+    int error;
+    int i;
+    
+    log_debug("ioctl %s cmd=%x\n", path, cmd);
+    
+    if ((unsigned int)cmd != FUSE_XFS_IOC_FIEMAP || is_usage_path(path)) {
+        return -ENOTTY;
+    }
+    if ((fm->fm_flags & ~FUSE_XFS_FIEMAP_FLAG_SYNC) ||
+        fm->fm_extent_count > FUSE_XFS_FIEMAP_EXTENTS) {
+        return -EINVAL;
+    }
+    
+    error = find_path(current_xfs_mount(), path, &ip);
+    if (error) {
+        return -ENOENT;
+    }
+    
+    error = xfs_fiemap(ip, fm->fm_start, fm->fm_length,
+                       fm->fm_extent_count ? ext : NULL, fm->fm_extent_count);
+    
+    libxfs_iput(ip, 0);
+    if (error < 0) {
+        return error;
+    }
+    /* Never copy out more than the caller's array holds */
+    if (fm->fm_extent_count && (unsigned int)error > fm->fm_extent_count) {
+        error = fm->fm_extent_count;
+    }
+    
+    fm->fm_mapped_extents = error;
+    for (i = 0; i < error && fm->fm_extent_count; i++) {
+        memset(&fm->fm_extents[i], 0, sizeof(fm->fm_extents[i]));
+        fm->fm_extents[i].fe_logical = ext[i].fe_logical;
+        fm->fm_extents[i].fe_physical = ext[i].fe_physical;
+        fm->fm_extents[i].fe_length = ext[i].fe_length;
+        fm->fm_extents[i].fe_flags = ext[i].fe_flags;
+    }
+    return 0;
+}
+#endif
+
+static void *
+fuse_xfs_defrag(void *arg) {
+    struct xfs_defrag_stats stats;
+    int r;
+
+    r = xfs_defrag(fuse_xfs_mp, "/", &g_defrag_opts, &stats);
+    if (r) {
+        fprintf(stderr, "fuse-xfs: defragmentation failed: %s\n", strerror(-r));
+    } else if (stats.files_defragged) {
+        fprintf(stderr, "fuse-xfs: defragmented %llu of %llu files, "
+                "%llu extents reduced to %llu\n",
+                (unsigned long long)stats.files_defragged,
+                (unsigned long long)stats.files_scanned,
+                (unsigned long long)stats.extents_before,
+                (unsigned long long)stats.extents_after);
+    }
+    return NULL;
+}
+
+#if FUSE_USE_VERSION >= 30
+/*
+ * The defragmenter changes files behind the kernel's back, so drop what the
+ * kernel has cached for each one it rewrites.  A path the kernel has not
+ * looked up has nothing cached, and the error for it is ignored.
+ */
+static void
+fuse_xfs_defrag_rewritten(const char *path) {
+    if (g_fuse) {
+        fuse_invalidate_path(g_fuse, path);
+    }
+}
+
+/*
+ * What a libfuse 3 mount asks of the kernel: requests of up to
+ * FUSE_XFS_MAX_IO, reads in parallel and by splice, lookups in one
+ * directory in parallel, and on read-write mounts the kernel's page cache
+ * collecting writes into large requests.  Parallel lookups only run in
+ * parallel on read-only mounts: read-write ones take g_xfs_lock for
+ * every operation (see main()), so namespace changes stay one at a time.  Only what the kernel offers is
+ * taken.  FUSE_CAP_SPLICE_READ is left off: a write has to be copied into
+ * libxfs buffers however it arrives, and taking it from a pipe would only
+ * add a read.
+ */
+static void
+fuse_xfs_negotiate(struct fuse_conn_info *conn) {
+    unsigned int want;
+
+    want = FUSE_CAP_ASYNC_READ | FUSE_CAP_PARALLEL_DIROPS |
+           FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+    if (!check_readonly()) {
+        want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+    conn->want |= want & conn->capable;
+    conn->max_write = FUSE_XFS_MAX_IO;
 }
 
+void *
+fuse_xfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+#else
 void *
 fuse_xfs_init(struct fuse_conn_info *conn) {
+#endif
     //FUSE_ENABLE_XTIMES(conn);
     struct fuse_context *cntx=fuse_get_context();
     
@@ -721,13 +1052,45 @@ fuse_xfs_init(struct fuse_conn_info *conn) {
 
     //fuse_xfs_mp = mount_xfs(progname, opts->device);
     fuse_xfs_mp = opts->xfs_mount;
+
+#if FUSE_USE_VERSION >= 30
+    fuse_xfs_negotiate(conn);
+    g_fuse = cntx->fuse;
+    if (check_readonly() && !opts->metadump) {
+        g_data_fd = open(opts->device, O_RDONLY);
+    }
+#endif
+
+    /* Started here rather than in main, after fuse has daemonized */
+    if (opts->defrag && !check_readonly()) {
+        memset(&g_defrag_opts, 0, sizeof(g_defrag_opts));
+        g_defrag_opts.max_extents_per_gb = opts->defrag;
+        g_defrag_opts.lock = &g_xfs_lock;
+        g_defrag_opts.stop = &g_defrag_stop;
+#if FUSE_USE_VERSION >= 30
+        g_defrag_opts.rewritten = fuse_xfs_defrag_rewritten;
+#endif
+        if (pthread_create(&g_defrag_thread, NULL, fuse_xfs_defrag, NULL) == 0) {
+            g_defrag_running = 1;
+        }
+    }
     
     return fuse_xfs_mp;
 }
 
 void
 fuse_xfs_destroy(void *userdata) {
-    libxfs_umount(fuse_xfs_mp);
+    if (g_defrag_running) {
+        g_defrag_stop = 1;
+        pthread_join(g_defrag_thread, NULL);
+        g_defrag_running = 0;
+    }
+    if (g_data_fd >= 0) {
+        close(g_data_fd);
+        g_data_fd = -1;
+    }
+    /* Folds the per-AG counters back into the superblock */
+    unmount_xfs(fuse_xfs_mp);
 }
 
 int fuse_xfs_opendir(const char *path, struct fuse_file_info *fi) {
@@ -763,27 +1126,243 @@ int fuse_xfs_get_readonly(void) {
     return g_xfs_readonly;
 }
 
+#if FUSE_USE_VERSION >= 30
+/*
+ * libfuse 3 passes the file handle, when there is one, to the calls that
+ * took only a path, and flags to rename and readdir; the attribute calls
+ * lose the macOS position.  These adapt its calls to the ones above.
+ */
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+static int
+fuse_xfs_getattr3(const char *path, struct stat *stbuf,
+                  struct fuse_file_info *fi) {
+    log_debug("getattr %s\n", path);
+    return fuse_xfs_fgetattr(path, stbuf, fi);
+}
+
+static int
+fuse_xfs_readdir3(const char *path, void *buf, fuse_fill_dir_t filler,
+                  off_t offset, struct fuse_file_info *fi,
+                  enum fuse_readdir_flags flags) {
+    struct filler_info_struct filler_info;
+
+    log_debug("readdir %s\n", path);
+    filler_info.buf = buf;
+    filler_info.filler = filler;
+    filler_info.fill_flags = (flags & FUSE_READDIR_PLUS) ? FUSE_FILL_DIR_PLUS : 0;
+    return fuse_xfs_fill_dir(path, &filler_info, offset);
+}
+
+static int
+fuse_xfs_rename3(const char *from, const char *to, unsigned int flags) {
+    xfs_inode_t *ip = NULL;
+
+    if (flags & ~RENAME_NOREPLACE) {
+        return -EINVAL;
+    }
+    if (flags & RENAME_NOREPLACE) {
+        if (find_path(current_xfs_mount(), to, &ip) == 0) {
+            libxfs_iput(ip, 0);
+            return -EEXIST;
+        }
+    }
+    return fuse_xfs_rename(from, to);
+}
+
+static int
+fuse_xfs_chmod3(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    return fuse_xfs_chmod(path, mode);
+}
+
+static int
+fuse_xfs_chown3(const char *path, uid_t uid, gid_t gid,
+                struct fuse_file_info *fi) {
+    return fuse_xfs_chown(path, uid, gid);
+}
+
+static int
+fuse_xfs_truncate3(const char *path, off_t size, struct fuse_file_info *fi) {
+    return fuse_xfs_truncate(path, size);
+}
+
+static int
+fuse_xfs_utimens3(const char *path, const struct timespec tv[2],
+                  struct fuse_file_info *fi) {
+    return fuse_xfs_utimens(path, tv);
+}
+
+static int
+fuse_xfs_setxattr3(const char *path, const char *name, const char *value,
+                   size_t size, int flags) {
+    return fuse_xfs_setxattr(path, name, value, size, flags, 0);
+}
+
+static int
+fuse_xfs_getxattr3(const char *path, const char *name, char *value,
+                   size_t size) {
+    return fuse_xfs_getxattr(path, name, value, size, 0);
+}
+
+/*
+ * Reads through a copy in memory, for data that can't be spliced
+ */
+static int
+fuse_xfs_read_mem(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec *bv;
+    void *mem;
+    int r;
+
+    bv = malloc(sizeof(*bv));
+    mem = malloc(size ? size : 1);
+    if (bv == NULL || mem == NULL) {
+        free(bv);
+        free(mem);
+        return -ENOMEM;
+    }
+    r = fuse_xfs_read(path, mem, size, offset, fi);
+    if (r < 0) {
+        free(bv);
+        free(mem);
+        return r;
+    }
+    *bv = FUSE_BUFVEC_INIT(r);
+    bv->buf[0].mem = mem;
+    *bufp = bv;
+    return 0;
+}
+
+/*
+ * Read by telling libfuse where the data is in the image rather than
+ * copying it out, so that it goes from the image's page cache to the
+ * reader by splice.  The range is described by a buffer for each piece
+ * of extent it covers, with zeroes in memory for holes and unwritten
+ * extents.  A range of more than FUSE_XFS_READ_EXTENTS extents, or any
+ * read without a data fd, is copied.
+ */
+#define FUSE_XFS_READ_EXTENTS 16
+
+static int
+fuse_xfs_read_zero(struct fuse_bufvec *bv, size_t len) {
+    struct fuse_buf *b = &bv->buf[bv->count];
+
+    memset(b, 0, sizeof(*b));
+    b->size = len;
+    b->mem = calloc(1, len);
+    if (b->mem == NULL) {
+        return -ENOMEM;
+    }
+    bv->count++;
+    return 0;
+}
+
+static int
+fuse_xfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+    struct xfs_fiemap_extent ext[FUSE_XFS_READ_EXTENTS];
+    struct fuse_bufvec *bv;
+    struct fuse_buf *b;
+    xfs_inode_t *ip = (xfs_inode_t *)fi->fh;
+    off_t pos, end, lo, hi;
+    int error = 0;
+    int i, n;
+
+    log_debug("read_buf %s size=%zu offset=%lld\n", path, size, (long long)offset);
+
+    if (g_data_fd < 0 || is_usage_path(path) || !xfs_is_regular(ip)) {
+        return fuse_xfs_read_mem(path, bufp, size, offset, fi);
+    }
+
+    end = offset + size;
+    if (end > ip->i_d.di_size) {
+        end = ip->i_d.di_size;
+    }
+    if (offset >= end) {
+        return fuse_xfs_read_mem(path, bufp, 0, offset, fi);
+    }
+
+    n = xfs_fiemap(ip, offset, end - offset, ext, FUSE_XFS_READ_EXTENTS);
+    if (n < 0) {
+        return n;
+    }
+    if (n > FUSE_XFS_READ_EXTENTS) {
+        n = FUSE_XFS_READ_EXTENTS;
+    }
+
+    /* Each extent may follow a hole, and the range may end in one */
+    bv = malloc(sizeof(*bv) + 2 * n * sizeof(struct fuse_buf));
+    if (bv == NULL) {
+        return -ENOMEM;
+    }
+    memset(bv, 0, sizeof(*bv));
+
+    for (i = 0, pos = offset; i < n && pos < end; i++) {
+        if (ext[i].fe_flags & XFS_FIEMAP_EXTENT_DATA_INLINE) {
+            error = -EINVAL;
+            break;
+        }
+        lo = ext[i].fe_logical > pos ? ext[i].fe_logical : pos;
+        hi = ext[i].fe_logical + ext[i].fe_length;
+        if (hi > end) {
+            hi = end;
+        }
+        if (lo >= hi) {
+            continue;
+        }
+        if (lo > pos && (error = fuse_xfs_read_zero(bv, lo - pos))) {
+            break;
+        }
+        if (ext[i].fe_flags & XFS_FIEMAP_EXTENT_UNWRITTEN) {
+            if ((error = fuse_xfs_read_zero(bv, hi - lo))) {
+                break;
+            }
+        } else {
+            b = &bv->buf[bv->count++];
+            memset(b, 0, sizeof(*b));
+            b->size = hi - lo;
+            b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            b->fd = g_data_fd;
+            b->pos = ext[i].fe_physical + (lo - ext[i].fe_logical);
+        }
+        pos = hi;
+    }
+
+    /* A hole to the end, unless the map may have been cut short */
+    if (!error && pos < end && n < FUSE_XFS_READ_EXTENTS &&
+        !(error = fuse_xfs_read_zero(bv, end - pos))) {
+        pos = end;
+    }
+
+    if (error || pos < end) {
+        for (i = 0; i < bv->count; i++) {
+            if (!(bv->buf[i].flags & FUSE_BUF_IS_FD)) {
+                free(bv->buf[i].mem);
+            }
+        }
+        free(bv);
+        return fuse_xfs_read_mem(path, bufp, size, offset, fi);
+    }
+    *bufp = bv;
+    return 0;
+}
+#endif
+
 struct fuse_operations fuse_xfs_operations = {
   .init        = fuse_xfs_init,
   .destroy     = fuse_xfs_destroy,
-  .getattr     = fuse_xfs_getattr,
-  .fgetattr    = fuse_xfs_fgetattr,
 /*  .access      = fuse_xfs_access, */
   .readlink    = fuse_xfs_readlink,
   .opendir     = fuse_xfs_opendir,
-  .readdir     = fuse_xfs_readdir,
   .releasedir  = fuse_xfs_releasedir,
   .mknod       = fuse_xfs_mknod,
   .mkdir       = fuse_xfs_mkdir,
   .symlink     = fuse_xfs_symlink,
   .unlink      = fuse_xfs_unlink,
   .rmdir       = fuse_xfs_rmdir,
-  .rename      = fuse_xfs_rename,
   .link        = fuse_xfs_link,
-  .chmod       = fuse_xfs_chmod,       /* Phase 1: chmod support */
-  .chown       = fuse_xfs_chown,       /* Phase 1: chown support */
-  .truncate    = fuse_xfs_truncate,    /* Phase 1: truncate support */
-  .utimens     = fuse_xfs_utimens,     /* Phase 1: utimens support */
   .create      = fuse_xfs_create,
   .open        = fuse_xfs_open,
   .read        = fuse_xfs_read,
@@ -792,13 +1371,304 @@ struct fuse_operations fuse_xfs_operations = {
   .flush       = fuse_xfs_flush,
   .release     = fuse_xfs_release,
   .fsync       = fuse_xfs_fsync,
-  .setxattr    = fuse_xfs_setxattr,
-  .getxattr    = fuse_xfs_getxattr,
   .listxattr   = fuse_xfs_listxattr,
   .removexattr = fuse_xfs_removexattr,
+#ifdef FUSE_IOCTL_COMPAT
+  .ioctl       = fuse_xfs_ioctl,
+#endif
+#if FUSE_USE_VERSION >= 30
+  .getattr     = fuse_xfs_getattr3,
+  .readdir     = fuse_xfs_readdir3,
+  .rename      = fuse_xfs_rename3,
+  .chmod       = fuse_xfs_chmod3,
+  .chown       = fuse_xfs_chown3,
+  .truncate    = fuse_xfs_truncate3,
+  .utimens     = fuse_xfs_utimens3,
+  .setxattr    = fuse_xfs_setxattr3,
+  .getxattr    = fuse_xfs_getxattr3,
+  .read_buf    = fuse_xfs_read_buf,
+#else
+  .getattr     = fuse_xfs_getattr,
+  .fgetattr    = fuse_xfs_fgetattr,
+  .readdir     = fuse_xfs_readdir,
+  .rename      = fuse_xfs_rename,
+  .chmod       = fuse_xfs_chmod,       /* Phase 1: chmod support */
+  .chown       = fuse_xfs_chown,       /* Phase 1: chown support */
+  .truncate    = fuse_xfs_truncate,    /* Phase 1: truncate support */
+  .utimens     = fuse_xfs_utimens,     /* Phase 1: utimens support */
+  .setxattr    = fuse_xfs_setxattr,
+  .getxattr    = fuse_xfs_getxattr,
+#endif
   //Not supported:
   //.exchange    = fuse_xfs_exchange,
   //.getxtimes   = fuse_xfs_getxtimes,
   //.setattr_x   = fuse_xfs_setattr_x,
   //.fsetattr_x  = fuse_xfs_fsetattr_x,
 };
+
+/*
+ * The same operations, each run under g_xfs_lock, for mounts with a
+ * background defragmenter.
+ */
+#define FUSE_XFS_LOCKED(call) do {          \
+    int r_;                                 \
+    pthread_mutex_lock(&g_xfs_lock);        \
+    r_ = (call);                            \
+    pthread_mutex_unlock(&g_xfs_lock);      \
+    return r_;                              \
+} while (0)
+
+static int
+locked_readlink(const char *path, char *buf, size_t size) {
+    FUSE_XFS_LOCKED(fuse_xfs_readlink(path, buf, size));
+}
+
+static int
+locked_opendir(const char *path, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_opendir(path, fi));
+}
+
+static int
+locked_mknod(const char *path, mode_t mode, dev_t rdev) {
+    FUSE_XFS_LOCKED(fuse_xfs_mknod(path, mode, rdev));
+}
+
+static int
+locked_mkdir(const char *path, mode_t mode) {
+    FUSE_XFS_LOCKED(fuse_xfs_mkdir(path, mode));
+}
+
+static int
+locked_symlink(const char *target, const char *linkpath) {
+    FUSE_XFS_LOCKED(fuse_xfs_symlink(target, linkpath));
+}
+
+static int
+locked_unlink(const char *path) {
+    FUSE_XFS_LOCKED(fuse_xfs_unlink(path));
+}
+
+static int
+locked_rmdir(const char *path) {
+    FUSE_XFS_LOCKED(fuse_xfs_rmdir(path));
+}
+
+static int
+locked_link(const char *oldpath, const char *newpath) {
+    FUSE_XFS_LOCKED(fuse_xfs_link(oldpath, newpath));
+}
+
+static int
+locked_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_create(path, mode, fi));
+}
+
+static int
+locked_open(const char *path, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_open(path, fi));
+}
+
+static int
+locked_read(const char *path, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_read(path, buf, size, offset, fi));
+}
+
+static int
+locked_write(const char *path, const char *buf, size_t size,
+             off_t offset, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_write(path, buf, size, offset, fi));
+}
+
+static int
+locked_statfs(const char *path, struct statvfs *stbuf) {
+    FUSE_XFS_LOCKED(fuse_xfs_statfs(path, stbuf));
+}
+
+static int
+locked_release(const char *path, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_release(path, fi));
+}
+
+static int
+locked_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_fsync(path, isdatasync, fi));
+}
+
+static int
+locked_listxattr(const char *path, char *list, size_t size) {
+    FUSE_XFS_LOCKED(fuse_xfs_listxattr(path, list, size));
+}
+
+static int
+locked_removexattr(const char *path, const char *name) {
+    FUSE_XFS_LOCKED(fuse_xfs_removexattr(path, name));
+}
+
+#if FUSE_USE_VERSION >= 30
+static int
+locked_getattr3(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_getattr3(path, stbuf, fi));
+}
+
+static int
+locked_readdir3(const char *path, void *buf, fuse_fill_dir_t filler,
+                off_t offset, struct fuse_file_info *fi,
+                enum fuse_readdir_flags flags) {
+    FUSE_XFS_LOCKED(fuse_xfs_readdir3(path, buf, filler, offset, fi, flags));
+}
+
+static int
+locked_rename3(const char *from, const char *to, unsigned int flags) {
+    FUSE_XFS_LOCKED(fuse_xfs_rename3(from, to, flags));
+}
+
+static int
+locked_chmod3(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_chmod(path, mode));
+}
+
+static int
+locked_chown3(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_chown(path, uid, gid));
+}
+
+static int
+locked_truncate3(const char *path, off_t size, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_truncate(path, size));
+}
+
+static int
+locked_utimens3(const char *path, const struct timespec tv[2],
+                struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_utimens(path, tv));
+}
+
+static int
+locked_setxattr3(const char *path, const char *name, const char *value,
+                 size_t size, int flags) {
+    FUSE_XFS_LOCKED(fuse_xfs_setxattr(path, name, value, size, flags, 0));
+}
+
+static int
+locked_getxattr3(const char *path, const char *name, char *value, size_t size) {
+    FUSE_XFS_LOCKED(fuse_xfs_getxattr(path, name, value, size, 0));
+}
+
+static int
+locked_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                off_t offset, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_read_buf(path, bufp, size, offset, fi));
+}
+#else
+static int
+locked_getattr(const char *path, struct stat *stbuf) {
+    FUSE_XFS_LOCKED(fuse_xfs_getattr(path, stbuf));
+}
+
+static int
+locked_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_fgetattr(path, stbuf, fi));
+}
+
+static int
+locked_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+               off_t offset, struct fuse_file_info *fi) {
+    FUSE_XFS_LOCKED(fuse_xfs_readdir(path, buf, filler, offset, fi));
+}
+
+static int
+locked_rename(const char *from, const char *to) {
+    FUSE_XFS_LOCKED(fuse_xfs_rename(from, to));
+}
+
+static int
+locked_chmod(const char *path, mode_t mode) {
+    FUSE_XFS_LOCKED(fuse_xfs_chmod(path, mode));
+}
+
+static int
+locked_chown(const char *path, uid_t uid, gid_t gid) {
+    FUSE_XFS_LOCKED(fuse_xfs_chown(path, uid, gid));
+}
+
+static int
+locked_truncate(const char *path, off_t size) {
+    FUSE_XFS_LOCKED(fuse_xfs_truncate(path, size));
+}
+
+static int
+locked_utimens(const char *path, const struct timespec tv[2]) {
+    FUSE_XFS_LOCKED(fuse_xfs_utimens(path, tv));
+}
+
+static int
+locked_setxattr(const char *path, const char *name, const char *value,
+                size_t size, int flags, uint32_t position) {
+    FUSE_XFS_LOCKED(fuse_xfs_setxattr(path, name, value, size, flags, position));
+}
+
+static int
+locked_getxattr(const char *path, const char *name, char *value, size_t size,
+                uint32_t position) {
+    FUSE_XFS_LOCKED(fuse_xfs_getxattr(path, name, value, size, position));
+}
+#endif
+
+#ifdef FUSE_IOCTL_COMPAT
+static int
+locked_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+             unsigned int flags, void *data) {
+    FUSE_XFS_LOCKED(fuse_xfs_ioctl(path, cmd, arg, fi, flags, data));
+}
+#endif
+
+struct fuse_operations fuse_xfs_locked_operations = {
+  .init        = fuse_xfs_init,
+  .destroy     = fuse_xfs_destroy,
+  .readlink    = locked_readlink,
+  .opendir     = locked_opendir,
+  .releasedir  = fuse_xfs_releasedir,
+  .mknod       = locked_mknod,
+  .mkdir       = locked_mkdir,
+  .symlink     = locked_symlink,
+  .unlink      = locked_unlink,
+  .rmdir       = locked_rmdir,
+  .link        = locked_link,
+  .create      = locked_create,
+  .open        = locked_open,
+  .read        = locked_read,
+  .write       = locked_write,
+  .statfs      = locked_statfs,
+  .flush       = fuse_xfs_flush,
+  .release     = locked_release,
+  .fsync       = locked_fsync,
+  .listxattr   = locked_listxattr,
+  .removexattr = locked_removexattr,
+#ifdef FUSE_IOCTL_COMPAT
+  .ioctl       = locked_ioctl,
+#endif
+#if FUSE_USE_VERSION >= 30
+  .getattr     = locked_getattr3,
+  .readdir     = locked_readdir3,
+  .rename      = locked_rename3,
+  .chmod       = locked_chmod3,
+  .chown       = locked_chown3,
+  .truncate    = locked_truncate3,
+  .utimens     = locked_utimens3,
+  .setxattr    = locked_setxattr3,
+  .getxattr    = locked_getxattr3,
+  .read_buf    = locked_read_buf,
+#else
+  .getattr     = locked_getattr,
+  .fgetattr    = locked_fgetattr,
+  .readdir     = locked_readdir,
+  .rename      = locked_rename,
+  .chmod       = locked_chmod,
+  .chown       = locked_chown,
+  .truncate    = locked_truncate,
+  .utimens     = locked_utimens,
+  .setxattr    = locked_setxattr,
+  .getxattr    = locked_getxattr,
+#endif
+};
@@ -11,6 +11,8 @@
 
 #define XATTR_LIST_MAX  16
 
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <xfsutil.h>
 
 /*
@@ -23,8 +25,63 @@ struct fuse_xfs_options {
     unsigned char probeonly;
     unsigned char printlabel;
     unsigned char printuuid;
+    unsigned char metadump;  /* Device is an xfs_metadump file */
+    unsigned int defrag;     /* Background defrag threshold, extents per GB (0 = off) */
 };
 
+/*
+ * Largest read or write asked of the kernel (libfuse 3).  max_read has to
+ * be given as a mount option, which main adds ahead of the user's.
+ */
+#define FUSE_XFS_MAX_IO (1024 * 1024)
+
+/*
+ * Kernel entry, attribute and negative lookup timeouts in seconds.  A
+ * read-only mount never changes, so its cache is kept for a year; a
+ * read-write mount sees every change through the kernel except the
+ * defragmenter's, which invalidates the files it rewrites.
+ */
+#define FUSE_XFS_RO_TIMEOUT (365 * 24 * 3600)
+#define FUSE_XFS_RW_TIMEOUT 1
+
+/*
+ * Virtual read-only file holding the space usage report (xfs_usage_report)
+ */
+#define FUSE_XFS_USAGE_PATH "/.xfs_usage"
+
+/*
+ * Extent map of a file on the mount, a page at a time.  The kernel answers
+ * FS_IOC_FIEMAP itself rather than passing it to FUSE, and FUSE only
+ * passes on ioctls whose argument size is in the command, so the mount has
+ * its own command taking struct fiemap with room for a fixed number of
+ * extents.  Fields and flags are those of FIEMAP; fm_extent_count may be 0
+ * to count the extents, and a map is continued by setting fm_start to the
+ * end of the last extent returned.
+ */
+#define FUSE_XFS_FIEMAP_EXTENTS     64
+#define FUSE_XFS_FIEMAP_FLAG_SYNC   0x1
+
+struct fuse_xfs_fiemap_extent {
+    uint64_t fe_logical;
+    uint64_t fe_physical;
+    uint64_t fe_length;
+    uint64_t fe_reserved64[2];
+    uint32_t fe_flags;              /* XFS_FIEMAP_EXTENT_* */
+    uint32_t fe_reserved[3];
+};
+
+struct fuse_xfs_fiemap {
+    uint64_t fm_start;
+    uint64_t fm_length;
+    uint32_t fm_flags;
+    uint32_t fm_mapped_extents;
+    uint32_t fm_extent_count;
+    uint32_t fm_reserved;
+    struct fuse_xfs_fiemap_extent fm_extents[FUSE_XFS_FIEMAP_EXTENTS];
+};
+
+#define FUSE_XFS_IOC_FIEMAP _IOWR('X', 200, struct fuse_xfs_fiemap)
+
 /*
  * Global mount accessor
  */
@@ -41,4 +98,10 @@ int fuse_xfs_get_readonly(void);
  */
 extern struct fuse_operations fuse_xfs_operations;
 
+/*
+ * The same operations serialized by one lock, for read-write mounts and
+ * the background defragmenter
+ */
+extern struct fuse_operations fuse_xfs_locked_operations;
+
 #endif /* __FUSE_XFS_H__ */
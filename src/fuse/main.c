@@ -10,23 +10,38 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <xfsutil.h>
 
 #define RAW_SECTOR_SIZE 512
+#define DEFAULT_DEFRAG_EXTENTS_PER_GB 16
 
 extern struct fuse_operations fuse_xfs_operations;
 
 void usage(int argc, char *argv[]) {
-    fprintf(stderr, "fuse-xfs [-p] [-l] [-u] [-rw] device/file [-- fuse-opts]\n");
+    fprintf(stderr, "fuse-xfs [-p] [-l] [-u] [-rw] [-defrag[=n]] device/file [-- fuse-opts]\n");
     fprintf(stderr, "         [-p]     Only probe if the device contains an XFS filesystem.\n");
     fprintf(stderr, "         [-l]     Print the label of the XFS filesystem.\n");
     fprintf(stderr, "         [-u]     Print the UUID of the XFS filesystem.\n");
     fprintf(stderr, "         [-rw]    Mount read-write (default is read-only).\n");
+    fprintf(stderr, "                  An xfs_metadump file is always mounted read-only.\n");
+    fprintf(stderr, "         [-defrag[=n]] Defragment files with more than n extents per GB\n");
+    fprintf(stderr, "                  (default %d) in the background. Needs -rw.\n", DEFAULT_DEFRAG_EXTENTS_PER_GB);
     fprintf(stderr, "         --       All options after -- are passed on to fuse.\n");
     fprintf(stderr, "                  The mount point must be supplied as the first argument.\n");
 }
 
+/*
+ * Put a fuse option straight after argv[0], ahead of the user's own -o
+ * options so that theirs still win
+ */
+static void insert_fuse_option(int *argc, char *argv[], char *opt) {
+    memmove(&argv[2], &argv[1], (*argc - 1) * sizeof(argv[0]));
+    argv[1] = opt;
+    (*argc)++;
+}
+
 int parse_options(struct fuse_xfs_options* opts, int argc, char *argv[], int *new_argc, char *new_argv[]) {
     int i;
     
@@ -52,6 +67,15 @@ int parse_options(struct fuse_xfs_options* opts, int argc, char *argv[], int *ne
         else if (!strcmp(argv[i], "-rw")) {
             opts->readonly = 0;  /* Enable read-write mode */
         }
+        else if (!strcmp(argv[i], "-defrag")) {
+            opts->defrag = DEFAULT_DEFRAG_EXTENTS_PER_GB;
+        }
+        else if (!strncmp(argv[i], "-defrag=", 8)) {
+            opts->defrag = atoi(argv[i] + 8);
+            if (opts->defrag == 0) {
+                return 0;
+            }
+        }
         else opts->device = argv[i];
     }
     
@@ -94,7 +118,14 @@ int xfs_probe(struct fuse_xfs_options* opts) {
     
     close(fd);
     
-    if (strncmp(magic, "XFSB", 4)) {
+    if (!strncmp(magic, "XFSM", 4) || !strncmp(magic, "XFM2", 4)) {
+        /* Metadumps are served in place by libxfs and never written */
+        opts->metadump = 1;
+        if (!opts->readonly) {
+            fprintf(stderr, "%s is a metadump, mounting read-only\n", opts->device);
+            opts->readonly = 1;
+        }
+    } else if (strncmp(magic, "XFSB", 4)) {
         fprintf(stderr, "No XFS signature on %s\n", opts->device);
         close(fd);
         return 0;
@@ -115,11 +146,22 @@ int main(int argc, char* argv[], char* envp[], char** exec_path) {
     struct fuse_xfs_options opts;
     char *fuse_argv[256];
     char fsname[20];
+    char timeouts[96];
+    int timeout;
     int fuse_argc = argc;
     int i;
+#if FUSE_USE_VERSION >= 30
+    char max_read[32];
+#endif
     
     memset(&opts, 0, sizeof(opts));
     
+    /* Leave room for the options added below */
+    if (argc > 250) {
+        usage(argc, argv);
+        return 1;
+    }
+    
     /* All arguments for xfs must precede fuse arguments */
     if (!parse_options(&opts, argc, argv, &fuse_argc, fuse_argv)) {
         usage(argc, argv);
@@ -166,6 +208,35 @@ int main(int argc, char* argv[], char* envp[], char** exec_path) {
     if (!opts.readonly) {
         fprintf(stderr, "Mounting %s read-write\n", opts.device);
     }
+
+    if (opts.defrag && opts.readonly) {
+        fprintf(stderr, "-defrag needs a read-write mount, ignoring it\n");
+        opts.defrag = 0;
+    }
+
+    /*
+     * Nothing changes under a read-only mount, so the kernel may keep
+     * names and attributes for good.  The probe may have switched a
+     * metadump to read-only, so this has to wait until now.
+     */
+    timeout = opts.readonly ? FUSE_XFS_RO_TIMEOUT : FUSE_XFS_RW_TIMEOUT;
+    snprintf(timeouts, sizeof(timeouts),
+             "-oentry_timeout=%d,attr_timeout=%d,negative_timeout=%d",
+             timeout, timeout, timeout);
+    insert_fuse_option(&fuse_argc, fuse_argv, timeouts);
+#if FUSE_USE_VERSION >= 30
+    /* libfuse 3 only takes max_read as a mount option */
+    snprintf(max_read, sizeof(max_read), "-omax_read=%d", FUSE_XFS_MAX_IO);
+    insert_fuse_option(&fuse_argc, fuse_argv, max_read);
+#endif
         
+    /*
+     * libxfs is not thread safe against changes, and the kernel sends
+     * namespace operations on different directories at once, so only
+     * read-only mounts take requests unlocked
+     */
+    if (opts.defrag || !opts.readonly) {
+        return fuse_main(fuse_argc, fuse_argv, &fuse_xfs_locked_operations, &opts);
+    }
     return fuse_main(fuse_argc, fuse_argv, &fuse_xfs_operations, &opts);
 }
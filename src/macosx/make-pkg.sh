@@ -73,6 +73,7 @@ ${INSTALL_C} -m 755 ${BUILD_FOLDER}/bin/mkfs.xfs ${DISTRIBUTION_FOLDER}/usr/loca
 ${INSTALL_C} -m 755 ${BUILD_FOLDER}/bin/fuse-xfs ${DISTRIBUTION_FOLDER}/usr/local/bin/fuse-xfs
 ${INSTALL_C} -m 755 ${BUILD_FOLDER}/bin/xfs-cli ${DISTRIBUTION_FOLDER}/usr/local/bin/xfs-cli
 ${INSTALL_C} -m 755 ${BUILD_FOLDER}/bin/xfs-rcopy ${DISTRIBUTION_FOLDER}/usr/local/bin/xfs-rcopy
+${INSTALL_C} -m 755 ${BUILD_FOLDER}/bin/xfs-defrag ${DISTRIBUTION_FOLDER}/usr/local/bin/xfs-defrag
 #${INSTALL_C} -m 755 ${BUILD_FOLDER}/fuse-xfs/fuse-xfs.wait ${DISTRIBUTION_FOLDER}/usr/local/bin/fuse-xfs.wait
 #${INSTALL_C} -m 755 ${BUILD_FOLDER}/fuse-xfs/fuse-xfs.probe ${DISTRIBUTION_FOLDER}/usr/local/bin/fuse-xfs.probe
 #${INSTALL_C} -m 755 ${BUILD_FOLDER}/fuse-xfs/fuse-xfs.install ${DISTRIBUTION_FOLDER}/usr/local/bin/fuse-xfs.install
@@ -46,7 +46,6 @@ __uint64_t	barcount[11];
 unsigned int	num_targets;
 target_control	*target;
 
-wbuf		w_buf;
 wbuf		btree_buf;
 
 pid_t		parent_pid;
@@ -55,7 +54,9 @@ unsigned int	kids;
 thread_control	glob_masks;
 thread_args	*targ;
 
-pthread_mutex_t	mainwait;
+int		source_direct;
+
+#define WBUF_RING	8	/* buffers the reader may run ahead by */
 
 #define ACTIVE		1
 #define INACTIVE	2
@@ -162,44 +163,58 @@ check_errors(void)
  * are taken care of when the buffer's read in
  */
 int
-do_write(thread_args *args)
+do_write(thread_args *args, wbuf *buf)
 {
 	int	res, error = 0;
 
-	if (target[args->id].position != w_buf.position)  {
-		if (lseek64(args->fd, w_buf.position, SEEK_SET) < 0)  {
+	if (target[args->id].position != buf->position)  {
+		if (lseek64(args->fd, buf->position, SEEK_SET) < 0)  {
 			error = target[args->id].err_type = 1;
 		} else  {
-			target[args->id].position = w_buf.position;
+			target[args->id].position = buf->position;
 		}
 	}
 
-	if ((res = write(target[args->id].fd, w_buf.data,
-				w_buf.length)) == w_buf.length)  {
+	if ((res = write(target[args->id].fd, buf->data,
+				buf->length)) == buf->length)  {
 		target[args->id].position += res;
+		target[args->id].bytes += res;
+		gettimeofday(&target[args->id].done, NULL);
 	} else  {
 		error = 2;
 	}
 
 	if (error) {
 		target[args->id].error = errno;
-		target[args->id].position = w_buf.position;
+		target[args->id].position = buf->position;
 	}
 	return error;
 }
 
+/*
+ * Each target thread works through the ring in order, behind the reader
+ * but independently of the other targets.
+ */
 void *
 begin_reader(void *arg)
 {
 	thread_args	*args = arg;
+	wbuf		*buf;
 
 	for (;;) {
-		pthread_mutex_lock(&args->wait);
-		if (do_write(args))
+		pthread_mutex_lock(&glob_masks.mutex);
+		while (args->seq == glob_masks.seq)
+			pthread_cond_wait(&glob_masks.cond, &glob_masks.mutex);
+		buf = &glob_masks.ring[args->seq % glob_masks.nbufs];
+		pthread_mutex_unlock(&glob_masks.mutex);
+
+		if (do_write(args, buf))
 			goto handle_error;
-	        pthread_mutex_lock(&glob_masks.mutex);
-		if (--glob_masks.num_working == 0)
-			pthread_mutex_unlock(&mainwait);
+
+		pthread_mutex_lock(&glob_masks.mutex);
+		args->seq++;
+		buf->refs--;
+		pthread_cond_broadcast(&glob_masks.cond);
 		pthread_mutex_unlock(&glob_masks.mutex);
 	}
 	/* NOTREACHED */
@@ -209,8 +224,10 @@ handle_error:
 
 	pthread_mutex_lock(&glob_masks.mutex);
 	target[args->id].state = INACTIVE;
-	if (--glob_masks.num_working == 0)
-		pthread_mutex_unlock(&mainwait);
+	/* let go of the buffers this target will never write */
+	for (; args->seq < glob_masks.seq; args->seq++)
+		glob_masks.ring[args->seq % glob_masks.nbufs].refs--;
+	pthread_cond_broadcast(&glob_masks.cond);
 	pthread_mutex_unlock(&glob_masks.mutex);
 	pthread_exit(NULL);
 	return NULL;
@@ -230,11 +247,23 @@ killall(void)
 		if (target[i].state == ACTIVE)  {
 			/* kill up target threads */
 			pthread_kill(target[i].pid, SIGKILL);
-			pthread_mutex_unlock(&targ[i].wait);
 		}
 	}
 }
 
+/*
+ * Block or unblock SIGCHLD for the calling thread.
+ */
+static void
+sigchld_mask(int how)
+{
+	sigset_t	set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	pthread_sigmask(how, &set, NULL);
+}
+
 void
 handler(int sig)
 {
@@ -404,7 +433,14 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		abort();
 	}
 
-	if ((res = read(fd, buf->data, buf->length)) < 0)  {
+	res = read(fd, buf->data, buf->length);
+	if (res < 0 && errno == EINVAL && source_direct)  {
+		/* source won't do direct I/O at this alignment, go buffered */
+		source_direct = 0;
+		if (fcntl(fd, F_SETFL, O_RDONLY) == 0)
+			res = read(fd, buf->data, buf->length);
+	}
+	if (res < 0)  {
 		do_warn(_("%s:  read failure at offset %lld\n"),
 				progname, source_position);
 		die_perror();
@@ -463,24 +499,86 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 }
 
 
+/*
+ * Get the next buffer in the ring to read into, waiting for any target
+ * still writing out what it held last time round.
+ */
+wbuf *
+wbuf_next(void)
+{
+	wbuf		*buf;
+
+	pthread_mutex_lock(&glob_masks.mutex);
+	buf = &glob_masks.ring[glob_masks.seq % glob_masks.nbufs];
+	sigchld_mask(SIG_UNBLOCK);
+	while (buf->refs > 0)
+		pthread_cond_wait(&glob_masks.cond, &glob_masks.mutex);
+	sigchld_mask(SIG_BLOCK);
+	pthread_mutex_unlock(&glob_masks.mutex);
+	return buf;
+}
+
+/*
+ * Hand a filled buffer to the target threads.  This doesn't wait for the
+ * writes, the buffer is only reused once they are all done with it.
+ */
 void
-write_wbuf(void)
+write_wbuf(wbuf *buf)
 {
 	int		i;
 
-	/* verify target threads */
+	pthread_mutex_lock(&glob_masks.mutex);
+	buf->refs = 0;
 	for (i = 0; i < num_targets; i++)
 		if (target[i].state != INACTIVE)
-			glob_masks.num_working++;
+			buf->refs++;
+	if (buf->refs == 0)  {
+		pthread_mutex_unlock(&glob_masks.mutex);
+		do_log(_("Aborting XFS copy - no more targets.\n"));
+		check_errors();
+		exit(1);
+	}
+	glob_masks.seq++;
+	pthread_cond_broadcast(&glob_masks.cond);
+	pthread_mutex_unlock(&glob_masks.mutex);
+}
 
-	/* release target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			pthread_mutex_unlock(&targ[i].wait);	/* wake up */
+/*
+ * Wait for every target to write out everything handed to it so far.
+ */
+void
+wbuf_drain(void)
+{
+	int		i;
 
-	sigrelse(SIGCHLD);
-	pthread_mutex_lock(&mainwait);
-	sighold(SIGCHLD);
+	pthread_mutex_lock(&glob_masks.mutex);
+	sigchld_mask(SIG_UNBLOCK);
+	for (i = 0; i < glob_masks.nbufs; i++)
+		while (glob_masks.ring[i].refs > 0)
+			pthread_cond_wait(&glob_masks.cond,
+					&glob_masks.mutex);
+	sigchld_mask(SIG_BLOCK);
+	pthread_mutex_unlock(&glob_masks.mutex);
+}
+
+void
+report_targets(struct timeval *start)
+{
+	double		secs;
+	int		i;
+
+	for (i = 0; i < num_targets; i++)  {
+		if (target[i].bytes == 0)
+			continue;
+		secs = (target[i].done.tv_sec - start->tv_sec) +
+			(target[i].done.tv_usec - start->tv_usec) / 1000000.0;
+		if (secs <= 0.0)
+			secs = 0.000001;
+		do_out(_("%s:  %llu MB in %.1f seconds (%.1f MB/s)\n"),
+			target[i].name,
+			(unsigned long long)target[i].bytes >> 20, secs,
+			target[i].bytes / secs / (1024 * 1024));
+	}
 }
 
 
@@ -501,6 +599,9 @@ main(int argc, char **argv)
 	int		wbuf_size;
 	int		wbuf_align;
 	int		wbuf_miniosize;
+	wbuf		*w_buf;
+	xfs_off_t	w_pos;
+	struct timeval	start;
 	int		source_is_file = 0;
 	int		buffered_output = 0;
 	int		duplicate = 0;
@@ -587,6 +688,7 @@ main(int argc, char **argv)
 		target[i].state = INACTIVE;
 		target[i].error = 0;
 		target[i].err_type = 0;
+		target[i].bytes = 0;
 	}
 
 	parent_pid = getpid();
@@ -630,12 +732,18 @@ main(int argc, char **argv)
 		wbuf_align = d.d_mem;
 		wbuf_size = MIN(d.d_maxiosz, 1 * 1024 * 1024);
 		wbuf_miniosize = d.d_miniosz;
+		source_direct = 1;
 	} else  {
 		/* set arbitrary I/O params, miniosize at least 1 disk block */
 
 		wbuf_align = getpagesize();
 		wbuf_size = 1 * 1024 * 1024;
 		wbuf_miniosize = -1;	/* set after mounting source fs */
+
+		/* read devices around the page cache, like the targets */
+		if (!source_is_file &&
+		    fcntl(source_fd, F_SETFL, open_flags | O_DIRECT) == 0)
+			source_direct = 1;
 	}
 
 	if (!source_is_file)  {
@@ -820,34 +928,42 @@ main(int argc, char **argv)
 		do_log(_("Couldn't initialize global thread mask\n"));
 		die_perror();
 	}
-	glob_masks.num_working = 0;
+	if (pthread_cond_init(&glob_masks.cond, NULL) != 0)  {
+		do_log(_("Couldn't initialize global thread condition\n"));
+		die_perror();
+	}
 
-	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
-					wbuf_miniosize, 0) == NULL)  {
-		do_log(_("Error initializing wbuf 0\n"));
+	glob_masks.nbufs = WBUF_RING;
+	glob_masks.seq = 0;
+	glob_masks.ring = calloc(glob_masks.nbufs, sizeof(wbuf));
+	if (glob_masks.ring == NULL)  {
+		do_log(_("Couldn't allocate wbuf ring\n"));
 		die_perror();
 	}
+	for (i = 0; i < glob_masks.nbufs; i++)  {
+		if (wbuf_init(&glob_masks.ring[i], wbuf_size, wbuf_align,
+						wbuf_miniosize, i) == NULL)  {
+			do_log(_("Error initializing wbuf %d\n"), i);
+			die_perror();
+		}
+		wbuf_size = MIN(wbuf_size, glob_masks.ring[i].size);
+	}
+	/* memalign may have come up short, use what they all have */
+	for (i = 0; i < glob_masks.nbufs; i++)
+		glob_masks.ring[i].size = wbuf_size;
 
 	wblocks = wbuf_size / BBSIZE;
 
 	if (wbuf_init(&btree_buf, MAX(source_blocksize, wbuf_miniosize),
-				wbuf_align, wbuf_miniosize, 1) == NULL)  {
-		do_log(_("Error initializing btree buf 1\n"));
+			wbuf_align, wbuf_miniosize, glob_masks.nbufs) == NULL)  {
+		do_log(_("Error initializing btree buf\n"));
 		die_perror();
 	}
 
-	if (pthread_mutex_init(&mainwait,NULL) != 0)  {
-		do_log(_("Error creating first semaphore.\n"));
-		die_perror();
-		exit(1);
-	}
-	/* need to start out blocking */
-	pthread_mutex_lock(&mainwait);
-
 	/* set up sigchild signal handler */
 
 	signal(SIGCHLD, handler);
-	sighold(SIGCHLD);
+	sigchld_mask(SIG_BLOCK);
 
 	/* make children */
 
@@ -862,14 +978,7 @@ main(int argc, char **argv)
 			platform_uuid_generate(&tcarg->uuid);
 		else
 			platform_uuid_copy(&tcarg->uuid, &mp->m_sb.sb_uuid);
-
-		if (pthread_mutex_init(&tcarg->wait, NULL) != 0)  {
-			do_log(_("Error creating thread mutex %d\n"), i);
-			die_perror();
-			exit(1);
-		}
-		/* need to start out blocking */
-		pthread_mutex_lock(&tcarg->wait);
+		tcarg->seq = 0;
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
@@ -898,11 +1007,13 @@ main(int argc, char **argv)
 
 	kids = num_targets;
 	block = (struct xfs_btree_block *) btree_buf.data;
+	gettimeofday(&start, NULL);
 
 	for (agno = 0; agno < num_ags && kids > 0; agno++)  {
 		/* read in first blocks of the ag */
 
-		read_ag_header(source_fd, agno, &w_buf, &ag_hdr, mp,
+		w_buf = wbuf_next();
+		read_ag_header(source_fd, agno, w_buf, &ag_hdr, mp,
 			source_blocksize, source_sectorsize);
 
 		/* set the in_progress bit for the first AG */
@@ -916,9 +1027,18 @@ main(int argc, char **argv)
 		ag_hdr.xfs_agf = (xfs_agf_t *) btree_buf.data;
 		btree_buf.length = source_blocksize;
 
+		/* align first data copy but don't overwrite ag header */
+
+		pos = w_buf->position >> BBSHIFT;
+		length = w_buf->length >> BBSHIFT;
+		next_begin = pos + length;
+		ag_begin = next_begin;
+
+		ASSERT(w_buf->position % source_sectorsize == 0);
+
 		/* write the ag header out */
 
-		write_wbuf();
+		write_wbuf(w_buf);
 
 		/* traverse btree until we get to the leftmost leaf node */
 
@@ -932,7 +1052,7 @@ main(int argc, char **argv)
 				+ source_blocksize / BBSIZE;
 
 		for (;;) {
-			/* none of this touches the w_buf buffer */
+			/* none of this touches the ring buffers */
 
 			ASSERT(current_level < btree_levels);
 
@@ -957,15 +1077,6 @@ main(int argc, char **argv)
 			bno = be32_to_cpu(ptr[0]);
 		}
 
-		/* align first data copy but don't overwrite ag header */
-
-		pos = w_buf.position >> BBSHIFT;
-		length = w_buf.length >> BBSHIFT;
-		next_begin = pos + length;
-		ag_begin = next_begin;
-
-		ASSERT(w_buf.position % source_sectorsize == 0);
-
 		/* handle the rest of the ag */
 
 		for (;;) {
@@ -1005,28 +1116,29 @@ main(int argc, char **argv)
 				if (size > 0)  {
 					/* copy extent */
 
-					w_buf.position = (xfs_off_t)
-						begin << BBSHIFT;
+					w_pos = (xfs_off_t) begin << BBSHIFT;
 
 					while (size > 0)  {
+						w_buf = wbuf_next();
+						w_buf->position = w_pos;
 						/*
 						 * let lower layer do alignment
 						 */
-						if (size > w_buf.size)  {
-							w_buf.length = w_buf.size;
-							size -= w_buf.size;
+						if (size > wbuf_size)  {
+							w_buf->length = wbuf_size;
+							size -= wbuf_size;
 							sizeb -= wblocks;
 							numblocks += wblocks;
 						} else  {
-							w_buf.length = size;
+							w_buf->length = size;
 							numblocks += sizeb;
 							size = 0;
 						}
 
-						read_wbuf(source_fd, &w_buf, mp);
-						write_wbuf();
-
-						w_buf.position += w_buf.length;
+						read_wbuf(source_fd, w_buf, mp);
+						w_pos = w_buf->position +
+							w_buf->length;
+						write_wbuf(w_buf);
 
 						howfar = bump_bar(
 							howfar, numblocks);
@@ -1039,7 +1151,7 @@ main(int argc, char **argv)
 						be32_to_cpu(rec_ptr->ar_startblock) +
 					 	be32_to_cpu(rec_ptr->ar_blockcount));
 				next_begin = rounddown(new_begin,
-						w_buf.min_io_size >> BBSHIFT);
+						wbuf_miniosize >> BBSHIFT);
 			}
 
 			if (be32_to_cpu(block->bb_u.s.bb_rightsib) == NULLAGBLOCK)
@@ -1076,27 +1188,28 @@ main(int argc, char **argv)
 			if (size > 0)  {
 				/* copy extent */
 
-				w_buf.position = (xfs_off_t) begin << BBSHIFT;
+				w_pos = (xfs_off_t) begin << BBSHIFT;
 
 				while (size > 0)  {
+					w_buf = wbuf_next();
+					w_buf->position = w_pos;
 					/*
 					 * let lower layer do alignment
 					 */
-					if (size > w_buf.size)  {
-						w_buf.length = w_buf.size;
-						size -= w_buf.size;
+					if (size > wbuf_size)  {
+						w_buf->length = wbuf_size;
+						size -= wbuf_size;
 						sizeb -= wblocks;
 						numblocks += wblocks;
 					} else  {
-						w_buf.length = size;
+						w_buf->length = size;
 						numblocks += sizeb;
 						size = 0;
 					}
 
-					read_wbuf(source_fd, &w_buf, mp);
-					write_wbuf();
-
-					w_buf.position += w_buf.length;
+					read_wbuf(source_fd, w_buf, mp);
+					w_pos = w_buf->position + w_buf->length;
+					write_wbuf(w_buf);
 
 					howfar = bump_bar(howfar, numblocks);
 				}
@@ -1105,23 +1218,28 @@ main(int argc, char **argv)
 	}
 
 	if (kids > 0)  {
+		/* the rest is written target by target from here */
+
+		wbuf_drain();
+		w_buf = wbuf_next();
+
 		if (!duplicate)  {
 
 			/* write a clean log using the specified UUID */
 			for (j = 0, tcarg = targ; j < num_targets; j++)  {
-				w_buf.owner = tcarg;
-				w_buf.length = rounddown(w_buf.size,
-							 w_buf.min_io_size);
+				w_buf->owner = tcarg;
+				w_buf->length = rounddown(w_buf->size,
+							 w_buf->min_io_size);
 				pos = write_log_header(
-							source_fd, &w_buf, mp);
+							source_fd, w_buf, mp);
 				end_pos = write_log_trailer(
-							source_fd, &w_buf, mp);
-				w_buf.position = pos;
-				memset(w_buf.data, 0, w_buf.length);
+							source_fd, w_buf, mp);
+				w_buf->position = pos;
+				memset(w_buf->data, 0, w_buf->length);
 
-				while (w_buf.position < end_pos)  {
-					do_write(tcarg);
-					w_buf.position += w_buf.length;
+				while (w_buf->position < end_pos)  {
+					do_write(tcarg, w_buf);
+					w_buf->position += w_buf->length;
 				}
 				tcarg++;
 			}
@@ -1133,7 +1251,7 @@ main(int argc, char **argv)
 		/* [backwards, so inprogress bit only updated when done] */
 
 		for (i = num_ags - 1; i >= 0; i--)  {
-			read_ag_header(source_fd, i, &w_buf, &ag_hdr, mp,
+			read_ag_header(source_fd, i, w_buf, &ag_hdr, mp,
 				source_blocksize, source_sectorsize);
 			if (i == 0)
 				ag_hdr.xfs_sb->sb_inprogress = 0;
@@ -1143,12 +1261,13 @@ main(int argc, char **argv)
 			for (j = 0, tcarg = targ; j < num_targets; j++)  {
 				platform_uuid_copy(&ag_hdr.xfs_sb->sb_uuid,
 							&tcarg->uuid);
-				do_write(tcarg);
+				do_write(tcarg, w_buf);
 				tcarg++;
 			}
 		}
 
 		bump_bar(100, 0);
+		report_targets(&start);
 	}
 
 	check_errors();
@@ -1166,7 +1285,7 @@ next_log_chunk(xfs_caddr_t p, int offset, void *private)
 	if (buf->length < (int)(p - buf->data) + offset) {
 		/* need to flush this one, then start afresh */
 
-		do_write(buf->owner);
+		do_write(buf->owner, buf);
 		memset(buf->data, 0, buf->length);
 		return buf->data;
 	}
@@ -1201,7 +1320,7 @@ write_log_header(int fd, wbuf *buf, xfs_mount_t *mp)
 			xfs_sb_version_haslogv2(&mp->m_sb) ? 2 : 1,
 			mp->m_sb.sb_logsunit, XLOG_FMT,
 			next_log_chunk, buf);
-	do_write(buf->owner);
+	do_write(buf->owner, buf);
 
 	return roundup(logstart + offset, buf->length);
 }
@@ -1226,7 +1345,7 @@ write_log_trailer(int fd, wbuf *buf, xfs_mount_t *mp)
 		read_wbuf(fd, buf, mp);
 		offset = (int)(logend - buf->position);
 		memset(buf->data, 0, offset);
-		do_write(buf->owner);
+		do_write(buf->owner, buf);
 	}
 
 	return buf->position;
@@ -58,19 +58,27 @@ typedef struct {
 	size_t		length;		/* requested length (bytes) */
 	char		*data;		/* pointer to data buffer */
 	struct t_args	*owner;		/* for non-parallel writes */
+	int		refs;		/* targets yet to write it out */
 } wbuf;
 
 typedef struct t_args {
 	int		id;
 	uuid_t		uuid;
-	pthread_mutex_t	wait;
+	__uint64_t	seq;		/* next ring buffer to write */
 	int		fd;
 } thread_args;
 
+/*
+ * The reader fills a ring of buffers and each target thread writes them
+ * out in order at its own pace, so reads run ahead of the writes and a
+ * slow target only holds the others back once the ring is full.
+ */
 typedef struct {
 	pthread_mutex_t mutex;
-	int		num_working;
-	wbuf		*buffer;
+	pthread_cond_t	cond;
+	wbuf		*ring;
+	int		nbufs;
+	__uint64_t	seq;		/* buffers handed to the targets */
 } thread_control;
 
 typedef int thread_id;
@@ -85,5 +93,7 @@ typedef struct {
 	int		state;
 	int		error;
 	int		err_type;
+	__uint64_t	bytes;		/* written, for the throughput report */
+	struct timeval	done;		/* when the last write finished */
 } target_control;
 
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2026 fuse-xfs contributors.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <xfs/libxfs.h>
+#include <pthread.h>
+#include "agwalk.h"
+#include "io.h"
+#include "init.h"
+#include "malloc.h"
+
+/*
+ * The AGs are handed out one at a time in list order, so with a single
+ * thread they are walked exactly as a plain loop would; callers keep
+ * per-AG results and merge them afterwards in AG order.
+ */
+typedef struct agwalk_ctx {
+	pthread_mutex_t		lock;
+	xfs_agnumber_t		*aglist;
+	int			nags;
+	int			next;
+	agwalk_f_t		func;
+} agwalk_ctx_t;
+
+static void *
+agwalk_worker(
+	void			*arg)
+{
+	agwalk_ctx_t		*ctx = arg;
+	int			i;
+
+	push_cur();
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		i = ctx->next++;
+		pthread_mutex_unlock(&ctx->lock);
+		if (i >= ctx->nags)
+			break;
+		ctx->func(ctx->aglist[i]);
+	}
+
+	/* tear down this thread's I/O stack */
+	while (iocur_sp > 0)
+		pop_cur();
+	pop_cur();
+	xfree(iocur_base);
+	return NULL;
+}
+
+void
+agwalk(
+	xfs_agnumber_t		*aglist,
+	int			nags,
+	int			nthreads,
+	agwalk_f_t		func)
+{
+	agwalk_ctx_t		ctx;
+	pthread_t		*threads;
+	int			started;
+	int			i;
+
+	if (nthreads > nags)
+		nthreads = nags;
+	if (nthreads <= 1) {
+		for (i = 0; i < nags; i++)
+			func(aglist[i]);
+		return;
+	}
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	ctx.aglist = aglist;
+	ctx.nags = nags;
+	ctx.next = 0;
+	ctx.func = func;
+	threads = xmalloc((nthreads - 1) * sizeof(*threads));
+	for (started = 0; started < nthreads - 1; started++)
+		if (pthread_create(&threads[started], NULL, agwalk_worker,
+				&ctx))
+			break;
+
+	/* this thread is the last of the walkers */
+	for (;;) {
+		pthread_mutex_lock(&ctx.lock);
+		i = ctx.next++;
+		pthread_mutex_unlock(&ctx.lock);
+		if (i >= nags)
+			break;
+		func(aglist[i]);
+	}
+	while (started--)
+		pthread_join(threads[started], NULL);
+	xfree(threads);
+	pthread_mutex_destroy(&ctx.lock);
+}
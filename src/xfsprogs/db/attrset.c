@@ -165,6 +165,7 @@ attr_set_f(
 	}
 
 	/* refresh with updated inode contents */
+	io_cache_purge();
 	set_cur_inode(iocur_top->ino);
 
 out:
@@ -240,6 +241,7 @@ attr_remove_f(
 	}
 
 	/* refresh with updated inode contents */
+	io_cache_purge();
 	set_cur_inode(iocur_top->ino);
 
 out:
@@ -19,8 +19,11 @@
 #include <xfs/libxfs.h>
 #include <math.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include "bmap.h"
 #include "check.h"
+#include "runmap.h"
+#include "agwalk.h"
 #include "command.h"
 #include "io.h"
 #include "type.h"
@@ -109,28 +112,56 @@ typedef struct dirhash {
 #define	DIR_HASH_SIZE	1024
 #define	DIR_HASH_FUNC(h,a)	(((h) ^ (a)) % DIR_HASH_SIZE)
 
-static xfs_extlen_t	agffreeblks;
-static xfs_extlen_t	agflongest;
-static __uint64_t	agf_aggr_freeblks;	/* aggregate count over all */
-static __uint32_t	agfbtreeblks;
+/*
+ * The AG headers and the free space and inode btrees are scanned by
+ * several threads at once.  Each AG only touches its own block map, and
+ * the counters below are per thread: scan_ag moves what one AG added to
+ * them into that AG's agscan_t, and the totals are made in AG order once
+ * the walk is over.  The inodes point all over the filesystem, so they
+ * are processed afterwards, one AG at a time, from the inode btree
+ * records the walk kept.
+ */
+typedef struct agscan {
+	int		error;
+	int		serious_error;
+	int		sbver_err;
+	int		lazycount;	/* this AG's sb has lazy counters */
+	int		noalign;	/* an inode chunk is misaligned */
+	__uint64_t	fdblocks;
+	__uint64_t	icount;
+	__uint64_t	ifree;
+	__uint64_t	agf_aggr_freeblks;
+	xfs_inobt_rec_t	*inorecs;
+	int		ninorecs;
+	int		maxinorecs;
+} agscan_t;
+
+static __thread xfs_extlen_t	agffreeblks;
+static __thread xfs_extlen_t	agflongest;
+static __thread __uint64_t	agf_aggr_freeblks;	/* aggregate count over all */
+static __thread __uint32_t	agfbtreeblks;
+static __thread agscan_t	*cur_agscan;
+static agscan_t		*agscans;
 static int		lazycount;
-static xfs_agino_t	agicount;
-static xfs_agino_t	agifreecount;
+static __thread xfs_agino_t	agicount;
+static __thread xfs_agino_t	agifreecount;
 static xfs_fsblock_t	*blist;
 static int		blist_size;
-static char		**dbmap;	/* really dbm_t:8 */
+static runmap_t		**dbmap;	/* values are dbm_t */
 static dirhash_t	**dirhash;
-static int		error;
-static __uint64_t	fdblocks;
+static __thread int	error;
+static __thread __uint64_t	fdblocks;
 static __uint64_t	frextents;
-static __uint64_t	icount;
-static __uint64_t	ifree;
+static __thread __uint64_t	icount;
+static __thread __uint64_t	ifree;
 static inodata_t	***inodata;
 static int		inodata_hash_size;
-static inodata_t	***inomap;
+static runmap_t		**inomap;	/* values are inodata_t * */
 static int		nflag;
+static int		nthreads;
 static int		pflag;
 static int		tflag;
+static int		Tflag;
 static qdata_t		**qpdata;
 static int		qpdo;
 static qdata_t		**qudata;
@@ -138,8 +169,8 @@ static int		qudo;
 static qdata_t		**qgdata;
 static int		qgdo;
 static unsigned		sbversion;
-static int		sbver_err;
-static int		serious_error;
+static __thread int	sbver_err;
+static __thread int	serious_error;
 static int		sflag;
 static xfs_suminfo_t	*sumcompute;
 static xfs_suminfo_t	*sumfile;
@@ -222,6 +253,7 @@ static void		blkmap_set_ext(blkmap_t **blkmapp, xfs_fileoff_t o,
 static void		blkmap_shrink(blkmap_t *blkmap, blkent_t **entp);
 static int		blockfree_f(int argc, char **argv);
 static int		blockget_f(int argc, char **argv);
+static void		blockget_report(struct timeval *start);
 static int		blocktrash_f(int argc, char **argv);
 static int		blockuse_f(int argc, char **argv);
 static int		check_blist(xfs_fsblock_t bno);
@@ -292,7 +324,7 @@ static void		process_exinode(inodata_t *id, xfs_dinode_t *dip,
 					dbm_t type, xfs_drfsbno_t *totd,
 					xfs_drfsbno_t *toti, xfs_extnum_t *nex,
 					blkmap_t **blkmapp, int whichfork);
-static void		process_inode(xfs_agf_t *agf, xfs_agino_t agino,
+static void		process_inode(xfs_agnumber_t agno, xfs_agino_t agino,
 				      xfs_dinode_t *dip, int isfree);
 static void		process_lclinode(inodata_t *id, xfs_dinode_t *dip,
 					 dbm_t type, xfs_drfsbno_t *totd,
@@ -330,7 +362,9 @@ static void		quota_add1(qdata_t **qt, xfs_dqid_t id, int dq,
 static void		quota_check(char *s, qdata_t **qt);
 static void		quota_init(void);
 static void		scan_ag(xfs_agnumber_t agno);
+static void		scan_ag_done(agscan_t *as);
 static void		scan_freelist(xfs_agf_t *agf);
+static void		scan_inodes(xfs_agnumber_t agno);
 static void		scan_lbtree(xfs_fsblock_t root, int nlevels,
 				    scan_lbtree_f_t func, dbm_t type,
 				    inodata_t *id, xfs_drfsbno_t *totd,
@@ -372,7 +406,7 @@ static const cmdinfo_t	blockfree_cmd =
 	  NULL, N_("free block usage information"), NULL };
 static const cmdinfo_t	blockget_cmd =
 	{ "blockget", "check", blockget_f, 0, -1, 0,
-	  N_("[-s|-v] [-n] [-t] [-b bno]... [-i ino] ..."),
+	  N_("[-s|-v] [-n] [-t] [-T] [-P threads] [-b bno]... [-i ino] ..."),
 	  N_("get block usage and check consistency"), NULL };
 static const cmdinfo_t	blocktrash_cmd =
 	{ "blocktrash", NULL, blocktrash_f, 0, -1, 0,
@@ -762,13 +796,13 @@ blockfree_f(
 	}
 	rt = mp->m_sb.sb_rextents != 0;
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		runmap_free(dbmap[c]);
+		runmap_free(inomap[c]);
 		free_inodata(c);
 	}
 	if (rt) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		runmap_free(dbmap[c]);
+		runmap_free(inomap[c]);
 		xfree(sumcompute);
 		xfree(sumfile);
 		sumcompute = sumfile = NULL;
@@ -790,14 +824,18 @@ blockget_f(
 	int		argc,
 	char		**argv)
 {
+	xfs_agnumber_t	*aglist;
 	xfs_agnumber_t	agno;
+	agscan_t	*as;
 	int		oldprefix;
 	int		sbyell;
+	struct timeval	start;
 
 	if (dbmap) {
 		dbprintf(_("already have block usage information\n"));
 		return 0;
 	}
+	gettimeofday(&start, NULL);
 	if (!init(argc, argv)) {
 		if (serious_error)
 			exitcode = 3;
@@ -807,14 +845,36 @@ blockget_f(
 	}
 	oldprefix = dbprefix;
 	dbprefix |= pflag;
+	agscans = xcalloc(mp->m_sb.sb_agcount, sizeof(*agscans));
+	aglist = xmalloc(mp->m_sb.sb_agcount * sizeof(*aglist));
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		aglist[agno] = agno;
+	/* per-block messages come out in block order with one thread */
+	agwalk(aglist, mp->m_sb.sb_agcount,
+		verbose || blist_size ? 1 : nthreads, scan_ag);
+	xfree(aglist);
 	for (agno = 0, sbyell = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		scan_ag(agno);
+		as = &agscans[agno];
+		error += as->error;
+		serious_error += as->serious_error;
+		sbver_err += as->sbver_err;
+		lazycount |= as->lazycount;
+		if (as->noalign)
+			sbversion &= ~XFS_SB_VERSION_ALIGNBIT;
+		fdblocks += as->fdblocks;
+		icount += as->icount;
+		ifree += as->ifree;
+		agf_aggr_freeblks += as->agf_aggr_freeblks;
 		if (sbver_err > 4 && !sbyell && sbver_err >= agno) {
 			sbyell = 1;
 			dbprintf(_("WARNING: this may be a newer XFS "
 				 "filesystem.\n"));
 		}
 	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		scan_inodes(agno);
+	xfree(agscans);
+	agscans = NULL;
 	if (blist_size) {
 		xfree(blist);
 		blist = NULL;
@@ -920,12 +980,38 @@ blockget_f(
 		quota_check("group", qgdata);
 	if (sbver_err > mp->m_sb.sb_agcount / 2)
 		dbprintf(_("WARNING: this may be a newer XFS filesystem.\n"));
+	if (Tflag)
+		blockget_report(&start);
 	if (error)
 		exitcode = 3;
 	dbprefix = oldprefix;
 	return 0;
 }
 
+/*
+ * For -T: how long the check took and the most memory it held.
+ */
+static void
+blockget_report(
+	struct timeval	*start)
+{
+	struct timeval	now;
+	long long	peak;
+	struct rusage	ru;
+
+	gettimeofday(&now, NULL);
+	getrusage(RUSAGE_SELF, &ru);
+	peak = ru.ru_maxrss;
+#ifdef __APPLE__
+	peak /= 1024;			/* in bytes here, not KB */
+#endif
+	dbprintf(_("blockget: %.2f seconds, peak memory %lld KB, "
+		   "block maps %lld KB\n"),
+		(now.tv_sec - start->tv_sec) +
+			(now.tv_usec - start->tv_usec) / 1000000.0,
+		peak, (long long)(runmap_peak_bytes() >> 10));
+}
+
 typedef struct ltab {
 	int	min;
 	int	max;
@@ -1012,12 +1098,14 @@ blocktrash_f(
 	int		max;
 	int		min;
 	int		mode;
+	__uint64_t	n;
 	struct timeval	now;
 	char		*p;
 	xfs_drfsbno_t	randb;
 	uint		seed;
 	int		sopt;
 	int		tmask;
+	dbm_t		type;
 
 	if (!dbmap) {
 		dbprintf(_("must run blockget first\n"));
@@ -1123,11 +1211,10 @@ blocktrash_f(
 			lentab[lentablen - 1].max = i;
 	}
 	for (blocks = 0, agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		for (agbno = 0, p = dbmap[agno];
-		     agbno < mp->m_sb.sb_agblocks;
-		     agbno++, p++) {
-			if ((1 << *p) & tmask)
-				blocks++;
+		for (agbno = 0; agbno < mp->m_sb.sb_agblocks; agbno += n) {
+			type = (dbm_t)runmap_get(dbmap[agno], agbno, &n);
+			if ((1 << type) & tmask)
+				blocks += n;
 		}
 	}
 	if (blocks == 0) {
@@ -1143,14 +1230,18 @@ blocktrash_f(
 		for (bi = 0, agno = 0, done = 0;
 		     !done && agno < mp->m_sb.sb_agcount;
 		     agno++) {
-			for (agbno = 0, p = dbmap[agno];
+			for (agbno = 0;
 			     agbno < mp->m_sb.sb_agblocks;
-			     agbno++, p++) {
-				if (!((1 << *p) & tmask))
+			     agbno += n) {
+				type = (dbm_t)runmap_get(dbmap[agno], agbno,
+						&n);
+				if (!((1 << type) & tmask))
 					continue;
-				if (bi++ < randb)
+				if (bi + n <= randb) {
+					bi += n;
 					continue;
-				blocktrash_b(agno, agbno, (dbm_t)*p,
+				}
+				blocktrash_b(agno, agbno + (randb - bi), type,
 					&lentab[random() % lentablen], mode);
 				done = 1;
 				break;
@@ -1173,8 +1264,10 @@ blockuse_f(
 	xfs_agblock_t	end;
 	xfs_fsblock_t	fsb;
 	inodata_t	*i;
+	__uint64_t	n;
 	char		*p;
 	int		shownames;
+	dbm_t		type;
 
 	if (!dbmap) {
 		dbprintf(_("must run blockget first\n"));
@@ -1210,11 +1303,11 @@ blockuse_f(
 		}
 	}
 	while (agbno <= end) {
-		p = &dbmap[agno][agbno];
-		i = inomap[agno][agbno];
+		type = (dbm_t)runmap_get(dbmap[agno], agbno, &n);
+		i = (inodata_t *)runmap_get(inomap[agno], agbno, &n);
 		dbprintf(_("block %llu (%u/%u) type %s"),
 			(xfs_dfsbno_t)XFS_AGB_TO_FSB(mp, agno, agbno),
-			agno, agbno, typename[(dbm_t)*p]);
+			agno, agbno, typename[type]);
 		if (i) {
 			dbprintf(_(" inode %lld"), i->ino);
 			if (shownames && (p = inode_name(i->ino, NULL))) {
@@ -1249,15 +1342,21 @@ check_dbmap(
 	dbm_t		type)
 {
 	xfs_extlen_t	i;
-	char		*p;
-
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if ((dbm_t)*p != type) {
-			if (!sflag || CHECK_BLISTA(agno, agbno + i))
+	xfs_extlen_t	j;
+	__uint64_t	n;
+	dbm_t		t;
+
+	for (i = 0; i < len; i += n) {
+		t = (dbm_t)runmap_get(dbmap[agno], agbno + i, &n);
+		n = MIN(n, len - i);
+		if (t == type)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLISTA(agno, agbno + j))
 				dbprintf(_("block %u/%u expected type %s got "
 					 "%s\n"),
-					agno, agbno + i, typename[type],
-					typename[(dbm_t)*p]);
+					agno, agbno + j, typename[type],
+					typename[t]);
 			error++;
 		}
 	}
@@ -1282,7 +1381,9 @@ check_inomap(
 	xfs_ino_t	c_ino)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
+	inodata_t	*id;
+	xfs_extlen_t	j;
+	__uint64_t	n;
 	int		rval;
 
 	if (!check_range(agno, agbno, len))  {
@@ -1290,16 +1391,20 @@ check_inomap(
 			agno, agbno, agbno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		if (*idp) {
-			if (!sflag || (*idp)->ilist ||
-			    CHECK_BLISTA(agno, agbno + i))
+	for (i = 0, rval = 1; i < len; i += n) {
+		id = (inodata_t *)runmap_get(inomap[agno], agbno + i, &n);
+		n = MIN(n, len - i);
+		if (!id)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || id->ilist ||
+			    CHECK_BLISTA(agno, agbno + j))
 				dbprintf(_("block %u/%u claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					agno, agbno + i, c_ino, (*idp)->ino);
+					agno, agbno + j, c_ino, id->ino);
 			error++;
-			rval = 0;
 		}
+		rval = 0;
 	}
 	return rval;
 }
@@ -1415,15 +1520,21 @@ check_rdbmap(
 	dbm_t		type)
 {
 	xfs_extlen_t	i;
-	char		*p;
-
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((dbm_t)*p != type) {
-			if (!sflag || CHECK_BLIST(bno + i))
+	xfs_extlen_t	j;
+	__uint64_t	n;
+	dbm_t		t;
+
+	for (i = 0; i < len; i += n) {
+		t = (dbm_t)runmap_get(dbmap[mp->m_sb.sb_agcount], bno + i, &n);
+		n = MIN(n, len - i);
+		if (t == type)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLIST(bno + j))
 				dbprintf(_("rtblock %llu expected type %s got "
 					 "%s\n"),
-					bno + i, typename[type],
-					typename[(dbm_t)*p]);
+					bno + j, typename[type],
+					typename[t]);
 			error++;
 		}
 	}
@@ -1436,7 +1547,9 @@ check_rinomap(
 	xfs_ino_t	c_ino)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
+	inodata_t	*id;
+	xfs_extlen_t	j;
+	__uint64_t	n;
 	int		rval;
 
 	if (!check_rrange(bno, len)) {
@@ -1444,17 +1557,20 @@ check_rinomap(
 			bno, bno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		if (*idp) {
-			if (!sflag || (*idp)->ilist || CHECK_BLIST(bno + i))
+	for (i = 0, rval = 1; i < len; i += n) {
+		id = (inodata_t *)runmap_get(inomap[mp->m_sb.sb_agcount],
+				bno + i, &n);
+		n = MIN(n, len - i);
+		if (!id)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || id->ilist || CHECK_BLIST(bno + j))
 				dbprintf(_("rtblock %llu claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					bno + i, c_ino, (*idp)->ino);
+					bno + j, c_ino, id->ino);
 			error++;
-			rval = 0;
 		}
+		rval = 0;
 	}
 	return rval;
 }
@@ -1509,7 +1625,6 @@ check_set_dbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_range(agno, agbno, len))  {
 		dbprintf(_("blocks %u/%u..%u claimed by block %u/%u\n"), agno,
@@ -1517,10 +1632,10 @@ check_set_dbmap(
 		return;
 	}
 	check_dbmap(agno, agbno, len, type1);
+	runmap_set(dbmap[agno], agbno, len, type2);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		*p = (char)type2;
-		if (mayprint && (verbose || CHECK_BLISTA(agno, agbno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || CHECK_BLISTA(agno, agbno + i))
 			dbprintf(_("setting block %u/%u to %s\n"), agno, agbno + i,
 				typename[type2]);
 	}
@@ -1535,15 +1650,14 @@ check_set_rdbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_rrange(bno, len))
 		return;
 	check_rdbmap(bno, len, type1);
+	runmap_set(dbmap[mp->m_sb.sb_agcount], bno, len, type2);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		*p = (char)type2;
-		if (mayprint && (verbose || CHECK_BLIST(bno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || CHECK_BLIST(bno + i))
 			dbprintf(_("setting rtblock %llu to %s\n"),
 				bno + i, typename[type2]);
 	}
@@ -1583,15 +1697,21 @@ checknot_dbmap(
 	int		typemask)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	j;
+	__uint64_t	n;
+	dbm_t		t;
 
 	if (!check_range(agno, agbno, len))
 		return;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
-			if (!sflag || CHECK_BLISTA(agno, agbno + i))
+	for (i = 0; i < len; i += n) {
+		t = (dbm_t)runmap_get(dbmap[agno], agbno + i, &n);
+		n = MIN(n, len - i);
+		if (!((1 << t) & typemask))
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLISTA(agno, agbno + j))
 				dbprintf(_("block %u/%u type %s not expected\n"),
-					agno, agbno + i, typename[(dbm_t)*p]);
+					agno, agbno + j, typename[t]);
 			error++;
 		}
 	}
@@ -1604,15 +1724,21 @@ checknot_rdbmap(
 	int		typemask)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	j;
+	__uint64_t	n;
+	dbm_t		t;
 
 	if (!check_rrange(bno, len))
 		return;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
-			if (!sflag || CHECK_BLIST(bno + i))
+	for (i = 0; i < len; i += n) {
+		t = (dbm_t)runmap_get(dbmap[mp->m_sb.sb_agcount], bno + i, &n);
+		n = MIN(n, len - i);
+		if (!((1 << t) & typemask))
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLIST(bno + j))
 				dbprintf(_("rtblock %llu type %s not expected\n"),
-					bno + i, typename[(dbm_t)*p]);
+					bno + j, typename[t]);
 			error++;
 		}
 	}
@@ -1784,18 +1910,21 @@ init(
 			     MAX_INODATA_HASH_SIZE),
 			 MIN_INODATA_HASH_SIZE);
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**inomap));
+		dbmap[c] = runmap_alloc(mp->m_sb.sb_agblocks, sizeof(char));
+		inomap[c] = runmap_alloc(mp->m_sb.sb_agblocks,
+					 sizeof(inodata_t *));
 		inodata[c] = xcalloc(inodata_hash_size, sizeof(**inodata));
 	}
 	if (rt) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**inomap));
+		dbmap[c] = runmap_alloc(mp->m_sb.sb_rblocks, sizeof(char));
+		inomap[c] = runmap_alloc(mp->m_sb.sb_rblocks,
+					 sizeof(inodata_t *));
 		sumfile = xcalloc(mp->m_rsumsize, 1);
 		sumcompute = xcalloc(mp->m_rsumsize, 1);
 	}
-	nflag = sflag = tflag = verbose = optind = 0;
-	while ((c = getopt(argc, argv, "b:i:npstv")) != EOF) {
+	nflag = sflag = tflag = Tflag = verbose = optind = 0;
+	nthreads = libxfs_nproc();
+	while ((c = getopt(argc, argv, "b:i:npP:stTv")) != EOF) {
 		switch (c) {
 		case 'b':
 			bno = strtoll(optarg, NULL, 10);
@@ -1811,12 +1940,22 @@ init(
 		case 'p':
 			pflag = 1;
 			break;
+		case 'P':
+			nthreads = atoi(optarg);
+			if (nthreads <= 0) {
+				dbprintf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			break;
 		case 's':
 			sflag = 1;
 			break;
 		case 't':
 			tflag = 1;
 			break;
+		case 'T':
+			Tflag = 1;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -1827,6 +1966,8 @@ init(
 	}
 	error = sbver_err = serious_error = 0;
 	fdblocks = frextents = icount = ifree = 0;
+	agf_aggr_freeblks = 0;
+	lazycount = xfs_sb_version_haslazysbcount(&mp->m_sb);
 	sbversion = XFS_SB_VERSION_4;
 	if (mp->m_sb.sb_inoalignmt)
 		sbversion |= XFS_SB_VERSION_ALIGNBIT;
@@ -2595,7 +2736,7 @@ process_exinode(
 
 static void
 process_inode(
-	xfs_agf_t		*agf,
+	xfs_agnumber_t		agno,
 	xfs_agino_t		agino,
 	xfs_dinode_t		*dip,
 	int			isfree)
@@ -2648,7 +2789,7 @@ process_inode(
 
 	libxfs_dinode_from_disk(&idic, &dip->di_core);
 
-	ino = XFS_AGINO_TO_INO(mp, be32_to_cpu(agf->agf_seqno), agino);
+	ino = XFS_AGINO_TO_INO(mp, agno, agino);
 	if (!isfree) {
 		id = find_inode(ino, 1);
 		bno = XFS_INO_TO_FSB(mp, ino);
@@ -3919,6 +4060,7 @@ scan_ag(
 	xfs_sb_t	tsb;
 	xfs_sb_t	*sb = &tsb;
 
+	cur_agscan = &agscans[agno];
 	agffreeblks = agflongest = 0;
 	agfbtreeblks = -2;
 	agicount = agifreecount = 0;
@@ -3948,9 +4090,8 @@ scan_ag(
 		error++;
 		sbver_err++;
 	}
-	if (!lazycount && xfs_sb_version_haslazysbcount(sb)) {
-		lazycount = 1;
-	}
+	if (xfs_sb_version_haslazysbcount(sb))
+		cur_agscan->lazycount = 1;
 	if (agno == 0 && sb->sb_inprogress != 0) {
 		if (!sflag)
 			dbprintf(_("mkfs not completed successfully\n"));
@@ -4042,7 +4183,7 @@ scan_ag(
 				agflongest, agno);
 		error++;
 	}
-	if (lazycount &&
+	if ((lazycount || cur_agscan->lazycount) &&
 	    be32_to_cpu(agf->agf_btreeblks) != agfbtreeblks) {
 		if (!sflag)
 			dbprintf(_("agf_btreeblks %u, counted %u in ag %u\n"),
@@ -4082,6 +4223,25 @@ pop2_out:
 	pop_cur();
 pop1_out:
 	pop_cur();
+	scan_ag_done(cur_agscan);
+}
+
+/*
+ * Move what this thread's counters picked up in an AG to its agscan_t.
+ */
+static void
+scan_ag_done(
+	agscan_t	*as)
+{
+	as->error = error;
+	as->serious_error = serious_error;
+	as->sbver_err = sbver_err;
+	as->fdblocks = fdblocks;
+	as->icount = icount;
+	as->ifree = ifree;
+	as->agf_aggr_freeblks = agf_aggr_freeblks;
+	error = serious_error = sbver_err = 0;
+	fdblocks = icount = ifree = agf_aggr_freeblks = 0;
 }
 
 static void
@@ -4135,6 +4295,67 @@ scan_freelist(
 	pop_cur();
 }
 
+/*
+ * Process the inodes of the chunks the inode btree scan of an AG found.
+ */
+static void
+scan_inodes(
+	xfs_agnumber_t	agno)
+{
+	xfs_agino_t	agino;
+	agscan_t	*as = &agscans[agno];
+	int		i;
+	int		isfree;
+	int		j;
+	int		nfree;
+	int		off;
+	xfs_inobt_rec_t	*rp;
+
+	for (i = 0; i < as->ninorecs; i++) {
+		rp = &as->inorecs[i];
+		if (i % mp->m_inobt_mxr[0] == 0)
+			readahead_inochunks(agno, rp,
+				MIN(as->ninorecs - i, mp->m_inobt_mxr[0]));
+		agino = be32_to_cpu(rp->ir_startino);
+		off = XFS_INO_TO_OFFSET(mp, agino);
+		push_cur();
+		set_cur(&typtab[TYP_INODE],
+			XFS_AGB_TO_DADDR(mp, agno,
+					 XFS_AGINO_TO_AGBNO(mp, agino)),
+			(int)XFS_FSB_TO_BB(mp, XFS_IALLOC_BLOCKS(mp)),
+			DB_RING_IGN, NULL);
+		if (iocur_top->data == NULL) {
+			if (!sflag)
+				dbprintf(_("can't read inode block %u/%u\n"),
+					agno, XFS_AGINO_TO_AGBNO(mp, agino));
+			error++;
+			pop_cur();
+			continue;
+		}
+		for (j = 0, nfree = 0; j < XFS_INODES_PER_CHUNK; j++) {
+			isfree = XFS_INOBT_IS_FREE_DISK(rp, j);
+			if (isfree)
+				nfree++;
+			process_inode(agno, agino + j,
+				(xfs_dinode_t *)((char *)iocur_top->data + ((off + j) << mp->m_sb.sb_inodelog)),
+					isfree);
+		}
+		if (nfree != be32_to_cpu(rp->ir_freecount)) {
+			if (!sflag)
+				dbprintf(_("ir_freecount/free mismatch, "
+					 "inode chunk %u/%u, freecount "
+					 "%d nfree %d\n"),
+					agno, agino,
+					be32_to_cpu(rp->ir_freecount), nfree);
+			error++;
+		}
+		pop_cur();
+	}
+	xfree(as->inorecs);
+	as->inorecs = NULL;
+	as->ninorecs = as->maxinorecs = 0;
+}
+
 static void
 scan_lbtree(
 	xfs_fsblock_t	root,
@@ -4259,6 +4480,7 @@ scanfunc_bmap(
 		return;
 	}
 	pp = XFS_BMBT_PTR_ADDR(mp, block, 1, mp->m_bmap_dmxr[0]);
+	readahead_lbtree(pp, be16_to_cpu(block->bb_numrecs));
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_lbtree(be64_to_cpu(pp[i]), level, scanfunc_bmap, type, id, 
 					totd, toti, nex, blkmapp, 0, btype);
@@ -4333,6 +4555,7 @@ scanfunc_bno(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	readahead_sbtree(seqno, pp, be16_to_cpu(block->bb_numrecs));
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, 0, scanfunc_bno, TYP_BNOBT);
 }
@@ -4409,6 +4632,7 @@ scanfunc_cnt(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	readahead_sbtree(seqno, pp, be16_to_cpu(block->bb_numrecs));
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, 0, scanfunc_cnt, TYP_CNTBT);
 }
@@ -4422,11 +4646,9 @@ scanfunc_ino(
 	int			isroot)
 {
 	xfs_agino_t		agino;
+	agscan_t		*as;
 	xfs_agnumber_t		seqno = be32_to_cpu(agf->agf_seqno);
 	int			i;
-	int			isfree;
-	int			j;
-	int			nfree;
 	int			off;
 	xfs_inobt_ptr_t		*pp;
 	xfs_inobt_rec_t		*rp;
@@ -4464,7 +4686,7 @@ scanfunc_ino(
 				    mp->m_sb.sb_inoalignmt &&
 				    (XFS_INO_TO_AGBNO(mp, agino) %
 				     mp->m_sb.sb_inoalignmt))
-					sbversion &= ~XFS_SB_VERSION_ALIGNBIT;
+					cur_agscan->noalign = 1;
 				set_dbmap(seqno, XFS_AGINO_TO_AGBNO(mp, agino),
 					(xfs_extlen_t)MAX(1,
 						XFS_INODES_PER_CHUNK >>
@@ -4475,41 +4697,17 @@ scanfunc_ino(
 			agicount += XFS_INODES_PER_CHUNK;
 			ifree += be32_to_cpu(rp[i].ir_freecount);
 			agifreecount += be32_to_cpu(rp[i].ir_freecount);
-			push_cur();
-			set_cur(&typtab[TYP_INODE],
-				XFS_AGB_TO_DADDR(mp, seqno,
-						 XFS_AGINO_TO_AGBNO(mp, agino)),
-				(int)XFS_FSB_TO_BB(mp, XFS_IALLOC_BLOCKS(mp)),
-				DB_RING_IGN, NULL);
-			if (iocur_top->data == NULL) {
-				if (!sflag)
-					dbprintf(_("can't read inode block "
-						 "%u/%u\n"),
-						seqno,
-						XFS_AGINO_TO_AGBNO(mp, agino));
-				error++;
-				pop_cur();
-				continue;
-			}
-			for (j = 0, nfree = 0; j < XFS_INODES_PER_CHUNK; j++) {
-				isfree = XFS_INOBT_IS_FREE_DISK(&rp[i], j);
-				if (isfree)
-					nfree++;
-				process_inode(agf, agino + j,
-					(xfs_dinode_t *)((char *)iocur_top->data + ((off + j) << mp->m_sb.sb_inodelog)),
-						isfree);
-			}
-			if (nfree != be32_to_cpu(rp[i].ir_freecount)) {
-				if (!sflag)
-					dbprintf(_("ir_freecount/free mismatch, "
-						 "inode chunk %u/%u, freecount "
-						 "%d nfree %d\n"),
-						seqno, agino,
-						be32_to_cpu(rp[i].ir_freecount), nfree);
-				error++;
-			}
-			pop_cur();
 		}
+		/* keep the records for scan_inodes */
+		as = cur_agscan;
+		if (as->ninorecs + i > as->maxinorecs) {
+			as->maxinorecs = MAX(as->maxinorecs * 2,
+					     as->ninorecs + i);
+			as->inorecs = xrealloc(as->inorecs,
+				as->maxinorecs * sizeof(*as->inorecs));
+		}
+		memcpy(as->inorecs + as->ninorecs, rp, i * sizeof(*rp));
+		as->ninorecs += i;
 		return;
 	}
 	if (be16_to_cpu(block->bb_numrecs) > mp->m_inobt_mxr[1] ||
@@ -4522,6 +4720,7 @@ scanfunc_ino(
 		return;
 	}
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, mp->m_inobt_mxr[1]);
+	readahead_sbtree(seqno, pp, be16_to_cpu(block->bb_numrecs));
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, 0, scanfunc_ino, TYP_INOBT);
 }
@@ -4546,16 +4745,14 @@ set_inomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
 	if (!check_inomap(agno, agbno, len, id->ino))
 		return;
+	runmap_set(inomap[agno], agbno, len, (unsigned long)id);
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		*idp = id;
-		if (mayprint &&
-		    (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i))
 			dbprintf(_("setting inode to %lld for block %u/%u\n"),
 				id->ino, agno, agbno + i);
 	}
@@ -4577,17 +4774,14 @@ set_rinomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
 	if (!check_rinomap(bno, len, id->ino))
 		return;
+	runmap_set(inomap[mp->m_sb.sb_agcount], bno, len, (unsigned long)id);
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		*idp = id;
-		if (mayprint && (verbose || id->ilist || CHECK_BLIST(bno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLIST(bno + i))
 			dbprintf(_("setting inode to %lld for rtblock %llu\n"),
 				id->ino, bno + i);
 	}
@@ -18,6 +18,7 @@
 
 #include <xfs/libxfs.h>
 #include <sys/time.h>
+#include "agwalk.h"
 #include "bmap.h"
 #include "command.h"
 #include "frag.h"
@@ -40,16 +41,43 @@ typedef	struct extmap {
 #define	EXTMAP_SIZE(n)	\
 	(offsetof(extmap_t, ents) + (sizeof(extent_t) * (n)))
 
+/* extent sizes are binned by power of two: bin n holds 2^n..2^(n+1)-1 */
+#define	FRAG_HISTBINS	64
+
+typedef struct fragworst {
+	xfs_ino_t	ino;
+	__uint64_t	actual;
+	__uint64_t	ideal;
+} fragworst_t;
+
+/*
+ * What one AG's inodes contributed, merged into the totals once all
+ * the AGs have been walked.
+ */
+typedef struct fragstat {
+	__uint64_t	actual;
+	__uint64_t	ideal;
+	__uint64_t	count[FRAG_HISTBINS];
+	__uint64_t	blocks[FRAG_HISTBINS];
+	fragworst_t	*worst;		/* most fragmented first */
+	int		nworst;
+} fragstat_t;
+
 static int		aflag;
 static int		dflag;
-static __uint64_t	extcount_actual;
-static __uint64_t	extcount_ideal;
+static int		eflag;
 static int		fflag;
+static int		jflag;
 static int		lflag;
+static int		nthreads;
 static int		qflag;
 static int		Rflag;
 static int		rflag;
 static int		vflag;
+static int		wcount;
+static fragstat_t	*fragstats;	/* indexed by agno */
+
+static __thread fragstat_t *cur_fragstat;
 
 typedef void	(*scan_lbtree_f_t)(struct xfs_btree_block *block,
 				   int			level,
@@ -65,7 +93,11 @@ static xfs_extnum_t	extmap_ideal(extmap_t *extmap);
 static void		extmap_set_ext(extmap_t **extmapp, xfs_fileoff_t o,
 				       xfs_extlen_t c);
 static int		frag_f(int argc, char **argv);
+static void		fragstat_worst(fragstat_t *st, xfs_ino_t ino,
+				       __uint64_t actual, __uint64_t ideal);
 static int		init(int argc, char **argv);
+static void		printhist(fragstat_t *st);
+static void		printjson(fragstat_t *st);
 static void		process_bmbt_reclist(xfs_bmbt_rec_t *rp, int numrecs,
 					     extmap_t **extmapp);
 static void		process_btinode(xfs_dinode_t *dip, extmap_t **extmapp,
@@ -89,7 +121,8 @@ static void		scanfunc_ino(struct xfs_btree_block *block, int level,
 
 static const cmdinfo_t	frag_cmd =
 	{ "frag", NULL, frag_f, 0, -1, 0,
-	  "[-a] [-d] [-f] [-l] [-q] [-R] [-r] [-v]",
+	  "[-a] [-d] [-e] [-f] [-j] [-l] [-q] [-R] [-r] [-v] [-t threads] "
+	  "[-w count]",
 	  "get file fragmentation data", NULL };
 
 static extmap_t *
@@ -159,22 +192,110 @@ frag_f(
 	char		**argv)
 {
 	xfs_agnumber_t	agno;
+	xfs_agnumber_t	*ags;
+	fragstat_t	total;
+	fragstat_t	*st;
 	double		answer;
+	int		i;
 
 	if (!init(argc, argv))
 		return 0;
+	ags = xmalloc(mp->m_sb.sb_agcount * sizeof(*ags));
+	fragstats = xcalloc(mp->m_sb.sb_agcount, sizeof(*fragstats));
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		ags[agno] = agno;
+		if (wcount)
+			fragstats[agno].worst =
+				xmalloc(wcount * sizeof(fragworst_t));
+	}
+
+	/* -v reports inodes as they are found, so keep those in order */
+	agwalk(ags, mp->m_sb.sb_agcount, vflag ? 1 : nthreads, scan_ag);
+
+	memset(&total, 0, sizeof(total));
+	if (wcount)
+		total.worst = xmalloc(wcount * sizeof(fragworst_t));
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		st = &fragstats[agno];
+		total.actual += st->actual;
+		total.ideal += st->ideal;
+		for (i = 0; i < FRAG_HISTBINS; i++) {
+			total.count[i] += st->count[i];
+			total.blocks[i] += st->blocks[i];
+		}
+		for (i = 0; i < st->nworst; i++)
+			fragstat_worst(&total, st->worst[i].ino,
+				st->worst[i].actual, st->worst[i].ideal);
+	}
+
+	if (jflag)
+		printjson(&total);
+	else {
+		if (total.actual)
+			answer = (double)(total.actual - total.ideal) * 100.0 /
+				 (double)total.actual;
+		else
+			answer = 0.0;
+		dbprintf(_("actual %llu, ideal %llu, "
+			   "fragmentation factor %.2f%%\n"),
+			total.actual, total.ideal, answer);
+		if (eflag)
+			printhist(&total);
+		if (wcount && total.nworst) {
+			dbprintf(_("most fragmented:\n"));
+			for (i = 0; i < total.nworst; i++)
+				dbprintf(_("inode %lld actual %lld ideal %lld\n"),
+					total.worst[i].ino,
+					total.worst[i].actual,
+					total.worst[i].ideal);
+		}
+	}
+
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		scan_ag(agno);
-	if (extcount_actual)
-		answer = (double)(extcount_actual - extcount_ideal) * 100.0 /
-			 (double)extcount_actual;
-	else
-		answer = 0.0;
-	dbprintf(_("actual %llu, ideal %llu, fragmentation factor %.2f%%\n"),
-		extcount_actual, extcount_ideal, answer);
+		if (fragstats[agno].worst)
+			xfree(fragstats[agno].worst);
+	if (total.worst)
+		xfree(total.worst);
+	xfree(fragstats);
+	xfree(ags);
 	return 0;
 }
 
+/*
+ * Keep the wcount inodes with the most excess extents, ordered by
+ * excess, then total extents, then inode number so that the list does
+ * not depend on which thread saw an AG first.
+ */
+static void
+fragstat_worst(
+	fragstat_t	*st,
+	xfs_ino_t	ino,
+	__uint64_t	actual,
+	__uint64_t	ideal)
+{
+	fragworst_t	*wp;
+	int		i;
+
+	for (i = st->nworst; i > 0; i--) {
+		wp = &st->worst[i - 1];
+		if (wp->actual - wp->ideal > actual - ideal)
+			break;
+		if (wp->actual - wp->ideal == actual - ideal &&
+		    (wp->actual > actual ||
+		     (wp->actual == actual && wp->ino < ino)))
+			break;
+	}
+	if (i >= wcount)
+		return;
+	if (st->nworst < wcount)
+		st->nworst++;
+	memmove(&st->worst[i + 1], &st->worst[i],
+		(st->nworst - i - 1) * sizeof(fragworst_t));
+	st->worst[i].ino = ino;
+	st->worst[i].actual = actual;
+	st->worst[i].ideal = ideal;
+}
+
 static int
 init(
 	int		argc,
@@ -183,8 +304,10 @@ init(
 	int		c;
 
 	aflag = dflag = fflag = lflag = qflag = Rflag = rflag = vflag = 0;
+	eflag = jflag = wcount = 0;
+	nthreads = libxfs_nproc();
 	optind = 0;
-	while ((c = getopt(argc, argv, "adflqRrv")) != EOF) {
+	while ((c = getopt(argc, argv, "adefjlqRrt:vw:")) != EOF) {
 		switch (c) {
 		case 'a':
 			aflag = 1;
@@ -192,9 +315,15 @@ init(
 		case 'd':
 			dflag = 1;
 			break;
+		case 'e':
+			eflag = 1;
+			break;
 		case 'f':
 			fflag = 1;
 			break;
+		case 'j':
+			jflag = 1;
+			break;
 		case 'l':
 			lflag = 1;
 			break;
@@ -207,9 +336,23 @@ init(
 		case 'r':
 			rflag = 1;
 			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads <= 0) {
+				dbprintf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			break;
 		case 'v':
 			vflag = 1;
 			break;
+		case 'w':
+			wcount = atoi(optarg);
+			if (wcount <= 0) {
+				dbprintf(_("bad inode count %s\n"), optarg);
+				return 0;
+			}
+			break;
 		default:
 			dbprintf(_("bad option for frag command\n"));
 			return 0;
@@ -217,10 +360,81 @@ init(
 	}
 	if (!aflag && !dflag && !fflag && !lflag && !qflag && !Rflag && !rflag)
 		aflag = dflag = fflag = lflag = qflag = Rflag = rflag = 1;
-	extcount_actual = extcount_ideal = 0;
 	return 1;
 }
 
+static void
+printhist(
+	fragstat_t	*st)
+{
+	__uint64_t	totblocks;
+	int		i;
+
+	for (i = 0, totblocks = 0; i < FRAG_HISTBINS; i++)
+		totblocks += st->blocks[i];
+	dbprintf("%7s %7s %7s %7s %6s\n",
+		_("from"), _("to"), _("extents"), _("blocks"), _("pct"));
+	for (i = 0; i < FRAG_HISTBINS; i++) {
+		if (st->count[i])
+			dbprintf("%7llu %7llu %7llu %7llu %6.2f\n",
+				1ULL << i, (2ULL << i) - 1, st->count[i],
+				st->blocks[i], st->blocks[i] * 100.0 / totblocks);
+	}
+}
+
+/*
+ * The totals, extent size histogram, per-AG counts and (with -w) the
+ * most fragmented inodes as one JSON object.
+ */
+static void
+printjson(
+	fragstat_t	*st)
+{
+	xfs_agnumber_t	agno;
+	__uint64_t	totblocks;
+	const char	*sep;
+	int		i;
+
+	for (i = 0, totblocks = 0; i < FRAG_HISTBINS; i++)
+		totblocks += st->blocks[i];
+	dbprintf("{\"command\": \"frag\", \"actual\": %llu, "
+		"\"ideal\": %llu, \"factor\": %.2f,\n",
+		st->actual, st->ideal, st->actual ?
+			(double)(st->actual - st->ideal) * 100.0 /
+			(double)st->actual : 0.0);
+	dbprintf(" \"histogram\": [");
+	for (i = 0, sep = ""; i < FRAG_HISTBINS; i++) {
+		if (!st->count[i])
+			continue;
+		dbprintf("%s\n  {\"from\": %llu, \"to\": %llu, "
+			"\"extents\": %llu, \"blocks\": %llu, "
+			"\"pct\": %.2f}", sep, 1ULL << i, (2ULL << i) - 1,
+			st->count[i], st->blocks[i],
+			st->blocks[i] * 100.0 / totblocks);
+		sep = ",";
+	}
+	dbprintf("],\n \"ags\": [");
+	for (agno = 0, sep = ""; agno < mp->m_sb.sb_agcount; agno++) {
+		dbprintf("%s\n  {\"agno\": %u, \"actual\": %llu, "
+			"\"ideal\": %llu}", sep, agno,
+			fragstats[agno].actual, fragstats[agno].ideal);
+		sep = ",";
+	}
+	dbprintf("]");
+	if (wcount) {
+		dbprintf(",\n \"worst\": [");
+		for (i = 0, sep = ""; i < st->nworst; i++) {
+			dbprintf("%s\n  {\"ino\": %llu, \"actual\": %llu, "
+				"\"ideal\": %llu}", sep,
+				(unsigned long long)st->worst[i].ino,
+				st->worst[i].actual, st->worst[i].ideal);
+			sep = ",";
+		}
+		dbprintf("]");
+	}
+	dbprintf("}\n");
+}
+
 static void
 process_bmbt_reclist(
 	xfs_bmbt_rec_t		*rp,
@@ -280,7 +494,10 @@ process_fork(
 	xfs_dinode_t	*dip,
 	int		whichfork)
 {
+	fragstat_t	*st = cur_fragstat;
+	extent_t	*ep;
 	extmap_t	*extmap;
+	int		bin;
 	int		nex;
 
 	nex = XFS_DFORK_NEXTENTS(dip, whichfork);
@@ -295,8 +512,15 @@ process_fork(
 		process_btinode(dip, &extmap, whichfork);
 		break;
 	}
-	extcount_actual += extmap->nents;
-	extcount_ideal += extmap_ideal(extmap);
+	st->actual += extmap->nents;
+	st->ideal += extmap_ideal(extmap);
+	for (ep = &extmap->ents[0]; ep < &extmap->ents[extmap->nents]; ep++) {
+		if (!ep->blockcount)
+			continue;
+		bin = libxfs_highbit64(ep->blockcount);
+		st->count[bin]++;
+		st->blocks[bin] += ep->blockcount;
+	}
 	xfree(extmap);
 }
 
@@ -306,6 +530,7 @@ process_inode(
 	xfs_agino_t		agino,
 	xfs_dinode_t		*dip)
 {
+	fragstat_t		*st = cur_fragstat;
 	__uint64_t		actual;
 	xfs_dinode_core_t	*dic;
 	__uint64_t		ideal;
@@ -340,8 +565,8 @@ process_inode(
 		skipd = 1;
 		break;
 	}
-	actual = extcount_actual;
-	ideal = extcount_ideal;
+	actual = st->actual;
+	ideal = st->ideal;
 	if (!skipd)
 		process_fork(dip, XFS_DATA_FORK);
 	skipa = !aflag || !XFS_DFORK_Q(dip);
@@ -349,7 +574,10 @@ process_inode(
 		process_fork(dip, XFS_ATTR_FORK);
 	if (vflag && (!skipd || !skipa))
 		dbprintf(_("inode %lld actual %lld ideal %lld\n"),
-			ino, extcount_actual - actual, extcount_ideal - ideal);
+			ino, st->actual - actual, st->ideal - ideal);
+	if (wcount && st->actual - actual > st->ideal - ideal)
+		fragstat_worst(st, ino, st->actual - actual,
+			st->ideal - ideal);
 }
 
 static void
@@ -359,6 +587,7 @@ scan_ag(
 	xfs_agf_t	*agf;
 	xfs_agi_t	*agi;
 
+	cur_fragstat = &fragstats[agno];
 	push_cur();
 	set_cur(&typtab[TYP_AGF],
 		XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
@@ -457,6 +686,7 @@ scanfunc_bmap(
 		return;
 	}
 	pp = XFS_BMBT_PTR_ADDR(mp, block, 1, mp->m_bmap_dmxr[0]);
+	readahead_lbtree(pp, nrecs);
 	for (i = 0; i < nrecs; i++)
 		scan_lbtree(be64_to_cpu(pp[i]), level, scanfunc_bmap, extmapp, 
 									btype);
@@ -478,6 +708,8 @@ scanfunc_ino(
 
 	if (level == 0) {
 		rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+		readahead_inochunks(seqno, rp, MIN(be16_to_cpu(block->bb_numrecs),
+						   mp->m_inobt_mxr[0]));
 		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++) {
 			agino = be32_to_cpu(rp[i].ir_startino);
 			off = XFS_INO_TO_OFFSET(mp, agino);
@@ -504,6 +736,8 @@ scanfunc_ino(
 		return;
 	}
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, mp->m_inobt_mxr[1]);
+	readahead_sbtree(seqno, pp, MIN(be16_to_cpu(block->bb_numrecs),
+					mp->m_inobt_mxr[1]));
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, scanfunc_ino, 
 								TYP_INOBT);
@@ -17,6 +17,7 @@
  */
 
 #include <xfs/libxfs.h>
+#include "agwalk.h"
 #include "command.h"
 #include "freesp.h"
 #include "io.h"
@@ -33,6 +34,17 @@ typedef struct histent
 	long long	blocks;
 } histent_t;
 
+/*
+ * What one AG's scan found, merged into the totals once all are done.
+ */
+typedef struct agstat {
+	long long	*count;		/* extents per histogram bucket */
+	long long	*blocks;	/* blocks per histogram bucket */
+	long long	totexts;
+	long long	totblocks;
+	xfs_extlen_t	longest;
+} agstat_t;
+
 static void	addhistent(int h);
 static void	addtohist(xfs_agnumber_t agno, xfs_agblock_t agbno,
 			  xfs_extlen_t len);
@@ -40,6 +52,7 @@ static int	freesp_f(int argc, char **argv);
 static void	histinit(int maxlen);
 static int	init(int argc, char **argv);
 static void	printhist(void);
+static void	printjson(void);
 static void	scan_ag(xfs_agnumber_t agno);
 static void	scanfunc_bno(struct xfs_btree_block *block, typnm_t typ, int level,
 			     xfs_agf_t *agf);
@@ -54,20 +67,26 @@ static int	usage(void);
 
 static int		agcount;
 static xfs_agnumber_t	*aglist;
+static agstat_t		*agstats;	/* indexed by agno */
 static int		countflag;
 static int		dumpflag;
 static int		equalsize;
 static histent_t	*hist;
 static int		histcount;
+static int		jsonflag;
 static int		multsize;
+static int		nthreads;
 static int		seen1;
 static int		summaryflag;
 static long long	totblocks;
 static long long	totexts;
 
+static __thread agstat_t *cur_agstat;
+
 static const cmdinfo_t	freesp_cmd =
 	{ "freesp", NULL, freesp_f, 0, -1, 0,
-	  "[-bcdfs] [-a agno]... [-e binsize] [-h h1]... [-m binmult]",
+	  "[-bcdfjs] [-a agno]... [-e binsize] [-h h1]... [-m binmult] "
+	  "[-t threads]",
 	  "summarize free space for filesystem", NULL };
 
 static int
@@ -93,21 +112,53 @@ freesp_f(
 	char		**argv)
 {
 	xfs_agnumber_t	agno;
+	xfs_agnumber_t	*ags;
+	agstat_t	*st;
+	int		nags;
+	int		i;
 
 	if (!init(argc, argv))
 		return 0;
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)  {
-		if (inaglist(agno))
-			scan_ag(agno);
+	ags = xmalloc(mp->m_sb.sb_agcount * sizeof(*ags));
+	agstats = xcalloc(mp->m_sb.sb_agcount, sizeof(*agstats));
+	for (agno = 0, nags = 0; agno < mp->m_sb.sb_agcount; agno++)  {
+		if (!inaglist(agno))
+			continue;
+		ags[nags++] = agno;
+		agstats[agno].count = xcalloc(histcount, sizeof(long long));
+		agstats[agno].blocks = xcalloc(histcount, sizeof(long long));
 	}
-	if (histcount)
+
+	/* extents are dumped as they are found, so keep those in order */
+	agwalk(ags, nags, dumpflag ? 1 : nthreads, scan_ag);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		st = &agstats[agno];
+		totexts += st->totexts;
+		totblocks += st->totblocks;
+		for (i = 0; st->count && i < histcount; i++) {
+			hist[i].count += st->count[i];
+			hist[i].blocks += st->blocks[i];
+		}
+	}
+	if (jsonflag)
+		printjson();
+	else if (histcount)
 		printhist();
-	if (summaryflag) {
+	if (summaryflag && !jsonflag) {
 		dbprintf(_("total free extents %lld\n"), totexts);
 		dbprintf(_("total free blocks %lld\n"), totblocks);
 		dbprintf(_("average free extent size %g\n"),
 			(double)totblocks / (double)totexts);
 	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		if (agstats[agno].count) {
+			xfree(agstats[agno].count);
+			xfree(agstats[agno].blocks);
+		}
+	}
+	xfree(agstats);
+	xfree(ags);
 	if (aglist)
 		xfree(aglist);
 	if (hist)
@@ -139,11 +190,12 @@ init(
 	int		speced = 0;
 
 	agcount = countflag = dumpflag = equalsize = multsize = optind = 0;
-	histcount = seen1 = summaryflag = 0;
+	histcount = jsonflag = seen1 = summaryflag = 0;
+	nthreads = libxfs_nproc();
 	totblocks = totexts = 0;
 	aglist = NULL;
 	hist = NULL;
-	while ((c = getopt(argc, argv, "a:bcde:h:m:s")) != EOF) {
+	while ((c = getopt(argc, argv, "a:bcde:h:jm:st:")) != EOF) {
 		switch (c) {
 		case 'a':
 			aglistadd(optarg);
@@ -172,6 +224,9 @@ init(
 			addhistent(atoi(optarg));
 			speced = 1;
 			break;
+		case 'j':
+			jsonflag = 1;
+			break;
 		case 'm':
 			if (speced)
 				return usage();
@@ -181,6 +236,11 @@ init(
 		case 's':
 			summaryflag = 1;
 			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads <= 0)
+				return usage();
+			break;
 		case '?':
 			return usage();
 		}
@@ -196,8 +256,8 @@ init(
 static int
 usage(void)
 {
-	dbprintf(_("freesp arguments: [-bcds] [-a agno] [-e binsize] [-h h1]... "
-		 "[-m binmult]\n"));
+	dbprintf(_("freesp arguments: [-bcdjs] [-a agno] [-e binsize] [-h h1]... "
+		 "[-m binmult] [-t threads]\n"));
 	return 0;
 }
 
@@ -207,6 +267,7 @@ scan_ag(
 {
 	xfs_agf_t	*agf;
 
+	cur_agstat = &agstats[agno];
 	push_cur();
 	set_cur(&typtab[TYP_AGF], XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
 				XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
@@ -298,6 +359,8 @@ scanfunc_bno(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	readahead_sbtree(be32_to_cpu(agf->agf_seqno), pp,
+		MIN(be16_to_cpu(block->bb_numrecs), mp->m_alloc_mxr[1]));
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), typ, level, scanfunc_bno);
 }
@@ -325,6 +388,8 @@ scanfunc_cnt(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	readahead_sbtree(be32_to_cpu(agf->agf_seqno), pp,
+		MIN(be16_to_cpu(block->bb_numrecs), mp->m_alloc_mxr[1]));
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), typ, level, scanfunc_cnt);
 }
@@ -349,16 +414,19 @@ addtohist(
 	xfs_agblock_t	agbno,
 	xfs_extlen_t	len)
 {
+	agstat_t	*st = cur_agstat;
 	int		i;
 
 	if (dumpflag)
 		dbprintf("%8d %8d %8d\n", agno, agbno, len);
-	totexts++;
-	totblocks += len;
+	st->totexts++;
+	st->totblocks += len;
+	if (len > st->longest)
+		st->longest = len;
 	for (i = 0; i < histcount; i++) {
 		if (hist[i].high >= len) {
-			hist[i].count++;
-			hist[i].blocks += len;
+			st->count[i]++;
+			st->blocks[i] += len;
 			break;
 		}
 	}
@@ -411,3 +479,51 @@ printhist(void)
 				hist[i].blocks * 100.0 / totblocks);
 	}
 }
+
+/*
+ * The histogram, totals and each AG's share as one JSON object, for
+ * tools that track free space over time.
+ */
+static void
+printjson(void)
+{
+	xfs_agnumber_t	agno;
+	agstat_t	*st;
+	const char	*sep;
+	const char	*binsep;
+	int		i;
+
+	dbprintf("{\"command\": \"freesp\", \"btree\": \"%s\", "
+		"\"extents\": %lld, \"blocks\": %lld, \"average\": %.2f,\n",
+		countflag ? "cnt" : "bno", totexts, totblocks,
+		totexts ? (double)totblocks / (double)totexts : 0.0);
+	dbprintf(" \"histogram\": [");
+	for (i = 0, sep = ""; i < histcount; i++) {
+		if (!hist[i].count)
+			continue;
+		dbprintf("%s\n  {\"from\": %d, \"to\": %d, \"extents\": %lld, "
+			"\"blocks\": %lld, \"pct\": %.2f}", sep, hist[i].low,
+			hist[i].high, hist[i].count, hist[i].blocks,
+			hist[i].blocks * 100.0 / totblocks);
+		sep = ",";
+	}
+	dbprintf("],\n \"ags\": [");
+	for (agno = 0, sep = ""; agno < mp->m_sb.sb_agcount; agno++) {
+		st = &agstats[agno];
+		if (!st->count)
+			continue;
+		dbprintf("%s\n  {\"agno\": %u, \"extents\": %lld, "
+			"\"blocks\": %lld, \"longest\": %u, \"histogram\": [",
+			sep, agno, st->totexts, st->totblocks, st->longest);
+		for (i = 0, binsep = ""; i < histcount; i++) {
+			if (!st->count[i])
+				continue;
+			dbprintf("%s[%d, %lld, %lld]", binsep, hist[i].low,
+				st->count[i], st->blocks[i]);
+			binsep = ", ";
+		}
+		dbprintf("]}");
+		sep = ",";
+	}
+	dbprintf("]}\n");
+}
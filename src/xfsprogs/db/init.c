@@ -36,7 +36,6 @@ int		expert_mode;
 int		force;
 xfs_mount_t	xmount;
 xfs_mount_t	*mp;
-libxfs_init_t	x;
 xfs_agnumber_t	cur_agno = NULLAGNUMBER;
 
 static void
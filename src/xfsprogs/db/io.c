@@ -60,10 +60,10 @@ static const cmdinfo_t  ring_cmd =
 	{ "ring", NULL, ring_f, 0, 1, 0, NULL,
 	  N_("show position ring or move to a specific entry"), ring_help };
 
-iocur_t	*iocur_base;
-iocur_t	*iocur_top;
-int	iocur_sp = -1;
-int	iocur_len;
+__thread iocur_t	*iocur_base;
+__thread iocur_t	*iocur_top;
+__thread int		iocur_sp = -1;
+__thread int		iocur_len;
 
 #define RING_ENTRIES 20
 static iocur_t iocur_ring[RING_ENTRIES];
@@ -71,9 +71,116 @@ static int     ring_head = -1;
 static int     ring_tail = -1;
 static int     ring_current = -1;
 
+/*
+ * Cache of metadata blocks shared by every I/O stack, the metadump
+ * workers' included.  Only reads of up to a filesystem block are kept:
+ * headers, btree and directory blocks are read over and over, inode
+ * chunks and file data mostly once.  A buffer is keyed by start and
+ * length since the same blocks are read as different types.  The lock
+ * covers filling a buffer and testing whether it has been filled; disk
+ * reads are done without it.
+ */
+#define	IO_HASHSIZE	512		/* cache holds 8 buffers per bucket */
+#define	RA_MAXBYTES	(1024 * 1024)	/* largest readahead request */
+
+typedef struct dbuf_key {
+	__int64_t		bbno;
+	int			count;
+} dbuf_key_t;
+
+typedef struct dbuf {
+	struct cache_node	node;
+	__int64_t		bbno;
+	int			count;
+	int			valid;	/* data has been read */
+	char			*data;
+} dbuf_t;
+
+static struct cache	*io_cache;
+static pthread_mutex_t	io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+dbuf_hash(
+	cache_key_t	key,
+	unsigned int	hashsize)
+{
+	return (unsigned int)(((dbuf_key_t *)key)->bbno >> 3) % hashsize;
+}
+
+static struct cache_node *
+dbuf_alloc(
+	cache_key_t	key)
+{
+	dbuf_key_t	*dkey = (dbuf_key_t *)key;
+	dbuf_t		*dbp;
+
+	dbp = xmalloc(sizeof(*dbp) + BBTOB(dkey->count));
+	dbp->bbno = dkey->bbno;
+	dbp->count = dkey->count;
+	dbp->valid = 0;
+	dbp->data = (char *)(dbp + 1);
+	return &dbp->node;
+}
+
+/*ARGSUSED*/
+static void
+dbuf_flush(
+	struct cache_node	*node)
+{
+}
+
+static void
+dbuf_relse(
+	struct cache_node	*node)
+{
+	xfree(node);
+}
+
+static int
+dbuf_compare(
+	struct cache_node	*node,
+	cache_key_t		key)
+{
+	dbuf_t			*dbp = (dbuf_t *)node;
+	dbuf_key_t		*dkey = (dbuf_key_t *)key;
+
+	return dbp->bbno == dkey->bbno && dbp->count == dkey->count;
+}
+
+static struct cache_operations	io_cache_operations = {
+	/* .hash */	dbuf_hash,
+	/* .alloc */	dbuf_alloc,
+	/* .flush */	dbuf_flush,
+	/* .relse */	dbuf_relse,
+	/* .compare */	dbuf_compare,
+	/* .bulkrelse */ NULL
+};
+
+static dbuf_t *
+dbuf_get(
+	__int64_t	bbno,
+	int		count)
+{
+	dbuf_key_t	key;
+	dbuf_t		*dbp;
+
+	key.bbno = bbno;
+	key.count = count;
+	cache_node_get(io_cache, &key, (struct cache_node **)&dbp);
+	return dbp;
+}
+
+static void
+dbuf_put(
+	dbuf_t		*dbp)
+{
+	cache_node_put(io_cache, &dbp->node);
+}
+
 void
 io_init(void)
 {
+	io_cache = cache_init(IO_HASHSIZE, &io_cache_operations);
 	add_command(&pop_cmd);
 	add_command(&push_cmd);
 	add_command(&stack_cmd);
@@ -430,6 +537,8 @@ write_bbs(
 	int		j;
 	int		rval = EINVAL;	/* initialize for zero `count' case */
 
+	/* cached copies of these blocks may be any length, drop them all */
+	io_cache_purge();
 	for (j = 0; j < count; j += bbmap ? 1 : count) {
 		if (bbmap)
 			bbno = bbmap->b[j];
@@ -452,6 +561,53 @@ write_bbs(
 	return rval;
 }
 
+/*
+ * Copy a cached buffer out, or read it and fill the cache from the copy.
+ * Returns 1 if the blocks aren't cached and the caller should read them
+ * itself.
+ */
+static int
+read_cached(
+	__int64_t	bbno,
+	int		count,
+	void		*buf,
+	int		*rvalp)
+{
+	dbuf_t		*dbp;
+	int		c = BBTOB(count);
+	int		i;
+
+	if (io_cache == NULL || c > mp->m_sb.sb_blocksize ||
+	    (dbp = dbuf_get(bbno, count)) == NULL)
+		return 1;
+	pthread_mutex_lock(&io_lock);
+	if (dbp->valid) {
+		pthread_mutex_unlock(&io_lock);
+		memcpy(buf, dbp->data, c);
+		dbuf_put(dbp);
+		*rvalp = 0;
+		return 0;
+	}
+	pthread_mutex_unlock(&io_lock);
+
+	i = (int)pread64(x.dfd, buf, c, bbno << BBSHIFT);
+	if (i < 0)
+		*rvalp = errno;
+	else if (i < c)
+		*rvalp = -1;
+	else {
+		*rvalp = 0;
+		pthread_mutex_lock(&io_lock);
+		if (!dbp->valid) {
+			memcpy(dbp->data, buf, c);
+			dbp->valid = 1;
+		}
+		pthread_mutex_unlock(&io_lock);
+	}
+	dbuf_put(dbp);
+	return 0;
+}
+
 int
 read_bbs(
 	__int64_t	bbno,
@@ -473,31 +629,32 @@ read_bbs(
 		buf = xmalloc(c);
 	else
 		buf = *bufp;
+	if (!bbmap && !read_cached(bbno, count, buf, &rval)) {
+		if (rval && *bufp == NULL)
+			xfree(buf);
+		else if (*bufp == NULL)
+			*bufp = buf;
+		return rval;
+	}
 	for (j = 0; j < count; j += bbmap ? 1 : count) {
 		if (bbmap)
 			bbno = bbmap->b[j];
-		if (lseek64(x.dfd, bbno << BBSHIFT, SEEK_SET) < 0) {
+		/* positioned reads, the device is shared by metadump workers */
+		c = BBTOB(bbmap ? 1 : count);
+		i = (int)pread64(x.dfd, (char *)buf + BBTOB(j), c,
+				bbno << BBSHIFT);
+		if (i < 0) {
 			rval = errno;
-			dbprintf(_("can't seek in filesystem at bb %lld\n"), bbno);
 			if (*bufp == NULL)
 				xfree(buf);
 			buf = NULL;
-		} else {
-			c = BBTOB(bbmap ? 1 : count);
-			i = (int)read(x.dfd, (char *)buf + BBTOB(j), c);
-			if (i < 0) {
-				rval = errno;
-				if (*bufp == NULL)
-					xfree(buf);
-				buf = NULL;
-			} else if (i < c) {
-				rval = -1;
-				if (*bufp == NULL)
-					xfree(buf);
-				buf = NULL;
-			} else
-				rval = 0;
-		}
+		} else if (i < c) {
+			rval = -1;
+			if (*bufp == NULL)
+				xfree(buf);
+			buf = NULL;
+		} else
+			rval = 0;
 		if (buf == NULL)
 			break;
 	}
@@ -506,6 +663,158 @@ read_bbs(
 	return rval;
 }
 
+/*
+ * Drop everything cached, for when the disk has been changed under us.
+ */
+void
+io_cache_purge(void)
+{
+	if (io_cache)
+		cache_purge(io_cache);
+}
+
+static int
+daddr_cmp(
+	const void	*a,
+	const void	*b)
+{
+	__int64_t	da = *(const __int64_t *)a;
+	__int64_t	db = *(const __int64_t *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+static void
+readahead_run(
+	__int64_t	bbno,
+	__int64_t	count)
+{
+#if defined(POSIX_FADV_WILLNEED)
+	posix_fadvise(x.dfd, bbno << BBSHIFT, BBTOB(count),
+			POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+	struct radvisory	ra;
+
+	ra.ra_offset = bbno << BBSHIFT;
+	ra.ra_count = (int)BBTOB(count);
+	fcntl(x.dfd, F_RDADVISE, &ra);
+#endif
+}
+
+/*
+ * Tell the kernel which blocks of count BBs are about to be read, so it
+ * can fetch them while we work through the ones before.  The list is
+ * sorted in place and runs of adjacent blocks go out as one request of
+ * up to RA_MAXBYTES.
+ */
+void
+readahead_bbs(
+	__int64_t	*daddrs,
+	int		nents,
+	int		count)
+{
+	__int64_t	start;
+	__int64_t	end;
+	int		i;
+
+	if (nents <= 0 || count <= 0)
+		return;
+	qsort(daddrs, nents, sizeof(*daddrs), daddr_cmp);
+	start = daddrs[0];
+	end = start + count;
+	for (i = 1; i <= nents; i++) {
+		if (i < nents && daddrs[i] <= end &&
+		    BBTOB(daddrs[i] + count - start) <= RA_MAXBYTES) {
+			end = MAX(end, daddrs[i] + count);
+			continue;
+		}
+		readahead_run(start, end - start);
+		if (i < nents) {
+			start = daddrs[i];
+			end = start + count;
+		}
+	}
+}
+
+/*
+ * Readahead of the blocks below a btree node, given its pointers.
+ * Pointers outside the AG or filesystem are skipped.
+ */
+void
+readahead_sbtree(
+	xfs_agnumber_t	agno,
+	__be32		*pp,
+	int		nptrs)
+{
+	__int64_t	*daddrs;
+	xfs_agblock_t	bno;
+	int		i;
+	int		n;
+
+	if (nptrs <= 0)
+		return;
+	daddrs = xmalloc(nptrs * sizeof(*daddrs));
+	for (i = n = 0; i < nptrs; i++) {
+		bno = be32_to_cpu(pp[i]);
+		if (bno == 0 || bno >= mp->m_sb.sb_agblocks)
+			continue;
+		daddrs[n++] = XFS_AGB_TO_DADDR(mp, agno, bno);
+	}
+	readahead_bbs(daddrs, n, blkbb);
+	xfree(daddrs);
+}
+
+void
+readahead_lbtree(
+	__be64		*pp,
+	int		nptrs)
+{
+	__int64_t	*daddrs;
+	xfs_dfsbno_t	bno;
+	int		i;
+	int		n;
+
+	if (nptrs <= 0)
+		return;
+	daddrs = xmalloc(nptrs * sizeof(*daddrs));
+	for (i = n = 0; i < nptrs; i++) {
+		bno = be64_to_cpu(pp[i]);
+		if (XFS_FSB_TO_AGNO(mp, bno) >= mp->m_sb.sb_agcount ||
+		    XFS_FSB_TO_AGBNO(mp, bno) >= mp->m_sb.sb_agblocks)
+			continue;
+		daddrs[n++] = XFS_FSB_TO_DADDR(mp, bno);
+	}
+	readahead_bbs(daddrs, n, blkbb);
+	xfree(daddrs);
+}
+
+/*
+ * Readahead of the inode chunks of an inode btree leaf.
+ */
+void
+readahead_inochunks(
+	xfs_agnumber_t	agno,
+	xfs_inobt_rec_t	*rp,
+	int		nrecs)
+{
+	__int64_t	*daddrs;
+	xfs_agblock_t	bno;
+	int		i;
+	int		n;
+
+	if (nrecs <= 0)
+		return;
+	daddrs = xmalloc(nrecs * sizeof(*daddrs));
+	for (i = n = 0; i < nrecs; i++) {
+		bno = XFS_AGINO_TO_AGBNO(mp, be32_to_cpu(rp[i].ir_startino));
+		if (bno == 0 || bno >= mp->m_sb.sb_agblocks)
+			continue;
+		daddrs[n++] = XFS_AGB_TO_DADDR(mp, agno, bno);
+	}
+	readahead_bbs(daddrs, n, XFS_FSB_TO_BB(mp, XFS_IALLOC_BLOCKS(mp)));
+	xfree(daddrs);
+}
+
 void
 write_cur(void)
 {
@@ -42,18 +42,28 @@ typedef struct iocur {
 #define DB_RING_ADD 1                   /* add to ring on set_cur */
 #define DB_RING_IGN 0                   /* do not add to ring on set_cur */
 
-extern iocur_t	*iocur_base;		/* base of stack */
-extern iocur_t	*iocur_top;		/* top element of stack */
-extern int	iocur_sp;		/* current top of stack */
-extern int	iocur_len;		/* length of stack array */
+/*
+ * The I/O stack is per thread so that metadump workers can walk
+ * allocation groups concurrently; commands only use the main thread's.
+ */
+extern __thread iocur_t	*iocur_base;	/* base of stack */
+extern __thread iocur_t	*iocur_top;	/* top element of stack */
+extern __thread int	iocur_sp;	/* current top of stack */
+extern __thread int	iocur_len;	/* length of stack array */
 
 extern void	io_init(void);
+extern void	io_cache_purge(void);
 extern void	off_cur(int off, int len);
 extern void	pop_cur(void);
 extern void	print_iocur(char *tag, iocur_t *ioc);
 extern void	push_cur(void);
 extern int	read_bbs(__int64_t daddr, int count, void **bufp,
 			 bbmap_t *bbmap);
+extern void	readahead_bbs(__int64_t *daddrs, int nents, int count);
+extern void	readahead_inochunks(xfs_agnumber_t agno, xfs_inobt_rec_t *rp,
+				    int nrecs);
+extern void	readahead_lbtree(__be64 *pp, int nptrs);
+extern void	readahead_sbtree(xfs_agnumber_t agno, __be32 *pp, int nptrs);
 extern int	write_bbs(__int64_t daddr, int count, void *bufp,
 			  bbmap_t *bbmap);
 extern void     write_cur(void);
@@ -25,6 +25,7 @@
 #include "type.h"
 #include "init.h"
 #include "sig.h"
+#include "malloc.h"
 #include "xfs_metadump.h"
 
 #define DEFAULT_MAX_EXT_SIZE	1000
@@ -52,19 +53,23 @@ static void	metadump_help(void);
 
 static const cmdinfo_t	metadump_cmd =
 	{ "metadump", NULL, metadump_f, 0, -1, 0,
-		N_("[-e] [-g] [-m max_extent] [-w] [-o] filename"),
+		N_("[-e] [-g] [-m max_extent] [-t threads] [-w] [-o] [-z method] filename"),
 		N_("dump metadata to a file"), metadump_help };
 
 static FILE		*outf;		/* metadump file */
 
-static xfs_metablock_t 	*metablock;	/* header + index + buffers */
-static __be64		*block_index;
-static char		*block_buffer;
+/*
+ * The index block being filled and the inode being copied belong to
+ * whichever thread is dumping an AG, see the parallel dump code below.
+ */
+static __thread xfs_metablock_t	*metablock;	/* header + index + buffers */
+static __thread __be64		*block_index;
+static __thread char		*block_buffer;
 
 static int		num_indicies;
-static int		cur_index;
+static __thread int	cur_index;
 
-static xfs_ino_t	cur_ino;
+static __thread xfs_ino_t	cur_ino;
 
 static int		show_progress = 0;
 static int		stop_on_read_error = 0;
@@ -92,7 +97,9 @@ metadump_help(void)
 "   -g -- Display dump progress\n"
 "   -m -- Specify max extent size in blocks to copy (default = %d blocks)\n"
 "   -o -- Don't obfuscate names and extended attributes\n"
+"   -t -- Dump this many AGs at a time (default = 1)\n"
 "   -w -- Show warnings of bad metadata information\n"
+"   -z -- Compress the dump with 'zstd' or 'lz4' (version 2 format)\n"
 "\n"), DEFAULT_MAX_EXT_SIZE);
 }
 
@@ -136,6 +143,133 @@ print_progress(const char *fmt, ...)
 	progress_since_warning = 1;
 }
 
+/*
+ * Parallel and compressed dumps.  Each AG is an item, and the realtime and
+ * quota inodes plus the log make one more after the last AG.  A worker
+ * thread dumps a whole item into chunks of up to XFS_MD_FRAME_MBS metablocks,
+ * compresses each chunk and hands it to the writer.  The writer runs in
+ * the calling thread and takes items strictly in order, so the dump holds
+ * the same blocks in the same order as a serial one.  Workers may only run
+ * ahead of the writer by a bounded number of chunks.
+ */
+typedef struct md_chunk {
+	struct md_chunk	*next;
+	xfs_agnumber_t	item;
+	int		last;		/* last chunk of the item */
+	int		failed;		/* item could not be dumped */
+	int		nmb;		/* metablocks in buf */
+	size_t		len;		/* bytes of metablocks in buf */
+	size_t		clen;		/* bytes in cbuf */
+	char		*buf;
+	char		*cbuf;
+} md_chunk_t;
+
+static int		num_threads;
+static int		compress_method;
+
+static pthread_mutex_t	md_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	md_cond = PTHREAD_COND_INITIALIZER;
+static md_chunk_t	*md_pending;	/* chunks queued for the writer */
+static int		md_npending;
+static xfs_agnumber_t	md_next_item;	/* next item for a worker */
+static xfs_agnumber_t	md_write_item;	/* item being written */
+static int		md_abort;
+
+static __thread md_chunk_t	*cur_chunk;
+
+#define	MD_MB_SIZE	((num_indicies + 1) << BBSHIFT)
+
+static void
+chunk_set_slot(void)
+{
+	metablock = (xfs_metablock_t *)(cur_chunk->buf +
+					cur_chunk->nmb * MD_MB_SIZE);
+	metablock->mb_magic = cpu_to_be32(XFS_MD_MAGIC);
+	metablock->mb_blocklog = BBSHIFT;
+	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
+	block_buffer = (char *)metablock + BBSIZE;
+	cur_index = 0;
+}
+
+static void
+chunk_start(
+	xfs_agnumber_t	item)
+{
+	cur_chunk = xcalloc(1, sizeof(md_chunk_t));
+	cur_chunk->buf = xcalloc(XFS_MD_FRAME_MBS, MD_MB_SIZE);
+	cur_chunk->item = item;
+	chunk_set_slot();
+}
+
+static void
+chunk_submit(
+	int		last,
+	int		failed)
+{
+	md_chunk_t	*chunk = cur_chunk;
+	md_chunk_t	**cp;
+
+	chunk->last = last;
+	chunk->failed = failed;
+	if (compress_method != XFS_MD_COMPRESS_NONE && chunk->len &&
+			!failed) {
+		chunk->cbuf = xmalloc(metadump_compress_bound(compress_method,
+						chunk->len));
+		chunk->clen = metadump_compress(compress_method, chunk->cbuf,
+				metadump_compress_bound(compress_method,
+						chunk->len),
+				chunk->buf, chunk->len);
+		if (chunk->clen == 0) {
+			print_warning("%s compression failed",
+				metadump_compress_name(compress_method));
+			chunk->failed = 1;
+		}
+	}
+
+	pthread_mutex_lock(&md_lock);
+	while (md_npending >= 4 * num_threads &&
+			chunk->item != md_write_item)
+		pthread_cond_wait(&md_cond, &md_lock);
+	for (cp = &md_pending; *cp; cp = &(*cp)->next)
+		;
+	*cp = chunk;
+	md_npending++;
+	pthread_cond_broadcast(&md_cond);
+	pthread_mutex_unlock(&md_lock);
+	cur_chunk = NULL;
+}
+
+/*
+ * The metablock in the current slot is complete; hand the chunk over if
+ * it is full and move on to the next slot.
+ */
+static int
+chunk_next_metablock(void)
+{
+	xfs_agnumber_t	item;
+
+	cur_chunk->len += (cur_index + 1) << BBSHIFT;
+	if (++cur_chunk->nmb == XFS_MD_FRAME_MBS) {
+		item = cur_chunk->item;
+		chunk_submit(0, 0);
+		chunk_start(item);
+	} else
+		chunk_set_slot();
+	return !md_abort;
+}
+
+static void
+chunk_finish_item(
+	int		ok)
+{
+	if (ok && cur_index > 0) {
+		metablock->mb_count = cpu_to_be16(cur_index);
+		cur_chunk->len += (cur_index + 1) << BBSHIFT;
+		cur_chunk->nmb++;
+	}
+	chunk_submit(1, !ok);
+}
+
 /*
  * A complete dump file will have a "zero" entry in the last index block,
  * even if the dump is exactly aligned, the last index will be full of
@@ -150,6 +284,8 @@ write_index(void)
 	 * write index block and following data blocks (streaming)
 	 */
 	metablock->mb_count = cpu_to_be16(cur_index);
+	if (cur_chunk)
+		return chunk_next_metablock();
 	if (fwrite(metablock, (cur_index + 1) << BBSHIFT, 1, outf) != 1) {
 		print_warning("error writing to file: %s", strerror(errno));
 		return 0;
@@ -263,6 +399,7 @@ scanfunc_freesp(
 	}
 
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	readahead_sbtree(agno, pp, numrecs);
 	for (i = 0; i < numrecs; i++) {
 		if (!valid_bno(agno, be32_to_cpu(pp[i]))) {
 			if (show_warnings)
@@ -346,7 +483,7 @@ struct name_ent {
 
 #define NAME_TABLE_SIZE		4096
 
-static struct name_ent		*nametable[NAME_TABLE_SIZE];
+static __thread struct name_ent	*nametable[NAME_TABLE_SIZE];
 
 static void
 nametable_clear(void)
@@ -1031,7 +1168,7 @@ obfuscate_sf_attr(
  * processing calls.
  */
 
-static struct dir_data_s {
+static __thread struct dir_data_s {
 	int			end_of_data;
 	int			block_index;
 	int			offset_to_entry;
@@ -1183,7 +1320,7 @@ obfuscate_symlink_blocks(
 
 #define MAX_REMOTE_VALS		4095
 
-static struct attr_data_s {
+static __thread struct attr_data_s {
 	int			remote_val_count;
 	xfs_dablk_t		remote_vals[MAX_REMOTE_VALS];
 } attr_data;
@@ -1431,6 +1568,7 @@ scanfunc_bmap(
 		return 1;
 	}
 	pp = XFS_BMBT_PTR_ADDR(mp, block, 1, mp->m_bmap_dmxr[1]);
+	readahead_lbtree(pp, nrecs);
 	for (i = 0; i < nrecs; i++) {
 		xfs_agnumber_t	ag;
 		xfs_agblock_t	bno;
@@ -1622,7 +1760,7 @@ process_inode(
 	return success;
 }
 
-static __uint32_t	inodes_copied = 0;
+static __uint32_t	inodes_copied = 0;	/* under md_lock */
 
 static int
 copy_inode_chunk(
@@ -1694,11 +1832,14 @@ skip_processing:
 	if (!write_buf(iocur_top))
 		goto pop_out;
 
+	pthread_mutex_lock(&md_lock);
 	inodes_copied += XFS_INODES_PER_CHUNK;
+	i = inodes_copied;
+	pthread_mutex_unlock(&md_lock);
 
 	if (show_progress)
 		print_progress("Copied %u of %u inodes (%u of %u AGs)",
-				inodes_copied, mp->m_sb.sb_icount, agno,
+				i, mp->m_sb.sb_icount, agno,
 				mp->m_sb.sb_agcount);
 	rval = 1;
 pop_out:
@@ -1731,6 +1872,7 @@ scanfunc_ino(
 			numrecs = mp->m_inobt_mxr[0];
 		}
 		rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+		readahead_inochunks(agno, rp, numrecs);
 		for (i = 0; i < numrecs; i++, rp++) {
 			if (!copy_inode_chunk(agno, rp))
 				return 0;
@@ -1746,6 +1888,7 @@ scanfunc_ino(
 	}
 
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, mp->m_inobt_mxr[1]);
+	readahead_sbtree(agno, pp, numrecs);
 	for (i = 0; i < numrecs; i++) {
 		if (!valid_bno(agno, be32_to_cpu(pp[i]))) {
 			if (show_warnings)
@@ -1958,6 +2101,183 @@ copy_log(void)
 	return write_buf(iocur_top);
 }
 
+static void *
+metadump_worker(
+	void		*arg)
+{
+	xfs_agnumber_t	item;
+	int		ok;
+
+	push_cur();
+	for (;;) {
+		pthread_mutex_lock(&md_lock);
+		item = md_next_item++;
+		pthread_mutex_unlock(&md_lock);
+		if (item > mp->m_sb.sb_agcount)
+			break;
+
+		chunk_start(item);
+		if (md_abort)
+			ok = 0;
+		else if (item < mp->m_sb.sb_agcount)
+			ok = scan_ag(item);
+		else
+			ok = copy_sb_inodes() && (mp->m_sb.sb_logstart == 0 ||
+						  copy_log());
+		chunk_finish_item(ok);
+	}
+
+	/* tear down this thread's I/O stack */
+	while (iocur_sp > 0)
+		pop_cur();
+	pop_cur();
+	xfree(iocur_base);
+	return NULL;
+}
+
+/*
+ * Version 1 output: feed the chunk's blocks through the calling thread's
+ * index block, exactly as a serial dump would have written them.
+ */
+static int
+write_chunk_blocks(
+	md_chunk_t	*chunk)
+{
+	xfs_metablock_t	*mb;
+	__be64		*index;
+	char		*data;
+	int		count;
+	int		i;
+	int		j;
+
+	for (i = 0; i < chunk->nmb; i++) {
+		mb = (xfs_metablock_t *)(chunk->buf + i * MD_MB_SIZE);
+		index = (__be64 *)((char *)mb + sizeof(xfs_metablock_t));
+		data = (char *)mb + BBSIZE;
+		count = be16_to_cpu(mb->mb_count);
+		for (j = 0; j < count; j++, data += BBSIZE) {
+			block_index[cur_index] = index[j];
+			memcpy(&block_buffer[cur_index << BBSHIFT], data,
+					BBSIZE);
+			if (++cur_index == num_indicies) {
+				if (!write_index())
+					return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int
+write_frame(
+	void		*buf,
+	size_t		len,
+	size_t		clen)
+{
+	xfs_metaframe_t	frame;
+
+	frame.mf_len = cpu_to_be32(len);
+	frame.mf_clen = cpu_to_be32(clen);
+	if (fwrite(&frame, sizeof(frame), 1, outf) != 1 ||
+			(clen && fwrite(buf, clen, 1, outf) != 1)) {
+		print_warning("error writing to file: %s", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+static int
+write_chunks(void)
+{
+	md_chunk_t	*chunk;
+	md_chunk_t	**cp;
+	int		ok = 1;
+
+	pthread_mutex_lock(&md_lock);
+	while (md_write_item <= mp->m_sb.sb_agcount) {
+		for (cp = &md_pending; *cp; cp = &(*cp)->next)
+			if ((*cp)->item == md_write_item)
+				break;
+		if (*cp == NULL) {
+			pthread_cond_wait(&md_cond, &md_lock);
+			continue;
+		}
+		chunk = *cp;
+		*cp = chunk->next;
+		md_npending--;
+		if (chunk->last)
+			md_write_item++;
+		pthread_cond_broadcast(&md_cond);
+		pthread_mutex_unlock(&md_lock);
+
+		if (chunk->failed)
+			ok = 0;
+		if (ok && chunk->len) {
+			if (compress_method != XFS_MD_COMPRESS_NONE)
+				ok = write_frame(chunk->cbuf, chunk->len,
+						chunk->clen);
+			else
+				ok = write_chunk_blocks(chunk);
+		}
+		free(chunk->cbuf);
+		free(chunk->buf);
+		free(chunk);
+
+		pthread_mutex_lock(&md_lock);
+		if (!ok)
+			md_abort = 1;
+	}
+	pthread_mutex_unlock(&md_lock);
+	return ok;
+}
+
+static int
+metadump_parallel(void)
+{
+	xfs_metadump_hdr_t	hdr;
+	pthread_t		*threads;
+	int			started;
+	int			ok;
+
+	if (compress_method != XFS_MD_COMPRESS_NONE) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.mh_magic = cpu_to_be32(XFS_MD_MAGIC_V2);
+		hdr.mh_version = XFS_MD_VERSION_2;
+		hdr.mh_compress = compress_method;
+		if (fwrite(&hdr, sizeof(hdr), 1, outf) != 1) {
+			print_warning("error writing to file: %s",
+					strerror(errno));
+			return 0;
+		}
+	}
+
+	md_pending = NULL;
+	md_npending = 0;
+	md_next_item = 0;
+	md_write_item = 0;
+	md_abort = 0;
+
+	threads = xmalloc(num_threads * sizeof(pthread_t));
+	for (started = 0; started < num_threads; started++) {
+		if (pthread_create(&threads[started], NULL,
+					metadump_worker, NULL))
+			break;
+	}
+	if (started == 0) {
+		print_warning("cannot create metadump threads");
+		xfree(threads);
+		return 0;
+	}
+	num_threads = started;
+
+	ok = write_chunks();
+
+	while (started--)
+		pthread_join(threads[started], NULL);
+	xfree(threads);
+	return ok;
+}
+
 static int
 metadump_f(
 	int 		argc,
@@ -1972,6 +2292,8 @@ metadump_f(
 	show_progress = 0;
 	show_warnings = 0;
 	stop_on_read_error = 0;
+	num_threads = 1;
+	compress_method = XFS_MD_COMPRESS_NONE;
 
 	if (mp->m_sb.sb_magicnum != XFS_SB_MAGIC) {
 		print_warning("bad superblock magic number %x, giving up",
@@ -1979,7 +2301,7 @@ metadump_f(
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "egm:ow")) != EOF) {
+	while ((c = getopt(argc, argv, "egm:ot:wz:")) != EOF) {
 		switch (c) {
 			case 'e':
 				stop_on_read_error = 1;
@@ -1998,9 +2320,35 @@ metadump_f(
 			case 'o':
 				dont_obfuscate = 1;
 				break;
+			case 't':
+				num_threads = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' || num_threads <= 0) {
+					print_warning("bad thread count %s",
+							optarg);
+					return 0;
+				}
+				break;
 			case 'w':
 				show_warnings = 1;
 				break;
+			case 'z':
+				if (strcmp(optarg, "zstd") == 0)
+					compress_method = XFS_MD_COMPRESS_ZSTD;
+				else if (strcmp(optarg, "lz4") == 0)
+					compress_method = XFS_MD_COMPRESS_LZ4;
+				else {
+					print_warning("unknown compression "
+						"method %s", optarg);
+					return 0;
+				}
+				if (!metadump_compress_supported(
+						compress_method)) {
+					print_warning("%s compression is not "
+						"supported by this build",
+						optarg);
+					return 0;
+				}
+				break;
 			default:
 				print_warning("bad option for metadump command");
 				return 0;
@@ -2043,25 +2391,32 @@ metadump_f(
 	}
 
 	exitcode = 0;
-
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		if (!scan_ag(agno)) {
-			exitcode = 1;
-			break;
+	if (num_threads > 1 || compress_method != XFS_MD_COMPRESS_NONE) {
+		exitcode = !metadump_parallel();
+	} else {
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			if (!scan_ag(agno)) {
+				exitcode = 1;
+				break;
+			}
 		}
-	}
 
-	/* copy realtime and quota inode contents */
-	if (!exitcode)
-		exitcode = !copy_sb_inodes();
+		/* copy realtime and quota inode contents */
+		if (!exitcode)
+			exitcode = !copy_sb_inodes();
 
-	/* copy log if it's internal */
-	if ((mp->m_sb.sb_logstart != 0) && !exitcode)
-		exitcode = !copy_log();
+		/* copy log if it's internal */
+		if ((mp->m_sb.sb_logstart != 0) && !exitcode)
+			exitcode = !copy_log();
+	}
 
-	/* write the remaining index */
-	if (!exitcode)
-		exitcode = !write_index();
+	/* write the remaining index, or the end frame */
+	if (!exitcode) {
+		if (compress_method != XFS_MD_COMPRESS_NONE)
+			exitcode = !write_frame(NULL, 0, 0);
+		else
+			exitcode = !write_index();
+	}
 
 	if (progress_since_warning)
 		fputc('\n', (outf == stdout) ? stderr : stdout);
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2026 fuse-xfs contributors.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <xfs/libxfs.h>
+#include <pthread.h>
+#include "malloc.h"
+#include "runmap.h"
+
+/*
+ * A map from block numbers to values for the check command.  The blocks
+ * are split into chunks.  A chunk has no memory until one of its blocks
+ * is given a nonzero value, and then holds a sorted array of runs of
+ * blocks sharing a value; as space is handed out in extents most chunks
+ * only ever need a few.  A chunk so fragmented that its runs would take
+ * more memory than a value per block is switched to a flat array.
+ */
+
+#define	RM_CHUNK_LOG	12
+#define	RM_CHUNK_SIZE	(1 << RM_CHUNK_LOG)
+#define	RM_CHUNK_MASK	(RM_CHUNK_SIZE - 1)
+
+typedef struct rm_run {
+	__uint16_t	first;		/* block offsets within the chunk */
+	__uint16_t	last;
+	unsigned long	value;
+} rm_run_t;
+
+typedef struct rm_chunk {
+	int		nruns;		/* -1 once flat */
+	int		maxruns;
+	void		*data;		/* rm_run_t[nruns] or flat values */
+} rm_chunk_t;
+
+struct runmap {
+	__uint64_t	nblocks;
+	int		width;		/* bytes per value when flat */
+	__uint64_t	nchunks;
+	rm_chunk_t	*chunks;
+};
+
+/* blockget fills the maps of different AGs from several threads */
+static pthread_mutex_t	rm_lock = PTHREAD_MUTEX_INITIALIZER;
+static __uint64_t	rm_bytes;	/* held by all maps */
+static __uint64_t	rm_peak;
+
+static void
+rm_account(
+	__int64_t	delta)
+{
+	pthread_mutex_lock(&rm_lock);
+	rm_bytes += delta;
+	if (rm_bytes > rm_peak)
+		rm_peak = rm_bytes;
+	pthread_mutex_unlock(&rm_lock);
+}
+
+static unsigned long
+rm_flat_get(
+	runmap_t	*map,
+	rm_chunk_t	*c,
+	int		off)
+{
+	if (map->width == 1)
+		return ((unsigned char *)c->data)[off];
+	return ((unsigned long *)c->data)[off];
+}
+
+static void
+rm_flat_set(
+	runmap_t	*map,
+	rm_chunk_t	*c,
+	int		off,
+	unsigned long	value)
+{
+	if (map->width == 1)
+		((unsigned char *)c->data)[off] = (unsigned char)value;
+	else
+		((unsigned long *)c->data)[off] = value;
+}
+
+/*
+ * Index of the first run ending at or after off.
+ */
+static int
+rm_find(
+	rm_chunk_t	*c,
+	int		off)
+{
+	rm_run_t	*runs = c->data;
+	int		lo = 0;
+	int		hi = c->nruns;
+	int		mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (runs[mid].last < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+rm_flatten(
+	runmap_t	*map,
+	rm_chunk_t	*c)
+{
+	rm_run_t	*runs = c->data;
+	int		i;
+	int		off;
+
+	c->data = xcalloc(RM_CHUNK_SIZE, map->width);
+	rm_account(RM_CHUNK_SIZE * map->width);
+	for (i = 0; i < c->nruns; i++)
+		for (off = runs[i].first; off <= runs[i].last; off++)
+			rm_flat_set(map, c, off, runs[i].value);
+	xfree(runs);
+	rm_account(-(__int64_t)(c->maxruns * sizeof(rm_run_t)));
+	c->nruns = -1;
+	c->maxruns = 0;
+}
+
+static void
+rm_chunk_set(
+	runmap_t	*map,
+	rm_chunk_t	*c,
+	int		first,
+	int		last,
+	unsigned long	value)
+{
+	rm_run_t	new[3];
+	rm_run_t	*runs;
+	int		hi;
+	int		i;
+	int		lo;
+	int		n = 0;
+	int		nruns;
+	int		stop;
+
+	if (c->nruns < 0) {
+		for (i = first; i <= last; i++)
+			rm_flat_set(map, c, i, value);
+		return;
+	}
+
+	/* runs [lo, hi) overlap the range; keep what lies outside it */
+	runs = c->data;
+	lo = rm_find(c, first);
+	for (hi = lo; hi < c->nruns && runs[hi].first <= last; hi++)
+		;
+	if (lo < hi && runs[lo].first < first) {
+		new[n] = runs[lo];
+		new[n++].last = first - 1;
+	}
+	if (value) {
+		new[n].first = first;
+		new[n].last = last;
+		new[n++].value = value;
+	}
+	if (lo < hi && runs[hi - 1].last > last) {
+		new[n] = runs[hi - 1];
+		new[n++].first = last + 1;
+	}
+
+	nruns = c->nruns - (hi - lo) + n;
+	if (nruns > c->maxruns) {
+		if (nruns * sizeof(rm_run_t) >= RM_CHUNK_SIZE * map->width) {
+			rm_flatten(map, c);
+			rm_chunk_set(map, c, first, last, value);
+			return;
+		}
+		i = c->maxruns ? c->maxruns * 2 : 4;
+		c->data = xrealloc(c->data, i * sizeof(rm_run_t));
+		rm_account((i - c->maxruns) * sizeof(rm_run_t));
+		c->maxruns = i;
+		runs = c->data;
+	}
+	memmove(&runs[lo + n], &runs[hi], (c->nruns - hi) * sizeof(rm_run_t));
+	memcpy(&runs[lo], new, n * sizeof(rm_run_t));
+	c->nruns = nruns;
+
+	/* join runs that now meet with the same value */
+	stop = MAX(lo, 1);
+	for (i = MIN(lo + n, c->nruns - 1); i >= stop; i--) {
+		if (runs[i - 1].last + 1 != runs[i].first ||
+		    runs[i - 1].value != runs[i].value)
+			continue;
+		runs[i - 1].last = runs[i].last;
+		memmove(&runs[i], &runs[i + 1],
+			(c->nruns - i - 1) * sizeof(rm_run_t));
+		c->nruns--;
+	}
+}
+
+/*
+ * width is the size of a value in a flat chunk, 1 or sizeof(long).
+ */
+runmap_t *
+runmap_alloc(
+	__uint64_t	nblocks,
+	int		width)
+{
+	runmap_t	*map;
+
+	if (!rm_bytes)
+		rm_peak = 0;		/* a new set of maps */
+	map = xmalloc(sizeof(runmap_t));
+	map->nblocks = nblocks;
+	map->width = width;
+	map->nchunks = (nblocks + RM_CHUNK_SIZE - 1) >> RM_CHUNK_LOG;
+	map->chunks = xcalloc(map->nchunks, sizeof(rm_chunk_t));
+	rm_account(sizeof(runmap_t) + map->nchunks * sizeof(rm_chunk_t));
+	return map;
+}
+
+void
+runmap_free(
+	runmap_t	*map)
+{
+	rm_chunk_t	*c;
+	__uint64_t	i;
+
+	for (i = 0, c = map->chunks; i < map->nchunks; i++, c++) {
+		if (c->nruns < 0)
+			rm_account(-(__int64_t)(RM_CHUNK_SIZE * map->width));
+		else
+			rm_account(-(__int64_t)(c->maxruns * sizeof(rm_run_t)));
+		xfree(c->data);
+	}
+	rm_account(-(__int64_t)(sizeof(runmap_t) +
+				map->nchunks * sizeof(rm_chunk_t)));
+	xfree(map->chunks);
+	xfree(map);
+}
+
+/*
+ * Value of block bno; *lenp is set to the number of blocks from bno on
+ * known to share it, at least one.
+ */
+unsigned long
+runmap_get(
+	runmap_t	*map,
+	__uint64_t	bno,
+	__uint64_t	*lenp)
+{
+	rm_chunk_t	*c;
+	int		end;
+	int		i;
+	int		off;
+	rm_run_t	*runs;
+	unsigned long	value;
+
+	c = &map->chunks[bno >> RM_CHUNK_LOG];
+	off = bno & RM_CHUNK_MASK;
+	end = (int)MIN(RM_CHUNK_SIZE, map->nblocks - (bno & ~RM_CHUNK_MASK));
+	if (c->nruns < 0) {
+		value = rm_flat_get(map, c, off);
+		for (i = off + 1; i < end && rm_flat_get(map, c, i) == value;
+		     i++)
+			;
+		*lenp = i - off;
+		return value;
+	}
+	runs = c->data;
+	i = rm_find(c, off);
+	if (i < c->nruns && runs[i].first <= off) {
+		*lenp = runs[i].last - off + 1;
+		return runs[i].value;
+	}
+	*lenp = (i < c->nruns ? runs[i].first : end) - off;
+	return 0;
+}
+
+void
+runmap_set(
+	runmap_t	*map,
+	__uint64_t	bno,
+	__uint64_t	len,
+	unsigned long	value)
+{
+	__uint64_t	end;
+	__uint64_t	n;
+
+	ASSERT(bno + len <= map->nblocks);
+	for (end = bno + len; bno < end; bno += n) {
+		n = MIN(end - bno, RM_CHUNK_SIZE - (bno & RM_CHUNK_MASK));
+		rm_chunk_set(map, &map->chunks[bno >> RM_CHUNK_LOG],
+			bno & RM_CHUNK_MASK, (bno & RM_CHUNK_MASK) + n - 1,
+			value);
+	}
+}
+
+/*
+ * Most memory held by block maps at any one time since the last time
+ * none were allocated.
+ */
+__uint64_t
+runmap_peak_bytes(void)
+{
+	return rm_peak;
+}
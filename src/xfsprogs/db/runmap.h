@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2026 fuse-xfs contributors.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Per-block values (block types, owning inodes) kept as runs of blocks.
+ */
+typedef struct runmap	runmap_t;
+
+extern runmap_t		*runmap_alloc(__uint64_t nblocks, int width);
+extern void		runmap_free(runmap_t *map);
+extern unsigned long	runmap_get(runmap_t *map, __uint64_t bno,
+				   __uint64_t *lenp);
+extern void		runmap_set(runmap_t *map, __uint64_t bno,
+				   __uint64_t len, unsigned long value);
+extern __uint64_t	runmap_peak_bytes(void);
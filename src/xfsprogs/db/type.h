@@ -43,7 +43,8 @@ typedef struct typ
 	pfunc_t			pfunc;
 	const struct field	*fields;
 } typ_t;
-extern const typ_t	typtab[], *cur_typ;
+extern const typ_t	typtab[];
+extern __thread const typ_t	*cur_typ;
 
 extern void	type_init(void);
 extern void	handle_block(int action, const struct field *fields, int argc,
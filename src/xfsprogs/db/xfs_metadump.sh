@@ -5,16 +5,18 @@
 
 OPTS=" "
 DBOPTS=" "
-USAGE="Usage: xfs_metadump [-efogwV] [-m max_extents] [-l logdev] source target"
+USAGE="Usage: xfs_metadump [-efogwV] [-m max_extents] [-t threads] [-z method] [-l logdev] source target"
 
-while getopts "efgl:m:owV" c
+while getopts "efgl:m:ot:wz:V" c
 do
 	case $c in
 	e)	OPTS=$OPTS"-e ";;
 	g)	OPTS=$OPTS"-g ";;
 	m)	OPTS=$OPTS"-m "$OPTARG" ";;
 	o)	OPTS=$OPTS"-o ";;
+	t)	OPTS=$OPTS"-t "$OPTARG" ";;
 	w)	OPTS=$OPTS"-w ";;
+	z)	OPTS=$OPTS"-z "$OPTARG" ";;
 	f)	DBOPTS=$DBOPTS" -f";;
 	l)	DBOPTS=$DBOPTS" -l "$OPTARG" ";;
 	V)	xfs_db -p xfs_metadump -V
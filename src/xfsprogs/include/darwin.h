@@ -139,6 +139,7 @@ typedef char*		xfs_caddr_t;
 typedef unsigned char	uchar_t;
 #define stat64		stat
 #define fstat64		fstat
+#define lstat64		lstat
 #define lseek64		lseek
 #define pread64		pread
 #define pwrite64	pwrite
@@ -85,6 +85,7 @@ typedef struct {
 	int             rcreat;         /* try to create realtime subvolume */
 	int		setblksize;	/* attempt to set device blksize */
 	int		usebuflock;	/* lock xfs_buf_t's - for MT usage */
+	int		ismetadump;	/* data "subvolume" may be a metadump */
 				/* output results */
 	dev_t           ddev;           /* device for data subvolume */
 	dev_t           logdev;         /* device for log subvolume */
@@ -109,6 +110,7 @@ typedef struct {
 #define LIBXFS_DANGEROUSLY	0x0008	/* repairing a device mounted ro    */
 #define LIBXFS_EXCLUSIVELY	0x0010	/* disallow other accesses (O_EXCL) */
 #define LIBXFS_DIRECT		0x0020	/* can use direct I/O, not buffered */
+#define LIBXFS_METADUMP		0x0040	/* read a metadump in place, ro only */
 
 extern char	*progname;
 extern int	libxfs_init (libxfs_init_t *);
@@ -169,6 +171,7 @@ typedef struct xfs_mount {
 	uint			m_bm_maxlevels[2]; /* XFS_BM_MAXLEVELS */
 	uint			m_in_maxlevels;	/* XFS_IN_MAXLEVELS */
 	xfs_perag_t		*m_perag;	/* per-ag accounting info */
+	pthread_mutex_t		m_sb_mutex;	/* sb counter fold lock */
 	uint			m_flags;	/* global mount flags */
 	uint			m_qflags;	/* quota status flags */
 	uint			m_attroffset;	/* inode attribute offset */
@@ -355,6 +358,7 @@ typedef struct xfs_trans {
 	long		t_ifree_delta;		/* superblock ifree change */
 	long		t_fdblocks_delta;	/* superblock fdblocks chg */
 	long		t_frextents_delta;	/* superblock freextents chg */
+	xfs_agnumber_t	t_agno;			/* AG context for sb deltas */
 	unsigned int	t_items_free;		/* log item descs free */
 	xfs_log_item_chunk_t	t_items;	/* first log item desc chunk */
 } xfs_trans_t;
@@ -365,6 +369,10 @@ extern int	libxfs_trans_reserve (xfs_trans_t *, uint,uint,uint,uint,uint);
 extern int	libxfs_trans_commit (xfs_trans_t *, uint);
 extern void	libxfs_trans_cancel (xfs_trans_t *, int);
 extern void	libxfs_mod_sb (xfs_trans_t *, __int64_t);
+extern void	libxfs_trans_agctx (xfs_trans_t *, xfs_agnumber_t);
+extern void	libxfs_icsb_read (xfs_mount_t *, __uint64_t *, __uint64_t *,
+				__uint64_t *);
+extern int	libxfs_icsb_sync_counters (xfs_mount_t *);
 extern xfs_buf_t	*libxfs_trans_getsb (xfs_trans_t *, xfs_mount_t *, int);
 
 extern int	libxfs_trans_iget (xfs_mount_t *, xfs_trans_t *, xfs_ino_t,
@@ -403,6 +411,7 @@ typedef struct xfs_inode {
 	xfs_trans_t		*i_transp;	/* ptr to owning transaction */
 	xfs_inode_log_item_t	*i_itemp;	/* logging information */
 	unsigned int		i_delayed_blks;	/* count of delay alloc blks */
+	unsigned long		i_forkgen;	/* data fork changes, 0 unset */
 	xfs_icdinode_t		i_d;		/* most of ondisk inode */
 	xfs_fsize_t		i_size;		/* in-memory size */
 } xfs_inode_t;
@@ -201,6 +201,13 @@ typedef struct xfs_perag
 	int		pag_ici_init;	/* incore inode cache initialised */
 	rwlock_t	pag_ici_lock;	/* incore inode lock */
 	struct radix_tree_root pag_ici_root;	/* incore inode cache root */
+#else
+	pthread_mutex_t	pag_lock;	/* allocation context lock */
+	__int64_t	pagsb_fdblocks;	/* sb fdblocks delta not yet folded */
+	__int64_t	pagsb_ifree;	/* sb ifree delta not yet folded */
+	__int64_t	pagsb_icount;	/* sb icount delta not yet folded */
+	xfs_agino_t	pagi_ichunk;	/* cached inode chunk with free inodes */
+	__uint64_t	pagi_ifree;	/* free mask of pagi_ichunk, 0 if none */
 #endif
 } xfs_perag_t;
 
@@ -89,6 +89,19 @@ xfs_dialloc(
 					   the free inodes */
 	xfs_ino_t	*inop);		/* inode number allocated */
 
+#ifndef __KERNEL__
+/*
+ * Allocate an inode from the free chunk cached in the parent's AG.
+ * Returns NULLFSINO in inop if xfs_dialloc() has to be used instead.
+ */
+int					/* error */
+xfs_dialloc_cached(
+	struct xfs_trans *tp,		/* transaction pointer */
+	xfs_ino_t	parent,		/* parent inode (directory) */
+	mode_t		mode,		/* mode bits for new inode */
+	xfs_ino_t	*inop);		/* inode number allocated */
+#endif
+
 /*
  * Free disk inode.  Carefully avoids touching the incore inode, all
  * manipulations incore are the caller's responsibility.
@@ -29,4 +29,145 @@ typedef struct xfs_metablock {
 	/* followed by an array of xfs_daddr_t */
 } xfs_metablock_t;
 
+/*
+ * Version 2 dumps start with an xfs_metadump_hdr and are followed by
+ * frames.  Each frame holds a run of version 1 metablocks (index block
+ * plus the mb_count sectors it describes), compressed as a unit with
+ * the method named in the header.  Unlike version 1, a metablock that
+ * is not full does not end the dump; a frame with mf_len == 0 does.
+ */
+#define	XFS_MD_MAGIC_V2		0x58464d32	/* 'XFM2' */
+#define	XFS_MD_VERSION_2	2
+
+#define	XFS_MD_COMPRESS_NONE	0
+#define	XFS_MD_COMPRESS_ZSTD	1
+#define	XFS_MD_COMPRESS_LZ4	2
+
+typedef struct xfs_metadump_hdr {
+	__be32		mh_magic;
+	__uint8_t	mh_version;
+	__uint8_t	mh_compress;	/* XFS_MD_COMPRESS_* */
+	__be16		mh_reserved;
+} xfs_metadump_hdr_t;
+
+typedef struct xfs_metaframe {
+	__be32		mf_len;		/* metablock bytes, 0 ends the dump */
+	__be32		mf_clen;	/* compressed bytes that follow */
+} xfs_metaframe_t;
+
+/*
+ * A frame holds at most XFS_MD_FRAME_MBS metablocks of BBSIZE index plus
+ * the BBSIZE / sizeof(__be64) - 1 sectors it can describe.
+ */
+#define	XFS_MD_FRAME_MBS	32
+#define	XFS_MD_MAX_FRAME	(XFS_MD_FRAME_MBS * \
+				 (BBSIZE / sizeof(__be64)) * BBSIZE)
+
+/*
+ * Frame codecs shared by xfs_db's metadump command and xfs_mdrestore.
+ * A method whose library was not found by configure is reported as
+ * unsupported.
+ */
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+static inline const char *
+metadump_compress_name(int method)
+{
+	switch (method) {
+	case XFS_MD_COMPRESS_NONE:	return "none";
+	case XFS_MD_COMPRESS_ZSTD:	return "zstd";
+	case XFS_MD_COMPRESS_LZ4:	return "lz4";
+	}
+	return "unknown";
+}
+
+static inline int
+metadump_compress_supported(int method)
+{
+	switch (method) {
+	case XFS_MD_COMPRESS_NONE:
+		return 1;
+#ifdef HAVE_ZSTD
+	case XFS_MD_COMPRESS_ZSTD:
+		return 1;
+#endif
+#ifdef HAVE_LZ4
+	case XFS_MD_COMPRESS_LZ4:
+		return 1;
+#endif
+	}
+	return 0;
+}
+
+static inline size_t
+metadump_compress_bound(int method, size_t len)
+{
+	switch (method) {
+#ifdef HAVE_ZSTD
+	case XFS_MD_COMPRESS_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_LZ4
+	case XFS_MD_COMPRESS_LZ4:
+		return LZ4_compressBound(len);
+#endif
+	}
+	return len;
+}
+
+/* returns the compressed length, or 0 on failure */
+static inline size_t
+metadump_compress(int method, void *dst, size_t dlen,
+		  const void *src, size_t len)
+{
+	switch (method) {
+	case XFS_MD_COMPRESS_NONE:
+		if (len > dlen)
+			return 0;
+		memcpy(dst, src, len);
+		return len;
+#ifdef HAVE_ZSTD
+	case XFS_MD_COMPRESS_ZSTD: {
+		size_t	ret = ZSTD_compress(dst, dlen, src, len, 3);
+
+		return ZSTD_isError(ret) ? 0 : ret;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case XFS_MD_COMPRESS_LZ4:
+		return LZ4_compress_default(src, dst, len, dlen);
+#endif
+	}
+	return 0;
+}
+
+/* returns 0 if clen bytes at src expanded to exactly len bytes */
+static inline int
+metadump_decompress(int method, void *dst, size_t len,
+		    const void *src, size_t clen)
+{
+	switch (method) {
+	case XFS_MD_COMPRESS_NONE:
+		if (clen != len)
+			return -1;
+		memcpy(dst, src, len);
+		return 0;
+#ifdef HAVE_ZSTD
+	case XFS_MD_COMPRESS_ZSTD:
+		return ZSTD_decompress(dst, len, src, clen) == len ? 0 : -1;
+#endif
+#ifdef HAVE_LZ4
+	case XFS_MD_COMPRESS_LZ4:
+		return LZ4_decompress_safe(src, dst, clen, len) ==
+							(int)len ? 0 : -1;
+#endif
+	}
+	return -1;
+}
+
 #endif /* _XFS_METADUMP_H_ */
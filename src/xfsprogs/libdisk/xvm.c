@@ -22,6 +22,9 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
 #include <disk/volume.h>
 #include "xvm.h"
 
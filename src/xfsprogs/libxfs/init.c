@@ -40,6 +40,7 @@ int nextfakedev = -1;	/* device number to give to next fake device */
 static struct dev_to_fd {
 	dev_t	dev;
 	int	fd;
+	struct libxfs_mdev *md;	/* metadump read in place, or NULL */
 } dev_map[MAX_DEVS]={{0}};
 
 /*
@@ -83,6 +84,20 @@ libxfs_device_to_fd(dev_t device)
 	/* NOTREACHED */
 }
 
+/* libxfs_device_to_mdev:
+ *     return the metadump behind a device number, or NULL
+ */
+struct libxfs_mdev *
+libxfs_device_to_mdev(dev_t device)
+{
+	int	d;
+
+	for (d = 0; d < MAX_DEVS; d++)
+		if (dev_map[d].dev == device)
+			return dev_map[d].md;
+	return NULL;
+}
+
 /* libxfs_device_open:
  *     open a device and return its device number
  */
@@ -93,6 +108,7 @@ libxfs_device_open(char *path, int creat, int xflags, int setblksize)
 	int		fd, d, flags;
 	int		readonly, dio, excl;
 	struct stat64	statb;
+	struct libxfs_mdev *md = NULL;
 
 	readonly = (xflags & LIBXFS_ISREADONLY);
 	excl = (xflags & LIBXFS_EXCLUSIVELY) && !creat;
@@ -129,6 +145,14 @@ retry:
 		}
 	}
 
+	if ((xflags & LIBXFS_METADUMP) && !creat &&
+	    (statb.st_mode & S_IFMT) == S_IFREG &&
+	    (md = libxfs_mdev_open(path)) != NULL && !readonly) {
+		fprintf(stderr, _("%s: %s is a metadump, it can only be "
+				  "opened read-only\n"), progname, path);
+		exit(1);
+	}
+
 	/*
 	 * Get the device number from the stat buf - unless
 	 * we're not opening a real device, in which case
@@ -147,6 +171,7 @@ retry:
 		if (!dev_map[d].dev) {
 			dev_map[d].dev = dev;
 			dev_map[d].fd = fd;
+			dev_map[d].md = md;
 
 			return dev;
 		}
@@ -168,6 +193,10 @@ libxfs_device_close(dev_t dev)
 
 			fd = dev_map[d].fd;
 			dev_map[d].dev = dev_map[d].fd = 0;
+			if (dev_map[d].md) {
+				libxfs_mdev_close(dev_map[d].md);
+				dev_map[d].md = NULL;
+			}
 
 			fsync(fd);
 			platform_flush_device(fd, dev);
@@ -261,8 +290,8 @@ libxfs_init(libxfs_init_t *a)
 		if (dname[0] != '/' && needcd)
 			chdir(curdir);
 		if (a->disfile) {
-			a->ddev= libxfs_device_open(dname, a->dcreat, flags,
-						    a->setblksize);
+			a->ddev= libxfs_device_open(dname, a->dcreat,
+					flags | a->ismetadump, a->setblksize);
 			a->dfd = libxfs_device_to_fd(a->ddev);
 		} else {
 			if (!check_open(dname, flags, &rawfile, &blockfile))
@@ -528,6 +557,7 @@ libxfs_mount(
 	xfs_sb_t	*sbp;
 	size_t		size;
 	int		error;
+	xfs_agnumber_t	agno;
 
 	mp->m_dev = dev;
 	mp->m_rtdev = rtdev;
@@ -535,6 +565,7 @@ libxfs_mount(
 	mp->m_flags = (LIBXFS_MOUNT_32BITINODES|LIBXFS_MOUNT_32BITINOOPT);
 	mp->m_sb = *sb;
 	sbp = &(mp->m_sb);
+	pthread_mutex_init(&mp->m_sb_mutex, NULL);
 
 	xfs_mount_common(mp, sb);
 
@@ -654,6 +685,8 @@ libxfs_mount(
 	}
 
 	mp->m_maxagi = xfs_initialize_perag(mp, sbp->sb_agcount);
+	for (agno = 0; agno < sbp->sb_agcount; agno++)
+		pthread_mutex_init(&mp->m_perag[agno].pag_lock, NULL);
 
 	/*
 	 * mkfs calls mount before the root inode is allocated.
@@ -717,6 +750,8 @@ libxfs_umount(xfs_mount_t *mp)
 			if (mp->m_perag[agno].pagb_list)
 				free(mp->m_perag[agno].pagb_list);
 		}
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+			pthread_mutex_destroy(&mp->m_perag[agno].pag_lock);
 		free(mp->m_perag);
 	}
 }
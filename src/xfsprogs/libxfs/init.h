@@ -35,4 +35,11 @@ extern int platform_nproc(void);
 extern unsigned long platform_physmem(void);	/* in kilobytes */
 extern int platform_has_uuid;
 
+struct libxfs_mdev;
+extern struct libxfs_mdev *libxfs_mdev_open(char *path);
+extern void libxfs_mdev_close(struct libxfs_mdev *md);
+extern int libxfs_mdev_read(struct libxfs_mdev *md, void *buf,
+				xfs_daddr_t blkno, int len);
+extern struct libxfs_mdev *libxfs_device_to_mdev(dev_t device);
+
 #endif	/* LIBXFS_INIT_H */
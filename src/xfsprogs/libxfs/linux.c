@@ -16,12 +16,9 @@
  * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-#define ustat __kernel_ustat
 #include <xfs/libxfs.h>
 #include <mntent.h>
 #include <sys/stat.h>
-#undef ustat
-#include <sys/ustat.h>
 #include <sys/mount.h>
 #include <sys/ioctl.h>
 #include <sys/sysinfo.h>
@@ -46,12 +43,18 @@ static int max_block_alignment;
 
 #define PROC_MOUNTED	"/proc/mounts"
 
+/*
+ * ustat(2) is gone from current C libraries, so look the device up in
+ * the mount table instead
+ */
 int
 platform_check_ismounted(char *name, char *block, struct stat64 *s, int verbose)
 {
-	/* Pad ust; pre-2.6.28 linux copies out too much in 32bit compat mode */
-	struct ustat	ust[2];
 	struct stat64	st;
+	struct stat64	mst;
+	struct mntent	*mnt;
+	FILE		*f;
+	char		mounts[MAXPATHLEN];
 
 	if (!s) {
 		if (stat64(block, &st) < 0)
@@ -61,7 +64,20 @@ platform_check_ismounted(char *name, char *block, struct stat64 *s, int verbose)
 		s = &st;
 	}
 
-	if (ustat(s->st_rdev, ust) >= 0) {
+	strcpy(mounts, (!access(PROC_MOUNTED, R_OK)) ? PROC_MOUNTED : MOUNTED);
+	if ((f = setmntent(mounts, "r")) == NULL)
+		return 0;
+	while ((mnt = getmntent(f)) != NULL) {
+		if (stat64(mnt->mnt_fsname, &mst) < 0)
+			continue;
+		if ((mst.st_mode & S_IFMT) != S_IFBLK)
+			continue;
+		if (mst.st_rdev == s->st_rdev)
+			break;
+	}
+	endmntent(f);
+
+	if (mnt != NULL) {
 		if (verbose)
 			fprintf(stderr,
 				_("%s: %s contains a mounted filesystem\n"),
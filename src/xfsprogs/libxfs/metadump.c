@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2026 fuse-xfs contributors.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <xfs/libxfs.h>
+#include "xfs_metadump.h"
+#include "init.h"
+
+/*
+ * A metadump used in place of the filesystem image.  Opening it reads
+ * just the index blocks, building a sorted table of runs of sectors that
+ * are stored contiguously in the dump.  Reads are then served from the
+ * dump through the table; sectors that were not dumped (file data, free
+ * space) read back as zeroes, as they would from a restored image.
+ *
+ * Only uncompressed (version 1) dumps can be read in place.
+ */
+
+typedef struct mdev_run {
+	xfs_daddr_t	daddr;		/* first sector of the run */
+	xfs_daddr_t	len;		/* sectors */
+	off64_t		off;		/* where it starts in the dump */
+} mdev_run_t;
+
+struct libxfs_mdev {
+	int		fd;
+	mdev_run_t	*runs;
+	size_t		nruns;
+};
+
+/* one dumped block, while the table is being built */
+typedef struct mdev_ent {
+	xfs_daddr_t	daddr;
+	off64_t		off;
+} mdev_ent_t;
+
+static int
+mdev_ent_cmp(
+	const void	*a,
+	const void	*b)
+{
+	const mdev_ent_t	*ea = a;
+	const mdev_ent_t	*eb = b;
+
+	if (ea->daddr != eb->daddr)
+		return ea->daddr < eb->daddr ? -1 : 1;
+	if (ea->off != eb->off)
+		return ea->off < eb->off ? -1 : 1;
+	return 0;
+}
+
+static void
+mdev_corrupt(
+	char		*path,
+	off64_t		off)
+{
+	fprintf(stderr, _("%s: %s: bad metadump index at offset %lld\n"),
+		progname, path, (long long)off);
+	exit(1);
+}
+
+/*
+ * Read the index blocks of the dump into a run table.  A block dumped more
+ * than once is served from its last copy, which is the one xfs_mdrestore
+ * would have left behind.
+ */
+static void
+mdev_build_index(
+	struct libxfs_mdev	*md,
+	char			*path)
+{
+	xfs_metablock_t		*mb;
+	__be64			*index;
+	mdev_ent_t		*ents = NULL;
+	size_t			nents = 0;
+	size_t			maxents = 0;
+	mdev_run_t		*run;
+	int			block_size;
+	int			max_indicies;
+	int			mb_count;
+	xfs_daddr_t		bblen;
+	off64_t			off = 0;
+	size_t			i;
+	int			j;
+
+	mb = malloc(XFS_MAX_SECTORSIZE);
+	if (mb == NULL) {
+		fprintf(stderr, _("%s: can't allocate metadump index block\n"),
+			progname);
+		exit(1);
+	}
+
+	if (pread64(md->fd, mb, sizeof(*mb), 0) != sizeof(*mb))
+		mdev_corrupt(path, 0);
+	if (mb->mb_blocklog < BBSHIFT ||
+	    mb->mb_blocklog > XFS_MAX_SECTORSIZE_LOG)
+		mdev_corrupt(path, 0);
+	block_size = 1 << mb->mb_blocklog;
+	max_indicies = (block_size - sizeof(xfs_metablock_t)) / sizeof(__be64);
+	bblen = BTOBB(block_size);
+	index = (__be64 *)((char *)mb + sizeof(xfs_metablock_t));
+
+	for (;;) {
+		if (pread64(md->fd, mb, block_size, off) != block_size)
+			break;		/* truncated dump, keep what we have */
+		if (be32_to_cpu(mb->mb_magic) != XFS_MD_MAGIC)
+			mdev_corrupt(path, off);
+		mb_count = be16_to_cpu(mb->mb_count);
+		if (mb_count > max_indicies)
+			mdev_corrupt(path, off);
+
+		if (nents + mb_count > maxents) {
+			maxents = maxents ? maxents * 2 : 4096;
+			ents = realloc(ents, maxents * sizeof(mdev_ent_t));
+			if (ents == NULL) {
+				fprintf(stderr, _("%s: can't allocate "
+					"metadump index\n"), progname);
+				exit(1);
+			}
+		}
+		for (j = 0; j < mb_count; j++) {
+			ents[nents].daddr = be64_to_cpu(index[j]);
+			ents[nents].off = off + (off64_t)(j + 1) * block_size;
+			nents++;
+		}
+
+		off += (off64_t)(mb_count + 1) * block_size;
+		if (mb_count < max_indicies)
+			break;
+	}
+	free(mb);
+
+	if (nents == 0 || ents[0].daddr != XFS_SB_DADDR)
+		mdev_corrupt(path, 0);
+
+	qsort(ents, nents, sizeof(mdev_ent_t), mdev_ent_cmp);
+
+	md->runs = malloc(nents * sizeof(mdev_run_t));
+	if (md->runs == NULL) {
+		fprintf(stderr, _("%s: can't allocate metadump index\n"),
+			progname);
+		exit(1);
+	}
+	run = NULL;
+	for (i = 0; i < nents; i++) {
+		/* later copies of a block sort after earlier ones */
+		if (i + 1 < nents && ents[i + 1].daddr == ents[i].daddr)
+			continue;
+		if (run && ents[i].daddr == run->daddr + run->len &&
+		    ents[i].off == run->off + BBTOB(run->len)) {
+			run->len += bblen;
+			continue;
+		}
+		run = &md->runs[md->nruns++];
+		run->daddr = ents[i].daddr;
+		run->len = bblen;
+		run->off = ents[i].off;
+	}
+	free(ents);
+	md->runs = realloc(md->runs, md->nruns * sizeof(mdev_run_t));
+}
+
+/*
+ * Returns NULL if path is not a metadump.
+ */
+struct libxfs_mdev *
+libxfs_mdev_open(
+	char			*path)
+{
+	struct libxfs_mdev	*md;
+	__be32			magic;
+	int			fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (pread64(fd, &magic, sizeof(magic), 0) != sizeof(magic) ||
+	    (be32_to_cpu(magic) != XFS_MD_MAGIC &&
+	     be32_to_cpu(magic) != XFS_MD_MAGIC_V2)) {
+		close(fd);
+		return NULL;
+	}
+	if (be32_to_cpu(magic) == XFS_MD_MAGIC_V2) {
+		fprintf(stderr, _("%s: %s is a compressed metadump, restore "
+			"it with xfs_mdrestore first\n"), progname, path);
+		exit(1);
+	}
+
+	md = calloc(1, sizeof(struct libxfs_mdev));
+	if (md == NULL) {
+		fprintf(stderr, _("%s: can't allocate metadump device\n"),
+			progname);
+		exit(1);
+	}
+	md->fd = fd;
+	mdev_build_index(md, path);
+	return md;
+}
+
+void
+libxfs_mdev_close(
+	struct libxfs_mdev	*md)
+{
+	close(md->fd);
+	free(md->runs);
+	free(md);
+}
+
+/*
+ * Read len sectors at blkno, zeroing whatever is not in the dump.
+ */
+int
+libxfs_mdev_read(
+	struct libxfs_mdev	*md,
+	void			*buf,
+	xfs_daddr_t		blkno,
+	int			len)
+{
+	mdev_run_t		*run;
+	xfs_daddr_t		start;
+	xfs_daddr_t		end;
+	size_t			lo = 0;
+	size_t			hi = md->nruns;
+	size_t			mid;
+
+	memset(buf, 0, BBTOB(len));
+
+	/* first run that ends after blkno */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		run = &md->runs[mid];
+		if (run->daddr + run->len <= blkno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < md->nruns; lo++) {
+		run = &md->runs[lo];
+		if (run->daddr >= blkno + len)
+			break;
+		start = MAX(run->daddr, blkno);
+		end = MIN(run->daddr + run->len, blkno + len);
+		if (pread64(md->fd, (char *)buf + BBTOB(start - blkno),
+			    BBTOB(end - start),
+			    run->off + BBTOB(start - run->daddr)) < 0)
+			return errno;
+	}
+	return 0;
+}
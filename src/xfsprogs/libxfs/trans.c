@@ -36,6 +36,7 @@ libxfs_trans_alloc(
 	}
 	ptr->t_mountp = mp;
 	ptr->t_type = type;
+	ptr->t_agno = NULLAGNUMBER;
 	ptr->t_items_free = XFS_LIC_NUM_SLOTS;
 	xfs_lic_init(&ptr->t_items);
 #ifdef XACT_DEBUG
@@ -51,6 +52,7 @@ libxfs_trans_dup(
 	xfs_trans_t	*ptr;
 
 	ptr = libxfs_trans_alloc(tp->t_mountp, tp->t_type);
+	ptr->t_agno = tp->t_agno;
 #ifdef XACT_DEBUG
 	fprintf(stderr, "duplicated transaction %p (new=%p)\n", tp, ptr);
 #endif
@@ -66,16 +68,22 @@ libxfs_trans_reserve(
 	uint		flags,
 	uint		logcount)
 {
-	xfs_sb_t	*mpsb = &tp->t_mountp->m_sb;
+	__uint64_t	fdblocks;
 
 	/*
 	 * Attempt to reserve the needed disk blocks by decrementing
 	 * the number needed from the number available.	 This will
-	 * fail if the count would go below zero.
+	 * fail if the count would go below zero.  The free count
+	 * includes per-AG deltas which have not been folded yet; a full
+	 * filesystem is a point to fold them, so the superblock on disk
+	 * is exact while nothing more can be allocated.
 	 */
 	if (blocks > 0) {
-		if (mpsb->sb_fdblocks < blocks)
+		libxfs_icsb_read(tp->t_mountp, &fdblocks, NULL, NULL);
+		if (fdblocks < blocks) {
+			libxfs_icsb_sync_counters(tp->t_mountp);
 			return ENOSPC;
+		}
 	}
 	/* user space, don't need log/RT stuff (preserve the API though) */
 	return 0;
@@ -565,6 +573,95 @@ libxfs_trans_mod_sb(
 	tp->t_flags |= (XFS_TRANS_SB_DIRTY | XFS_TRANS_DIRTY);
 }
 
+/*
+ * Attach an allocation group context to the transaction.  Superblock
+ * counter changes made by the transaction are then accumulated in that
+ * AG's per-AG counters at commit time rather than in the global in-core
+ * superblock, so writers working in different AGs don't contend on it.
+ */
+void
+libxfs_trans_agctx(
+	xfs_trans_t		*tp,
+	xfs_agnumber_t		agno)
+{
+	ASSERT(agno == NULLAGNUMBER || agno < tp->t_mountp->m_sb.sb_agcount);
+	tp->t_agno = agno;
+}
+
+/*
+ * Read the superblock free block and inode counters, including per-AG
+ * deltas which have not been folded in yet.  Like a percpu counter read
+ * this is not exact while transactions in other AGs are committing.
+ */
+void
+libxfs_icsb_read(
+	xfs_mount_t		*mp,
+	__uint64_t		*fdblocks,
+	__uint64_t		*icount,
+	__uint64_t		*ifree)
+{
+	__int64_t		bfree, icnt, ifr;
+	xfs_agnumber_t		agno;
+
+	bfree = mp->m_sb.sb_fdblocks;
+	icnt = mp->m_sb.sb_icount;
+	ifr = mp->m_sb.sb_ifree;
+	if (mp->m_perag) {
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			bfree += mp->m_perag[agno].pagsb_fdblocks;
+			icnt += mp->m_perag[agno].pagsb_icount;
+			ifr += mp->m_perag[agno].pagsb_ifree;
+		}
+	}
+	if (fdblocks)
+		*fdblocks = bfree < 0 ? 0 : bfree;
+	if (icount)
+		*icount = icnt < 0 ? 0 : icnt;
+	if (ifree)
+		*ifree = ifr < 0 ? 0 : ifr;
+}
+
+/*
+ * Fold the per-AG superblock counter deltas into the in-core superblock
+ * and write the counters back to disk.
+ */
+int
+libxfs_icsb_sync_counters(
+	xfs_mount_t		*mp)
+{
+	xfs_trans_t		*tp;
+	xfs_perag_t		*pag;
+	xfs_agnumber_t		agno;
+	int			dirty = 0;
+
+	if (mp->m_perag == NULL)
+		return 0;
+
+	pthread_mutex_lock(&mp->m_sb_mutex);
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		pag = &mp->m_perag[agno];
+		pthread_mutex_lock(&pag->pag_lock);
+		if (pag->pagsb_icount || pag->pagsb_ifree ||
+		    pag->pagsb_fdblocks) {
+			mp->m_sb.sb_icount += pag->pagsb_icount;
+			mp->m_sb.sb_ifree += pag->pagsb_ifree;
+			mp->m_sb.sb_fdblocks += pag->pagsb_fdblocks;
+			pag->pagsb_icount = 0;
+			pag->pagsb_ifree = 0;
+			pag->pagsb_fdblocks = 0;
+			dirty = 1;
+		}
+		pthread_mutex_unlock(&pag->pag_lock);
+	}
+	if (dirty) {
+		tp = libxfs_trans_alloc(mp, 0);
+		xfs_mod_sb(tp, XFS_SB_ICOUNT | XFS_SB_IFREE | XFS_SB_FDBLOCKS);
+		libxfs_trans_commit(tp, 0);
+	}
+	pthread_mutex_unlock(&mp->m_sb_mutex);
+	return 0;
+}
+
 
 /*
  * Transaction commital code follows (i.e. write to disk in libxfs)
@@ -820,7 +917,9 @@ libxfs_trans_commit(
 	xfs_trans_t	*tp,
 	uint		flags)
 {
+	xfs_mount_t	*mp;
 	xfs_sb_t	*sbp;
+	xfs_perag_t	*pag;
 
 	if (tp == NULL)
 		return 0;
@@ -836,16 +935,37 @@ libxfs_trans_commit(
 	}
 
 	if (tp->t_flags & XFS_TRANS_SB_DIRTY) {
-		sbp = &(tp->t_mountp->m_sb);
-		if (tp->t_icount_delta)
-			sbp->sb_icount += tp->t_icount_delta;
-		if (tp->t_ifree_delta)
-			sbp->sb_ifree += tp->t_ifree_delta;
-		if (tp->t_fdblocks_delta)
-			sbp->sb_fdblocks += tp->t_fdblocks_delta;
-		if (tp->t_frextents_delta)
-			sbp->sb_frextents += tp->t_frextents_delta;
-		xfs_mod_sb(tp, XFS_SB_ALL_BITS);
+		mp = tp->t_mountp;
+		sbp = &mp->m_sb;
+		if (tp->t_agno != NULLAGNUMBER && !tp->t_frextents_delta &&
+		    xfs_sb_version_haslazysbcount(sbp)) {
+			/*
+			 * Accumulate the deltas in the AG context and leave
+			 * them to libxfs_icsb_sync_counters().  Nothing is
+			 * logged, so the kernel only rebuilds lazy counters
+			 * from the AG headers after log recovery, so until
+			 * the fold the superblock on disk is stale.  Folds
+			 * happen at sync, statfs, unmount and ENOSPC.
+			 */
+			pag = &mp->m_perag[tp->t_agno];
+			pthread_mutex_lock(&pag->pag_lock);
+			pag->pagsb_icount += tp->t_icount_delta;
+			pag->pagsb_ifree += tp->t_ifree_delta;
+			pag->pagsb_fdblocks += tp->t_fdblocks_delta;
+			pthread_mutex_unlock(&pag->pag_lock);
+		} else {
+			pthread_mutex_lock(&mp->m_sb_mutex);
+			if (tp->t_icount_delta)
+				sbp->sb_icount += tp->t_icount_delta;
+			if (tp->t_ifree_delta)
+				sbp->sb_ifree += tp->t_ifree_delta;
+			if (tp->t_fdblocks_delta)
+				sbp->sb_fdblocks += tp->t_fdblocks_delta;
+			if (tp->t_frextents_delta)
+				sbp->sb_frextents += tp->t_frextents_delta;
+			xfs_mod_sb(tp, XFS_SB_ALL_BITS);
+			pthread_mutex_unlock(&mp->m_sb_mutex);
+		}
 	}
 
 #ifdef XACT_DEBUG
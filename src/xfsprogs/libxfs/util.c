@@ -195,13 +195,24 @@ libxfs_ialloc(
 	int		error;
 
 	/*
-	 * Call the space management code to pick
-	 * the on-disk inode to be allocated.
+	 * Try the free inode chunk cached in the parent's AG first, then
+	 * call the space management code to pick the on-disk inode to be
+	 * allocated.
 	 */
-	error = xfs_dialloc(tp, pip ? pip->i_ino : 0, mode, okalloc,
-			    ialloc_context, call_again, &ino);
-	if (error != 0)
-		return error;
+	ino = NULLFSINO;
+	if (*ialloc_context == NULL) {
+		error = xfs_dialloc_cached(tp, pip ? pip->i_ino : 0, mode,
+					   &ino);
+		if (error != 0)
+			return error;
+	}
+	if (ino == NULLFSINO) {
+		error = xfs_dialloc(tp, pip ? pip->i_ino : 0, mode, okalloc,
+				    ialloc_context, call_again, &ino);
+		if (error != 0)
+			return error;
+	} else
+		*call_again = B_FALSE;
 	if (*call_again || ino == NULLFSINO) {
 		*ipp = NULL;
 		return 0;
@@ -989,6 +989,14 @@ nextag:
 	xfs_ialloc_log_agi(tp, agbp, XFS_AGI_FREECOUNT);
 	down_read(&mp->m_peraglock);
 	mp->m_perag[tagno].pagi_freecount--;
+#ifndef __KERNEL__
+	/*
+	 * Remember the chunk so the next allocation in this AG can be
+	 * handed out by xfs_dialloc_cached() with a single lookup.
+	 */
+	mp->m_perag[tagno].pagi_ichunk = rec.ir_startino;
+	mp->m_perag[tagno].pagi_ifree = rec.ir_freecount ? rec.ir_free : 0;
+#endif
 	up_read(&mp->m_peraglock);
 #ifdef DEBUG
 	if (cur->bc_nlevels == 1) {
@@ -1020,6 +1028,90 @@ error0:
 	return error;
 }
 
+#ifndef __KERNEL__
+/*
+ * Allocate an inode from the chunk cached in the parent's AG by the last
+ * xfs_dialloc() call there, so that a run of creates in one directory
+ * fills up a chunk and ends up in the same inode clusters.  Directories
+ * are not allocated from the cache so that they keep being spread over
+ * the AGs.
+ *
+ * This is not O(1): the record has to be updated in this transaction, so
+ * it is still found with one exact-key inobt lookup, a root to leaf
+ * descent.  What is saved is xfs_dialloc()'s AG selection and its search
+ * left and right of the parent for a chunk with free inodes.  The cached
+ * free mask only says whether the chunk is worth trying; the inode is
+ * picked from the on-disk mask, and the entry is dropped if the record
+ * has no free inodes left.  Returns NULLFSINO in inop if the caller has
+ * to fall back to xfs_dialloc().
+ */
+int
+xfs_dialloc_cached(
+	xfs_trans_t	*tp,		/* transaction pointer */
+	xfs_ino_t	parent,		/* parent inode (directory) */
+	mode_t		mode,		/* mode bits for new inode */
+	xfs_ino_t	*inop)		/* inode number allocated */
+{
+	xfs_agi_t	*agi;		/* allocation group header structure */
+	xfs_buf_t	*agbp;		/* allocation group header's buffer */
+	xfs_agnumber_t	agno;		/* allocation group number */
+	xfs_btree_cur_t	*cur;		/* inode allocation btree cursor */
+	int		error;		/* error return value */
+	int		i;		/* result code */
+	int		offset;		/* index of inode in chunk */
+	xfs_mount_t	*mp;		/* file system mount structure */
+	xfs_perag_t	*pag;		/* per allocation group data */
+	xfs_inobt_rec_incore_t rec;	/* inode allocation record */
+
+	*inop = NULLFSINO;
+	mp = tp->t_mountp;
+	if (parent == 0 || (mode & S_IFMT) == S_IFDIR)
+		return 0;
+	agno = XFS_INO_TO_AGNO(mp, parent);
+	if (agno >= mp->m_sb.sb_agcount)
+		return 0;
+	pag = &mp->m_perag[agno];
+	if (pag->pagi_ifree == 0)
+		return 0;
+
+	error = xfs_ialloc_read_agi(mp, tp, agno, &agbp);
+	if (error)
+		return error;
+	agi = XFS_BUF_TO_AGI(agbp);
+	cur = xfs_inobt_init_cursor(mp, tp, agbp, agno);
+	if ((error = xfs_inobt_lookup_eq(cur, pag->pagi_ichunk, 0, 0, &i)))
+		goto error0;
+	if (i == 1 && (error = xfs_inobt_get_rec(cur, &rec.ir_startino,
+			&rec.ir_freecount, &rec.ir_free, &i)))
+		goto error0;
+	if (i != 1 || rec.ir_startino != pag->pagi_ichunk ||
+	    rec.ir_freecount <= 0) {
+		pag->pagi_ifree = 0;
+		xfs_btree_del_cursor(cur, XFS_BTREE_NOERROR);
+		xfs_trans_brelse(tp, agbp);
+		return 0;
+	}
+	offset = XFS_IALLOC_FIND_FREE(&rec.ir_free);
+	XFS_WANT_CORRUPTED_GOTO(offset >= 0 && offset < XFS_INODES_PER_CHUNK,
+				error0);
+	XFS_INOBT_CLR_FREE(&rec, offset);
+	rec.ir_freecount--;
+	if ((error = xfs_inobt_update(cur, rec.ir_startino, rec.ir_freecount,
+			rec.ir_free)))
+		goto error0;
+	be32_add_cpu(&agi->agi_freecount, -1);
+	xfs_ialloc_log_agi(tp, agbp, XFS_AGI_FREECOUNT);
+	pag->pagi_freecount--;
+	pag->pagi_ifree = rec.ir_freecount ? rec.ir_free : 0;
+	xfs_btree_del_cursor(cur, XFS_BTREE_NOERROR);
+	xfs_trans_mod_sb(tp, XFS_TRANS_SB_IFREE, -1);
+	*inop = XFS_AGINO_TO_INO(mp, agno, rec.ir_startino + offset);
+	return 0;
+error0:
+	xfs_btree_del_cursor(cur, XFS_BTREE_ERROR);
+	return error;
+}
+#endif
 
 /*
  * Return the location of the inode in bno/off, for mapping it into a buffer.
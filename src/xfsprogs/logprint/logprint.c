@@ -33,7 +33,6 @@ int	print_buffer;
 int	print_overwrite;
 int     print_no_data;
 int     print_no_print;
-int     print_exit = 1; /* -e is now default. specify -c to override */
 int	print_operation = OP_PRINT;
 
 void
@@ -136,6 +135,7 @@ main(int argc, char **argv)
 	textdomain(PACKAGE);
 
 	progname = basename(argv[0]);
+	print_exit = 1;	/* -e is now default. specify -c to override */
 	while ((c = getopt(argc, argv, "bC:cdefl:iqnors:tDVv")) != EOF) {
 		switch (c) {
 			case 'D':
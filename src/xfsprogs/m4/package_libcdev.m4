@@ -124,3 +124,39 @@ AC_DEFUN([AC_HAVE_FIEMAP],
   [ AC_CHECK_HEADERS([linux/fiemap.h], [ have_fiemap=yes ], [ have_fiemap=no ])
     AC_SUBST(have_fiemap)
   ])
+
+#
+# Check if we have the io_uring interface (Linux)
+#
+AC_DEFUN([AC_HAVE_IO_URING],
+  [ AC_CHECK_HEADERS([linux/io_uring.h], [ have_io_uring=yes ], [ have_io_uring=no ])
+    AC_SUBST(have_io_uring)
+  ])
+
+#
+# Check if we have the zstd compression library
+#
+AC_DEFUN([AC_HAVE_ZSTD],
+  [ have_zstd=no
+    libzstd=""
+    AC_CHECK_HEADER([zstd.h],
+      [ AC_CHECK_LIB([zstd], [ZSTD_compress],
+          [ have_zstd=yes
+            libzstd="-lzstd" ]) ])
+    AC_SUBST(have_zstd)
+    AC_SUBST(libzstd)
+  ])
+
+#
+# Check if we have the lz4 compression library
+#
+AC_DEFUN([AC_HAVE_LZ4],
+  [ have_lz4=no
+    liblz4=""
+    AC_CHECK_HEADER([lz4.h],
+      [ AC_CHECK_LIB([lz4], [LZ4_compress_default],
+          [ have_lz4=yes
+            liblz4="-llz4" ]) ])
+    AC_SUBST(have_lz4)
+    AC_SUBST(liblz4)
+  ])
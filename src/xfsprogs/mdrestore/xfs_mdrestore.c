@@ -17,9 +17,9 @@
  */
 
 #include <libxfs.h>
+#include <sys/mman.h>
 #include "xfs_metadump.h"
 
-char 		*progname;
 int		show_progress = 0;
 int		progress_since_warning = 0;
 
@@ -50,22 +50,317 @@ print_progress(const char *fmt, ...)
 	progress_since_warning = 1;
 }
 
+/*
+ * The dump being restored.  Version 1 dumps are a plain stream of
+ * metablocks; version 2 dumps carry the same stream split into frames,
+ * each compressed on its own.
+ */
+typedef struct md_source {
+	FILE		*f;
+	int		version;
+	int		method;
+	char		*frame;		/* current frame, decompressed */
+	size_t		frame_len;
+	size_t		frame_off;
+	size_t		frame_size;	/* allocated */
+	char		*cbuf;
+	size_t		cbuf_size;	/* allocated */
+} md_source_t;
+
+static void
+md_fread(
+	md_source_t	*src,
+	void		*buf,
+	size_t		len)
+{
+	if (fread(buf, len, 1, src->f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+}
+
+/*
+ * Read the next version 2 frame.  Returns 0 at the end frame.
+ */
+static int
+md_next_frame(
+	md_source_t	*src)
+{
+	xfs_metaframe_t	frame;
+	size_t		len;
+	size_t		clen;
+
+	md_fread(src, &frame, sizeof(frame));
+	len = be32_to_cpu(frame.mf_len);
+	clen = be32_to_cpu(frame.mf_clen);
+	if (len == 0)
+		return 0;
+	if (len > XFS_MD_MAX_FRAME || clen == 0 ||
+	    clen > metadump_compress_bound(src->method, XFS_MD_MAX_FRAME))
+		fatal("bad frame size in metadump (len %zu, clen %zu)\n",
+			len, clen);
+
+	if (len > src->frame_size) {
+		free(src->frame);
+		src->frame = malloc(len);
+		if (src->frame == NULL)
+			fatal("memory allocation failure\n");
+		src->frame_size = len;
+	}
+	if (clen > src->cbuf_size) {
+		free(src->cbuf);
+		src->cbuf = malloc(clen);
+		if (src->cbuf == NULL)
+			fatal("memory allocation failure\n");
+		src->cbuf_size = clen;
+	}
+	md_fread(src, src->cbuf, clen);
+	if (metadump_decompress(src->method, src->frame, len,
+				src->cbuf, clen))
+		fatal("corrupt %s frame in metadump\n",
+			metadump_compress_name(src->method));
+
+	src->frame_len = len;
+	src->frame_off = 0;
+	return 1;
+}
+
+/*
+ * Read len bytes of the metablock stream.  Returns 0 if a version 2 dump
+ * ended cleanly before any of them; a version 1 dump has no such marker
+ * and running out of it is an error.
+ */
+static int
+md_read(
+	md_source_t	*src,
+	void		*buf,
+	size_t		len)
+{
+	char		*p = buf;
+	size_t		n;
+
+	if (src->version == 1) {
+		md_fread(src, buf, len);
+		return 1;
+	}
+
+	while (len) {
+		if (src->frame_off == src->frame_len && !md_next_frame(src)) {
+			if (p == buf)
+				return 0;
+			fatal("metadump ends inside a metablock\n");
+		}
+		n = MIN(len, src->frame_len - src->frame_off);
+		memcpy(p, src->frame + src->frame_off, n);
+		src->frame_off += n;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/*
+ * Restores are split between a reader thread, which pulls metablocks out
+ * of the dump (decompressing version 2 frames) into batches, and the
+ * calling thread, which writes them out.  Sectors at consecutive disk
+ * addresses are gathered into one run and written with a single call, or
+ * copied straight into the target when it is mapped with -m.  Nothing is
+ * written for sectors missing from the dump, so a file target stays
+ * sparse.
+ */
+#define	MD_BATCH_MBS	64		/* metablocks per batch */
+#define	MD_NBATCHES	4		/* batches in flight */
+#define	MD_RUN_SIZE	(1024 * 1024)	/* largest coalesced write */
+
+typedef struct md_batch {
+	struct md_batch	*next;
+	int		nmb;
+	int		last;		/* no more batches follow */
+	char		*buf;		/* nmb metablocks, mb_size apart */
+} md_batch_t;
+
+typedef struct md_queue {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	md_batch_t	*head;
+	md_batch_t	**tail;
+} md_queue_t;
+
+static md_source_t	src;
+static int		block_size;
+static int		block_log;
+static int		max_indicies;
+static size_t		mb_size;	/* index block plus its sectors */
+
+static md_queue_t	free_batches;
+static md_queue_t	full_batches;
+
+static int		dst_fd;
+static char		*dst_map;	/* target mapping, or NULL */
+static off64_t		dst_size;
+static char		*run_buf;
+static off64_t		run_off;
+static size_t		run_len;
+static __int64_t	bytes_written;
+
+static void
+queue_init(
+	md_queue_t	*q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->head = NULL;
+	q->tail = &q->head;
+}
+
+static void
+queue_put(
+	md_queue_t	*q,
+	md_batch_t	*b)
+{
+	pthread_mutex_lock(&q->lock);
+	b->next = NULL;
+	*q->tail = b;
+	q->tail = &b->next;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static md_batch_t *
+queue_get(
+	md_queue_t	*q)
+{
+	md_batch_t	*b;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->head == NULL)
+		pthread_cond_wait(&q->cond, &q->lock);
+	b = q->head;
+	q->head = b->next;
+	if (q->head == NULL)
+		q->tail = &q->head;
+	pthread_mutex_unlock(&q->lock);
+	return b;
+}
+
+/*
+ * Read one metablock into mb.  Returns 0 at the end of the dump.
+ */
+static int
+read_metablock(
+	xfs_metablock_t	*mb)
+{
+	int		mb_count;
+
+	if (!md_read(&src, mb, block_size))
+		return 0;
+
+	mb_count = be16_to_cpu(mb->mb_count);
+	if (mb_count == 0 && src.version == 1)
+		return 0;
+	if (mb_count == 0 || mb_count > max_indicies)
+		fatal("bad block count: %u\n", mb_count);
+
+	md_read(&src, (char *)mb + block_size, mb_count << block_log);
+	return 1;
+}
+
+static void *
+restore_reader(
+	void		*arg)
+{
+	md_batch_t	*b;
+	xfs_metablock_t	*mb;
+	int		done = 0;
+
+	while (!done) {
+		b = queue_get(&free_batches);
+		for (b->nmb = 0; b->nmb < MD_BATCH_MBS; b->nmb++) {
+			mb = (xfs_metablock_t *)(b->buf + b->nmb * mb_size);
+			if (!read_metablock(mb)) {
+				done = 1;
+				break;
+			}
+			/* a version 1 dump ends with its first short index */
+			if (src.version == 1 &&
+			    be16_to_cpu(mb->mb_count) < max_indicies) {
+				b->nmb++;
+				done = 1;
+				break;
+			}
+		}
+		b->last = done;
+		queue_put(&full_batches, b);
+	}
+	return NULL;
+}
+
+static void
+flush_run(void)
+{
+	if (run_len == 0)
+		return;
+
+	if (dst_map) {
+		if (run_off + run_len > dst_size)
+			fatal("block %llu is beyond the end of the filesystem\n",
+				(unsigned long long)run_off);
+		memcpy(dst_map + run_off, run_buf, run_len);
+	} else if (pwrite64(dst_fd, run_buf, run_len, run_off) < 0)
+		fatal("error writing block %llu: %s\n",
+			(unsigned long long)run_off, strerror(errno));
+
+	bytes_written += run_len;
+	run_len = 0;
+}
+
+static void
+restore_metablock(
+	xfs_metablock_t	*mb)
+{
+	__be64		*index;
+	char		*data;
+	off64_t		off;
+	int		mb_count;
+	int		i;
+
+	index = (__be64 *)((char *)mb + sizeof(xfs_metablock_t));
+	data = (char *)mb + block_size;
+	mb_count = be16_to_cpu(mb->mb_count);
+
+	for (i = 0; i < mb_count; i++, data += block_size) {
+		off = be64_to_cpu(index[i]) << BBSHIFT;
+		if (run_len == 0 || off != run_off + run_len ||
+		    run_len + block_size > MD_RUN_SIZE) {
+			flush_run();
+			run_off = off;
+		}
+		memcpy(run_buf + run_len, data, block_size);
+		run_len += block_size;
+	}
+}
+
 static void
 perform_restore(
 	FILE			*src_f,
-	int			dst_fd,
-	int			is_target_file)
+	int			is_target_file,
+	int			map_target)
 {
+	xfs_metadump_hdr_t	hdr;
 	xfs_metablock_t 	*metablock;	/* header + index + blocks */
 	__be64			*block_index;
 	char			*block_buffer;
-	int			block_size;
-	int			max_indicies;
-	int			cur_index;
 	int			mb_count;
 	xfs_metablock_t		tmb;
 	xfs_sb_t		sb;
-	__int64_t		bytes_read;
+	md_batch_t		*batches;
+	md_batch_t		*b;
+	pthread_t		reader;
+	struct timeval		start;
+	struct timeval		end;
+	double			secs;
+	__int64_t		last_mb = -1;
+	int			i;
+
+	gettimeofday(&start, NULL);
 
 	/*
 	 * read in first blocks (superblock 0), set "inprogress" flag for it,
@@ -73,17 +368,42 @@ perform_restore(
 	 * "inprogress flag"
 	 */
 
+	memset(&src, 0, sizeof(src));
+	src.f = src_f;
+	src.version = 1;
+
 	if (fread(&tmb, sizeof(tmb), 1, src_f) != 1)
 		fatal("error reading from file: %s\n", strerror(errno));
 
+	if (be32_to_cpu(tmb.mb_magic) == XFS_MD_MAGIC_V2) {
+		memcpy(&hdr, &tmb, sizeof(hdr));
+		if (hdr.mh_version != XFS_MD_VERSION_2)
+			fatal("unsupported metadump version %u\n",
+				hdr.mh_version);
+		if (!metadump_compress_supported(hdr.mh_compress))
+			fatal("metadump is compressed with %s, which is not "
+				"supported by this build\n",
+				metadump_compress_name(hdr.mh_compress));
+		src.version = hdr.mh_version;
+		src.method = hdr.mh_compress;
+		if (!md_read(&src, &tmb, sizeof(tmb)))
+			fatal("metadump is empty\n");
+	}
+
 	if (be32_to_cpu(tmb.mb_magic) != XFS_MD_MAGIC)
 		fatal("specified file is not a metadata dump\n");
 
-	block_size = 1 << tmb.mb_blocklog;
+	if (tmb.mb_blocklog < BBSHIFT ||
+	    tmb.mb_blocklog > XFS_MAX_BLOCKSIZE_LOG)
+		fatal("bad block size log in metadump: %u\n", tmb.mb_blocklog);
+	block_log = tmb.mb_blocklog;
+	block_size = 1 << block_log;
 	max_indicies = (block_size - sizeof(xfs_metablock_t)) / sizeof(__be64);
+	mb_size = (size_t)(max_indicies + 1) * block_size;
 
 	metablock = (xfs_metablock_t *)calloc(max_indicies + 1, block_size);
-	if (metablock == NULL)
+	run_buf = malloc(MD_RUN_SIZE);
+	if (metablock == NULL || run_buf == NULL)
 		fatal("memory allocation failure\n");
 
 	mb_count = be16_to_cpu(tmb.mb_count);
@@ -93,16 +413,14 @@ perform_restore(
 	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
 	block_buffer = (char *)metablock + block_size;
 
-	if (fread(block_index, block_size - sizeof(tmb), 1, src_f) != 1)
-		fatal("error reading from file: %s\n", strerror(errno));
+	memcpy(metablock, &tmb, sizeof(tmb));
+	md_read(&src, block_index, block_size - sizeof(tmb));
 
 	if (block_index[0] != 0)
 		fatal("first block is not the primary superblock\n");
 
 
-	if (fread(block_buffer, mb_count << tmb.mb_blocklog,
-			1, src_f) != 1)
-		fatal("error reading from file: %s\n", strerror(errno));
+	md_read(&src, block_buffer, mb_count << block_log);
 
 	libxfs_sb_from_disk(&sb, (xfs_dsb_t *)block_buffer);
 
@@ -111,56 +429,76 @@ perform_restore(
 
 	((xfs_dsb_t*)block_buffer)->sb_inprogress = 1;
 
+	dst_size = sb.sb_dblocks * sb.sb_blocksize;
 	if (is_target_file)  {
 		/* ensure regular files are correctly sized */
 
-		if (ftruncate64(dst_fd, sb.sb_dblocks * sb.sb_blocksize))
+		if (ftruncate64(dst_fd, dst_size))
 			fatal("cannot set filesystem image size: %s\n",
 				strerror(errno));
+
+		if (map_target) {
+			dst_map = mmap(NULL, dst_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, dst_fd, 0);
+			if (dst_map == MAP_FAILED)
+				fatal("cannot map filesystem image: %s\n",
+					strerror(errno));
+		}
 	} else  {
 		/* ensure device is sufficiently large enough */
 
 		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
 		off64_t		off;
 
-		off = sb.sb_dblocks * sb.sb_blocksize - sizeof(lb);
+		off = dst_size - sizeof(lb);
 		if (pwrite64(dst_fd, lb, sizeof(lb), off) < 0)
 			fatal("failed to write last block, is target too "
 				"small? (error: %s)\n", strerror(errno));
 	}
 
-	bytes_read = 0;
-
-	for (;;) {
-		if (show_progress && (bytes_read & ((1 << 20) - 1)) == 0)
-			print_progress("%lld MB read\n", bytes_read >> 20);
-
-		for (cur_index = 0; cur_index < mb_count; cur_index++) {
-			if (pwrite64(dst_fd, &block_buffer[cur_index <<
-					tmb.mb_blocklog], block_size,
-					be64_to_cpu(block_index[cur_index]) <<
-						BBSHIFT) < 0)
-				fatal("error writing block %llu: %s\n",
-					be64_to_cpu(block_index[cur_index]) << BBSHIFT,
-					strerror(errno));
+	restore_metablock(metablock);
+
+	if (src.version != 1 || mb_count == max_indicies) {
+		queue_init(&free_batches);
+		queue_init(&full_batches);
+		batches = calloc(MD_NBATCHES, sizeof(md_batch_t));
+		if (batches == NULL)
+			fatal("memory allocation failure\n");
+		for (i = 0; i < MD_NBATCHES; i++) {
+			batches[i].buf = malloc(MD_BATCH_MBS * mb_size);
+			if (batches[i].buf == NULL)
+				fatal("memory allocation failure\n");
+			queue_put(&free_batches, &batches[i]);
 		}
-		if (mb_count < max_indicies)
-			break;
-
-		if (fread(metablock, block_size, 1, src_f) != 1)
-			fatal("error reading from file: %s\n", strerror(errno));
-
-		mb_count = be16_to_cpu(metablock->mb_count);
-		if (mb_count == 0)
-			break;
-		if (mb_count > max_indicies)
-			fatal("bad block count: %u\n", mb_count);
 
-		if (fread(block_buffer, mb_count << tmb.mb_blocklog, 
-								1, src_f) != 1)
-			fatal("error reading from file: %s\n", strerror(errno));
+		if (pthread_create(&reader, NULL, restore_reader, NULL))
+			fatal("cannot create reader thread\n");
+
+		do {
+			b = queue_get(&full_batches);
+			for (i = 0; i < b->nmb; i++)
+				restore_metablock((xfs_metablock_t *)
+						(b->buf + i * mb_size));
+			if (show_progress && (bytes_written >> 20) != last_mb) {
+				last_mb = bytes_written >> 20;
+				print_progress("%lld MB written", last_mb);
+			}
+			if (!b->last)
+				queue_put(&free_batches, b);
+		} while (!b->last);
+
+		pthread_join(reader, NULL);
+		for (i = 0; i < MD_NBATCHES; i++)
+			free(batches[i].buf);
+		free(batches);
+	}
+	flush_run();
 
-		bytes_read += block_size;
+	if (dst_map) {
+		if (munmap(dst_map, dst_size) < 0)
+			fatal("error unmapping filesystem image: %s\n",
+				strerror(errno));
+		dst_map = NULL;
 	}
 
 	if (progress_since_warning)
@@ -172,13 +510,25 @@ perform_restore(
 	if (pwrite(dst_fd, block_buffer, sb.sb_sectsize, 0) < 0)
 		fatal("error writing primary superblock: %s\n", strerror(errno));
 
+	if (show_progress) {
+		gettimeofday(&end, NULL);
+		secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_usec - start.tv_usec) / 1000000.0;
+		printf("restored %lld MB in %.2f seconds (%.1f MB/s)\n",
+			(long long)(bytes_written >> 20), secs,
+			secs > 0 ? (bytes_written / 1048576.0) / secs : 0.0);
+	}
+
+	free(run_buf);
 	free(metablock);
+	free(src.frame);
+	free(src.cbuf);
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-bg] source target\n", progname);
+	fprintf(stderr, "Usage: %s [-bgm] source target\n", progname);
 	exit(1);
 }
 
@@ -190,19 +540,22 @@ main(
 	char 		**argv)
 {
 	FILE		*src_f;
-	int		dst_fd;
 	int		c;
 	int		open_flags;
 	struct stat64	statbuf;
 	int		is_target_file;
+	int		map_target = 0;
 
 	progname = basename(argv[0]);
 
-	while ((c = getopt(argc, argv, "gV")) != EOF) {
+	while ((c = getopt(argc, argv, "gmV")) != EOF) {
 		switch (c) {
 			case 'g':
 				show_progress = 1;
 				break;
+			case 'm':
+				map_target = 1;
+				break;
 			case 'V':
 				printf("%s version %s\n", progname, VERSION);
 				exit(0);
@@ -250,7 +603,13 @@ main(
 	if (dst_fd < 0)
 		fatal("couldn't open target \"%s\"\n", argv[optind]);
 
-	perform_restore(src_f, dst_fd, is_target_file);
+	if (map_target && !is_target_file) {
+		fprintf(stderr, "%s: -m only applies to file targets, "
+			"writing to the device\n", progname);
+		map_target = 0;
+	}
+
+	perform_restore(src_f, is_target_file, map_target);
 
 	close(dst_fd);
 	if (src_f != stdin)
@@ -18,8 +18,16 @@
 
 #include <xfs/libxfs.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
+#include <dirent.h>
+#include <pthread.h>
 #include "xfs_mkfs.h"
 
+#ifdef __APPLE__
+#define	llistxattr(p, l, s)	listxattr(p, l, s, XATTR_NOFOLLOW)
+#define	lgetxattr(p, n, v, s)	getxattr(p, n, v, s, 0, XATTR_NOFOLLOW)
+#endif
+
 /*
  * Prototypes for internal functions.
  */
@@ -30,7 +38,10 @@ static void getres(xfs_trans_t *tp, uint blocks);
 static void rsvfile(xfs_mount_t *mp, xfs_inode_t *ip, long long len);
 static int newfile(xfs_trans_t *tp, xfs_inode_t *ip, xfs_bmap_free_t *flist,
 	xfs_fsblock_t *first, int dolocal, int logit, char *buf, int len);
-static char *newregfile(char **pp, int *len);
+static struct copy_src *newregfile(char **pp, off64_t *size);
+static void writefile(xfs_mount_t *mp, xfs_inode_t *ip, struct copy_src *src,
+	off64_t size, struct stat64 *st);
+static void populate(xfs_mount_t *mp, struct fsxattr *fsxp, char *dir);
 static void rtinit(xfs_mount_t *mp);
 static long filesize(int fd);
 
@@ -44,6 +55,10 @@ static long filesize(int fd);
 	((uint)(MKFS_BLOCKRES_INODE + XFS_DA_NODE_MAXDEPTH + \
 	(XFS_BM_MAXLEVELS(mp, XFS_DATA_FORK) - 1) + (rb)))
 
+/*
+ * Directory to populate the filesystem from, when -p names one.
+ */
+static char	*protodir;
 
 char *
 setup_proto(
@@ -53,9 +68,14 @@ setup_proto(
 	static char	dflt[] = "d--755 0 0 $";
 	int		fd;
 	long		size;
+	struct stat64	st;
 
 	if (!fname)
 		return dflt;
+	if (stat64(fname, &st) == 0 && S_ISDIR(st.st_mode)) {
+		protodir = fname;
+		return dflt;
+	}
 	if ((fd = open(fname, O_RDONLY)) < 0 || (size = filesize(fd)) < 0) {
 		fprintf(stderr, _("%s: failed to open %s: %s\n"),
 			progname, fname, strerror(errno));
@@ -269,33 +289,355 @@ newfile(
 	return flags;
 }
 
-static char *
-newregfile(
-	char		**pp,
-	int		*len)
+/*
+ * Copy the access and modification times of a source file.
+ */
+static void
+settimes(
+	xfs_inode_t	*ip,
+	struct stat64	*st)
 {
-	char		*buf;
+#ifdef __APPLE__
+	ip->i_d.di_atime.t_sec = (__int32_t)st->st_atimespec.tv_sec;
+	ip->i_d.di_atime.t_nsec = (__int32_t)st->st_atimespec.tv_nsec;
+	ip->i_d.di_mtime.t_sec = (__int32_t)st->st_mtimespec.tv_sec;
+	ip->i_d.di_mtime.t_nsec = (__int32_t)st->st_mtimespec.tv_nsec;
+#else
+	ip->i_d.di_atime.t_sec = (__int32_t)st->st_atim.tv_sec;
+	ip->i_d.di_atime.t_nsec = (__int32_t)st->st_atim.tv_nsec;
+	ip->i_d.di_mtime.t_sec = (__int32_t)st->st_mtim.tv_sec;
+	ip->i_d.di_mtime.t_nsec = (__int32_t)st->st_mtim.tv_nsec;
+#endif
+}
+
+/*
+ * File data is copied in by a pool of threads.  The main thread allocates
+ * the space for a file, as many extents as it takes, and queues the copies;
+ * the threads read the source file and write the device directly in large
+ * I/Os while the main thread goes on to the next file.  Writing around the
+ * buffer cache is safe as the new data blocks are never in it: blocks freed
+ * while populating have their buffers invalidated.
+ */
+#define	COPY_CHUNK	(4 * 1024 * 1024)	/* largest single copy */
+#define	COPY_QUEUE	64			/* copies queued at once */
+#define	COPY_MAXTHREADS	16
+
+typedef struct copy_src {
 	int		fd;
-	char		*fname;
-	long		size;
+	char		*name;
+	int		refs;			/* queued copies + opener */
+} copy_src_t;
 
-	fname = getstr(pp);
-	if ((fd = open(fname, O_RDONLY)) < 0 || (size = filesize(fd)) < 0) {
+typedef struct copy_job {
+	copy_src_t	*src;
+	off64_t		off;			/* in the source file */
+	off64_t		dst;			/* on the device, in bytes */
+	size_t		len;			/* whole blocks */
+} copy_job_t;
+
+static struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	more;			/* a copy was queued */
+	pthread_cond_t	room;			/* a copy was taken */
+	copy_job_t	jobs[COPY_QUEUE];
+	int		head;
+	int		count;
+	int		done;
+	int		fd;
+	size_t		align;
+	int		nthreads;
+	pthread_t	threads[COPY_MAXTHREADS];
+} copyq;
+
+static void
+copy_src_put(
+	copy_src_t	*src)
+{
+	int		refs;
+
+	pthread_mutex_lock(&copyq.lock);
+	refs = --src->refs;
+	pthread_mutex_unlock(&copyq.lock);
+	if (refs)
+		return;
+	close(src->fd);
+	free(src->name);
+	free(src);
+}
+
+static void *
+copy_worker(
+	void		*arg)
+{
+	copy_job_t	job;
+	char		*buf;
+	size_t		done;
+	ssize_t		n;
+
+	buf = memalign(copyq.align, COPY_CHUNK);
+	if (!buf) {
+		fprintf(stderr, _("%s: can't allocate copy buffer\n"),
+			progname);
+		exit(1);
+	}
+	for (;;) {
+		pthread_mutex_lock(&copyq.lock);
+		while (!copyq.count && !copyq.done)
+			pthread_cond_wait(&copyq.more, &copyq.lock);
+		if (!copyq.count) {
+			pthread_mutex_unlock(&copyq.lock);
+			break;
+		}
+		job = copyq.jobs[copyq.head];
+		copyq.head = (copyq.head + 1) % COPY_QUEUE;
+		copyq.count--;
+		pthread_cond_signal(&copyq.room);
+		pthread_mutex_unlock(&copyq.lock);
+
+		for (done = 0; done < job.len; done += n) {
+			n = pread64(job.src->fd, buf + done, job.len - done,
+					job.off + done);
+			if (n < 0) {
+				fprintf(stderr, _("%s: read failed on %s: %s\n"),
+					progname, job.src->name,
+					strerror(errno));
+				exit(1);
+			}
+			if (n == 0)
+				break;
+		}
+		/* the tail of the last block, or a file that shrank */
+		memset(buf + done, 0, job.len - done);
+
+		if (pwrite64(copyq.fd, buf, job.len, job.dst) != job.len) {
+			fprintf(stderr, _("%s: write failed copying %s: %s\n"),
+				progname, job.src->name, strerror(errno));
+			exit(1);
+		}
+		copy_src_put(job.src);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void
+copy_queue(
+	copy_src_t	*src,
+	off64_t		off,
+	off64_t		dst,
+	size_t		len)
+{
+	copy_job_t	*job;
+
+	pthread_mutex_lock(&copyq.lock);
+	while (copyq.count == COPY_QUEUE)
+		pthread_cond_wait(&copyq.room, &copyq.lock);
+	job = &copyq.jobs[(copyq.head + copyq.count) % COPY_QUEUE];
+	job->src = src;
+	job->off = off;
+	job->dst = dst;
+	job->len = len;
+	copyq.count++;
+	src->refs++;
+	pthread_cond_signal(&copyq.more);
+	pthread_mutex_unlock(&copyq.lock);
+}
+
+static void
+copy_start(
+	xfs_mount_t	*mp)
+{
+	long		ncpus;
+	int		i;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	copyq.nthreads = MAX(1, MIN(ncpus, COPY_MAXTHREADS));
+	copyq.fd = libxfs_device_to_fd(mp->m_dev);
+	/* the device may be open O_DIRECT */
+	copyq.align = MAX(mp->m_sb.sb_sectsize, getpagesize());
+	pthread_mutex_init(&copyq.lock, NULL);
+	pthread_cond_init(&copyq.more, NULL);
+	pthread_cond_init(&copyq.room, NULL);
+	for (i = 0; i < copyq.nthreads; i++) {
+		if (pthread_create(&copyq.threads[i], NULL, copy_worker,
+				NULL)) {
+			fprintf(stderr, _("%s: can't start copy threads\n"),
+				progname);
+			exit(1);
+		}
+	}
+}
+
+/*
+ * Wait for the queued copies to finish.
+ */
+static void
+copy_finish(void)
+{
+	int		i;
+
+	pthread_mutex_lock(&copyq.lock);
+	copyq.done = 1;
+	pthread_cond_broadcast(&copyq.more);
+	pthread_mutex_unlock(&copyq.lock);
+	for (i = 0; i < copyq.nthreads; i++)
+		pthread_join(copyq.threads[i], NULL);
+}
+
+static copy_src_t *
+copy_src_open(
+	char		*fname,
+	struct stat64	*st)
+{
+	copy_src_t	*src;
+
+	src = malloc(sizeof(copy_src_t));
+	if (!src) {
+		fprintf(stderr, _("%s: can't allocate copy source\n"),
+			progname);
+		exit(1);
+	}
+	if ((src->fd = open(fname, O_RDONLY)) < 0 ||
+	    fstat64(src->fd, st) < 0) {
 		fprintf(stderr, _("%s: cannot open %s: %s\n"),
 			progname, fname, strerror(errno));
 		exit(1);
 	}
-	if ((*len = (int)size)) {
-		buf = malloc(size);
-		if (read(fd, buf, size) < size) {
-			fprintf(stderr, _("%s: read failed on %s: %s\n"),
-				progname, fname, strerror(errno));
+	src->name = strdup(fname);
+	src->refs = 1;
+	return src;
+}
+
+/*
+ * Allocate len blocks of a file from bno and queue the copies into them.
+ */
+static void
+allocfile(
+	xfs_mount_t	*mp,
+	xfs_inode_t	*ip,
+	copy_src_t	*src,
+	xfs_fileoff_t	bno,
+	xfs_filblks_t	len)
+{
+	int		committed;
+	xfs_extlen_t	count;
+	int		error;
+	xfs_fsblock_t	first;
+	xfs_bmap_free_t	flist;
+	int		i;
+	xfs_bmbt_irec_t	map[XFS_BMAP_MAX_NMAP];
+	xfs_filblks_t	n;
+	int		nmap;
+	xfs_filblks_t	off;
+	xfs_trans_t	*tp;
+
+	while (len > 0) {
+		count = MIN(len, MAXEXTLEN);
+		tp = libxfs_trans_alloc(mp, 0);
+		getres(tp, count);
+		libxfs_trans_ijoin(tp, ip, 0);
+		libxfs_trans_ihold(tp, ip);
+		XFS_BMAP_INIT(&flist, &first);
+		nmap = XFS_BMAP_MAX_NMAP;
+		error = libxfs_bmapi(tp, ip, bno, count, XFS_BMAPI_WRITE,
+				&first, count, map, &nmap, &flist, NULL);
+		if (error)
+			fail(_("error allocating space for a file"), error);
+		if (nmap == 0) {
+			fprintf(stderr,
+				_("%s: cannot allocate space for file\n"),
+				progname);
 			exit(1);
 		}
-	} else
-		buf = 0;
-	close(fd);
-	return buf;
+		error = libxfs_bmap_finish(&tp, &flist, &committed);
+		if (error)
+			fail(_("error allocating space for a file"), error);
+		libxfs_trans_commit(tp, 0);
+
+		for (i = 0; i < nmap; i++) {
+			for (off = 0; off < map[i].br_blockcount; off += n) {
+				n = MIN(map[i].br_blockcount - off,
+					COPY_CHUNK >> mp->m_sb.sb_blocklog);
+				copy_queue(src,
+					XFS_FSB_TO_B(mp, map[i].br_startoff + off),
+					BBTOB(XFS_FSB_TO_DADDR(mp,
+						map[i].br_startblock + off)),
+					XFS_FSB_TO_B(mp, n));
+			}
+			bno += map[i].br_blockcount;
+			len -= map[i].br_blockcount;
+		}
+	}
+}
+
+/*
+ * Give a regular file its data.  Only the parts of the source that hold
+ * data get space, so holes stay holes.  Then set the size, and the times
+ * from the source when we have them.
+ */
+static void
+writefile(
+	xfs_mount_t	*mp,
+	xfs_inode_t	*ip,
+	copy_src_t	*src,
+	off64_t		size,
+	struct stat64	*st)
+{
+	off64_t		data;
+	off64_t		hole;
+	xfs_fileoff_t	bno;
+	xfs_fileoff_t	end;
+	xfs_fileoff_t	next = 0;
+	xfs_trans_t	*tp;
+
+	for (data = 0; data < size; data = hole) {
+		hole = size;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		{
+			off64_t	off;
+
+			off = lseek64(src->fd, data, SEEK_DATA);
+			if (off < 0 && errno == ENXIO)
+				break;		/* only a hole left */
+			if (off >= 0) {		/* else copy it all */
+				data = off;
+				hole = lseek64(src->fd, data, SEEK_HOLE);
+				if (hole <= data || hole > size)
+					hole = size;
+			}
+		}
+#endif
+		if (data >= size)
+			break;
+		/* blocks shared with the last range are already there */
+		bno = MAX(XFS_B_TO_FSBT(mp, data), next);
+		end = XFS_B_TO_FSB(mp, hole);
+		if (end > bno)
+			allocfile(mp, ip, src, bno, end - bno);
+		next = end;
+	}
+
+	tp = libxfs_trans_alloc(mp, 0);
+	libxfs_trans_ijoin(tp, ip, 0);
+	libxfs_trans_ihold(tp, ip);
+	ip->i_d.di_size = size;
+	if (st)
+		settimes(ip, st);
+	libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+	libxfs_trans_commit(tp, 0);
+}
+
+static copy_src_t *
+newregfile(
+	char		**pp,
+	off64_t		*size)
+{
+	copy_src_t	*src;
+	struct stat64	st;
+
+	src = copy_src_open(getstr(pp), &st);
+	*size = st.st_size;
+	return src;
 }
 
 static void
@@ -367,6 +709,8 @@ parseproto(
 	cred_t		creds;
 	char		*value;
 	struct xfs_name	xname;
+	copy_src_t	*src;
+	off64_t		size;
 
 	memset(&creds, 0, sizeof(creds));
 	mstr = getstr(pp);
@@ -439,19 +783,26 @@ parseproto(
 	XFS_BMAP_INIT(&flist, &first);
 	switch (fmt) {
 	case IF_REGULAR:
-		buf = newregfile(pp, &len);
-		getres(tp, XFS_B_TO_FSB(mp, len));
+		src = newregfile(pp, &size);
+		getres(tp, 0);
 		error = libxfs_inode_alloc(&tp, pip, mode|S_IFREG, 1, 0,
 					   &creds, fsxp, &ip);
 		if (error)
 			fail(_("Inode allocation failed"), error);
-		flags |= newfile(tp, ip, &flist, &first, 0, 0, buf, len);
-		if (buf)
-			free(buf);
 		libxfs_trans_ijoin(tp, pip, 0);
 		newdirent(mp, tp, pip, &xname, ip->i_ino, &first, &flist, 1);
 		libxfs_trans_ihold(tp, pip);
-		break;
+		libxfs_trans_ihold(tp, ip);
+		libxfs_trans_log_inode(tp, ip, flags);
+		error = libxfs_bmap_finish(&tp, &flist, &committed);
+		if (error)
+			fail(_("Error encountered creating file from prototype file"),
+				error);
+		libxfs_trans_commit(tp, 0);
+		writefile(mp, ip, src, size, NULL);
+		copy_src_put(src);
+		libxfs_iput(ip, 0);
+		return;
 
 	case IF_RESERVED:			/* pre-allocated space only */
 		value = getstr(pp);
@@ -589,7 +940,373 @@ parse_proto(
 	struct fsxattr	*fsx,
 	char		**pp)
 {
-	parseproto(mp, NULL, fsx, pp, NULL);
+	copy_start(mp);
+	if (protodir)
+		populate(mp, fsx, protodir);
+	else
+		parseproto(mp, NULL, fsx, pp, NULL);
+	copy_finish();
+}
+
+/*
+ * Populating the filesystem from a directory tree.  Entries are created in
+ * name order, so the same tree always makes the same filesystem.  Files
+ * with more than one link are remembered by source inode, and their later
+ * names become links to the inode already created.
+ */
+#define	HARDLINK_HASH	4096
+
+typedef struct hardlink {
+	struct hardlink	*next;
+	dev_t		dev;
+	ino_t		ino;
+	xfs_ino_t	xino;
+} hardlink_t;
+
+static hardlink_t	*hardlinks[HARDLINK_HASH];
+
+static hardlink_t **
+hardlink_slot(
+	struct stat64	*st)
+{
+	return &hardlinks[(st->st_ino ^ st->st_dev) % HARDLINK_HASH];
+}
+
+static hardlink_t *
+hardlink_find(
+	struct stat64	*st)
+{
+	hardlink_t	*hl;
+
+	for (hl = *hardlink_slot(st); hl; hl = hl->next)
+		if (hl->ino == st->st_ino && hl->dev == st->st_dev)
+			return hl;
+	return NULL;
+}
+
+static void
+hardlink_add(
+	struct stat64	*st,
+	xfs_ino_t	xino)
+{
+	hardlink_t	**slot = hardlink_slot(st);
+	hardlink_t	*hl;
+
+	hl = malloc(sizeof(hardlink_t));
+	if (!hl) {
+		fprintf(stderr, _("%s: can't allocate hard link table\n"),
+			progname);
+		exit(1);
+	}
+	hl->dev = st->st_dev;
+	hl->ino = st->st_ino;
+	hl->xino = xino;
+	hl->next = *slot;
+	*slot = hl;
+}
+
+#define	XATTR_VALUE_MAX	(64 * 1024)	/* largest value XFS stores */
+
+/*
+ * Copy the extended attributes of a source file.  Names outside the user,
+ * trusted and security namespaces, POSIX ACLs among them, are skipped.
+ */
+static void
+copyxattrs(
+	xfs_inode_t	*ip,
+	char		*path)
+{
+	char		*attrname;
+	int		error;
+	int		flags;
+	ssize_t		len;
+	char		*name;
+	char		*names;
+	char		*value;
+	ssize_t		vlen;
+
+	len = llistxattr(path, NULL, 0);
+	if (len <= 0)
+		return;
+	names = malloc(len);
+	value = malloc(XATTR_VALUE_MAX);
+	if (!names || !value) {
+		fprintf(stderr, _("%s: can't allocate attribute buffer\n"),
+			progname);
+		exit(1);
+	}
+	len = llistxattr(path, names, len);
+	for (name = names; len > 0 && name < names + len;
+	     name += strlen(name) + 1) {
+		flags = 0;
+		if (strncmp(name, "user.", 5) == 0)
+			attrname = name + 5;
+		else if (strncmp(name, "trusted.", 8) == 0) {
+			attrname = name + 8;
+			flags = LIBXFS_ATTR_ROOT;
+		} else if (strncmp(name, "security.", 9) == 0) {
+			attrname = name + 9;
+			flags = LIBXFS_ATTR_SECURE;
+		} else {
+#ifdef __APPLE__
+			attrname = name;	/* no namespaces on Darwin */
+#else
+			continue;
+#endif
+		}
+		vlen = lgetxattr(path, name, value, XATTR_VALUE_MAX);
+		if (vlen < 0) {
+			fprintf(stderr, _("%s: warning - can't read attribute "
+				"%s of %s: %s\n"), progname, name, path,
+				strerror(errno));
+			continue;
+		}
+		error = libxfs_attr_set(ip, attrname, value, (int)vlen, flags);
+		if (error)
+			fail(_("error setting an extended attribute"), error);
+	}
+	free(value);
+	free(names);
+}
+
+static void populate_dir(xfs_mount_t *mp, xfs_inode_t *dp,
+	struct fsxattr *fsxp, char *path);
+
+/*
+ * Create one entry of a directory from the source file at path.
+ */
+static void
+populate_entry(
+	xfs_mount_t	*mp,
+	xfs_inode_t	*pip,
+	struct fsxattr	*fsxp,
+	char		*path,
+	char		*name,
+	struct stat64	*st)
+{
+	char		buf[MAXPATHLEN];
+	int		committed;
+	cred_t		creds;
+	int		error;
+	xfs_fsblock_t	first;
+	int		flags;
+	xfs_bmap_free_t	flist;
+	hardlink_t	*hl;
+	xfs_inode_t	*ip;
+	int		len;
+	mode_t		mode;
+	copy_src_t	*src = NULL;
+	struct stat64	sst;
+	xfs_trans_t	*tp;
+	struct xfs_name	xname;
+
+	xname.name = name;
+	xname.len = strlen(name);
+	memset(&creds, 0, sizeof(creds));
+	creds.cr_uid = st->st_uid;
+	creds.cr_gid = st->st_gid;
+	mode = st->st_mode & 07777;
+
+	tp = libxfs_trans_alloc(mp, 0);
+	flags = XFS_ILOG_CORE;
+	XFS_BMAP_INIT(&flist, &first);
+	getres(tp, 0);
+
+	if (!S_ISDIR(st->st_mode) && st->st_nlink > 1 &&
+	    (hl = hardlink_find(st)) != NULL) {
+		error = libxfs_trans_iget(mp, tp, hl->xino, 0, 0, &ip);
+		if (error)
+			fail(_("Inode lookup failed"), error);
+		libxfs_trans_ijoin(tp, pip, 0);
+		newdirent(mp, tp, pip, &xname, ip->i_ino, &first, &flist, 1);
+		libxfs_trans_ihold(tp, pip);
+		ip->i_d.di_nlink++;
+		libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+		error = libxfs_bmap_finish(&tp, &flist, &committed);
+		if (error)
+			fail(_("Hard link creation failed"), error);
+		libxfs_trans_commit(tp, 0);
+		return;
+	}
+
+	switch (st->st_mode & S_IFMT) {
+	case S_IFREG:
+		src = copy_src_open(path, &sst);
+		error = libxfs_inode_alloc(&tp, pip, mode|S_IFREG, 1, 0,
+				&creds, fsxp, &ip);
+		break;
+	case S_IFLNK:
+		len = readlink(path, buf, sizeof(buf));
+		if (len < 0 || len >= sizeof(buf)) {
+			fprintf(stderr, _("%s: cannot read link %s: %s\n"),
+				progname, path, strerror(errno));
+			exit(1);
+		}
+		error = libxfs_inode_alloc(&tp, pip, mode|S_IFLNK, 1, 0,
+				&creds, fsxp, &ip);
+		if (error)
+			break;
+		flags |= newfile(tp, ip, &flist, &first, 1, 1, buf, len);
+		break;
+	case S_IFBLK:
+	case S_IFCHR:
+		error = libxfs_inode_alloc(&tp, pip,
+				mode|(st->st_mode & S_IFMT), 1,
+				IRIX_MKDEV(major(st->st_rdev),
+					   minor(st->st_rdev)),
+				&creds, fsxp, &ip);
+		flags |= XFS_ILOG_DEV;
+		break;
+	case S_IFIFO:
+	case S_IFSOCK:
+		error = libxfs_inode_alloc(&tp, pip,
+				mode|(st->st_mode & S_IFMT), 1, 0,
+				&creds, fsxp, &ip);
+		break;
+	case S_IFDIR:
+		error = libxfs_inode_alloc(&tp, pip, mode|S_IFDIR, 1, 0,
+				&creds, fsxp, &ip);
+		if (error)
+			break;
+		ip->i_d.di_nlink++;		/* account for . */
+		pip->i_d.di_nlink++;		/* and for .. */
+		newdirectory(mp, tp, ip, pip);
+		break;
+	default:
+		fprintf(stderr, _("%s: warning - skipping %s, unknown "
+			"file type\n"), progname, path);
+		libxfs_trans_cancel(tp, 0);
+		return;
+	}
+	if (error)
+		fail(_("Inode allocation failed"), error);
+
+	libxfs_trans_ijoin(tp, pip, 0);
+	newdirent(mp, tp, pip, &xname, ip->i_ino, &first, &flist, 1);
+	libxfs_trans_ihold(tp, pip);
+	if (S_ISDIR(st->st_mode))
+		libxfs_trans_log_inode(tp, pip, XFS_ILOG_CORE);
+	settimes(ip, st);
+	libxfs_trans_log_inode(tp, ip, flags);
+	error = libxfs_bmap_finish(&tp, &flist, &committed);
+	if (error)
+		fail(_("Error encountered creating file from directory"),
+			error);
+	libxfs_trans_ihold(tp, ip);
+	libxfs_trans_commit(tp, 0);
+
+	if (src) {
+		writefile(mp, ip, src, sst.st_size, st);
+		copy_src_put(src);
+	}
+	copyxattrs(ip, path);
+	if (S_ISDIR(st->st_mode))
+		populate_dir(mp, ip, fsxp, path);
+	else if (st->st_nlink > 1)
+		hardlink_add(st, ip->i_ino);
+	libxfs_iput(ip, 0);
+}
+
+/*
+ * Fill in directory dp from the source directory at path, which is a
+ * buffer of PATH_MAX bytes that is extended for each entry in turn.
+ */
+static void
+populate_dir(
+	xfs_mount_t	*mp,
+	xfs_inode_t	*dp,
+	struct fsxattr	*fsxp,
+	char		*path)
+{
+	int		i;
+	size_t		len;
+	char		*name;
+	struct dirent	**names;
+	int		n;
+	struct stat64	st;
+
+	n = scandir(path, &names, NULL, alphasort);
+	if (n < 0) {
+		fprintf(stderr, _("%s: cannot read directory %s: %s\n"),
+			progname, path, strerror(errno));
+		exit(1);
+	}
+	len = strlen(path);
+	for (i = 0; i < n; i++) {
+		name = names[i]->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			free(names[i]);
+			continue;
+		}
+		if (len + 1 + strlen(name) >= PATH_MAX) {
+			fprintf(stderr, _("%s: path too long: %s/%s\n"),
+				progname, path, name);
+			exit(1);
+		}
+		sprintf(path + len, "/%s", name);
+		if (lstat64(path, &st) < 0) {
+			fprintf(stderr, _("%s: cannot stat %s: %s\n"),
+				progname, path, strerror(errno));
+			exit(1);
+		}
+		populate_entry(mp, dp, fsxp, path, name, &st);
+		path[len] = '\0';
+		free(names[i]);
+	}
+	free(names);
+}
+
+static void
+populate(
+	xfs_mount_t	*mp,
+	struct fsxattr	*fsxp,
+	char		*dir)
+{
+	int		committed;
+	cred_t		creds;
+	int		error;
+	xfs_fsblock_t	first;
+	xfs_bmap_free_t	flist;
+	xfs_inode_t	*ip;
+	char		path[PATH_MAX];
+	struct stat64	st;
+	xfs_trans_t	*tp;
+
+	if (stat64(dir, &st) < 0 || strlen(dir) >= PATH_MAX) {
+		fprintf(stderr, _("%s: cannot stat %s: %s\n"),
+			progname, dir, strerror(errno));
+		exit(1);
+	}
+	memset(&creds, 0, sizeof(creds));
+	creds.cr_uid = st.st_uid;
+	creds.cr_gid = st.st_gid;
+
+	tp = libxfs_trans_alloc(mp, 0);
+	XFS_BMAP_INIT(&flist, &first);
+	getres(tp, 0);
+	error = libxfs_inode_alloc(&tp, NULL, (st.st_mode & 07777)|S_IFDIR,
+			1, 0, &creds, fsxp, &ip);
+	if (error)
+		fail(_("Inode allocation failed"), error);
+	ip->i_d.di_nlink++;		/* account for . */
+	mp->m_sb.sb_rootino = ip->i_ino;
+	libxfs_mod_sb(tp, XFS_SB_ROOTINO);
+	mp->m_rootip = ip;
+	newdirectory(mp, tp, ip, ip);
+	settimes(ip, &st);
+	libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+	error = libxfs_bmap_finish(&tp, &flist, &committed);
+	if (error)
+		fail(_("Directory creation failed"), error);
+	libxfs_trans_ihold(tp, ip);
+	libxfs_trans_commit(tp, 0);
+	/* as in parseproto, the RT inodes go after the root inode */
+	rtinit(mp);
+
+	copyxattrs(ip, dir);
+	strcpy(path, dir);
+	populate_dir(mp, ip, fsxp, path);
+	libxfs_iput(ip, 0);
 }
 
 /*
@@ -2823,7 +2823,7 @@ usage( void )
 			    lazy-count=0|1]\n\
 /* label */		[-L label (maximum 12 characters)]\n\
 /* naming */		[-n log=n|size=num,version=2|ci]\n\
-/* prototype file */	[-p fname]\n\
+/* prototype file */	[-p fname|directory]\n\
 /* quiet */		[-q]\n\
 /* realtime subvol */	[-r extsize=num,size=num,rtdev=xxx]\n\
 /* sectorsize */	[-s log=n|size=num]\n\
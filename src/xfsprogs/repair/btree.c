@@ -21,9 +21,10 @@
 
 /*
  * Maximum number of keys per node.  Must be greater than 2 for the code
- * to work.
+ * to work.  Nodes are kept wide (512 bytes on 64 bit) so that lookups in
+ * trees with millions of items touch few nodes.
  */
-#define BTREE_KEY_MAX		7
+#define BTREE_KEY_MAX		31
 #define BTREE_KEY_MIN		(BTREE_KEY_MAX / 2)
 
 #define BTREE_PTR_MAX		(BTREE_KEY_MAX + 1)
@@ -160,6 +161,29 @@ btree_is_empty(
 	return root->root_node->num_keys == 0;
 }
 
+/*
+ * Index of the first key in the node that is >= key, or num_keys if there
+ * is none.
+ */
+static inline int
+btree_node_search(
+	struct btree_node	*node,
+	unsigned long		key)
+{
+	int			lo = 0;
+	int			hi = node->num_keys;
+	int			mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (node->keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 static inline void
 btree_invalidate_cursor(
 	struct btree_root	*root)
@@ -179,11 +203,11 @@ btree_key_of_cursor(
 }
 
 static void *
-btree_get_prev(
-	struct btree_root	*root,
+__btree_get_prev(
+	struct btree_cursor	*cur,
+	int			height,
 	unsigned long		*key)
 {
-	struct btree_cursor	*cur = root->cursor;
 	int			level = 0;
 	struct btree_node	*node;
 
@@ -198,9 +222,9 @@ btree_get_prev(
 		if (cur->index)
 			break;
 		cur++;
-	} while (++level < root->height);
+	} while (++level < height);
 
-	if (level == root->height)
+	if (level == height)
 		return NULL;
 
 	/* the key is in the current level */
@@ -214,6 +238,14 @@ btree_get_prev(
 	return node;
 }
 
+static inline void *
+btree_get_prev(
+	struct btree_root	*root,
+	unsigned long		*key)
+{
+	return __btree_get_prev(root->cursor, root->height, key);
+}
+
 static void *
 btree_get_next(
 	struct btree_root	*root,
@@ -249,30 +281,45 @@ btree_get_next(
  * Lookup/Search functions
  */
 
+/*
+ * Walk down to the first key >= key, filling in the path in cursor.
+ */
 static int
-btree_do_search(
-	struct btree_root	*root,
-	unsigned long		key)
+btree_search_path(
+	struct btree_node	*node,
+	int			height,
+	struct btree_cursor	*cursor,
+	unsigned long		key,
+	unsigned long		*found_key)
 {
-	unsigned long		k = 0;
-	struct btree_cursor	*cur = root->cursor + root->height;
-	struct btree_node	*node = root->root_node;
-	int			height = root->height;
+	struct btree_cursor	*cur = cursor + height;
 	int			key_found = 0;
 	int			i;
 
 	while (--height >= 0) {
 		cur--;
-		for (i = 0; i < node->num_keys; i++)
-			if (node->keys[i] >= key) {
-				k = node->keys[i];
-				key_found = 1;
-				break;
-			}
+		i = btree_node_search(node, key);
+		if (i < node->num_keys) {
+			*found_key = node->keys[i];
+			key_found = 1;
+		}
 		cur->node = node;
 		cur->index = i;
 		node = node->ptrs[i];
 	}
+	return key_found;
+}
+
+static int
+btree_do_search(
+	struct btree_root	*root,
+	unsigned long		key)
+{
+	unsigned long		k = 0;
+	int			key_found;
+
+	key_found = btree_search_path(root->root_node, root->height,
+					root->cursor, key, &k);
 	root->keys_valid = key_found;
 	if (!key_found)
 		return 0;
@@ -468,17 +515,62 @@ btree_uncached_lookup(
 	int			key_found = 0;
 
 	while (height >= 0) {
-		for (i = 0; i < node->num_keys; i++)
-			if (node->keys[i] >= key) {
-				key_found = node->keys[i] == key;
-				break;
-			}
+		i = btree_node_search(node, key);
+		if (i < node->num_keys)
+			key_found = node->keys[i] == key;
 		node = node->ptrs[i];
 		height--;
 	}
 	return key_found ? node : NULL;
 }
 
+/*
+ * The cursor-less lookups below neither use nor update the lookup cache,
+ * so any number of threads can search a tree concurrently as long as it
+ * isn't being modified at the same time.
+ */
+
+/*
+ * Find the first item with a key >= key.
+ */
+void *
+btree_uncached_find(
+	struct btree_root	*root,
+	unsigned long		key,
+	unsigned long		*actual_key)
+{
+	struct btree_cursor	cursor[root->height];
+	unsigned long		k;
+
+	if (!btree_search_path(root->root_node, root->height, cursor,
+				key, &k))
+		return NULL;
+	if (actual_key)
+		*actual_key = k;
+	return cursor->node->ptrs[cursor->index];
+}
+
+/*
+ * Find the last item with a key <= key.
+ */
+void *
+btree_uncached_find_le(
+	struct btree_root	*root,
+	unsigned long		key,
+	unsigned long		*actual_key)
+{
+	struct btree_cursor	cursor[root->height];
+	unsigned long		k;
+
+	if (btree_search_path(root->root_node, root->height, cursor,
+				key, &k) && k == key) {
+		if (actual_key)
+			*actual_key = k;
+		return cursor->node->ptrs[cursor->index];
+	}
+	return __btree_get_prev(cursor, root->height, actual_key);
+}
+
 /* Update functions */
 
 static inline void
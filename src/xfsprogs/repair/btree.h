@@ -45,6 +45,23 @@ btree_find(
 	unsigned long		key,
 	unsigned long		*actual_key);
 
+void *
+btree_uncached_lookup(
+	struct btree_root	*root,
+	unsigned long		key);
+
+void *
+btree_uncached_find(
+	struct btree_root	*root,
+	unsigned long		key,
+	unsigned long		*actual_key);
+
+void *
+btree_uncached_find_le(
+	struct btree_root	*root,
+	unsigned long		key,
+	unsigned long		*actual_key);
+
 void *
 btree_peek_prev(
 	struct btree_root	*root,
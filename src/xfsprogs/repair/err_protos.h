@@ -22,5 +22,8 @@ void  __attribute__((noreturn)) do_abort(char const *, ...);
 void  __attribute__((noreturn)) do_error(char const *, ...);
 /* issue warning */
 void do_warn(char const *, ...);
+/* count rather than issue this thread's warnings */
+extern __thread int	warnings_muted;
+extern __thread int	muted_warnings;
 /* issue log message */
 void do_log(char const *, ...);
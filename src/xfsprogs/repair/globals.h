@@ -193,6 +193,7 @@ EXTERN pthread_mutex_t	*ag_locks;
 
 EXTERN int 		report_interval;
 EXTERN __uint64_t 	*prog_rpt_done;
+EXTERN __uint64_t 	*prog_rpt_thread_done;
 
 EXTERN int		ag_stride;
 EXTERN int		thread_count;
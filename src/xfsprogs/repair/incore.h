@@ -20,6 +20,7 @@
 #define XFS_REPAIR_INCORE_H
 
 #include "avl.h"
+#include "btree.h"
 
 
 /*
@@ -62,12 +63,14 @@ get_bmap(xfs_agnumber_t agno, xfs_agblock_t agbno)
  * future to use an extent tree instead of a bitmask for tracking
  * fs blocks, then we could lose the dup extent tree if we labelled
  * each extent with the inode that owned it.
+ *
+ * The bno and bcnt trees are btrees (see btree.c) of pointers to
+ * extent nodes, so the nodes carry no tree linkage of their own.
  */
 
 typedef unsigned char extent_state_t;
 
 typedef struct extent_tree_node  {
-	avlnode_t		avl_node;
 	xfs_agblock_t		ex_startblock;	/* starting block (agbno) */
 	xfs_extlen_t		ex_blockcount;	/* number of blocks in extent */
 	extent_state_t		ex_state;	/* see state flags below */
@@ -138,8 +141,8 @@ find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t agbno);
 extent_tree_node_t *
 findfirst_bno_extent(xfs_agnumber_t agno);
 
-#define findnext_bno_extent(exent_ptr)	\
-		((extent_tree_node_t *) ((exent_ptr)->avl_node.avl_nextino))
+extent_tree_node_t *
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
 
 void
 get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
@@ -273,7 +276,7 @@ typedef struct ino_ex_data  {
 } ino_ex_data_t;
 
 typedef struct ino_tree_node  {
-	avlnode_t		avl_node;
+	struct ino_tree_node	*next;		/* next record in ino order */
 	xfs_agino_t		ino_startnum;	/* starting inode # */
 	xfs_inofree_t		ir_free;	/* inode free bit mask */
 	__uint64_t		ino_confirmed;	/* confirmed bitmask */
@@ -309,17 +312,27 @@ void		free_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec);
  */
 void		get_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec);
 
-extern avltree_desc_t     **inode_tree_ptrs;
+/*
+ * The inode trees are btrees keyed by ino_startnum.  Lookups don't use
+ * the btree cursor so the prefetch and processing threads can search
+ * the same AG at once; in-order walks follow the records' next links.
+ */
+extern struct btree_root	**inode_tree_ptrs;
 static inline ino_tree_node_t *
 findfirst_inode_rec(xfs_agnumber_t agno)
 {
-	return((ino_tree_node_t *) inode_tree_ptrs[agno]->avl_firstino);
+	return((ino_tree_node_t *)
+		btree_uncached_find(inode_tree_ptrs[agno], 0, NULL));
 }
 static inline ino_tree_node_t *
 find_inode_rec(xfs_agnumber_t agno, xfs_agino_t ino)
 {
-	return((ino_tree_node_t *)
-		avl_findrange(inode_tree_ptrs[agno], ino));
+	ino_tree_node_t		*irec;
+
+	irec = btree_uncached_find_le(inode_tree_ptrs[agno], ino, NULL);
+	if (irec && ino >= irec->ino_startnum + XFS_INODES_PER_CHUNK)
+		return NULL;
+	return irec;
 }
 void		find_inode_rec_range(xfs_agnumber_t agno,
 			xfs_agino_t start_ino, xfs_agino_t end_ino,
@@ -353,14 +366,7 @@ void			clear_uncertain_ino_cache(xfs_agnumber_t agno);
 /*
  * return next in-order inode tree node.  takes an "ino_tree_node_t *"
  */
-#define next_ino_rec(ino_node_ptr)	\
-		((ino_tree_node_t *) ((ino_node_ptr)->avl_node.avl_nextino))
-/*
- * return the next linked inode (forward avl tree link)-- meant to be used
- * by linked list routines (uncertain inode routines/records)
- */
-#define next_link_rec(ino_node_ptr)	\
-		((ino_tree_node_t *) ((ino_node_ptr)->avl_node.avl_forw))
+#define next_ino_rec(ino_node_ptr)	((ino_node_ptr)->next)
 
 /*
  * Bit manipulations for processed field
@@ -373,10 +379,8 @@ void			clear_uncertain_ino_cache(xfs_agnumber_t agno);
 		? 0 : 1)
 #define	XFS_INOPROC_SET_PROC(rp, i) \
 	((rp)->ino_un.ex_data->ino_processed |= XFS_INOPROC_MASK((i)))
-/*
 #define	XFS_INOPROC_CLR_PROC(rp, i) \
 	((rp)->ino_un.ex_data->ino_processed &= ~XFS_INOPROC_MASK((i)))
-*/
 
 /*
  * same for ir_confirmed.
@@ -26,6 +26,7 @@
 #include "err_protos.h"
 #include "avl64.h"
 #include "threads.h"
+#include "spill.h"
 #define ALLOC_NUM_EXTS		100
 
 /*
@@ -44,9 +45,10 @@ typedef struct rt_extent_alloc_rec  {
 /*
  * note:  there are 4 sets of incore things handled here:
  * block bitmaps, extent trees, uncertain inode list,
- * and inode tree.  The tree-based code uses the AVL
- * tree package used by the IRIX kernel VM code
- * (sys/avl.h).  The inode list code uses the same records
+ * and inode tree.  The per-AG trees are btrees (btree.c)
+ * of pointers to the records, except for the realtime
+ * duplicate extent tree which uses the 64-bit AVL tree
+ * package.  The inode list code uses the same records
  * as the inode tree code for convenience.  The bitmaps
  * and bitmap operators are mostly macros defined in incore.h.
  * There are one of everything per AG except for extent
@@ -76,13 +78,13 @@ static avl64tree_desc_t	*rt_ext_tree_ptr;	/* dup extent tree for rt */
 static struct btree_root **dup_extent_trees;	/* per ag dup extent trees */
 static pthread_mutex_t *dup_extent_tree_locks;
 
-static avltree_desc_t	**extent_bno_ptrs;	/*
+static struct btree_root **extent_bno_ptrs;	/*
 						 * array of extent tree ptrs
 						 * one per ag for free extents
 						 * sorted by starting block
 						 * number
 						 */
-static avltree_desc_t	**extent_bcnt_ptrs;	/*
+static struct btree_root **extent_bcnt_ptrs;	/*
 						 * array of extent tree ptrs
 						 * one per ag for free extents
 						 * sorted by size
@@ -159,12 +161,12 @@ out:
 
 
 /*
- * extent tree stuff is avl trees of duplicate extents,
- * sorted in order by block number.  there is one tree per ag.
+ * extent tree stuff is btrees of free extents, one sorted by block
+ * number and one by size.  there is one of each per ag.
  */
 
 static extent_tree_node_t *
-mk_extent_tree_nodes(xfs_agblock_t new_startblock,
+mk_extent_tree_nodes(xfs_agnumber_t agno, xfs_agblock_t new_startblock,
 	xfs_extlen_t new_blockcount, extent_state_t new_state)
 {
 	int i;
@@ -172,6 +174,11 @@ mk_extent_tree_nodes(xfs_agblock_t new_startblock,
 	extent_alloc_rec_t *rec;
 
 	pthread_mutex_lock(&ext_flist_lock);
+	if (ext_flist.cnt == 0 && do_spill)  {
+		pthread_mutex_unlock(&ext_flist_lock);
+		new = spill_alloc(agno, sizeof(extent_tree_node_t));
+		goto init;
+	}
 	if (ext_flist.cnt == 0)  {
 		ASSERT(ext_flist.list == NULL);
 
@@ -184,8 +191,7 @@ mk_extent_tree_nodes(xfs_agblock_t new_startblock,
 		new = &rec->extents[0];
 
 		for (i = 0; i < ALLOC_NUM_EXTS; i++)  {
-			new->avl_node.avl_nextino = (avlnode_t *)
-							ext_flist.list;
+			new->next = ext_flist.list;
 			ext_flist.list = new;
 			ext_flist.cnt++;
 			new++;
@@ -195,11 +201,11 @@ mk_extent_tree_nodes(xfs_agblock_t new_startblock,
 	ASSERT(ext_flist.list != NULL);
 
 	new = ext_flist.list;
-	ext_flist.list = (extent_tree_node_t *) new->avl_node.avl_nextino;
+	ext_flist.list = new->next;
 	ext_flist.cnt--;
-	new->avl_node.avl_nextino = NULL;
 	pthread_mutex_unlock(&ext_flist_lock);
 
+init:
 	/* initialize node */
 
 	new->ex_startblock = new_startblock;
@@ -215,7 +221,7 @@ void
 release_extent_tree_node(extent_tree_node_t *node)
 {
 	pthread_mutex_lock(&ext_flist_lock);
-	node->avl_node.avl_nextino = (avlnode_t *) ext_flist.list;
+	node->next = ext_flist.list;
 	ext_flist.list = node;
 	ext_flist.cnt++;
 	pthread_mutex_unlock(&ext_flist_lock);
@@ -230,38 +236,27 @@ release_extent_tree_node(extent_tree_node_t *node)
  * are recycled after they're no longer needed to save memory
  */
 void
-release_extent_tree(avltree_desc_t *tree)
+release_extent_tree(struct btree_root *tree)
 {
 	extent_tree_node_t	*ext;
 	extent_tree_node_t	*tmp;
-	extent_tree_node_t	*lext;
-	extent_tree_node_t	*ltmp;
+	unsigned long		key;
 
-	if (tree->avl_firstino == NULL)
-		return;
-
-	ext = (extent_tree_node_t *) tree->avl_firstino;
+	ext = btree_find(tree, 0, &key);
 
 	while (ext != NULL)  {
-		tmp = (extent_tree_node_t *) ext->avl_node.avl_nextino;
-
 		/*
 		 * ext->next is guaranteed to be set only in bcnt trees
 		 */
-		if (ext->next != NULL)  {
-			lext = ext->next;
-			while (lext != NULL)  {
-				ltmp = lext->next;
-				release_extent_tree_node(lext);
-				lext = ltmp;
-			}
+		while (ext != NULL)  {
+			tmp = ext->next;
+			release_extent_tree_node(ext);
+			ext = tmp;
 		}
-
-		release_extent_tree_node(ext);
-		ext = tmp;
+		ext = btree_lookup_next(tree, &key);
 	}
 
-	tree->avl_root = tree->avl_firstino = NULL;
+	btree_clear(tree);
 
 	return;
 }
@@ -299,9 +294,9 @@ add_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
+	ext = mk_extent_tree_nodes(agno, startblock, blockcount, XR_E_FREE);
 
-	if (avl_insert(extent_bno_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	if (btree_insert(extent_bno_ptrs[agno], startblock, ext) != 0)  {
 		do_error(_("duplicate bno extent range\n"));
 	}
 }
@@ -312,7 +307,7 @@ findfirst_bno_extent(xfs_agnumber_t agno)
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino);
+	return(btree_find(extent_bno_ptrs[agno], 0, NULL));
 }
 
 extent_tree_node_t *
@@ -321,8 +316,17 @@ find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock)
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) avl_find(extent_bno_ptrs[agno],
-						startblock));
+	return(btree_lookup(extent_bno_ptrs[agno], startblock));
+}
+
+extent_tree_node_t *
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
+{
+	ASSERT(extent_bno_ptrs != NULL);
+	ASSERT(extent_bno_ptrs[agno] != NULL);
+
+	return(btree_find(extent_bno_ptrs[agno], ext->ex_startblock + 1,
+			NULL));
 }
 
 /*
@@ -334,37 +338,31 @@ get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	avl_delete(extent_bno_ptrs[agno], &ext->avl_node);
+	btree_delete(extent_bno_ptrs[agno], ext->ex_startblock);
 
 	return;
 }
 
-/*
- * normalizing constant for bcnt size -> address conversion (see avl ops)
- * used by the AVL tree code to convert sizes and must be used when
- * doing an AVL search in the tree (e.g. avl_findrange(s))
- */
-#define MAXBCNT		0xFFFFFFFF
-#define BCNT_ADDR(cnt)	((unsigned int) MAXBCNT - (cnt))
-
 /*
  * the next 4 routines manage the trees of free extents -- 2 trees
  * per AG.  The first tree is sorted by block number.  The second
  * tree is sorted by extent size.  This is the bcnt tree.
+ *
+ * The btree doesn't handle duplicate keys, so it holds one "anchor"
+ * node per extent size, and extents of the same size hang off the
+ * anchor in a list linked through "next" in increasing startblock
+ * order.  The anchor's "last" field points at the end of its list.
  */
 void
 add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
 	extent_tree_node_t *ext, *prev, *current, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
 
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
+	ext = mk_extent_tree_nodes(agno, startblock, blockcount, XR_E_FREE);
 
 	ASSERT(ext->next == NULL);
 
@@ -372,11 +370,10 @@ add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 	fprintf(stderr, "adding bcnt: agno = %d, start = %u, count = %u\n",
 			agno, startblock, blockcount);
 #endif
-	if ((current = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
+	if ((current = btree_lookup(extent_bcnt_ptrs[agno],
 							blockcount)) != NULL)  {
 		/*
-		 * avl tree code doesn't handle dups so insert
-		 * onto linked list in increasing startblock order
+		 * insert onto linked list in increasing startblock order
 		 *
 		 * when called from mk_incore_fstree,
 		 * startblock is in increasing order.
@@ -392,53 +389,39 @@ add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 			return;
 		}
 
+		/*
+		 * new entry goes ahead of the anchor, so it becomes
+		 * the new anchor.
+		 */
+		top = current;
+		if (startblock < top->ex_startblock)  {
+			ext->next = top;
+			ext->last = top->last;
+			top->last = NULL;
+			btree_update_value(extent_bcnt_ptrs[agno],
+					blockcount, ext);
+			return;
+		}
+
 		/*
 		 * scan, to find the proper location for new entry.
 		 * this scan is *very* expensive and gets worse with
 		 * with increasing entries.
 		 */
-		top = prev = current;
+		prev = current;
 		while (current != NULL &&
 				startblock > current->ex_startblock)  {
 			prev = current;
 			current = current->next;
 		}
 
-		if (top == current)  {
-			ASSERT(top == prev);
-			/*
-			 * new entry should be ahead of current.
-			 * to keep the avl tree intact,
-			 * swap the values of to-be-inserted element
-			 * and the values of the head of the list.
-			 * then insert as the 2nd element on the list.
-			 *
-			 * see the comment in get_bcnt_extent()
-			 * as to why we have to do this.
-			 */
-			tmp_startblock = top->ex_startblock;
-			tmp_blockcount = top->ex_blockcount;
-			tmp_state = top->ex_state;
-
-			top->ex_startblock = ext->ex_startblock;
-			top->ex_blockcount = ext->ex_blockcount;
-			top->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			current = top->next;
-			prev = top;
-		}
-
 		prev->next = ext;
 		ext->next = current;
 
 		return;
 	}
 
-	if (avl_insert(extent_bcnt_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	if (btree_insert(extent_bcnt_ptrs[agno], blockcount, ext) != 0)  {
 		do_error(_(":  duplicate bno extent range\n"));
 	}
 
@@ -453,43 +436,39 @@ findfirst_bcnt_extent(xfs_agnumber_t agno)
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) extent_bcnt_ptrs[agno]->avl_firstino);
+	return(btree_find(extent_bcnt_ptrs[agno], 0, NULL));
 }
 
 extent_tree_node_t *
 findbiggest_bcnt_extent(xfs_agnumber_t agno)
 {
-	extern avlnode_t *avl_lastino(avlnode_t *root);
-
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) avl_lastino(extent_bcnt_ptrs[agno]->avl_root));
+	return(btree_uncached_find_le(extent_bcnt_ptrs[agno], ULONG_MAX,
+			NULL));
 }
 
 extent_tree_node_t *
 findnext_bcnt_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 {
-	avlnode_t *nextino;
+	extent_tree_node_t *next;
 
 	if (ext->next != NULL)  {
 		ASSERT(ext->ex_blockcount == ext->next->ex_blockcount);
 		ASSERT(ext->ex_startblock < ext->next->ex_startblock);
 		return(ext->next);
-	} else  {
-		/*
-		 * have to look at the top of the list to get the
-		 * correct avl_nextino pointer since that pointer
-		 * is maintained and altered by the AVL code.
-		 */
-		nextino = avl_find(extent_bcnt_ptrs[agno], ext->ex_blockcount);
-		ASSERT(nextino != NULL);
-		if (nextino->avl_nextino != NULL)  {
-			ASSERT(ext->ex_blockcount < ((extent_tree_node_t *)
-					nextino->avl_nextino)->ex_blockcount);
-		}
-		return((extent_tree_node_t *) nextino->avl_nextino);
 	}
+
+	/*
+	 * end of this size's list, go to the anchor of the next size
+	 */
+	next = btree_find(extent_bcnt_ptrs[agno], ext->ex_blockcount + 1,
+			NULL);
+	if (next != NULL)  {
+		ASSERT(ext->ex_blockcount < next->ex_blockcount);
+	}
+	return(next);
 }
 
 /*
@@ -502,21 +481,31 @@ get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
 	extent_tree_node_t	*ext, *prev, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
 
 	prev = NULL;
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	if ((ext = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) == NULL)
+	if ((ext = btree_lookup(extent_bcnt_ptrs[agno], blockcount)) == NULL)
 		return(NULL);
 
 	top = ext;
 
-	if (ext->next != NULL)  {
+	if (ext->next == NULL)  {
+		/*
+		 * no list, just one node.  simply delete
+		 */
+		btree_delete(extent_bcnt_ptrs[agno], blockcount);
+	} else if (startblock == top->ex_startblock)  {
+		/*
+		 * removing the anchor, so the next node on the list
+		 * takes over as anchor.
+		 */
+		top->next->last = top->last;
+		btree_update_value(extent_bcnt_ptrs[agno], blockcount,
+				top->next);
+		top->next = NULL;
+	} else  {
 		/*
 		 * pull it off the list
 		 */
@@ -525,103 +514,18 @@ get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 			ext = ext->next;
 		}
 		ASSERT(ext != NULL);
-		if (ext == top)  {
-			/*
-			 * this node is linked into the tree so we
-			 * swap the core values so we can delete
-			 * the next item on the list instead of
-			 * the head of the list.  This is because
-			 * the rest of the tree undoubtedly has
-			 * pointers to the piece of memory that
-			 * is the head of the list so pulling
-			 * the item out of the list and hence
-			 * the avl tree would be a bad idea.
-			 *
-			 * (cheaper than the alternative, a tree
-			 * delete of this node followed by a tree
-			 * insert of the next node on the list).
-			 */
-			tmp_startblock = ext->next->ex_startblock;
-			tmp_blockcount = ext->next->ex_blockcount;
-			tmp_state = ext->next->ex_state;
-
-			ext->next->ex_startblock = ext->ex_startblock;
-			ext->next->ex_blockcount = ext->ex_blockcount;
-			ext->next->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			ext = ext->next;
-			prev = top;
-		}
-		/*
-		 * now, a simple list deletion
-		 */
 		prev->next = ext->next;
+		if (top->last == ext)
+			top->last = prev;
 		ext->next = NULL;
-	} else  {
-		/*
-		 * no list, just one node.  simply delete
-		 */
-		avl_delete(extent_bcnt_ptrs[agno], &ext->avl_node);
 	}
+	ext->last = NULL;
 
 	ASSERT(ext->ex_startblock == startblock);
 	ASSERT(ext->ex_blockcount == blockcount);
 	return(ext);
 }
 
-static __psunsigned_t
-avl_ext_start(avlnode_t *node)
-{
-	return((__psunsigned_t)
-		((extent_tree_node_t *) node)->ex_startblock);
-}
-
-static __psunsigned_t
-avl_ext_end(avlnode_t *node)
-{
-	return((__psunsigned_t) (
-		((extent_tree_node_t *) node)->ex_startblock +
-		((extent_tree_node_t *) node)->ex_blockcount));
-}
-
-/*
- * convert size to an address for the AVL tree code -- the bigger the size,
- * the lower the address so the biggest extent will be first in the tree
- */
-static __psunsigned_t
-avl_ext_bcnt_start(avlnode_t *node)
-{
-/*
-	return((__psunsigned_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((__psunsigned_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
-
-static __psunsigned_t
-avl_ext_bcnt_end(avlnode_t *node)
-{
-/*
-	return((__psunsigned_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((__psunsigned_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
-
-avlops_t avl_extent_bcnt_tree_ops = {
-	avl_ext_bcnt_start,
-	avl_ext_bcnt_end
-};
-
-avlops_t avl_extent_tree_ops = {
-	avl_ext_start,
-	avl_ext_end
-};
-
 /*
  * for real-time extents -- have to dup code since realtime extent
  * startblocks can be 64-bit values.
@@ -877,31 +781,20 @@ incore_ext_init(xfs_mount_t *mp)
 		do_error(_("couldn't malloc dup extent tree descriptor table\n"));
 
 	if ((extent_bno_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(struct btree_root *))) == NULL)
 		do_error(
 	_("couldn't malloc free by-bno extent tree descriptor table\n"));
 
 	if ((extent_bcnt_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(struct btree_root *))) == NULL)
 		do_error(
 	_("couldn't malloc free by-bcnt extent tree descriptor table\n"));
 
-	for (i = 0; i < agcount; i++)  {
-		if ((extent_bno_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bno extent tree descriptor\n"));
-		if ((extent_bcnt_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bcnt extent tree descriptor\n"));
-	}
-
 	for (i = 0; i < agcount; i++)  {
 		btree_init(&dup_extent_trees[i]);
 		pthread_mutex_init(&dup_extent_tree_locks[i], NULL);
-		avl_init_tree(extent_bno_ptrs[i], &avl_extent_tree_ops);
-		avl_init_tree(extent_bcnt_ptrs[i], &avl_extent_bcnt_tree_ops);
+		btree_init(&extent_bno_ptrs[i]);
+		btree_init(&extent_bcnt_ptrs[i]);
 	}
 
 	if ((rt_ext_tree_ptr = malloc(sizeof(avltree_desc_t))) == NULL)
@@ -929,8 +822,8 @@ incore_ext_teardown(xfs_mount_t *mp)
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
 		btree_destroy(dup_extent_trees[i]);
-		free(extent_bno_ptrs[i]);
-		free(extent_bcnt_ptrs[i]);
+		btree_destroy(extent_bno_ptrs[i]);
+		btree_destroy(extent_bcnt_ptrs[i]);
 	}
 
 	free(dup_extent_trees);
@@ -943,19 +836,19 @@ incore_ext_teardown(xfs_mount_t *mp)
 }
 
 int
-count_extents(xfs_agnumber_t agno, avltree_desc_t *tree, int whichtree)
+count_extents(xfs_agnumber_t agno, struct btree_root *tree, int whichtree)
 {
 	extent_tree_node_t *node;
 	int i = 0;
 
-	node = (extent_tree_node_t *) tree->avl_firstino;
+	node = btree_find(tree, 0, NULL);
 
 	while (node != NULL)  {
 		i++;
 		if (whichtree)
 			node = findnext_bcnt_extent(agno, node);
 		else
-			node = findnext_bno_extent(node);
+			node = findnext_bno_extent(agno, node);
 	}
 
 	return(i);
@@ -972,12 +865,12 @@ count_bno_extents_blocks(xfs_agnumber_t agno, uint *numblocks)
 
 	nblocks = 0;
 
-	node = (extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino;
+	node = findfirst_bno_extent(agno);
 
 	while (node != NULL) {
 		nblocks += node->ex_blockcount;
 		i++;
-		node = findnext_bno_extent(node);
+		node = findnext_bno_extent(agno, node);
 	}
 
 	*numblocks = nblocks;
@@ -17,26 +17,25 @@
  */
 
 #include <libxfs.h>
-#include "avl.h"
 #include "globals.h"
 #include "incore.h"
 #include "agheader.h"
 #include "protos.h"
 #include "threads.h"
 #include "err_protos.h"
+#include "spill.h"
 
 static pthread_mutex_t	ino_flist_lock;
-extern avlnode_t	*avl_firstino(avlnode_t *root);
 
 /*
  * array of inode tree ptrs, one per ag
  */
-avltree_desc_t	**inode_tree_ptrs;
+struct btree_root	**inode_tree_ptrs;
 
 /*
  * ditto for uncertain inodes
  */
-static avltree_desc_t	**inode_uncertain_tree_ptrs;
+static struct btree_root	**inode_uncertain_tree_ptrs;
 
 #define ALLOC_NUM_INOS		100
 
@@ -173,6 +172,29 @@ counted_nlink_8_dec(ino_tree_node_t *irec, int ino_offset)
 }
 
 
+/*
+ * The arrays hanging off inode records come from the spill file when
+ * repair is spilling its incore state (see spill.c), and from the heap
+ * otherwise.  Spilled space is never handed back.
+ */
+static void *
+irec_alloc(
+	xfs_agnumber_t	agno,
+	size_t		size)
+{
+	if (do_spill)
+		return spill_alloc(agno, size);
+	return calloc(1, size);
+}
+
+static void
+irec_free(
+	void		*p)
+{
+	if (!do_spill)
+		free(p);
+}
+
 static nlink_ops_t nlinkops[] = {
 	{sizeof(__uint8_t) * XFS_INODES_PER_CHUNK,
 		disk_nlink_8_set, disk_nlink_8_get,
@@ -191,21 +213,23 @@ nlink_grow_8_to_16(ino_tree_node_t *irec)
 	__uint16_t	*new_nlinks;
 	int		i;
 
-	new_nlinks = malloc(sizeof(__uint16_t) * XFS_INODES_PER_CHUNK);
+	new_nlinks = irec_alloc(NULLAGNUMBER,
+				sizeof(__uint16_t) * XFS_INODES_PER_CHUNK);
 	if (new_nlinks == NULL)
 		do_error(_("could not allocate expanded nlink array\n"));
 	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 		new_nlinks[i] = irec->disk_nlinks[i];
-	free(irec->disk_nlinks);
+	irec_free(irec->disk_nlinks);
 	irec->disk_nlinks = (__uint8_t*)new_nlinks;
 
 	if (full_ino_ex_data) {
-		new_nlinks = malloc(sizeof(__uint16_t) * XFS_INODES_PER_CHUNK);
+		new_nlinks = irec_alloc(NULLAGNUMBER,
+				sizeof(__uint16_t) * XFS_INODES_PER_CHUNK);
 		if (new_nlinks == NULL)
 			do_error(_("could not allocate expanded nlink array\n"));
 		for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 			new_nlinks[i] = irec->ino_un.ex_data->counted_nlinks[i];
-		free(irec->ino_un.ex_data->counted_nlinks);
+		irec_free(irec->ino_un.ex_data->counted_nlinks);
 		irec->ino_un.ex_data->counted_nlinks = (__uint8_t*)new_nlinks;
 	}
 	irec->nlinkops = &nlinkops[1];
@@ -217,21 +241,23 @@ nlink_grow_16_to_32(ino_tree_node_t *irec)
 	__uint32_t	*new_nlinks;
 	int		i;
 
-	new_nlinks = malloc(sizeof(__uint32_t) * XFS_INODES_PER_CHUNK);
+	new_nlinks = irec_alloc(NULLAGNUMBER,
+				sizeof(__uint32_t) * XFS_INODES_PER_CHUNK);
 	if (new_nlinks == NULL)
 		do_error(_("could not allocate expanded nlink array\n"));
 	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 		new_nlinks[i] = ((__int16_t*)&irec->disk_nlinks)[i];
-	free(irec->disk_nlinks);
+	irec_free(irec->disk_nlinks);
 	irec->disk_nlinks = (__uint8_t*)new_nlinks;
 
 	if (full_ino_ex_data) {
-		new_nlinks = malloc(sizeof(__uint32_t) * XFS_INODES_PER_CHUNK);
+		new_nlinks = irec_alloc(NULLAGNUMBER,
+				sizeof(__uint32_t) * XFS_INODES_PER_CHUNK);
 		if (new_nlinks == NULL)
 			do_error(_("could not allocate expanded nlink array\n"));
 		for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 			new_nlinks[i] = ((__int16_t*)&irec->ino_un.ex_data->counted_nlinks)[i];
-		free(irec->ino_un.ex_data->counted_nlinks);
+		irec_free(irec->ino_un.ex_data->counted_nlinks);
 		irec->ino_un.ex_data->counted_nlinks = (__uint8_t*)new_nlinks;
 	}
 	irec->nlinkops = &nlinkops[2];
@@ -253,13 +279,22 @@ nlink_grow_16_to_32(ino_tree_node_t *irec)
 /* ARGSUSED */
 static ino_tree_node_t *
 mk_ino_tree_nodes(
+	xfs_agnumber_t		agno,
 	xfs_agino_t		starting_ino)
 {
 	int 			i;
 	ino_tree_node_t 	*ino_rec;
-	avlnode_t 		*node;
 
 	pthread_mutex_lock(&ino_flist_lock);
+	if (ino_flist.cnt == 0 && do_spill)  {
+		/*
+		 * spilled records are carved one at a time from the
+		 * AG's own arena so an AG's records stay together
+		 */
+		pthread_mutex_unlock(&ino_flist_lock);
+		ino_rec = spill_alloc(agno, sizeof(ino_tree_node_t));
+		goto init;
+	}
 	if (ino_flist.cnt == 0)  {
 		ASSERT(ino_flist.list == NULL);
 
@@ -268,8 +303,7 @@ mk_ino_tree_nodes(
 			do_error(_("inode map malloc failed\n"));
 
 		for (i = 0; i < ALLOC_NUM_INOS; i++)  {
-			ino_rec->avl_node.avl_nextino =
-				(avlnode_t *) ino_flist.list;
+			ino_rec->next = ino_flist.list;
 			ino_flist.list = ino_rec;
 			ino_flist.cnt++;
 			ino_rec++;
@@ -279,12 +313,12 @@ mk_ino_tree_nodes(
 	ASSERT(ino_flist.list != NULL);
 
 	ino_rec = ino_flist.list;
-	ino_flist.list = (ino_tree_node_t *) ino_rec->avl_node.avl_nextino;
+	ino_flist.list = ino_rec->next;
 	ino_flist.cnt--;
-	node = &ino_rec->avl_node;
-	node->avl_nextino = node->avl_forw = node->avl_back = NULL;
+	ino_rec->next = NULL;
 	pthread_mutex_unlock(&ino_flist_lock);
 
+init:
 	/* initialize node */
 
 	ino_rec->ino_startnum = 0;
@@ -293,7 +327,7 @@ mk_ino_tree_nodes(
 	ino_rec->ir_free = (xfs_inofree_t) - 1;
 	ino_rec->ino_un.ex_data = NULL;
 	ino_rec->nlinkops = &nlinkops[0];
-	ino_rec->disk_nlinks = calloc(1, nlinkops[0].nlink_size);
+	ino_rec->disk_nlinks = irec_alloc(agno, nlinkops[0].nlink_size);
 	if (ino_rec->disk_nlinks == NULL)
 		do_error(_("could not allocate nlink array\n"));
 
@@ -307,35 +341,95 @@ mk_ino_tree_nodes(
 static void
 free_ino_tree_node(ino_tree_node_t *ino_rec)
 {
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
+	ino_rec->next = NULL;
 
 	pthread_mutex_lock(&ino_flist_lock);
 	if (ino_flist.list != NULL)  {
 		ASSERT(ino_flist.cnt > 0);
-		ino_rec->avl_node.avl_nextino = (avlnode_t *) ino_flist.list;
+		ino_rec->next = ino_flist.list;
 	} else  {
 		ASSERT(ino_flist.cnt == 0);
-		ino_rec->avl_node.avl_nextino = NULL;
+		ino_rec->next = NULL;
 	}
 
 	ino_flist.list = ino_rec;
 	ino_flist.cnt++;
 
-	free(ino_rec->disk_nlinks);
+	irec_free(ino_rec->disk_nlinks);
 
 	if (ino_rec->ino_un.ex_data != NULL)  {
 		if (full_ino_ex_data) {
-			free(ino_rec->ino_un.ex_data->parents);
-			free(ino_rec->ino_un.ex_data->counted_nlinks);
+			irec_free(ino_rec->ino_un.ex_data->parents);
+			irec_free(ino_rec->ino_un.ex_data->counted_nlinks);
 		}
-		free(ino_rec->ino_un.ex_data);
+		irec_free(ino_rec->ino_un.ex_data);
 
 	}
 	pthread_mutex_unlock(&ino_flist_lock);
 }
 
+/*
+ * The inode and uncertain inode trees index records by ino_startnum in a
+ * btree.  Each record also points at the next record in inode order so
+ * that walking an AG needs no tree lookups; the link is fixed up here on
+ * insertion and removal.
+ *
+ * A record covers [ino_startnum, ino_startnum + XFS_INODES_PER_CHUNK),
+ * and records that would overlap one already in the tree are refused.
+ */
+static int
+ino_tree_insert(
+	struct btree_root	*tree,
+	ino_tree_node_t		*ino_rec)
+{
+	ino_tree_node_t		*prev;
+	ino_tree_node_t		*next;
+	xfs_agino_t		ino = ino_rec->ino_startnum;
+
+	prev = btree_uncached_find_le(tree, ino, NULL);
+	if (prev && ino < prev->ino_startnum + XFS_INODES_PER_CHUNK)
+		return EEXIST;
+	next = prev ? prev->next : btree_uncached_find(tree, 0, NULL);
+	if (next && next->ino_startnum < ino + XFS_INODES_PER_CHUNK)
+		return EEXIST;
+
+	if (btree_insert(tree, ino, ino_rec))
+		return ENOMEM;
+	ino_rec->next = next;
+	if (prev)
+		prev->next = ino_rec;
+	return 0;
+}
+
+static void
+ino_tree_delete(
+	struct btree_root	*tree,
+	ino_tree_node_t		*ino_rec)
+{
+	ino_tree_node_t		*prev = NULL;
+
+	if (ino_rec->ino_startnum > 0)
+		prev = btree_uncached_find_le(tree,
+					ino_rec->ino_startnum - 1, NULL);
+	if (prev)
+		prev->next = ino_rec->next;
+	btree_delete(tree, ino_rec->ino_startnum);
+	ino_rec->next = NULL;
+}
+
+static ino_tree_node_t *
+ino_tree_find(
+	struct btree_root	*tree,
+	xfs_agino_t		ino)
+{
+	ino_tree_node_t		*ino_rec;
+
+	ino_rec = btree_uncached_find_le(tree, ino, NULL);
+	if (ino_rec && ino >= ino_rec->ino_startnum + XFS_INODES_PER_CHUNK)
+		return NULL;
+	return ino_rec;
+}
+
 /*
  * last referenced cache for uncertain inodes
  */
@@ -379,14 +473,13 @@ add_aginode_uncertain(xfs_agnumber_t agno, xfs_agino_t ino, int free)
 	 * check to see if record containing inode is already in the tree.
 	 * if not, add it
 	 */
-	if ((ino_rec = (ino_tree_node_t *)
-			avl_findrange(inode_uncertain_tree_ptrs[agno],
+	if ((ino_rec = ino_tree_find(inode_uncertain_tree_ptrs[agno],
 				s_ino)) == NULL)  {
-		ino_rec = mk_ino_tree_nodes(s_ino);
+		ino_rec = mk_ino_tree_nodes(agno, s_ino);
 		ino_rec->ino_startnum = s_ino;
 
-		if (avl_insert(inode_uncertain_tree_ptrs[agno],
-				(avlnode_t *) ino_rec) == NULL)  {
+		if (ino_tree_insert(inode_uncertain_tree_ptrs[agno],
+				ino_rec) != 0)  {
 			do_error(_("add_aginode_uncertain - "
 				   "duplicate inode range\n"));
 		}
@@ -423,25 +516,20 @@ get_uncertain_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 	ASSERT(inode_tree_ptrs != NULL);
 	ASSERT(inode_tree_ptrs[agno] != NULL);
 
-	avl_delete(inode_uncertain_tree_ptrs[agno], &ino_rec->avl_node);
-
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
+	ino_tree_delete(inode_uncertain_tree_ptrs[agno], ino_rec);
 }
 
 ino_tree_node_t *
 findfirst_uncertain_inode_rec(xfs_agnumber_t agno)
 {
 	return((ino_tree_node_t *)
-		inode_uncertain_tree_ptrs[agno]->avl_firstino);
+		btree_uncached_find(inode_uncertain_tree_ptrs[agno], 0, NULL));
 }
 
 ino_tree_node_t *
 find_uncertain_inode_rec(xfs_agnumber_t agno, xfs_agino_t ino)
 {
-	return((ino_tree_node_t *)
-		avl_findrange(inode_uncertain_tree_ptrs[agno], ino));
+	return(ino_tree_find(inode_uncertain_tree_ptrs[agno], ino));
 }
 
 void
@@ -452,7 +540,7 @@ clear_uncertain_ino_cache(xfs_agnumber_t agno)
 
 
 /*
- * next comes the inode trees.  One per ag.  AVL trees
+ * next comes the inode trees.  One per ag.  btrees
  * of inode records, each inode record tracking 64 inodes
  */
 /*
@@ -480,11 +568,10 @@ add_inode(xfs_agnumber_t agno, xfs_agino_t ino)
 
 	/* no record exists, make some and put them into the tree */
 
-	ino_rec = mk_ino_tree_nodes(ino);
+	ino_rec = mk_ino_tree_nodes(agno, ino);
 	ino_rec->ino_startnum = ino;
 
-	if (avl_insert(inode_tree_ptrs[agno],
-			(avlnode_t *) ino_rec) == NULL)  {
+	if (ino_tree_insert(inode_tree_ptrs[agno], ino_rec) != 0)  {
 		do_warn(_("add_inode - duplicate inode range\n"));
 	}
 
@@ -500,11 +587,7 @@ get_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 	ASSERT(inode_tree_ptrs != NULL);
 	ASSERT(inode_tree_ptrs[agno] != NULL);
 
-	avl_delete(inode_tree_ptrs[agno], &ino_rec->avl_node);
-
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
+	ino_tree_delete(inode_tree_ptrs[agno], ino_rec);
 }
 
 /*
@@ -522,10 +605,25 @@ find_inode_rec_range(xfs_agnumber_t agno, xfs_agino_t start_ino,
 			xfs_agino_t end_ino, ino_tree_node_t **first,
 			ino_tree_node_t **last)
 {
+	ino_tree_node_t		*irec;
+
 	*first = *last = NULL;
 
-	avl_findranges(inode_tree_ptrs[agno], start_ino,
-		end_ino, (avlnode_t **) first, (avlnode_t **) last);
+	/*
+	 * first is the record containing start_ino or the one after it,
+	 * last is the record containing end_ino - 1 or the one before it
+	 */
+	irec = ino_tree_find(inode_tree_ptrs[agno], start_ino);
+	if (irec == NULL)
+		irec = btree_uncached_find(inode_tree_ptrs[agno], start_ino,
+						NULL);
+	if (irec == NULL || irec->ino_startnum >= end_ino)
+		return;
+
+	*first = irec;
+	*last = btree_uncached_find_le(inode_tree_ptrs[agno], end_ino - 1,
+					NULL);
+	ASSERT(*last != NULL);
 }
 
 /*
@@ -622,6 +720,21 @@ print_uncertain_inode_list(xfs_agnumber_t agno)
  * the array where N starts at 0.
  */
 
+static xfs_ino_t *
+alloc_pentries(
+	int		cnt)
+{
+	xfs_ino_t	*pentries;
+
+	if (do_spill)
+		return spill_alloc(NULLAGNUMBER, cnt * sizeof(xfs_ino_t));
+
+	pentries = memalign(sizeof(xfs_ino_t), cnt * sizeof(xfs_ino_t));
+	if (!pentries)
+		do_error(_("couldn't memalign pentries table\n"));
+	return pentries;
+}
+
 void
 set_inode_parent(
 	ino_tree_node_t		*irec,
@@ -641,7 +754,7 @@ set_inode_parent(
 		ptbl = irec->ino_un.plist;
 
 	if (ptbl == NULL)  {
-		ptbl = (parent_list_t *)malloc(sizeof(parent_list_t));
+		ptbl = irec_alloc(NULLAGNUMBER, sizeof(parent_list_t));
 		if (!ptbl)
 			do_error(_("couldn't malloc parent list table\n"));
 
@@ -651,10 +764,7 @@ set_inode_parent(
 			irec->ino_un.plist = ptbl;
 
 		ptbl->pmask = 1LL << offset;
-		ptbl->pentries = (xfs_ino_t*)memalign(sizeof(xfs_ino_t),
-							sizeof(xfs_ino_t));
-		if (!ptbl->pentries)
-			do_error(_("couldn't memalign pentries table\n"));
+		ptbl->pentries = alloc_pentries(1);
 #ifdef DEBUG
 		ptbl->cnt = 1;
 #endif
@@ -698,19 +808,26 @@ set_inode_parent(
 #endif
 	ASSERT(cnt >= target);
 
-	tmp = (xfs_ino_t*)memalign(sizeof(xfs_ino_t), (cnt + 1) * sizeof(xfs_ino_t));
-	if (!tmp)
-		do_error(_("couldn't memalign pentries table\n"));
+	if (do_spill && (cnt & (cnt - 1)) != 0)  {
+		/*
+		 * spilled tables are sized in powers of two, so there
+		 * is still room to insert in place
+		 */
+		memmove(ptbl->pentries + target + 1, ptbl->pentries + target,
+				(cnt - target) * sizeof(parent_entry_t));
+	} else  {
+		tmp = alloc_pentries(do_spill ? cnt * 2 : cnt + 1);
 
-	memmove(tmp, ptbl->pentries, target * sizeof(parent_entry_t));
+		memmove(tmp, ptbl->pentries, target * sizeof(parent_entry_t));
 
-	if (cnt > target)
-		memmove(tmp + target + 1, ptbl->pentries + target,
+		if (cnt > target)
+			memmove(tmp + target + 1, ptbl->pentries + target,
 				(cnt - target) * sizeof(parent_entry_t));
 
-	free(ptbl->pentries);
+		irec_free(ptbl->pentries);
 
-	ptbl->pentries = tmp;
+		ptbl->pentries = tmp;
+	}
 
 #ifdef DEBUG
 	ptbl->cnt++;
@@ -751,17 +868,18 @@ get_inode_parent(ino_tree_node_t *irec, int offset)
 }
 
 static void
-alloc_ex_data(ino_tree_node_t *irec)
+alloc_ex_data(xfs_agnumber_t agno, ino_tree_node_t *irec)
 {
 	parent_list_t 	*ptbl;
 
 	ptbl = irec->ino_un.plist;
-	irec->ino_un.ex_data  = (ino_ex_data_t *)calloc(1, sizeof(ino_ex_data_t));
+	irec->ino_un.ex_data = irec_alloc(agno, sizeof(ino_ex_data_t));
 	if (irec->ino_un.ex_data == NULL)
 		do_error(_("could not malloc inode extra data\n"));
 
 	irec->ino_un.ex_data->parents = ptbl;
-	irec->ino_un.ex_data->counted_nlinks = calloc(1, irec->nlinkops->nlink_size);
+	irec->ino_un.ex_data->counted_nlinks = irec_alloc(agno,
+						irec->nlinkops->nlink_size);
 
 	if (irec->ino_un.ex_data->counted_nlinks == NULL)
 		do_error(_("could not malloc inode extra data\n"));
@@ -777,32 +895,14 @@ add_ino_ex_data(xfs_mount_t *mp)
 		ino_rec = findfirst_inode_rec(i);
 
 		while (ino_rec != NULL)  {
-			alloc_ex_data(ino_rec);
+			alloc_ex_data(i, ino_rec);
 			ino_rec = next_ino_rec(ino_rec);
 		}
+		spill_release_ag(i);
 	}
 	full_ino_ex_data = 1;
 }
 
-static __psunsigned_t
-avl_ino_start(avlnode_t *node)
-{
-	return((__psunsigned_t) ((ino_tree_node_t *) node)->ino_startnum);
-}
-
-static __psunsigned_t
-avl_ino_end(avlnode_t *node)
-{
-	return((__psunsigned_t) (
-		((ino_tree_node_t *) node)->ino_startnum +
-		XFS_INODES_PER_CHUNK));
-}
-
-avlops_t avl_ino_tree_ops = {
-	avl_ino_start,
-	avl_ino_end
-};
-
 void
 incore_ino_init(xfs_mount_t *mp)
 {
@@ -811,25 +911,16 @@ incore_ino_init(xfs_mount_t *mp)
 
 	pthread_mutex_init(&ino_flist_lock, NULL);
 	if ((inode_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(struct btree_root *))) == NULL)
 		do_error(_("couldn't malloc inode tree descriptor table\n"));
 	if ((inode_uncertain_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(struct btree_root *))) == NULL)
 		do_error(
 		_("couldn't malloc uncertain ino tree descriptor table\n"));
 
 	for (i = 0; i < agcount; i++)  {
-		if ((inode_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(_("couldn't malloc inode tree descriptor\n"));
-		if ((inode_uncertain_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc uncertain ino tree descriptor\n"));
-	}
-	for (i = 0; i < agcount; i++)  {
-		avl_init_tree(inode_tree_ptrs[i], &avl_ino_tree_ops);
-		avl_init_tree(inode_uncertain_tree_ptrs[i], &avl_ino_tree_ops);
+		btree_init(&inode_tree_ptrs[i]);
+		btree_init(&inode_uncertain_tree_ptrs[i]);
 	}
 
 	ino_flist.cnt = 0;
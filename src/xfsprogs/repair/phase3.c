@@ -26,6 +26,7 @@
 #include "dinode.h"
 #include "threads.h"
 #include "progress.h"
+#include "spill.h"
 #include "prefetch.h"
 
 /*
@@ -149,10 +150,12 @@ process_ag_func(
 	 * turn on directory processing (inode discovery) and
 	 * attribute processing (extra_attr_check)
 	 */
+	spill_prefetch_ag(agno);
 	wait_for_inode_prefetch(arg);
 	do_log(_("        - agno = %d\n"), agno);
 	process_aginodes(wq->mp, arg, agno, 1, 0, 1);
 	cleanup_inode_prefetch(arg);
+	spill_release_ag(agno);
 }
 
 static void
@@ -30,6 +30,7 @@
 #include "dir2.h"
 #include "threads.h"
 #include "progress.h"
+#include "spill.h"
 #include "prefetch.h"
 
 
@@ -121,10 +122,12 @@ process_ag_func(
 	xfs_agnumber_t 		agno,
 	void			*arg)
 {
+	spill_prefetch_ag(agno);
 	wait_for_inode_prefetch(arg);
 	do_log(_("        - agno = %d\n"), agno);
 	process_aginodes(wq->mp, arg, agno, 0, 1, 0);
 	cleanup_inode_prefetch(arg);
+	spill_release_ag(agno);
 
 	/*
 	 * now recycle the per-AG duplicate extent records
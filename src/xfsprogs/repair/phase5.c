@@ -799,7 +799,7 @@ build_freespace_tree(xfs_mount_t *mp, xfs_agnumber_t agno,
 							ext_ptr->ex_blockcount);
 			freeblks += ext_ptr->ex_blockcount;
 			if (magic == XFS_ABTB_MAGIC)
-				ext_ptr = findnext_bno_extent(ext_ptr);
+				ext_ptr = findnext_bno_extent(agno, ext_ptr);
 			else
 				ext_ptr = findnext_bcnt_extent(agno, ext_ptr);
 #if 0
@@ -1563,10 +1563,20 @@ phase5_func(
 	PROG_RPT_INC(prog_rpt_done[agno], 1);
 }
 
+static void
+phase5_worker(
+	work_queue_t	*wq,
+	xfs_agnumber_t	agno,
+	void		*arg)
+{
+	phase5_func(wq->mp, agno);
+}
+
 void
 phase5(xfs_mount_t *mp)
 {
 	xfs_agnumber_t		agno;
+	work_queue_t		queue;
 
 	do_log(_("Phase 5 - rebuild AG headers and trees...\n"));
 	set_progress_msg(PROG_FMT_REBUILD_AG, (__uint64_t )glob_agcount);
@@ -1608,8 +1618,16 @@ phase5(xfs_mount_t *mp)
 	if (sb_fdblocks_ag == NULL)
 		do_error(_("cannot alloc sb_fdblocks_ag buffers\n"));
 
+	/*
+	 * the incore free space trees, block maps and inode trees used to
+	 * rebuild an AG are all per-AG, so the AGs can be rebuilt in
+	 * parallel.  With ag_stride set stick to one thread per segment.
+	 */
+	create_work_queue(&queue, mp, ag_stride ? thread_count :
+						  libxfs_nproc());
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		phase5_func(mp, agno);
+		queue_work(&queue, phase5_worker, agno, NULL);
+	destroy_work_queue(&queue);
 
 	print_final_rpt();
 
@@ -51,14 +51,211 @@ typedef struct dotdot_update {
 static dotdot_update_t		*dotdot_update_list;
 static int			dotdot_update;
 
+/*
+ * With ag_stride set the AGs are traversed in parallel.  A directory
+ * entry updates the reached state and link counts of inode records in
+ * any AG, so those updates are serialised while the workers are running.
+ *
+ * Junking entries, rebuilding directories and the other fixes share
+ * transactions and allocation, so a modifying run splits the traversal.
+ * The workers first only look: each directory is checked as with -n,
+ * with warnings counted rather than printed, and the incore updates it
+ * makes are logged.  A directory that warned or wants a rebuild has its
+ * updates undone and is left to a serial pass that checks and fixes it
+ * for real, in the usual AG order, once the workers are done.  A clean
+ * directory only claims a child directory whose ".." names it, so the
+ * directories left over reach the same verdicts as in a serial run.
+ */
+static int			traverse_parallel;
+static pthread_mutex_t		reached_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int		dir_looking;	/* first pass, check only */
+static __thread int		dir_would_fix;	/* found something to fix */
+
+/* while looking, everything below behaves as if run with -n */
+static inline int
+dir_no_modify(void)
+{
+	return no_modify || dir_looking;
+}
+
+/*
+ * Incore updates made while looking at one directory, undone if it
+ * turns out to need fixing
+ */
+typedef struct dir_undo {
+	ino_tree_node_t		*irec;
+	int			ino_offset;
+	int			what;
+	xfs_ino_t		parent;		/* DIR_UNDO_PARENT */
+} dir_undo_t;
+
+#define DIR_UNDO_REACHED	1
+#define DIR_UNDO_REF		2
+#define DIR_UNDO_REFCHECKED	3
+#define DIR_UNDO_PARENT		4
+
+static __thread dir_undo_t	*dir_undo;
+static __thread int		dir_nundo;
+static __thread int		dir_maxundo;
+
+/*
+ * Directories found to need fixing by the looking pass, one list per
+ * worker, each in AG and inode order
+ */
+typedef struct dir_later {
+	xfs_agnumber_t		agno;
+	ino_tree_node_t		*irec;
+	int			ino_offset;
+} dir_later_t;
+
+typedef struct dir_later_list {
+	dir_later_t		*dirs;
+	int			ndirs;
+	int			maxdirs;
+} dir_later_list_t;
+
+static dir_later_list_t		*dirs_later;
+
+static inline void
+lock_reached(void)
+{
+	if (traverse_parallel)
+		pthread_mutex_lock(&reached_lock);
+}
+
+static inline void
+unlock_reached(void)
+{
+	if (traverse_parallel)
+		pthread_mutex_unlock(&reached_lock);
+}
+
+static void
+log_dir_undo(
+	ino_tree_node_t		*irec,
+	int			ino_offset,
+	int			what,
+	xfs_ino_t		parent)
+{
+	if (dir_nundo == dir_maxundo) {
+		dir_maxundo = dir_maxundo ? dir_maxundo * 2 : 64;
+		dir_undo = realloc(dir_undo, dir_maxundo * sizeof(dir_undo_t));
+		if (dir_undo == NULL)
+			do_error(_("couldn't allocate phase 6 undo log\n"));
+	}
+	dir_undo[dir_nundo].irec = irec;
+	dir_undo[dir_nundo].ino_offset = ino_offset;
+	dir_undo[dir_nundo].what = what;
+	dir_undo[dir_nundo].parent = parent;
+	dir_nundo++;
+}
+
+/*
+ * Undo the incore updates logged for the directory just looked at, most
+ * recent first.  A directory is reached once, so its reached flag goes
+ * with the link; other inodes stay reached while links to them remain.
+ */
+static void
+undo_dir_updates(void)
+{
+	dir_undo_t		*u;
+
+	lock_reached();
+	while (dir_nundo > 0) {
+		u = &dir_undo[--dir_nundo];
+		switch (u->what) {
+		case DIR_UNDO_REACHED:
+			drop_inode_ref(u->irec, u->ino_offset);
+			if (inode_isadir(u->irec, u->ino_offset))
+				XFS_INO_RCHD_CLR_RCHD(u->irec, u->ino_offset);
+			break;
+		case DIR_UNDO_REF:
+			drop_inode_ref(u->irec, u->ino_offset);
+			break;
+		case DIR_UNDO_REFCHECKED:
+			XFS_INOPROC_CLR_PROC(u->irec, u->ino_offset);
+			break;
+		case DIR_UNDO_PARENT:
+			set_inode_parent(u->irec, u->ino_offset, u->parent);
+			break;
+		}
+	}
+	unlock_reached();
+}
+
+/*
+ * The incore updates of the directory traversal, logged while looking.
+ * Callers hold the reached lock where add_inode_* calls would need it.
+ */
+static void
+dir_add_reached(
+	ino_tree_node_t		*irec,
+	int			ino_offset)
+{
+	add_inode_reached(irec, ino_offset);
+	if (dir_looking)
+		log_dir_undo(irec, ino_offset, DIR_UNDO_REACHED, 0);
+}
+
+static void
+dir_add_ref(
+	ino_tree_node_t		*irec,
+	int			ino_offset)
+{
+	add_inode_ref(irec, ino_offset);
+	if (dir_looking)
+		log_dir_undo(irec, ino_offset, DIR_UNDO_REF, 0);
+}
+
+static void
+dir_add_refchecked(
+	xfs_ino_t		ino,
+	ino_tree_node_t		*irec,
+	int			ino_offset)
+{
+	add_inode_refchecked(ino, irec, ino_offset);
+	if (dir_looking)
+		log_dir_undo(irec, ino_offset, DIR_UNDO_REFCHECKED, 0);
+}
+
+static void
+dir_set_parent(
+	ino_tree_node_t		*irec,
+	int			ino_offset,
+	xfs_ino_t		parent)
+{
+	if (dir_looking)
+		log_dir_undo(irec, ino_offset, DIR_UNDO_PARENT,
+				get_inode_parent(irec, ino_offset));
+	set_inode_parent(irec, ino_offset, parent);
+}
+
+/*
+ * An entry pointing at the orphanage is being junked.  Only done when
+ * acting, the looking pass leaves the directory to the serial one.
+ */
+static void
+forget_orphanage(
+	xfs_ino_t		ino)
+{
+	if (!dir_looking && ino == orphanage_ino)
+		orphanage_ino = 0;
+}
+
 static void
 add_dotdot_update(
 	xfs_agnumber_t		agno,
 	ino_tree_node_t		*irec,
 	int			ino_offset)
 {
-	dotdot_update_t		*dir = malloc(sizeof(dotdot_update_t));
+	dotdot_update_t		*dir;
+
+	/* the directory warned, so the serial pass will get here again */
+	if (dir_looking)
+		return;
 
+	dir = malloc(sizeof(dotdot_update_t));
 	if (!dir)
 		do_error(_("malloc failed add_dotdot_update (%u bytes)\n"),
 			sizeof(dotdot_update_t));
@@ -240,7 +437,7 @@ dir_hash_check(
 		return 0;
 	do_warn(_("bad hash table for directory inode %llu (%s): "),
 		ip->i_ino, seevalstr[seeval]);
-	if (!no_modify)
+	if (!dir_no_modify())
 		do_warn(_("rebuilding\n"));
 	else
 		do_warn(_("would rebuild\n"));
@@ -1153,7 +1350,7 @@ map_first_dblock_fsbno(xfs_mount_t	*mp,
 				XFS_BMAPI_METADATA, &fblock, 0,
 				&map, &nmap, NULL, NULL);
 	if (error || nmap != 1)  {
-		if (!no_modify)
+		if (!dir_no_modify())
 			do_error(
 _("can't map block %d in %s inode %llu, xfs_bmapi returns %d, nmap = %d\n"),
 				da_bno, ftype, ino, error, nmap);
@@ -1166,7 +1363,7 @@ _("can't map block %d in %s inode %llu, xfs_bmapi returns %d, nmap = %d\n"),
 	}
 
 	if ((fsbno = map.br_startblock) == HOLESTARTBLOCK)  {
-		if (!no_modify)
+		if (!dir_no_modify())
 			do_error(_("block %d in %s ino %llu doesn't exist\n"),
 				da_bno, ftype, ino);
 		else  {
@@ -1223,7 +1420,7 @@ _("bad dir/attr magic number in inode %llu, file bno = %u, fsbno = %llu\n"),
 				XFS_BMAPI_METADATA, &fblock, 0,
 				&map, &nmap, NULL, NULL);
 		if (error || nmap != 1)  {
-			if (!no_modify)
+			if (!dir_no_modify())
 				do_error(
 _("can't map block %d in %s ino %llu, xfs_bmapi returns %d, nmap = %d\n"),
 					da_bno, ftype, ino, error, nmap);
@@ -1235,7 +1432,7 @@ _("can't map block %d in %s ino %llu, xfs_bmapi returns %d, nmap = %d\n"),
 			}
 		}
 		if ((fsbno = map.br_startblock) == HOLESTARTBLOCK)  {
-			if (!no_modify)
+			if (!dir_no_modify())
 				do_error(
 				_("block %d in %s inode %llu doesn't exist\n"),
 					da_bno, ftype, ino);
@@ -1262,14 +1459,14 @@ entry_junked(
 	xfs_ino_t	ino2)
 {
 	do_warn(msg, iname, ino1, ino2);
-	if (!no_modify) {
+	if (!dir_no_modify()) {
 		if (verbose)
 			do_warn(_(", marking entry to be junked\n"));
 		else
 			do_warn("\n");
 	} else
 		do_warn(_(", would junk entry\n"));
-	return !no_modify;
+	return !dir_no_modify();
 }
 
 /*
@@ -1352,7 +1549,7 @@ lf_block_dir_entry_check(xfs_mount_t		*mp,
 				namest->name[1] == '.')
 			continue;
 
-		ASSERT(no_modify || !verify_inum(mp, lino));
+		ASSERT(dir_no_modify() || !verify_inum(mp, lino));
 
 		/*
 		 * special case the . entry.  we know there's only one
@@ -1365,7 +1562,9 @@ lf_block_dir_entry_check(xfs_mount_t		*mp,
 		 */
 		if (ino == lino)  {
 			ASSERT(namest->name[0] == '.' && entry->namelen == 1);
-			add_inode_ref(current_irec, current_ino_offset);
+			lock_reached();
+			dir_add_ref(current_irec, current_ino_offset);
+			unlock_reached();
 			*need_dot = 0;
 			continue;
 		}
@@ -1373,7 +1572,7 @@ lf_block_dir_entry_check(xfs_mount_t		*mp,
 		/*
 		 * skip entries with bogus inumbers if we're in no modify mode
 		 */
-		if (no_modify && verify_inum(mp, lino))
+		if (dir_no_modify() && verify_inum(mp, lino))
 			continue;
 
 		/*
@@ -1446,8 +1645,7 @@ lf_block_dir_entry_check(xfs_mount_t		*mp,
 				namest->name[0] = '/';
 				*dirty = 1;
 			}
-			if (lino == orphanage_ino)
-				orphanage_ino = 0;
+			forget_orphanage(lino);
 			continue;
 		}
 		/*
@@ -1455,10 +1653,13 @@ lf_block_dir_entry_check(xfs_mount_t		*mp,
 		 * the link count and continue
 		 */
 		if (!inode_isadir(irec, ino_offset))  {
-			add_inode_reached(irec, ino_offset);
+			lock_reached();
+			dir_add_reached(irec, ino_offset);
+			unlock_reached();
 			continue;
 		}
 
+		lock_reached();
 		parent = get_inode_parent(irec, ino_offset);
 		ASSERT(parent != 0);
 
@@ -1475,30 +1676,30 @@ lf_block_dir_entry_check(xfs_mount_t		*mp,
 				"already connected dir inode %llu,\n"),
 				fname, ino, lino);
 		} else if (parent == ino)  {
-			add_inode_reached(irec, ino_offset);
-			add_inode_ref(current_irec, current_ino_offset);
+			dir_add_reached(irec, ino_offset);
+			dir_add_ref(current_irec, current_ino_offset);
 		} else if (parent == NULLFSINO) {
 			/* ".." was missing, but this entry refers to it,
 			   so, set it as the parent and mark for rebuild */
 			do_warn(_("entry \"%s\" in dir ino %llu doesn't have a"
 				" .. entry, will set it in ino %llu.\n"),
 				fname, ino, lino);
-			set_inode_parent(irec, ino_offset, ino);
-			add_inode_reached(irec, ino_offset);
-			add_inode_ref(current_irec, current_ino_offset);
+			dir_set_parent(irec, ino_offset, ino);
+			dir_add_reached(irec, ino_offset);
+			dir_add_ref(current_irec, current_ino_offset);
 		} else {
 			junkit = 1;
 			do_warn(_("entry \"%s\" in dir ino %llu not consistent"
 				" with .. value (%llu) in ino %llu,\n"),
 				fname, ino, parent, lino);
 		}
+		unlock_reached();
 
 		if (junkit)  {
-			if (lino == orphanage_ino)
-				orphanage_ino = 0;
+			forget_orphanage(lino);
 			junkit = 0;
 			nbad++;
-			if (!no_modify)  {
+			if (!dir_no_modify())  {
 				namest->name[0] = '/';
 				*dirty = 1;
 				if (verbose)
@@ -1549,7 +1750,7 @@ longform_dir_entry_check(xfs_mount_t	*mp,
 
 	fsbno = map_first_dblock_fsbno(mp, ino, ip, &da_bno);
 
-	if (fsbno == NULLDFSBNO && no_modify)  {
+	if (fsbno == NULLDFSBNO && dir_no_modify())  {
 		do_warn(_("cannot map block 0 of directory inode %llu\n"), ino);
 		return;
 	}
@@ -1571,7 +1772,7 @@ longform_dir_entry_check(xfs_mount_t	*mp,
 		leaf = (xfs_dir_leafblock_t *)XFS_BUF_PTR(bp);
 
 		if (be16_to_cpu(leaf->hdr.info.magic) != XFS_DIR_LEAF_MAGIC) {
-			if (!no_modify)  {
+			if (!dir_no_modify())  {
 				do_error(
 _("bad magic # (0x%x) for dir ino %llu leaf block (bno %u fsbno %llu)\n"),
 					be16_to_cpu(leaf->hdr.info.magic),
@@ -1594,9 +1795,9 @@ _("bad magic # (0x%x) for dir ino %llu leaf block (bno %u fsbno %llu)\n"),
 
 		da_bno = be32_to_cpu(leaf->hdr.info.forw);
 
-		ASSERT(dirty == 0 || (dirty && !no_modify));
+		ASSERT(dirty == 0 || (dirty && !dir_no_modify()));
 
-		if (dirty && !no_modify)
+		if (dirty && !dir_no_modify())
 			libxfs_writebuf(bp, 0);
 		else
 			libxfs_putbuf(bp);
@@ -1608,7 +1809,7 @@ _("bad magic # (0x%x) for dir ino %llu leaf block (bno %u fsbno %llu)\n"),
 					XFS_BMAPI_METADATA, &fblock, 0,
 					&map, &nmap, NULL, NULL);
 			if (error || nmap != 1)  {
-				if (!no_modify)
+				if (!dir_no_modify())
 					do_error(
 _("can't map leaf block %d in dir %llu, xfs_bmapi returns %d, nmap = %d\n"),
 						da_bno, ino, error, nmap);
@@ -1621,7 +1822,7 @@ _("can't map leaf block %d in dir %llu, xfs_bmapi returns %d, nmap = %d\n"),
 			}
 			fsbno = map.br_startblock;
 			if (fsbno == HOLESTARTBLOCK)  {
-				if (!no_modify)
+				if (!dir_no_modify())
 					do_error(
 				_("block %d in %s ino %llu doesn't exist\n"),
 						da_bno, ftype, ino);
@@ -1949,7 +2150,7 @@ longform_dir2_entry_check_data(
 			do_warn(_("corrupt block %u in directory inode %llu: "),
 				da_bno, ip->i_ino);
 		}
-		if (!no_modify) {
+		if (!dir_no_modify()) {
 			do_warn(_("junking block\n"));
 			dir2_kill_block(mp, ip, da_bno, bp);
 		} else {
@@ -1979,7 +2180,7 @@ longform_dir2_entry_check_data(
 		do_warn(_("bad directory block magic # %#x for directory inode "
 			"%llu block %d: "),
 			be32_to_cpu(d->hdr.magic), ip->i_ino, da_bno);
-		if (!no_modify) {
+		if (!dir_no_modify()) {
 			do_warn(_("fixing magic # to %#x\n"), wantmagic);
 			d->hdr.magic = cpu_to_be32(wantmagic);
 			needlog = 1;
@@ -2007,7 +2208,7 @@ longform_dir2_entry_check_data(
 				do_warn(_("directory inode %llu block %u has "
 					  "consecutive free entries: "),
 					ip->i_ino, da_bno);
-				if (!no_modify) {
+				if (!dir_no_modify()) {
 					do_warn(_("joining together\n"));
 					len = be16_to_cpu(dup->length);
 					libxfs_dir2_data_use_free(tp, bp, dup,
@@ -2035,7 +2236,7 @@ longform_dir2_entry_check_data(
 		 */
 		if (dep->name[0] == '/')  {
 			nbad++;
-			if (!no_modify)
+			if (!dir_no_modify())
 				libxfs_dir2_data_log_entry(tp, bp, dep);
 			continue;
 		}
@@ -2110,8 +2311,7 @@ longform_dir2_entry_check_data(
 				dep->name[0] = '/';
 				libxfs_dir2_data_log_entry(tp, bp, dep);
 			}
-			if (inum == orphanage_ino)
-				orphanage_ino = 0;
+			forget_orphanage(inum);
 			continue;
 		}
 
@@ -2145,7 +2345,7 @@ longform_dir2_entry_check_data(
 			}
 			continue;
 		}
-		ASSERT(no_modify || !verify_inum(mp, inum));
+		ASSERT(dir_no_modify() || !verify_inum(mp, inum));
 		/*
 		 * special case the . entry.  we know there's only one
 		 * '.' and only '.' points to itself because bogus entries
@@ -2157,7 +2357,9 @@ longform_dir2_entry_check_data(
 		 */
 		if (ip->i_ino == inum)  {
 			ASSERT(dep->name[0] == '.' && dep->namelen == 1);
-			add_inode_ref(current_irec, current_ino_offset);
+			lock_reached();
+			dir_add_ref(current_irec, current_ino_offset);
+			unlock_reached();
 			if (da_bno != 0 || dep != (xfs_dir2_data_entry_t *)d->u) {
 				/* "." should be the first entry */
 				nbad++;
@@ -2174,16 +2376,19 @@ longform_dir2_entry_check_data(
 		/*
 		 * skip entries with bogus inumbers if we're in no modify mode
 		 */
-		if (no_modify && verify_inum(mp, inum))
+		if (dir_no_modify() && verify_inum(mp, inum))
 			continue;
 		/*
 		 * check easy case first, regular inode, just bump
 		 * the link count and continue
 		 */
 		if (!inode_isadir(irec, ino_offset))  {
-			add_inode_reached(irec, ino_offset);
+			lock_reached();
+			dir_add_reached(irec, ino_offset);
+			unlock_reached();
 			continue;
 		}
+		lock_reached();
 		parent = get_inode_parent(irec, ino_offset);
 		ASSERT(parent != 0);
 		junkit = 0;
@@ -2200,17 +2405,17 @@ longform_dir2_entry_check_data(
 _("entry \"%s\" in dir %llu points to an already connected directory inode %llu\n"),
 				fname, ip->i_ino, inum);
 		} else if (parent == ip->i_ino)  {
-			add_inode_reached(irec, ino_offset);
-			add_inode_ref(current_irec, current_ino_offset);
+			dir_add_reached(irec, ino_offset);
+			dir_add_ref(current_irec, current_ino_offset);
 		} else if (parent == NULLFSINO) {
 			/* ".." was missing, but this entry refers to it,
 			   so, set it as the parent and mark for rebuild */
 			do_warn(_("entry \"%s\" in dir ino %llu doesn't have a"
 				" .. entry, will set it in ino %llu.\n"),
 				fname, ip->i_ino, inum);
-			set_inode_parent(irec, ino_offset, ip->i_ino);
-			add_inode_reached(irec, ino_offset);
-			add_inode_ref(current_irec, current_ino_offset);
+			dir_set_parent(irec, ino_offset, ip->i_ino);
+			dir_add_reached(irec, ino_offset);
+			dir_add_ref(current_irec, current_ino_offset);
 			add_dotdot_update(XFS_INO_TO_AGNO(mp, inum), irec,
 								ino_offset);
 		} else  {
@@ -2219,12 +2424,12 @@ _("entry \"%s\" in dir %llu points to an already connected directory inode %llu\
 _("entry \"%s\" in dir inode %llu inconsistent with .. value (%llu) in ino %llu\n"),
 				fname, ip->i_ino, parent, inum);
 		}
+		unlock_reached();
 		if (junkit)  {
-			if (inum == orphanage_ino)
-				orphanage_ino = 0;
+			forget_orphanage(inum);
 			junkit = 0;
 			nbad++;
-			if (!no_modify)  {
+			if (!dir_no_modify())  {
 				dep->name[0] = '/';
 				libxfs_dir2_data_log_entry(tp, bp, dep);
 				if (verbose)
@@ -2544,7 +2749,9 @@ longform_dir2_entry_check(xfs_mount_t	*mp,
 								freetab);
 		}
 	}
-	if (!no_modify && (fixit || dotdot_update)) {
+	if (fixit)
+		dir_would_fix = 1;	/* may be silent, e.g. dir2_is_badino */
+	if (!dir_no_modify() && (fixit || dotdot_update)) {
 		dir_hash_dup_names(hashtab);
 		for (i = 0; i < freetab->naents; i++)
 			if (bplist[i])
@@ -2606,7 +2813,9 @@ shortform_dir_entry_check(xfs_mount_t	*mp,
 	 * the directory is reached or will be taken care of when the
 	 * directory is moved to orphanage.
 	 */
-	add_inode_ref(current_irec, current_ino_offset);
+	lock_reached();
+	dir_add_ref(current_irec, current_ino_offset);
+	unlock_reached();
 
 	/*
 	 * now run through entries, stop at first bad entry, don't need
@@ -2632,9 +2841,9 @@ shortform_dir_entry_check(xfs_mount_t	*mp,
 
 		namelen = sf_entry->namelen;
 
-		ASSERT(no_modify || namelen > 0);
+		ASSERT(dir_no_modify() || namelen > 0);
 
-		if (no_modify && namelen == 0)  {
+		if (dir_no_modify() && namelen == 0)  {
 			/*
 			 * if we're really lucky, this is
 			 * the last entry in which case we
@@ -2656,7 +2865,7 @@ shortform_dir_entry_check(xfs_mount_t	*mp,
 				 */
 				break;
 			}
-		} else if (no_modify && (__psint_t) sf_entry - (__psint_t) sf +
+		} else if (dir_no_modify() && (__psint_t) sf_entry - (__psint_t) sf +
 				+ xfs_dir_sf_entsize_byentry(sf_entry)
 				> ip->i_d.di_size)  {
 			bad_sfnamelen = 1;
@@ -2677,8 +2886,8 @@ shortform_dir_entry_check(xfs_mount_t	*mp,
 		memmove(fname, sf_entry->name, sf_entry->namelen);
 		fname[sf_entry->namelen] = '\0';
 
-		ASSERT(no_modify || lino != NULLFSINO);
-		ASSERT(no_modify || !verify_inum(mp, lino));
+		ASSERT(dir_no_modify() || lino != NULLFSINO);
+		ASSERT(dir_no_modify() || !verify_inum(mp, lino));
 
 		irec = find_inode_rec(XFS_INO_TO_AGNO(mp, lino),
 					XFS_INO_TO_AGINO(mp, lino));
@@ -2734,12 +2943,15 @@ shortform_dir_entry_check(xfs_mount_t	*mp,
 			 * check easy case first, regular inode, just bump
 			 * the link count and continue
 			 */
-			add_inode_reached(irec, ino_offset);
+			lock_reached();
+			dir_add_reached(irec, ino_offset);
+			unlock_reached();
 
 			next_sfe = (xfs_dir_sf_entry_t *)((__psint_t)sf_entry +
 					xfs_dir_sf_entsize_byentry(sf_entry));
 			continue;
 		} else  {
+			lock_reached();
 			parent = get_inode_parent(irec, ino_offset);
 
 			/*
@@ -2753,17 +2965,17 @@ shortform_dir_entry_check(xfs_mount_t	*mp,
 					"already connected dir ino %llu,\n"),
 					fname, ino, lino);
 			} else if (parent == ino)  {
-				add_inode_reached(irec, ino_offset);
-				add_inode_ref(current_irec, current_ino_offset);
+				dir_add_reached(irec, ino_offset);
+				dir_add_ref(current_irec, current_ino_offset);
 			} else if (parent == NULLFSINO) {
 				/* ".." was missing, but this entry refers to it,
 				so, set it as the parent and mark for rebuild */
 				do_warn(_("entry \"%s\" in dir ino %llu doesn't have a"
 					" .. entry, will set it in ino %llu.\n"),
 					fname, ino, lino);
-				set_inode_parent(irec, ino_offset, ino);
-				add_inode_reached(irec, ino_offset);
-				add_inode_ref(current_irec, current_ino_offset);
+				dir_set_parent(irec, ino_offset, ino);
+				dir_add_reached(irec, ino_offset);
+				dir_add_ref(current_irec, current_ino_offset);
 			} else  {
 				junkit = 1;
 				do_warn(_("entry \"%s\" in dir %llu not "
@@ -2771,12 +2983,12 @@ shortform_dir_entry_check(xfs_mount_t	*mp,
 					"dir ino %llu"),
 					fname, ino, parent, lino);
 			}
+			unlock_reached();
 		}
 		if (junkit)  {
 do_junkit:
-			if (lino == orphanage_ino)
-				orphanage_ino = 0;
-			if (!no_modify)  {
+			forget_orphanage(lino);
+			if (!dir_no_modify())  {
 				tmp_elen = xfs_dir_sf_entsize_byentry(sf_entry);
 				tmp_sfe = (xfs_dir_sf_entry_t *)
 					((__psint_t) sf_entry + tmp_elen);
@@ -2823,7 +3035,7 @@ do_junkit:
 		 * with bad namelen into account in no modify mode since we
 		 * calculate size based on next_sfe.
 		 */
-		ASSERT(no_modify || bad_sfnamelen == 0);
+		ASSERT(dir_no_modify() || bad_sfnamelen == 0);
 
 		next_sfe = (tmp_sfe == NULL)
 			? (xfs_dir_sf_entry_t *) ((__psint_t) sf_entry
@@ -2840,7 +3052,7 @@ do_junkit:
 	 */
 	if (*ino_dirty)  {
 		ASSERT(bytes_deleted > 0);
-		ASSERT(!no_modify);
+		ASSERT(!dir_no_modify());
 		libxfs_idata_realloc(ip, -bytes_deleted, XFS_DATA_FORK);
 		ip->i_d.di_size -= bytes_deleted;
 	}
@@ -2901,7 +3113,7 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 	 */
 	if (dotdot_update) {
 		parent = get_inode_parent(current_irec, current_ino_offset);
-		if (no_modify) {
+		if (dir_no_modify()) {
 			do_warn(_("would set .. in sf dir inode %llu to %llu\n"),
 				ino, parent);
 		} else {
@@ -2919,7 +3131,9 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 	 * the directory is reached or will be taken care of when the
 	 * directory is moved to orphanage.
 	 */
-	add_inode_ref(current_irec, current_ino_offset);
+	lock_reached();
+	dir_add_ref(current_irec, current_ino_offset);
+	unlock_reached();
 
 	/*
 	 * Initialise i8 counter -- the parent inode number counts as well.
@@ -2945,9 +3159,9 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 
 		namelen = sfep->namelen;
 
-		ASSERT(no_modify || namelen > 0);
+		ASSERT(dir_no_modify() || namelen > 0);
 
-		if (no_modify && namelen == 0)  {
+		if (dir_no_modify() && namelen == 0)  {
 			/*
 			 * if we're really lucky, this is
 			 * the last entry in which case we
@@ -2969,7 +3183,7 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 				 */
 				break;
 			}
-		} else if (no_modify && (__psint_t) sfep - (__psint_t) sfp +
+		} else if (dir_no_modify() && (__psint_t) sfep - (__psint_t) sfp +
 				+ xfs_dir2_sf_entsize_byentry(sfp, sfep)
 				> ip->i_d.di_size)  {
 			bad_sfnamelen = 1;
@@ -2990,15 +3204,15 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 		memmove(fname, sfep->name, sfep->namelen);
 		fname[sfep->namelen] = '\0';
 
-		ASSERT(no_modify || (lino != NULLFSINO && lino != 0));
-		ASSERT(no_modify || !verify_inum(mp, lino));
+		ASSERT(dir_no_modify() || (lino != NULLFSINO && lino != 0));
+		ASSERT(dir_no_modify() || !verify_inum(mp, lino));
 
 		/*
 		 * Also skip entries with bogus inode numbers if we're
 		 * in no modify mode.
 		 */
 
-		if (no_modify && verify_inum(mp, lino))  {
+		if (dir_no_modify() && verify_inum(mp, lino))  {
 			next_sfep = (xfs_dir2_sf_entry_t *)((__psint_t)sfep +
 					xfs_dir2_sf_entsize_byentry(sfp, sfep));
 			continue;
@@ -3062,8 +3276,11 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 			 * check easy case first, regular inode, just bump
 			 * the link count
 			 */
-			add_inode_reached(irec, ino_offset);
+			lock_reached();
+			dir_add_reached(irec, ino_offset);
+			unlock_reached();
 		} else  {
+			lock_reached();
 			parent = get_inode_parent(irec, ino_offset);
 
 			/*
@@ -3078,17 +3295,17 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 					  "%llu,\n"),
 					fname, ino, lino);
 			} else if (parent == ino)  {
-				add_inode_reached(irec, ino_offset);
-				add_inode_ref(current_irec, current_ino_offset);
+				dir_add_reached(irec, ino_offset);
+				dir_add_ref(current_irec, current_ino_offset);
 			} else if (parent == NULLFSINO) {
 				/* ".." was missing, but this entry refers to it,
 				so, set it as the parent and mark for rebuild */
 				do_warn(_("entry \"%s\" in dir ino %llu doesn't have a"
 					" .. entry, will set it in ino %llu.\n"),
 					fname, ino, lino);
-				set_inode_parent(irec, ino_offset, ino);
-				add_inode_reached(irec, ino_offset);
-				add_inode_ref(current_irec, current_ino_offset);
+				dir_set_parent(irec, ino_offset, ino);
+				dir_add_reached(irec, ino_offset);
+				dir_add_ref(current_irec, current_ino_offset);
 				add_dotdot_update(XFS_INO_TO_AGNO(mp, lino),
 							irec, ino_offset);
 			} else  {
@@ -3098,13 +3315,13 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 					  " in inode %llu,\n"),
 					fname, ino, parent, lino);
 			}
+			unlock_reached();
 		}
 
 		if (junkit)  {
 do_junkit:
-			if (lino == orphanage_ino)
-				orphanage_ino = 0;
-			if (!no_modify)  {
+			forget_orphanage(lino);
+			if (!dir_no_modify())  {
 				tmp_elen = xfs_dir2_sf_entsize_byentry(sfp, sfep);
 				tmp_sfep = (xfs_dir2_sf_entry_t *)
 					((__psint_t) sfep + tmp_elen);
@@ -3152,7 +3369,7 @@ do_junkit:
 		 * with bad namelen into account in no modify mode since we
 		 * calculate size based on next_sfep.
 		 */
-		ASSERT(no_modify || bad_sfnamelen == 0);
+		ASSERT(dir_no_modify() || bad_sfnamelen == 0);
 
 		next_sfep = (tmp_sfep == NULL)
 			? (xfs_dir2_sf_entry_t *) ((__psint_t) sfep
@@ -3163,7 +3380,7 @@ do_junkit:
 	}
 
 	if (sfp->hdr.i8count != i8) {
-		if (no_modify) {
+		if (dir_no_modify()) {
 			do_warn(_("would fix i8count in inode %llu\n"), ino);
 		} else {
 			if (i8 == 0) {
@@ -3185,7 +3402,7 @@ do_junkit:
 	 */
 	if (*ino_dirty)  {
 		ASSERT(bytes_deleted > 0);
-		ASSERT(!no_modify);
+		ASSERT(!dir_no_modify());
 		libxfs_idata_realloc(ip, -bytes_deleted, XFS_DATA_FORK);
 		ip->i_d.di_size -= bytes_deleted;
 	}
@@ -3234,7 +3451,7 @@ process_dir_inode(
 
 	error = libxfs_iget(mp, NULL, ino, 0, &ip, 0);
 	if (error) {
-		if (!no_modify)
+		if (!dir_no_modify())
 			do_error(_("couldn't map inode %llu, err = %d\n"),
 				ino, error);
 		else  {
@@ -3247,12 +3464,16 @@ process_dir_inode(
 			 * as being disconnected in the no_modify case.
 			 */
 			if (mp->m_sb.sb_rootino == ino)  {
-				add_inode_reached(irec, 0);
-				add_inode_ref(irec, 0);
+				lock_reached();
+				dir_add_reached(irec, 0);
+				dir_add_ref(irec, 0);
+				unlock_reached();
 			}
 		}
 
-		add_inode_refchecked(ino, irec, 0);
+		lock_reached();
+		dir_add_refchecked(ino, irec, 0);
+		unlock_reached();
 		return;
 	}
 
@@ -3267,10 +3488,14 @@ process_dir_inode(
 		 * that root's '..' is always good --
 		 * guaranteed by phase 3 and/or below.
 		 */
-		add_inode_reached(irec, ino_offset);
+		lock_reached();
+		dir_add_reached(irec, ino_offset);
+		unlock_reached();
 	}
 
-	add_inode_refchecked(ino, irec, ino_offset);
+	lock_reached();
+	dir_add_refchecked(ino, irec, ino_offset);
+	unlock_reached();
 
 	hashtab = dir_hash_init(ip->i_d.di_size);
 
@@ -3306,7 +3531,7 @@ process_dir_inode(
 			 * inode but it's easier than wedging a
 			 * new define in ourselves.
 			 */
-			nres = no_modify ? 0 : XFS_REMOVE_SPACE_RES(mp);
+			nres = dir_no_modify() ? 0 : XFS_REMOVE_SPACE_RES(mp);
 			error = libxfs_trans_reserve(tp, nres,
 					XFS_REMOVE_LOG_RES(mp), 0,
 					XFS_TRANS_PERM_LOG_RES,
@@ -3326,7 +3551,7 @@ process_dir_inode(
 							irec, ino_offset,
 							hashtab);
 
-			ASSERT(dirty == 0 || (dirty && !no_modify));
+			ASSERT(dirty == 0 || (dirty && !dir_no_modify()));
 			if (dirty)  {
 				libxfs_trans_log_inode(tp, ip,
 					XFS_ILOG_CORE | XFS_ILOG_DDATA);
@@ -3362,7 +3587,9 @@ process_dir_inode(
 				num_illegal, ino);
 		}
 		if (need_dot) {
-			add_inode_ref(irec, ino_offset);
+			lock_reached();
+			dir_add_ref(irec, ino_offset);
+			unlock_reached();
 
 			do_warn(_("missing \".\" entry in dir ino %llu, "
 				"cannot in fix V1 dir filesystem\n"), ino);
@@ -3380,7 +3607,7 @@ process_dir_inode(
 	 * in hash-value order so the simulation won't get confused
 	 * if it has to move them around.
 	 */
-	if (!no_modify && need_root_dotdot && ino == mp->m_sb.sb_rootino)  {
+	if (!dir_no_modify() && need_root_dotdot && ino == mp->m_sb.sb_rootino)  {
 		ASSERT(ip->i_d.di_format != XFS_DINODE_FMT_LOCAL);
 
 		do_warn(_("recreating root directory .. entry\n"));
@@ -3434,9 +3661,11 @@ process_dir_inode(
 		 * it turns out to be wrong, we'll catch
 		 * that in phase 7.
 		 */
-		add_inode_ref(irec, ino_offset);
+		lock_reached();
+		dir_add_ref(irec, ino_offset);
+		unlock_reached();
 
-		if (no_modify)  {
+		if (dir_no_modify())  {
 			do_warn(_("would create missing \".\" entry in dir ino %llu\n"),
 				ino);
 		} else if (ip->i_d.di_format != XFS_DINODE_FMT_LOCAL)  {
@@ -3562,7 +3791,7 @@ check_for_orphaned_inodes(
 			do_warn(_("disconnected inode %llu, "), ino);
 		if (!xfs_sb_version_hasdirv2(&mp->m_sb)) 
 			do_warn(_("cannot fix in V1 dir filesystem\n"));
-		else if (!no_modify)  {
+		else if (!dir_no_modify())  {
 		    	if (!orphanage_ino)
 				orphanage_ino = mk_orphanage(mp);
 			do_warn(_("moving to %s\n"), ORPHANAGE);
@@ -3579,6 +3808,41 @@ check_for_orphaned_inodes(
 	}
 }
 
+/*
+ * Check a directory without changing anything.  If it needs fixing,
+ * undo what the check did to the incore state and queue it for the
+ * serial pass.
+ */
+static void
+look_at_dir_inode(
+	xfs_mount_t		*mp,
+	xfs_agnumber_t		agno,
+	ino_tree_node_t		*irec,
+	int			ino_offset)
+{
+	dir_later_list_t	*later = &dirs_later[agno / ag_stride];
+
+	muted_warnings = 0;
+	dir_would_fix = 0;
+	dir_nundo = 0;
+	process_dir_inode(mp, agno, irec, ino_offset);
+	if (muted_warnings == 0 && dir_would_fix == 0)
+		return;
+
+	undo_dir_updates();
+	if (later->ndirs == later->maxdirs) {
+		later->maxdirs = later->maxdirs ? later->maxdirs * 2 : 64;
+		later->dirs = realloc(later->dirs,
+				later->maxdirs * sizeof(dir_later_t));
+		if (later->dirs == NULL)
+			do_error(_("couldn't allocate phase 6 directory list\n"));
+	}
+	later->dirs[later->ndirs].agno = agno;
+	later->dirs[later->ndirs].irec = irec;
+	later->dirs[later->ndirs].ino_offset = ino_offset;
+	later->ndirs++;
+}
+
 static void
 traverse_function(
 	work_queue_t		*wq,
@@ -3587,6 +3851,7 @@ traverse_function(
 {
 	ino_tree_node_t 	*irec;
 	int			i;
+	__uint64_t		ndirs = 0;
 	prefetch_args_t		*pf_args = arg;
 
 	wait_for_inode_prefetch(pf_args);
@@ -3594,6 +3859,10 @@ traverse_function(
 	if (verbose)
 		do_log(_("        - agno = %d\n"), agno);
 
+	if (dirs_later) {
+		dir_looking = 1;
+		warnings_muted = 1;
+	}
 	for (irec = findfirst_inode_rec(agno); irec; irec = next_ino_rec(irec)) {
 		if (irec->ino_isa_dir == 0)
 			continue;
@@ -3602,11 +3871,27 @@ traverse_function(
 			sem_post(&pf_args->ra_count);
 
 		for (i = 0; i < XFS_INODES_PER_CHUNK; i++)  {
-			if (inode_isadir(irec, i))
+			if (!inode_isadir(irec, i))
+				continue;
+			if (dir_looking)
+				look_at_dir_inode(wq->mp, agno, irec, i);
+			else
 				process_dir_inode(wq->mp, agno, irec, i);
+			ndirs++;
 		}
 	}
+	if (dir_looking) {
+		dir_looking = 0;
+		warnings_muted = 0;
+		free(dir_undo);
+		dir_undo = NULL;
+		dir_maxundo = 0;
+	}
 	cleanup_inode_prefetch(pf_args);
+
+	PROG_RPT_INC(prog_rpt_done[agno], 1);
+	if (traverse_parallel)
+		PROG_RPT_THREAD_INC(agno / ag_stride, ndirs);
 }
 
 static void
@@ -3628,14 +3913,81 @@ update_missing_dotdot_entries(
 	}
 }
 
+/*
+ * Check and fix, one at a time, the directories the workers found to
+ * need fixing
+ */
+static void
+fix_dirs_later(
+	xfs_mount_t		*mp)
+{
+	dir_later_list_t	*later;
+	int			i;
+	int			j;
+
+	for (i = 0; i < thread_count; i++) {
+		later = &dirs_later[i];
+		for (j = 0; j < later->ndirs; j++)
+			process_dir_inode(mp, later->dirs[j].agno,
+					later->dirs[j].irec,
+					later->dirs[j].ino_offset);
+		free(later->dirs);
+	}
+	free(dirs_later);
+	dirs_later = NULL;
+}
+
 static void
 traverse_ags(
 	xfs_mount_t 		*mp)
 {
 	int			i;
+	xfs_agnumber_t		agno;
 	work_queue_t		queue;
+	work_queue_t		*queues;
 	prefetch_args_t		*pf_args[2];
 
+	/*
+	 * With ag_stride set give each segment of the volume its own worker
+	 * and prefetch chain as phase 4 does.  Without modifications the
+	 * only state shared between directories is the incore inode tree;
+	 * otherwise the workers only look and the directories that need
+	 * fixing are done afterwards (see traverse_parallel).
+	 */
+	if (ag_stride && do_prefetch) {
+		queues = malloc(thread_count * sizeof(work_queue_t));
+		if (queues == NULL)
+			do_error(_("cannot allocate phase 6 work queues\n"));
+		if (!dir_no_modify()) {
+			dirs_later = calloc(thread_count,
+					sizeof(dir_later_list_t));
+			if (dirs_later == NULL)
+				do_error(
+				_("cannot allocate phase 6 directory lists\n"));
+		}
+
+		traverse_parallel = 1;
+		set_progress_threads(thread_count, _("directories"));
+		for (i = 0, agno = 0; i < thread_count; i++) {
+			create_work_queue(&queues[i], mp, 1);
+			pf_args[0] = NULL;
+			for (; agno < (i + 1) * ag_stride &&
+					agno < glob_agcount; agno++) {
+				pf_args[0] = start_inode_prefetch(agno, 1,
+						pf_args[0]);
+				queue_work(&queues[i], traverse_function, agno,
+						pf_args[0]);
+			}
+		}
+		for (i = 0; i < thread_count; i++)
+			destroy_work_queue(&queues[i]);
+		traverse_parallel = 0;
+		free(queues);
+		if (dirs_later)
+			fix_dirs_later(mp);
+		return;
+	}
+
 	/*
 	 * we always do prefetch for phase 6 as it will fill in the gaps
 	 * not read during phase 3 prefetch.
@@ -3675,7 +4027,7 @@ phase6(xfs_mount_t *mp)
 		if (!xfs_sb_version_hasdirv2(&mp->m_sb))
 			do_warn(_("need to reinitialize root directory, "
 				"but not supported on V1 dir filesystem\n"));
-		else if (!no_modify)  {
+		else if (!dir_no_modify())  {
 			do_warn(_("reinitializing root directory\n"));
 			mk_root_dir(mp);
 			need_root_inode = 0;
@@ -3686,7 +4038,7 @@ phase6(xfs_mount_t *mp)
 	}
 
 	if (need_rbmino)  {
-		if (!no_modify)  {
+		if (!dir_no_modify())  {
 			do_warn(_("reinitializing realtime bitmap inode\n"));
 			mk_rbmino(mp);
 			need_rbmino = 0;
@@ -3696,7 +4048,7 @@ phase6(xfs_mount_t *mp)
 	}
 
 	if (need_rsumino)  {
-		if (!no_modify)  {
+		if (!dir_no_modify())  {
 			do_warn(_("reinitializing realtime summary inode\n"));
 			mk_rsumino(mp);
 			need_rsumino = 0;
@@ -3705,7 +4057,7 @@ phase6(xfs_mount_t *mp)
 		}
 	}
 
-	if (!no_modify)  {
+	if (!dir_no_modify())  {
 		do_log(
 _("        - resetting contents of realtime bitmap and summary inodes\n"));
 		if (fill_rbmino(mp))  {
@@ -3737,7 +4089,10 @@ _("        - resetting contents of realtime bitmap and summary inodes\n"));
 	/*
 	 * then process all inodes by walking incore inode tree
 	 */
+	set_progress_msg(PROG_FMT_TRAVERSAL, (__uint64_t) glob_agcount);
 	traverse_ags(mp);
+	print_final_rpt();
+	set_progress_threads(0, NULL);
 
 	/*
 	 * any directories that had updated ".." entries, rebuild them now
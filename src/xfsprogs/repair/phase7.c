@@ -26,6 +26,7 @@
 #include "dinode.h"
 #include "versions.h"
 #include "progress.h"
+#include "spill.h"
 
 /* dinoc is a pointer to the IN-CORE dinode core */
 static void
@@ -132,6 +133,7 @@ phase7(xfs_mount_t *mp)
 	 * links is bad, reset it, log the inode core, commit the transaction
 	 */
 	for (i = 0; i < glob_agcount; i++)  {
+		spill_prefetch_ag(i);
 		irec = findfirst_inode_rec(i);
 
 		while (irec != NULL)  {
@@ -155,5 +157,6 @@ phase7(xfs_mount_t *mp)
 			}
 			irec = next_ino_rec(irec);
 		}
+		spill_release_ag(i);
 	}
 }
@@ -1,3 +1,14 @@
+#ifdef HAVE_IO_URING
+/*
+ * linux/io_uring.h pulls in linux/fs.h, which has its own definition of
+ * struct fsxattr, so it has to come first and suppress the xfs_fs.h one.
+ */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#define HAVE_FSXATTR
+#endif
 #include <libxfs.h>
 #include <pthread.h>
 #include "avl.h"
@@ -32,6 +43,8 @@ static int		pf_max_bbs;
 static int		pf_max_fsbs;
 static int		pf_batch_bytes;
 static int		pf_batch_fsbs;
+static int		pf_io_threads = PF_THREAD_COUNT;
+static void		*(*pf_io_engine)(void *);
 
 static void		pf_read_inode_dirs(prefetch_args_t *, xfs_buf_t *);
 
@@ -385,135 +398,190 @@ pf_read_inode_dirs(
 }
 
 /*
- * pf_batch_read must be called with the lock locked.
+ * A batch of buffers covering one contiguous read.
  */
+typedef struct pf_batch {
+	xfs_buf_t		*bplist[MAX_BUFS + 1];
+	unsigned int		num;
+	pf_which_t		which;
+	off64_t			first_off;
+	off64_t			last_off;
+} pf_batch_t;
 
-static void
-pf_batch_read(
+/*
+ * Pick the next batch of buffers to read from the given queue and take
+ * them off the queue.  Returns the number of buffers in the batch, zero
+ * if there is nothing left to read.
+ *
+ * pf_batch_select must be called with the lock locked.
+ */
+static int
+pf_batch_select(
 	prefetch_args_t		*args,
 	pf_which_t		which,
-	void			*buf)
+	pf_batch_t		*batch)
 {
-	xfs_buf_t		*bplist[MAX_BUFS];
+	xfs_buf_t		**bplist = batch->bplist;
 	unsigned int		num;
 	off64_t			first_off, last_off, next_off;
-	int			len, size;
 	int			i;
 	int			inode_bufs;
 	unsigned long		fsbno;
 	unsigned long		max_fsbno;
-	char			*pbuf;
 
-	for (;;) {
-		num = 0;
-		if (which == PF_SECONDARY) {
-			bplist[0] = btree_find(args->io_queue, 0, &fsbno);
-			max_fsbno = MIN(fsbno + pf_max_fsbs,
-							args->last_bno_read);
-		} else {
-			bplist[0] = btree_find(args->io_queue,
-						args->last_bno_read, &fsbno);
-			max_fsbno = fsbno + pf_max_fsbs;
-		}
-		while (bplist[num] && num < MAX_BUFS && fsbno < max_fsbno) {
-			if (which != PF_META_ONLY ||
-			    !B_IS_INODE(XFS_BUF_PRIORITY(bplist[num])))
-				num++;
-			bplist[num] = btree_lookup_next(args->io_queue, &fsbno);
-		}
-		if (!num)
-			return;
+	num = 0;
+	if (which == PF_SECONDARY) {
+		bplist[0] = btree_find(args->io_queue, 0, &fsbno);
+		max_fsbno = MIN(fsbno + pf_max_fsbs,
+						args->last_bno_read);
+	} else {
+		bplist[0] = btree_find(args->io_queue,
+					args->last_bno_read, &fsbno);
+		max_fsbno = fsbno + pf_max_fsbs;
+	}
+	while (bplist[num] && num < MAX_BUFS && fsbno < max_fsbno) {
+		if (which != PF_META_ONLY ||
+		    !B_IS_INODE(XFS_BUF_PRIORITY(bplist[num])))
+			num++;
+		bplist[num] = btree_lookup_next(args->io_queue, &fsbno);
+	}
+	if (!num)
+		return 0;
 
-		/*
-		 * do a big read if 25% of the potential buffer is useful,
-		 * otherwise, find as many close together blocks and
-		 * read them in one read
-		 */
-		first_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[0]));
+	/*
+	 * do a big read if 25% of the potential buffer is useful,
+	 * otherwise, find as many close together blocks and
+	 * read them in one read
+	 */
+	first_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[0]));
+	last_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[num-1])) +
+		XFS_BUF_SIZE(bplist[num-1]);
+	while (last_off - first_off > pf_max_bytes) {
+		num--;
 		last_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[num-1])) +
 			XFS_BUF_SIZE(bplist[num-1]);
-		while (last_off - first_off > pf_max_bytes) {
-			num--;
-			last_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[num-1])) +
-				XFS_BUF_SIZE(bplist[num-1]);
-		}
-		if (num < ((last_off - first_off) >> (mp->m_sb.sb_blocklog + 3))) {
-			/*
-			 * not enough blocks for one big read, so determine
-			 * the number of blocks that are close enough.
-			 */
-			last_off = first_off + XFS_BUF_SIZE(bplist[0]);
-			for (i = 1; i < num; i++) {
-				next_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) +
-						XFS_BUF_SIZE(bplist[i]);
-				if (next_off - last_off > pf_batch_bytes)
-					break;
-				last_off = next_off;
-			}
-			num = i;
+	}
+	if (num < ((last_off - first_off) >> (mp->m_sb.sb_blocklog + 3))) {
+		/*
+		 * not enough blocks for one big read, so determine
+		 * the number of blocks that are close enough.
+		 */
+		last_off = first_off + XFS_BUF_SIZE(bplist[0]);
+		for (i = 1; i < num; i++) {
+			next_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) +
+					XFS_BUF_SIZE(bplist[i]);
+			if (next_off - last_off > pf_batch_bytes)
+				break;
+			last_off = next_off;
 		}
+		num = i;
+	}
 
-		for (i = 0; i < num; i++) {
-			if (btree_delete(args->io_queue, XFS_DADDR_TO_FSB(mp,
-					XFS_BUF_ADDR(bplist[i]))) == NULL)
-				do_error(_("prefetch corruption\n"));
-		}
+	for (i = 0; i < num; i++) {
+		if (btree_delete(args->io_queue, XFS_DADDR_TO_FSB(mp,
+				XFS_BUF_ADDR(bplist[i]))) == NULL)
+			do_error(_("prefetch corruption\n"));
+	}
 
-		if (which == PF_PRIMARY) {
-			for (inode_bufs = 0, i = 0; i < num; i++) {
-				if (B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])))
-					inode_bufs++;
-			}
-			args->inode_bufs_queued -= inode_bufs;
-			if (inode_bufs && (first_off >> mp->m_sb.sb_blocklog) >
-					pf_batch_fsbs)
-				args->last_bno_read = (first_off >> mp->m_sb.sb_blocklog);
+	if (which == PF_PRIMARY) {
+		for (inode_bufs = 0, i = 0; i < num; i++) {
+			if (B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])))
+				inode_bufs++;
 		}
+		args->inode_bufs_queued -= inode_bufs;
+		if (inode_bufs && (first_off >> mp->m_sb.sb_blocklog) >
+				pf_batch_fsbs)
+			args->last_bno_read = (first_off >> mp->m_sb.sb_blocklog);
+	}
 #ifdef XR_PF_TRACE
-		pftrace("reading bbs %llu to %llu (%d bufs) from %s queue in AG %d (last_bno = %lu, inode_bufs = %d)",
-			(long long)XFS_BUF_ADDR(bplist[0]),
-			(long long)XFS_BUF_ADDR(bplist[num-1]), num,
-			(which != PF_SECONDARY) ? "pri" : "sec", args->agno,
-			args->last_bno_read, args->inode_bufs_queued);
+	pftrace("reading bbs %llu to %llu (%d bufs) from %s queue in AG %d (last_bno = %lu, inode_bufs = %d)",
+		(long long)XFS_BUF_ADDR(bplist[0]),
+		(long long)XFS_BUF_ADDR(bplist[num-1]), num,
+		(which != PF_SECONDARY) ? "pri" : "sec", args->agno,
+		args->last_bno_read, args->inode_bufs_queued);
 #endif
+	batch->num = num;
+	batch->which = which;
+	batch->first_off = first_off;
+	batch->last_off = last_off;
+	return num;
+}
+
+/*
+ * Copy the data read for a batch into its xfs_buf_t's and release them.
+ * len is the result of the read.
+ */
+static void
+pf_batch_complete(
+	prefetch_args_t		*args,
+	pf_batch_t		*batch,
+	void			*buf,
+	int			len)
+{
+	xfs_buf_t		**bplist = batch->bplist;
+	int			size;
+	int			i;
+	char			*pbuf;
+
+	if (len > 0) {
+		/*
+		 * go through the xfs_buf_t list copying from the
+		 * read buffer into the xfs_buf_t's and release them.
+		 */
+		for (i = 0; i < batch->num; i++) {
+
+			pbuf = ((char *)buf) + (LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) - batch->first_off);
+			size = XFS_BUF_SIZE(bplist[i]);
+			if (len < size)
+				break;
+			memcpy(XFS_BUF_PTR(bplist[i]), pbuf, size);
+			bplist[i]->b_flags |= LIBXFS_B_UPTODATE;
+			len -= size;
+			if (B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])))
+				pf_read_inode_dirs(args, bplist[i]);
+			else if (batch->which == PF_META_ONLY)
+				XFS_BUF_SET_PRIORITY(bplist[i],
+							B_DIR_META_H);
+			else if (batch->which == PF_PRIMARY && batch->num == 1)
+				XFS_BUF_SET_PRIORITY(bplist[i],
+							B_DIR_META_S);
+		}
+	}
+	for (i = 0; i < batch->num; i++) {
+		pftrace("putbuf %c %p (%llu) in AG %d",
+			B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])) ? 'I' : 'M',
+			bplist[i], (long long)XFS_BUF_ADDR(bplist[i]),
+			args->agno);
+		libxfs_putbuf(bplist[i]);
+	}
+}
+
+/*
+ * pf_batch_read must be called with the lock locked.
+ */
+
+static void
+pf_batch_read(
+	prefetch_args_t		*args,
+	pf_which_t		which,
+	void			*buf)
+{
+	pf_batch_t		batch;
+	int			len;
+
+	for (;;) {
+		if (!pf_batch_select(args, which, &batch))
+			return;
+
 		pthread_mutex_unlock(&args->lock);
 
 		/*
 		 * now read the data and put into the xfs_but_t's
 		 */
-		len = pread64(mp_fd, buf, (int)(last_off - first_off), first_off);
-		if (len > 0) {
-			/*
-			 * go through the xfs_buf_t list copying from the
-			 * read buffer into the xfs_buf_t's and release them.
-			 */
-			last_off = first_off;
-			for (i = 0; i < num; i++) {
-
-				pbuf = ((char *)buf) + (LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) - first_off);
-				size = XFS_BUF_SIZE(bplist[i]);
-				if (len < size)
-					break;
-				memcpy(XFS_BUF_PTR(bplist[i]), pbuf, size);
-				bplist[i]->b_flags |= LIBXFS_B_UPTODATE;
-				len -= size;
-				if (B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])))
-					pf_read_inode_dirs(args, bplist[i]);
-				else if (which == PF_META_ONLY)
-					XFS_BUF_SET_PRIORITY(bplist[i],
-								B_DIR_META_H);
-				else if (which == PF_PRIMARY && num == 1)
-					XFS_BUF_SET_PRIORITY(bplist[i],
-								B_DIR_META_S);
-			}
-		}
-		for (i = 0; i < num; i++) {
-			pftrace("putbuf %c %p (%llu) in AG %d",
-				B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])) ? 'I' : 'M',
-				bplist[i], (long long)XFS_BUF_ADDR(bplist[i]),
-				args->agno);
-			libxfs_putbuf(bplist[i]);
-		}
+		len = pread64(mp_fd, buf, (int)(batch.last_off - batch.first_off),
+				batch.first_off);
+		pf_batch_complete(args, &batch, buf, len);
+
 		pthread_mutex_lock(&args->lock);
 		if (which != PF_SECONDARY) {
 			pftrace("inode_bufs_queued for AG %d = %d", args->agno,
@@ -577,6 +645,372 @@ pf_io_worker(
 	return NULL;
 }
 
+#ifdef HAVE_IO_URING
+
+/*
+ * io_uring prefetch engine.
+ *
+ * Instead of PF_THREAD_COUNT threads each blocked in pread64, a single
+ * thread per AG keeps up to PF_URING_DEPTH batches in flight on an
+ * io_uring and copies them into the cache as they complete.  The batches
+ * are chosen exactly as pf_batch_read chooses them.  The ring is driven
+ * through the raw system calls so no extra library is needed; if the
+ * kernel refuses to set one up we fall back to the pread threads.
+ */
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter	426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register	427
+#endif
+
+#define PF_URING_DEPTH	16
+
+typedef struct pf_uring {
+	int			fd;
+	int			fixed;		/* buffers registered */
+	unsigned int		to_submit;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+} pf_uring_t;
+
+typedef struct pf_uring_slot {
+	pf_batch_t		batch;
+	int			busy;
+} pf_uring_slot_t;
+
+static void
+pf_uring_exit(
+	pf_uring_t		*ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+static int
+pf_uring_init(
+	pf_uring_t		*ring)
+{
+	struct io_uring_params	p;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, PF_URING_DEPTH, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+				p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+#endif
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto out_close;
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+#endif
+	{
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto out_unmap_sq;
+	}
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto out_unmap_cq;
+
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ring +
+						p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ring +
+						p.sq_off.array);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ring +
+						p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+						p.cq_off.cqes);
+	return 0;
+
+out_unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+out_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+out_close:
+	close(ring->fd);
+	return -1;
+}
+
+/*
+ * Queue a read of a batch into the given slot buffer.  There is always a
+ * free SQE as we never have more than PF_URING_DEPTH reads outstanding.
+ */
+static void
+pf_uring_queue_read(
+	pf_uring_t		*ring,
+	int			slot,
+	pf_batch_t		*batch,
+	struct iovec		*iov)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		tail;
+	unsigned int		idx;
+
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = mp_fd;
+	sqe->off = batch->first_off;
+	sqe->user_data = slot;
+	if (ring->fixed) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long)iov->iov_base;
+		sqe->len = batch->last_off - batch->first_off;
+		sqe->buf_index = slot;
+	} else {
+		sqe->opcode = IORING_OP_READV;
+		iov->iov_len = batch->last_off - batch->first_off;
+		sqe->addr = (unsigned long)iov;
+		sqe->len = 1;
+	}
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+/*
+ * Submit the queued reads and wait for at least one of them to complete.
+ */
+static void
+pf_uring_submit_and_wait(
+	pf_uring_t		*ring)
+{
+	int			ret;
+
+	for (;;) {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+				1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret >= 0) {
+			ring->to_submit -= ret;
+			if (!ring->to_submit)
+				return;
+			continue;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			do_error(_("prefetch I/O submission failed: %s\n"),
+				strerror(errno));
+	}
+}
+
+/*
+ * Pick the next batch to read, in the same order of preference as
+ * pf_batch_read: metadata first when the inode queue is running low,
+ * otherwise inodes ahead of the processing thread, then whatever is left
+ * behind it.  Called with the lock held.
+ */
+static int
+pf_uring_select(
+	prefetch_args_t		*args,
+	pf_batch_t		*batch)
+{
+	if (!args->queuing_done && args->inode_bufs_queued < IO_THRESHOLD) {
+		if (pf_batch_select(args, PF_META_ONLY, batch) ||
+		    pf_batch_select(args, PF_SECONDARY, batch))
+			return 1;
+	}
+	return pf_batch_select(args, PF_PRIMARY, batch) ||
+	       pf_batch_select(args, PF_SECONDARY, batch);
+}
+
+/*
+ * Rings and their registered buffers are expensive to set up, so they are
+ * kept on a free list and reused by the prefetch threads of later AGs.
+ */
+typedef struct pf_uring_ctx {
+	pf_uring_t		ring;
+	pf_uring_slot_t		slots[PF_URING_DEPTH];
+	struct iovec		iov[PF_URING_DEPTH];
+	struct pf_uring_ctx	*next;
+} pf_uring_ctx_t;
+
+static pthread_mutex_t		pf_uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pf_uring_ctx_t		*pf_uring_free;
+
+static pf_uring_ctx_t *
+pf_uring_ctx_get(void)
+{
+	pf_uring_ctx_t		*ctx;
+	int			i;
+
+	pthread_mutex_lock(&pf_uring_lock);
+	ctx = pf_uring_free;
+	if (ctx)
+		pf_uring_free = ctx->next;
+	pthread_mutex_unlock(&pf_uring_lock);
+	if (ctx)
+		return ctx;
+
+	ctx = calloc(1, sizeof(pf_uring_ctx_t));
+	if (ctx == NULL)
+		return NULL;
+	if (pf_uring_init(&ctx->ring) < 0) {
+		free(ctx);
+		return NULL;
+	}
+	for (i = 0; i < PF_URING_DEPTH; i++) {
+		ctx->iov[i].iov_base = memalign(libxfs_device_alignment(),
+						pf_max_bytes);
+		ctx->iov[i].iov_len = pf_max_bytes;
+		if (ctx->iov[i].iov_base == NULL) {
+			while (--i >= 0)
+				free(ctx->iov[i].iov_base);
+			pf_uring_exit(&ctx->ring);
+			free(ctx);
+			return NULL;
+		}
+	}
+	if (syscall(__NR_io_uring_register, ctx->ring.fd,
+			IORING_REGISTER_BUFFERS, ctx->iov, PF_URING_DEPTH) == 0)
+		ctx->ring.fixed = 1;
+	return ctx;
+}
+
+static void
+pf_uring_ctx_put(
+	pf_uring_ctx_t		*ctx)
+{
+	pthread_mutex_lock(&pf_uring_lock);
+	ctx->next = pf_uring_free;
+	pf_uring_free = ctx;
+	pthread_mutex_unlock(&pf_uring_lock);
+}
+
+static void *
+pf_uring_worker(
+	void			*param)
+{
+	prefetch_args_t		*args = param;
+	pf_uring_ctx_t		*ctx;
+	pf_uring_t		*ring;
+	pf_uring_slot_t		*slots;
+	struct io_uring_cqe	*cqe;
+	unsigned int		head;
+	int			inflight = 0;
+	int			i;
+
+	ctx = pf_uring_ctx_get();
+	if (ctx == NULL)
+		return pf_io_worker(param);
+	ring = &ctx->ring;
+	slots = ctx->slots;
+
+	pthread_mutex_lock(&args->lock);
+	while (!args->queuing_done || !btree_is_empty(args->io_queue) ||
+			inflight) {
+		if (!inflight) {
+			pftrace("waiting to start prefetch I/O for AG %d",
+				args->agno);
+			while (!args->can_start_reading && !args->queuing_done)
+				pthread_cond_wait(&args->start_reading,
+						&args->lock);
+		}
+
+		for (i = 0; i < PF_URING_DEPTH; i++) {
+			if (slots[i].busy)
+				continue;
+			if (!pf_uring_select(args, &slots[i].batch))
+				break;
+			slots[i].busy = 1;
+			inflight++;
+			pf_uring_queue_read(ring, i, &slots[i].batch,
+					&ctx->iov[i]);
+		}
+
+		if (!inflight) {
+			pftrace("ran out of bufs to prefetch for AG %d",
+				args->agno);
+			if (!args->queuing_done)
+				args->can_start_reading = 0;
+			continue;
+		}
+		pthread_mutex_unlock(&args->lock);
+
+		pf_uring_submit_and_wait(ring);
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			i = cqe->user_data;
+			pf_batch_complete(args, &slots[i].batch,
+					ctx->iov[i].iov_base, cqe->res);
+			slots[i].busy = 0;
+			inflight--;
+			head++;
+			__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		pthread_mutex_lock(&args->lock);
+	}
+	pthread_mutex_unlock(&args->lock);
+
+	pf_uring_ctx_put(ctx);
+
+	pftrace("finished prefetch I/O for AG %d", args->agno);
+
+	return NULL;
+}
+
+/*
+ * Check once whether the kernel will give us a ring.
+ */
+static int
+pf_uring_probe(void)
+{
+	pf_uring_t		ring;
+
+	if (pf_uring_init(&ring) < 0)
+		return 0;
+	pf_uring_exit(&ring);
+	return 1;
+}
+
+#endif /* HAVE_IO_URING */
+
 static int
 pf_create_prefetch_thread(
 	prefetch_args_t		*args);
@@ -598,9 +1032,9 @@ pf_queuing_worker(
 	if (blks_per_cluster == 0)
 		blks_per_cluster = 1;
 
-	for (i = 0; i < PF_THREAD_COUNT; i++) {
+	for (i = 0; i < pf_io_threads; i++) {
 		err = pthread_create(&args->io_threads[i], NULL,
-				pf_io_worker, args);
+				pf_io_engine, args);
 		if (err != 0) {
 			do_warn(_("failed to create prefetch thread: %s\n"),
 				strerror(err));
@@ -710,6 +1144,15 @@ init_prefetch(
 	pf_max_fsbs = pf_max_bytes >> mp->m_sb.sb_blocklog;
 	pf_batch_bytes = DEF_BATCH_BYTES;
 	pf_batch_fsbs = DEF_BATCH_BYTES >> (mp->m_sb.sb_blocklog + 1);
+
+	pf_io_engine = pf_io_worker;
+	pf_io_threads = PF_THREAD_COUNT;
+#ifdef HAVE_IO_URING
+	if (pf_uring_probe()) {
+		pf_io_engine = pf_uring_worker;
+		pf_io_threads = 1;
+	}
+#endif
 }
 
 prefetch_args_t *
@@ -90,6 +90,9 @@ typedef struct msg_block_s {
 	__uint64_t	*total;
 	int		count;
 	int		interval;
+	__uint64_t	*thread_done;	/* per worker thread counts */
+	int		thread_count;
+	char		*thread_type;
 } msg_block_t;
 static msg_block_t 	global_msgs;
 
@@ -102,6 +105,7 @@ typedef struct phase_times_s {
 static phase_times_t phase_times[8];
 
 static void *progress_rpt_thread(void *);
+static void print_thread_rpt(msg_block_t *, struct tm *);
 static int current_phase;
 static int running;
 static __uint64_t prog_rpt_total;
@@ -246,6 +250,7 @@ progress_rpt_thread (void *p)
 		}
 
 		do_log(_("%s"), msgbuf);
+		print_thread_rpt(msgp, tmp);
 		elapsed = now - phase_times[current_phase].start;
 		if ((msgp->format->format == FMT1) && sum && elapsed &&
 			((current_phase == 3) ||
@@ -306,6 +311,50 @@ set_progress_msg (int report, __uint64_t total)
 	return (0);
 }
 
+/*
+ *  Set up per worker thread counters for a phase that hands each
+ *  worker its own segment of ag_stride AGs.  The workers add to their
+ *  slot with PROG_RPT_THREAD_INC() and the counts are reported, in units
+ *  of type, after the regular message.  Zero threads tears them down.
+ */
+void
+set_progress_threads(int nthreads, char *type)
+{
+	if (!ag_stride)
+		return;
+
+	if (pthread_mutex_lock(&global_msgs.mutex))
+		do_error(_("set_progress_threads: cannot lock progress mutex\n"));
+
+	free(prog_rpt_thread_done);
+	prog_rpt_thread_done = NULL;
+	if (nthreads > 0) {
+		prog_rpt_thread_done = calloc(nthreads, sizeof(__uint64_t));
+		if (prog_rpt_thread_done == NULL)
+			do_error(_("cannot malloc pointer to thread done vector\n"));
+	}
+	global_msgs.thread_done = prog_rpt_thread_done;
+	global_msgs.thread_count = prog_rpt_thread_done ? nthreads : 0;
+	global_msgs.thread_type = type;
+
+	if (pthread_mutex_unlock(&global_msgs.mutex))
+		do_error(_("set_progress_threads: cannot unlock progress mutex\n"));
+}
+
+/*
+ *  Report the per worker thread counts, called with the msg mutex held.
+ */
+static void
+print_thread_rpt(msg_block_t *msgp, struct tm *tmp)
+{
+	int i;
+
+	for (i = 0; i < msgp->thread_count; i++)
+		do_log(_("\t- %02d:%02d:%02d: thread %d - %llu %s done\n"),
+			tmp->tm_hour, tmp->tm_min, tmp->tm_sec,
+			i, msgp->thread_done[i], msgp->thread_type);
+}
+
 __uint64_t
 print_final_rpt(void)
 {
@@ -354,6 +403,7 @@ print_final_rpt(void)
 			break;
 		}
 		do_log(_("%s"), msgbuf);
+		print_thread_rpt(msgp, tmp);
 	}
 
 	if (pthread_mutex_unlock(&global_msgs.mutex))
@@ -33,11 +33,14 @@ extern void init_progress_rpt(void);
 extern void stop_progress_rpt(void);
 extern void summary_report(void);
 extern int  set_progress_msg(int report, __uint64_t total);
+extern void set_progress_threads(int nthreads, char *type);
 extern __uint64_t print_final_rpt(void);
 extern char *timestamp(int end, int phase, char *buf);
 extern char *duration(int val, char *buf);
 extern int do_parallel;
 
 #define	PROG_RPT_INC(a,b) if (ag_stride && prog_rpt_done) (a) += (b)
+#define	PROG_RPT_THREAD_INC(t,b) \
+	if (ag_stride && prog_rpt_thread_done) prog_rpt_thread_done[t] += (b)
 
 #endif	/* _XFS_REPAIR_PROGRESS_RPT_H_ */
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2026 fuse-xfs contributors.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <libxfs.h>
+#include <sys/mman.h>
+#include "globals.h"
+#include "err_protos.h"
+#include "spill.h"
+
+/*
+ * When the incore inode and extent records of a filesystem will not fit
+ * in the memory budget, they are carved out of a scratch file instead of
+ * the heap.  Each AG has its own arena of file-backed segments, so the
+ * records for an AG sit together in the file.  Once a phase is done with
+ * an AG its segments are dropped from memory and written back, and the
+ * next phase to walk that AG reads them back in ahead of use.
+ *
+ * Records are never returned to the arena.  The callers keep their own
+ * free lists, which is enough for repair's allocate-mostly pattern.
+ */
+
+int			do_spill;
+
+#define	SPILL_SEG_SIZE	(1024 * 1024)
+#define	SPILL_ALIGN	sizeof(__uint64_t)
+
+typedef struct spill_seg {
+	struct spill_seg	*next;
+	char			*addr;
+	size_t			len;
+	off64_t			off;
+} spill_seg_t;
+
+typedef struct spill_arena {
+	pthread_mutex_t		lock;
+	spill_seg_t		*segs;
+	char			*cur;
+	size_t			left;
+	__uint64_t		used;
+} spill_arena_t;
+
+static int			spill_fd = -1;
+static off64_t			spill_off;
+static pthread_mutex_t		spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static spill_arena_t		*spill_arenas;
+static xfs_agnumber_t		spill_narenas;
+
+static spill_seg_t *
+spill_new_seg(
+	size_t		len)
+{
+	spill_seg_t	*seg;
+
+	seg = malloc(sizeof(spill_seg_t));
+	if (!seg)
+		do_error(_("couldn't allocate spill segment descriptor\n"));
+
+	pthread_mutex_lock(&spill_lock);
+	seg->off = spill_off;
+	spill_off += len;
+	if (ftruncate64(spill_fd, spill_off) < 0)
+		do_error(_("couldn't extend spill file to %lld bytes: %s\n"),
+			(long long)spill_off, strerror(errno));
+	pthread_mutex_unlock(&spill_lock);
+
+	seg->len = len;
+	seg->addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			spill_fd, seg->off);
+	if (seg->addr == MAP_FAILED)
+		do_error(_("couldn't map spill file segment: %s\n"),
+			strerror(errno));
+	return seg;
+}
+
+/*
+ * Allocate zeroed, 8 byte aligned space for a record of the given AG.
+ * Records not tied to an AG pass NULLAGNUMBER and share an extra arena.
+ */
+void *
+spill_alloc(
+	xfs_agnumber_t	agno,
+	size_t		size)
+{
+	spill_arena_t	*arena;
+	spill_seg_t	*seg;
+	void		*p;
+
+	ASSERT(do_spill);
+	if (agno == NULLAGNUMBER || agno >= spill_narenas - 1)
+		agno = spill_narenas - 1;
+	arena = &spill_arenas[agno];
+	size = roundup(size, SPILL_ALIGN);
+
+	pthread_mutex_lock(&arena->lock);
+	if (size > arena->left) {
+		seg = spill_new_seg(MAX(SPILL_SEG_SIZE,
+					roundup(size, getpagesize())));
+		seg->next = arena->segs;
+		arena->segs = seg;
+		arena->cur = seg->addr;
+		arena->left = seg->len;
+	}
+	p = arena->cur;
+	arena->cur += size;
+	arena->left -= size;
+	arena->used += size;
+	pthread_mutex_unlock(&arena->lock);
+
+	return p;
+}
+
+/*
+ * Start reading an AG's records back in before a phase walks them.
+ */
+void
+spill_prefetch_ag(
+	xfs_agnumber_t	agno)
+{
+	spill_seg_t	*seg;
+
+	if (!do_spill || agno >= spill_narenas)
+		return;
+
+	pthread_mutex_lock(&spill_arenas[agno].lock);
+	for (seg = spill_arenas[agno].segs; seg; seg = seg->next)
+		madvise(seg->addr, seg->len, MADV_WILLNEED);
+	pthread_mutex_unlock(&spill_arenas[agno].lock);
+}
+
+/*
+ * Drop an AG's records from memory once a phase is done with it.  The
+ * mapping is shared, so dirty pages are kept by the page cache and
+ * written back to the scratch file rather than discarded.
+ */
+void
+spill_release_ag(
+	xfs_agnumber_t	agno)
+{
+	spill_seg_t	*seg;
+
+	if (!do_spill || agno >= spill_narenas)
+		return;
+
+	pthread_mutex_lock(&spill_arenas[agno].lock);
+	for (seg = spill_arenas[agno].segs; seg; seg = seg->next) {
+		msync(seg->addr, seg->len, MS_ASYNC);
+		madvise(seg->addr, seg->len, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+		posix_fadvise(spill_fd, seg->off, seg->len,
+				POSIX_FADV_DONTNEED);
+#endif
+	}
+	pthread_mutex_unlock(&spill_arenas[agno].lock);
+}
+
+/*
+ * Bytes of records handed out, rather than the size of the file.
+ */
+__uint64_t
+spill_bytes(void)
+{
+	__uint64_t	used = 0;
+	xfs_agnumber_t	i;
+
+	for (i = 0; i < spill_narenas; i++)
+		used += spill_arenas[i].used;
+	return used;
+}
+
+void
+spill_init(
+	xfs_mount_t	*mp,
+	char		*dir)
+{
+	char		*path;
+	xfs_agnumber_t	i;
+
+	path = malloc(strlen(dir) + sizeof("/xfs_repair.XXXXXX"));
+	if (!path)
+		do_error(_("couldn't allocate spill file name\n"));
+	sprintf(path, "%s/xfs_repair.XXXXXX", dir);
+
+	spill_fd = mkstemp(path);
+	if (spill_fd < 0)
+		do_error(_("couldn't create spill file in %s: %s\n"),
+			dir, strerror(errno));
+	unlink(path);
+	free(path);
+
+	spill_narenas = mp->m_sb.sb_agcount + 1;
+	spill_arenas = calloc(spill_narenas, sizeof(spill_arena_t));
+	if (!spill_arenas)
+		do_error(_("couldn't allocate spill arenas\n"));
+	for (i = 0; i < spill_narenas; i++)
+		pthread_mutex_init(&spill_arenas[i].lock, NULL);
+
+	do_spill = 1;
+}
+
+void
+spill_exit(void)
+{
+	spill_seg_t	*seg;
+	xfs_agnumber_t	i;
+
+	if (!do_spill)
+		return;
+
+	for (i = 0; i < spill_narenas; i++) {
+		while ((seg = spill_arenas[i].segs) != NULL) {
+			spill_arenas[i].segs = seg->next;
+			munmap(seg->addr, seg->len);
+			free(seg);
+		}
+		pthread_mutex_destroy(&spill_arenas[i].lock);
+	}
+	free(spill_arenas);
+	spill_arenas = NULL;
+	close(spill_fd);
+	spill_fd = -1;
+	do_spill = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef	_XFS_REPAIR_SPILL_H_
+#define	_XFS_REPAIR_SPILL_H_
+
+/*
+ * Scratch file backing for the per-AG incore inode and extent records,
+ * used when they will not fit in the -m memory budget.  See spill.c.
+ */
+
+extern int		do_spill;
+
+void	spill_init(xfs_mount_t *mp, char *dir);
+void	spill_exit(void);
+
+void	*spill_alloc(xfs_agnumber_t agno, size_t size);
+
+void	spill_prefetch_ag(xfs_agnumber_t agno);
+void	spill_release_ag(xfs_agnumber_t agno);
+
+__uint64_t	spill_bytes(void);
+
+#endif	/* _XFS_REPAIR_SPILL_H_ */
@@ -115,18 +115,21 @@ queue_work(
 	wi->next = NULL;
 
 	/*
-	 *  Now queue the new work structure to the work queue.
+	 *  Now queue the new work structure to the work queue and wake
+	 *  an idle worker for it.  Signalling only when the queue was
+	 *  empty leaves the other workers asleep while a burst of items
+	 *  is queued up front, serialising the whole burst.
 	 */
 	pthread_mutex_lock(&wq->lock);
 	if (wq->next_item == NULL) {
 		wq->next_item = wi;
 		ASSERT(wq->item_count == 0);
-		pthread_cond_signal(&wq->wakeup);
 	} else {
 		wq->last_item->next = wi;
 	}
 	wq->last_item = wi;
 	wq->item_count++;
+	pthread_cond_signal(&wq->wakeup);
 	pthread_mutex_unlock(&wq->lock);
 }
 
@@ -29,6 +29,7 @@
 #include "prefetch.h"
 #include "threads.h"
 #include "progress.h"
+#include "spill.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
 
@@ -65,6 +66,8 @@ char *o_opts[] = {
 	"force_geometry",
 #define PHASE2_THREADS	6
 	"phase2_threads",
+#define SPILL_DIR	7
+	"spill_dir",
 	NULL
 };
 
@@ -83,6 +86,8 @@ static int	ihash_option_used;
 static int	bhash_option_used;
 static long	max_mem_specified;	/* in megabytes */
 static int	phase2_threads = 32;
+static char	*spill_dir;
+static unsigned long	spill_budget;	/* in kilobytes */
 
 static void
 usage(void)
@@ -272,6 +277,12 @@ process_args(int argc, char **argv)
 				case PHASE2_THREADS:
 					phase2_threads = (int)strtol(val, NULL, 0);
 					break;
+				case SPILL_DIR:
+					if (!val)
+						do_abort(
+			_("-o spill_dir requires a directory\n"));
+					spill_dir = val;
+					break;
 				default:
 					unknown('o', val);
 					break;
@@ -374,11 +385,23 @@ do_abort(char const *msg, ...)
 	exit(1);
 }
 
+/*
+ * A thread that only looks ahead (the first phase 6 pass of a modifying
+ * run) counts its warnings instead of printing them; the pass that acts
+ * on what it found prints them again.
+ */
+__thread int	warnings_muted;
+__thread int	muted_warnings;
+
 void
 do_warn(char const *msg, ...)
 {
 	va_list args;
 
+	if (warnings_muted) {
+		muted_warnings++;
+		return;
+	}
 	fs_is_dirty = 1;
 
 	va_start(args, msg);
@@ -526,6 +549,36 @@ _("sb realtime summary inode %llu %sinconsistent with calculated value %lu\n"),
 
 }
 
+/*
+ * When the incore state was spilled, say how much went to the scratch
+ * file and how long repair took within the memory it was given.
+ */
+static void
+report_spill(
+	time_t		start_time,
+	char		*msgbuf)
+{
+	struct rusage	ru;
+	long		maxrss;
+
+	if (!do_spill)
+		return;
+
+	getrusage(RUSAGE_SELF, &ru);
+	maxrss = ru.ru_maxrss;
+#ifdef __APPLE__
+	maxrss >>= 10;		/* darwin reports bytes, not kilobytes */
+#endif
+	do_log(_("        - spilled %llu KB of incore state, memory budget "
+		"%lu MB, peak resident %ld MB\n"),
+		(unsigned long long)spill_bytes() >> 10, spill_budget >> 10,
+		maxrss >> 10);
+	if (msgbuf)
+		do_log(_("        - repair took %s\n"),
+			duration((int)(time(NULL) - start_time), msgbuf));
+	spill_exit();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -535,7 +588,9 @@ main(int argc, char **argv)
 	xfs_buf_t	*sbp;
 	xfs_mount_t	xfs_m;
 	char		*msgbuf;
+	time_t		start_time;
 
+	start_time = time(NULL);
 	progname = basename(argv[0]);
 	setlocale(LC_ALL, "");
 	bindtextdomain(PACKAGE, LOCALEDIR);
@@ -651,6 +706,20 @@ main(int argc, char **argv)
 				mp->m_sb.sb_dblocks,
 				mp->m_sb.sb_dblocks >> (10 + 1));
 
+		if (max_mem <= mem_used && spill_dir) {
+			/*
+			 * The inode records go to the spill file, so only
+			 * the block map has to fit in memory.
+			 */
+			mem_used -= mp->m_sb.sb_icount >> (10 - 2);
+			spill_budget = max_mem;
+			spill_init(mp, spill_dir);
+			if (verbose)
+				do_log(
+	_("        - incore inode state will be spilled to %s\n"),
+					spill_dir);
+		}
+
 		if (max_mem <= mem_used) {
 			/*
 			 * Turn off prefetch and minimise libxfs cache if
@@ -807,6 +876,8 @@ _("Warning:  project quota information would be cleared.\n"
 	if (ag_stride && report_interval)
 		stop_progress_rpt();
 
+	report_spill(start_time, msgbuf);
+
 	if (no_modify)  {
 		do_log(
 	_("No modify flag set, skipping filesystem flush and exiting.\n"));
@@ -1,12 +1,12 @@
 #include <xfsutil.h>
 #include <xfs/libxfs.h>
-#include <sys/dirent.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdarg.h>
 
 #define do_log printf
 
@@ -21,6 +21,25 @@
 
 #define XFS_STATS_INC(stat)
 
+/* Keep the space usage index current, see Phase 7 */
+static void xfs_usage_update(xfs_inode_t *ip);
+static void xfs_usage_create(xfs_inode_t *dp, xfs_inode_t *ip,
+                             const char *name);
+static void xfs_usage_rename(xfs_inode_t *src_dp, xfs_inode_t *dst_dp,
+                             xfs_inode_t *ip, xfs_inode_t *target);
+
+/* Drop cached extended attributes at unmount, see Phase 8 */
+static void xfs_xattr_cache_purge(xfs_mount_t *mp);
+
+/* Drop cached extent maps when they go stale, see Phase 9 */
+static void xfs_extmap_drop(xfs_inode_t *ip);
+static void xfs_extmap_purge(xfs_mount_t *mp);
+
+/* Keep the defragmenter's donor out of sight, see Phase 5 */
+static int xfs_defrag_hidden(xfs_inode_t *dp, const char *name, int namelen,
+                             xfs_ino_t ino);
+static void xfs_defrag_reclaim(xfs_mount_t *mp);
+
 /*
  * Convert XFS directory file type to POSIX DT_* type for readdir.
  * This is used when the filesystem has FTYPE support (V5 format).
@@ -693,6 +712,26 @@ xfs_dir2_block_getdents(
 	return 0;
 }
 
+/*
+ * Root directory listings go through this to leave out the donor
+ */
+struct xfs_readdir_root {
+	xfs_inode_t	*dp;
+	void		*dirent;
+	filldir_t	filldir;
+};
+
+static int
+xfs_readdir_root_filldir(void *priv, const char *name, int namelen,
+                         off_t offset, uint64_t ino, unsigned type)
+{
+	struct xfs_readdir_root *rr = priv;
+
+	if (xfs_defrag_hidden(rr->dp, name, namelen, ino))
+		return 0;
+	return rr->filldir(rr->dirent, name, namelen, offset, ino, type);
+}
+
 /*********** taken from xfs/xfs_dir2.c in the linux kernel ************/
 /*
  * Read a directory.
@@ -707,9 +746,18 @@ xfs_readdir(
 {
 	int		rval;		/* return value */
 	int		v;		/* type-checking value */
+	struct xfs_readdir_root rr;
     
     if (!(dp->i_d.di_mode & S_IFDIR))
 		return XFS_ERROR(ENOTDIR);
+
+	if (dp->i_ino == dp->i_mount->m_sb.sb_rootino) {
+		rr.dp = dp;
+		rr.dirent = dirent;
+		rr.filldir = filldir;
+		dirent = &rr;
+		filldir = xfs_readdir_root_filldir;
+	}
     
     //TODO: find suitable replacement
 	//trace_xfs_readdir(dp);
@@ -807,15 +855,45 @@ int extent_overlaps_buffer(xfs_mount_t *mp, xfs_bmbt_irec_t rec, off_t offset, s
     return 0;
 }
 
-int xfs_readfile_extents(xfs_inode_t *ip, void *buffer, off_t offset, size_t len, int *last_extent) {
-    xfs_extnum_t nextents;
-    xfs_extnum_t extent;
+/*
+ * Read through the file's extent map, starting at the first extent that
+ * reaches the range rather than testing every extent against it.
+ * Returns 0 or a negative errno.
+ */
+static int xfs_readfile_map(xfs_inode_t *ip, void *buffer, off_t offset,
+                            size_t len) {
+    xfs_mount_t     *mp = ip->i_mount;
+    xfs_fileoff_t   end = XFS_B_TO_FSB(mp, offset + len);
+    struct xfs_extmap *map;
     xfs_bmbt_irec_t rec;
-    xfs_ifork_t *dp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
-    xfs_bmbt_rec_host_t *ep;
-	xfs_mount_t	*mp = ip->i_mount;		/* filesystem mount point */
-    xfs_fsize_t size = ip->i_d.di_size;
+    xfs_extnum_t    i;
+    int             error;
+
+    error = xfs_extmap_get(ip, &map);
+    if (error) {
+        return error;
+    }
+    for (i = xfs_extmap_lookup(map, XFS_B_TO_FSBT(mp, offset));
+         i < map->em_nextents && map->em_startoff[i] < end; i++) {
+        if (map->em_unwritten[i]) {
+            continue;
+        }
+        rec.br_startoff = map->em_startoff[i];
+        rec.br_startblock = map->em_startblock[i];
+        rec.br_blockcount = map->em_blockcount[i];
+        rec.br_state = XFS_EXT_NORM;
+        error = copy_extent_to_buffer(mp, rec, buffer, offset, len);
+        if (error) {
+            error = -error;
+            break;
+        }
+    }
+    xfs_extmap_put(map);
+    return error;
+}
 
+int xfs_readfile_extents(xfs_inode_t *ip, void *buffer, off_t offset, size_t len, int *last_extent) {
+    xfs_fsize_t size = ip->i_d.di_size;
     int error;
 
     if (offset >= size) return 0;
@@ -823,28 +901,226 @@ int xfs_readfile_extents(xfs_inode_t *ip, void *buffer, off_t offset, size_t len
     if (offset + len > size) 
         len = size - offset;
 
-    nextents = XFS_IFORK_NEXTENTS(ip, XFS_DATA_FORK);
-        
-    for (extent=0; extent<nextents; extent++) {
-        ep = xfs_iext_get_ext(dp, extent);
-        xfs_bmbt_get_all(ep, &rec);
-                
-        if (extent_overlaps_buffer(mp, rec, offset, len)) {
-            error = copy_extent_to_buffer(mp, rec, buffer, offset, len); 
-            if (error) return error;
+    error = xfs_readfile_map(ip, buffer, offset, len);
+    return error ? error : len;
+}
+
+/*
+ * Reads of a btree format file whose extent list is not in core.  Reading
+ * the list in walks every leaf of the bmap btree, which for a file with a
+ * million extents is seconds of I/O and tens of MB to read a few blocks.
+ * Instead a read descends the btree to the leaf covering its range and
+ * walks right from there, leaving the leaf blocks in the buffer cache.
+ * Anything that changes the mapping goes through xfs_bmapi(), which reads
+ * the whole list in first, and reads use that once it is there.
+ *
+ * The last leaf used is remembered for each inode, so sequential reads
+ * go straight to it.  A remembered leaf is checked against its first
+ * record before use, and dropped when the file's mapping changes.
+ */
+#define XFS_BMAP_CURSORS    64
+
+struct xfs_bmap_cursor {
+    xfs_mount_t     *mp;
+    xfs_ino_t       ino;                /* 0 if unused */
+    xfs_fsblock_t   leaf;
+    xfs_fileoff_t   startoff;           /* first record in the leaf */
+    xfs_fileoff_t   endoff;             /* end of its last record */
+};
+
+static struct xfs_bmap_cursor xfs_bmap_cursors[XFS_BMAP_CURSORS];
+static pthread_mutex_t xfs_bmap_cursor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct xfs_bmap_cursor *xfs_bmap_cursor_slot(xfs_inode_t *ip) {
+    return &xfs_bmap_cursors[(ip->i_ino * 0x9e3779b1) % XFS_BMAP_CURSORS];
+}
+
+static void xfs_bmap_cursor_drop(xfs_inode_t *ip) {
+    struct xfs_bmap_cursor *bc = xfs_bmap_cursor_slot(ip);
+
+    pthread_mutex_lock(&xfs_bmap_cursor_lock);
+    if (bc->ino == ip->i_ino && bc->mp == ip->i_mount) {
+        bc->ino = 0;
+    }
+    pthread_mutex_unlock(&xfs_bmap_cursor_lock);
+}
+
+static void xfs_bmap_cursor_purge(xfs_mount_t *mp) {
+    int             i;
+
+    pthread_mutex_lock(&xfs_bmap_cursor_lock);
+    for (i = 0; i < XFS_BMAP_CURSORS; i++) {
+        if (xfs_bmap_cursors[i].mp == mp) {
+            xfs_bmap_cursors[i].ino = 0;
         }
     }
-    
-    return len;
+    pthread_mutex_unlock(&xfs_bmap_cursor_lock);
+}
+
+static int xfs_bmap_read_block(xfs_mount_t *mp, xfs_fsblock_t fsbno, int level,
+                               xfs_buf_t **bpp) {
+    struct xfs_btree_block *block;
+    xfs_buf_t       *bp;
+
+    if (!XFS_FSB_SANITY_CHECK(mp, fsbno)) {
+        return XFS_ERROR(EFSCORRUPTED);
+    }
+    bp = libxfs_readbuf(mp->m_dev, XFS_FSB_TO_DADDR(mp, fsbno),
+                        XFS_FSB_TO_BB(mp, 1), 0);
+    if (bp == NULL) {
+        return XFS_ERROR(EIO);
+    }
+    block = XFS_BUF_TO_BLOCK(bp);
+    if (be32_to_cpu(block->bb_magic) != XFS_BMAP_MAGIC ||
+        be16_to_cpu(block->bb_level) != level ||
+        be16_to_cpu(block->bb_numrecs) == 0 ||
+        be16_to_cpu(block->bb_numrecs) > mp->m_bmap_dmxr[level != 0]) {
+        libxfs_putbuf(bp);
+        return XFS_ERROR(EFSCORRUPTED);
+    }
+    *bpp = bp;
+    return 0;
+}
+
+/*
+ * The pointer to follow from a node: that of the last key at or before bno
+ */
+static xfs_fsblock_t xfs_bmap_node_ptr(xfs_mount_t *mp,
+                                       struct xfs_btree_block *block,
+                                       xfs_bmbt_ptr_t *pp, xfs_fileoff_t bno) {
+    int             lo = 1;
+    int             hi = be16_to_cpu(block->bb_numrecs);
+    int             mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (be64_to_cpu(XFS_BMBT_KEY_ADDR(mp, block, mid)->br_startoff) <= bno) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return be64_to_cpu(pp[lo - 1]);
+}
+
+static int xfs_bmap_find_leaf(xfs_inode_t *ip, xfs_fileoff_t bno,
+                              xfs_buf_t **bpp) {
+    xfs_mount_t     *mp = ip->i_mount;
+    xfs_ifork_t     *ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+    struct xfs_btree_block *block = ifp->if_broot;
+    struct xfs_bmap_cursor *bc = xfs_bmap_cursor_slot(ip);
+    xfs_fsblock_t   fsbno = NULLFSBLOCK;
+    xfs_fileoff_t   startoff = 0;
+    xfs_buf_t       *bp;
+    int             level;
+    int             error;
+
+    pthread_mutex_lock(&xfs_bmap_cursor_lock);
+    if (bc->ino == ip->i_ino && bc->mp == mp &&
+        bc->startoff <= bno && bno < bc->endoff) {
+        fsbno = bc->leaf;
+        startoff = bc->startoff;
+    }
+    pthread_mutex_unlock(&xfs_bmap_cursor_lock);
+
+    if (fsbno != NULLFSBLOCK &&
+        xfs_bmap_read_block(mp, fsbno, 0, &bp) == 0) {
+        if (xfs_bmbt_disk_get_startoff(XFS_BMBT_REC_ADDR(mp,
+                                       XFS_BUF_TO_BLOCK(bp), 1)) == startoff) {
+            *bpp = bp;
+            return 0;
+        }
+        libxfs_putbuf(bp);
+    }
+    xfs_bmap_cursor_drop(ip);
+
+    level = be16_to_cpu(block->bb_level);
+    if (level == 0) {
+        return XFS_ERROR(EFSCORRUPTED);
+    }
+    fsbno = xfs_bmap_node_ptr(mp, block,
+                              XFS_BMAP_BROOT_PTR_ADDR(mp, block, 1,
+                                                      ifp->if_broot_bytes),
+                              bno);
+    while (level-- > 0) {
+        error = xfs_bmap_read_block(mp, fsbno, level, &bp);
+        if (error) {
+            return error;
+        }
+        if (level == 0) {
+            break;
+        }
+        block = XFS_BUF_TO_BLOCK(bp);
+        fsbno = xfs_bmap_node_ptr(mp, block,
+                                  XFS_BMBT_PTR_ADDR(mp, block, 1,
+                                                    mp->m_bmap_dmxr[1]),
+                                  bno);
+        libxfs_putbuf(bp);
+    }
+    *bpp = bp;
+    return 0;
+}
+
+static int xfs_readfile_bmbt(xfs_inode_t *ip, void *buffer, off_t offset,
+                             size_t len) {
+    xfs_mount_t     *mp = ip->i_mount;
+    xfs_fileoff_t   bno = XFS_B_TO_FSBT(mp, offset);
+    xfs_fileoff_t   end = XFS_B_TO_FSB(mp, offset + len);
+    struct xfs_bmap_cursor *bc = xfs_bmap_cursor_slot(ip);
+    struct xfs_btree_block *block;
+    xfs_bmbt_rec_t  *frp;
+    xfs_bmbt_irec_t rec;
+    xfs_fsblock_t   fsbno;
+    xfs_buf_t       *bp;
+    int             numrecs;
+    int             i;
+    int             error;
+
+    error = xfs_bmap_find_leaf(ip, bno, &bp);
+    for (;;) {
+        if (error) {
+            return error;
+        }
+        block = XFS_BUF_TO_BLOCK(bp);
+        numrecs = be16_to_cpu(block->bb_numrecs);
+        frp = XFS_BMBT_REC_ADDR(mp, block, 1);
+
+        pthread_mutex_lock(&xfs_bmap_cursor_lock);
+        bc->mp = mp;
+        bc->ino = ip->i_ino;
+        bc->leaf = XFS_DADDR_TO_FSB(mp, XFS_BUF_ADDR(bp));
+        bc->startoff = xfs_bmbt_disk_get_startoff(frp);
+        xfs_bmbt_disk_get_all(frp + numrecs - 1, &rec);
+        bc->endoff = rec.br_startoff + rec.br_blockcount;
+        pthread_mutex_unlock(&xfs_bmap_cursor_lock);
+
+        for (i = 0; i < numrecs; i++) {
+            xfs_bmbt_disk_get_all(frp + i, &rec);
+            if (rec.br_startoff >= end) {
+                libxfs_putbuf(bp);
+                return 0;
+            }
+            if (rec.br_state != XFS_EXT_UNWRITTEN &&
+                extent_overlaps_buffer(mp, rec, offset, len)) {
+                error = copy_extent_to_buffer(mp, rec, buffer, offset, len);
+                if (error) {
+                    libxfs_putbuf(bp);
+                    return error;
+                }
+            }
+        }
+
+        fsbno = be64_to_cpu(block->bb_u.l.bb_rightsib);
+        libxfs_putbuf(bp);
+        if (fsbno == NULLFSBLOCK) {
+            return 0;
+        }
+        error = xfs_bmap_read_block(mp, fsbno, 0, &bp);
+    }
 }
 
 int xfs_readfile_btree(xfs_inode_t *ip, void *buffer, off_t offset, size_t len, int *last_extent) {
-    xfs_extnum_t nextents;
-    xfs_extnum_t extent;
     xfs_ifork_t *dp;
-    xfs_bmbt_rec_host_t *ep;
-    xfs_bmbt_irec_t rec;
-	xfs_mount_t	*mp = ip->i_mount;		/* filesystem mount point */
     xfs_fsize_t size = ip->i_d.di_size;
     
     int error;
@@ -856,22 +1132,11 @@ int xfs_readfile_btree(xfs_inode_t *ip, void *buffer, off_t offset, size_t len,
          
     dp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
     
-    if (!(dp->if_flags & XFS_IFEXTENTS) &&
-        (error = xfs_iread_extents(NULL, ip, XFS_DATA_FORK)))
-        return error;
-
-    nextents = XFS_IFORK_NEXTENTS(ip, XFS_DATA_FORK);
-
-    for (extent=0; extent<nextents; extent++) {
-        ep = xfs_iext_get_ext(dp, extent);
-        xfs_bmbt_get_all(ep, &rec);
-        if (extent_overlaps_buffer(mp, rec, offset, len)) {
-            error = copy_extent_to_buffer(mp, rec, buffer, offset, len); 
-            if (error) return error;
-        }
-    }
-    
-    return len;
+    if (dp->if_flags & XFS_IFEXTENTS)
+        error = xfs_readfile_map(ip, buffer, offset, len);
+    else
+        error = xfs_readfile_bmbt(ip, buffer, offset, len);
+    return error ? error : len;
 }
 
 int xfs_readfile(xfs_inode_t *ip, void *buffer, off_t offset, size_t len, int *last_extent) {
@@ -982,6 +1247,10 @@ int find_path(xfs_mount_t *mp, const char *path, xfs_inode_t **result) {
         if (error != 0) {
             return error;
         }
+        if (xfs_defrag_hidden(current, xname.name, xname.len, inode)) {
+            libxfs_iput(current, 0);
+            return XFS_ERROR(ENOENT);
+        }
 
         /* Done with current: make it available */
         libxfs_iput(current, 0);
@@ -997,27 +1266,43 @@ int find_path(xfs_mount_t *mp, const char *path, xfs_inode_t **result) {
     return 0;
 }
 
-int xfs_stat(xfs_inode_t *inode, struct stat *stats) {  
+static void xfs_dinode_to_stat(xfs_ino_t ino, xfs_icdinode_t *dic,
+                               struct stat *stats) {
     stats->st_dev = 0;
-    stats->st_mode = inode->i_d.di_mode;
-    stats->st_nlink = inode->i_d.di_nlink;
-    stats->st_ino = inode->i_ino;
-    stats->st_uid = inode->i_d.di_uid;
-    stats->st_gid = inode->i_d.di_gid;
+    stats->st_mode = dic->di_mode;
+    stats->st_nlink = dic->di_nlink;
+    stats->st_ino = ino;
+    stats->st_uid = dic->di_uid;
+    stats->st_gid = dic->di_gid;
     stats->st_rdev = 0;
-    stats->st_atimespec.tv_sec = inode->i_d.di_atime.t_sec;
-    stats->st_atimespec.tv_nsec = inode->i_d.di_atime.t_nsec;
-    stats->st_mtimespec.tv_sec = inode->i_d.di_mtime.t_sec;
-    stats->st_mtimespec.tv_nsec = inode->i_d.di_mtime.t_nsec;
-    stats->st_ctimespec.tv_sec = inode->i_d.di_ctime.t_sec;
-    stats->st_ctimespec.tv_nsec = inode->i_d.di_ctime.t_nsec;
-    stats->st_birthtimespec.tv_sec = inode->i_d.di_ctime.t_sec; 
-    stats->st_birthtimespec.tv_nsec = inode->i_d.di_ctime.t_nsec; 
-    stats->st_size = inode->i_d.di_size;
-    stats->st_blocks = inode->i_d.di_nblocks;
+#ifdef __APPLE__
+    stats->st_atimespec.tv_sec = dic->di_atime.t_sec;
+    stats->st_atimespec.tv_nsec = dic->di_atime.t_nsec;
+    stats->st_mtimespec.tv_sec = dic->di_mtime.t_sec;
+    stats->st_mtimespec.tv_nsec = dic->di_mtime.t_nsec;
+    stats->st_ctimespec.tv_sec = dic->di_ctime.t_sec;
+    stats->st_ctimespec.tv_nsec = dic->di_ctime.t_nsec;
+    stats->st_birthtimespec.tv_sec = dic->di_ctime.t_sec; 
+    stats->st_birthtimespec.tv_nsec = dic->di_ctime.t_nsec; 
+#else
+    stats->st_atim.tv_sec = dic->di_atime.t_sec;
+    stats->st_atim.tv_nsec = dic->di_atime.t_nsec;
+    stats->st_mtim.tv_sec = dic->di_mtime.t_sec;
+    stats->st_mtim.tv_nsec = dic->di_mtime.t_nsec;
+    stats->st_ctim.tv_sec = dic->di_ctime.t_sec;
+    stats->st_ctim.tv_nsec = dic->di_ctime.t_nsec;
+#endif
+    stats->st_size = dic->di_size;
+    stats->st_blocks = dic->di_nblocks;
     stats->st_blksize = 4096;
-    stats->st_flags = inode->i_d.di_flags;
-    stats->st_gen = inode->i_d.di_gen;
+#ifdef __APPLE__
+    stats->st_flags = dic->di_flags;
+    stats->st_gen = dic->di_gen;
+#endif
+}
+
+int xfs_stat(xfs_inode_t *inode, struct stat *stats) {  
+    xfs_dinode_to_stat(inode->i_ino, &inode->i_d, stats);
     return 0;
 }
 
@@ -1058,6 +1343,9 @@ xfs_mount_t *mount_xfs_ex(char *progname, char *source_name, int readonly) {
     xargs.dname = source_name;
     xargs.disfile = 1;
     
+    /* A metadump file is read in place, without restoring it first */
+    xargs.ismetadump = LIBXFS_METADUMP;
+    
     if (!libxfs_init(&xargs))  {
         do_log(_("%s: couldn't initialize XFS library\n"
                  "%s: Aborting.\n"), progname, progname);
@@ -1099,6 +1387,8 @@ xfs_mount_t *mount_xfs_ex(char *progname, char *source_name, int readonly) {
     /* Store readonly flag in mount structure for later checks */
     if (readonly) {
         mp->m_flags |= XFS_MOUNT_RDONLY_FLAG;
+    } else {
+        xfs_defrag_reclaim(mp);
     }
     
     return mp;
@@ -1124,6 +1414,11 @@ int unmount_xfs(xfs_mount_t *mp) {
         xfs_sync_fs(mp);
     }
     
+    xfs_usage_free(mp);
+    xfs_xattr_cache_purge(mp);
+    xfs_bmap_cursor_purge(mp);
+    xfs_extmap_purge(mp);
+
     /* Unmount the filesystem */
     libxfs_umount(mp);
     
@@ -1254,7 +1549,11 @@ int xfs_setattr_owner(xfs_inode_t *ip, uid_t uid, gid_t gid) {
     
     /* Commit transaction */
     error = libxfs_trans_commit(tp, 0);
-    return error ? -error : 0;
+    if (error) {
+        return -error;
+    }
+    xfs_usage_update(ip);
+    return 0;
 }
 
 /*
@@ -1368,12 +1667,14 @@ int xfs_truncate_file(xfs_inode_t *ip, off_t size) {
     if (!S_ISREG(ip->i_d.di_mode)) {
         return -EINVAL;
     }
+    xfs_bmap_cursor_drop(ip);
     
     /* Allocate transaction */
     tp = libxfs_trans_alloc(mp, XFS_TRANS_SETATTR_SIZE);
     if (tp == NULL) {
         return -ENOMEM;
     }
+    libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, ip->i_ino));
     
     /* Reserve space for truncate operation */
     error = libxfs_trans_reserve(tp, 0,
@@ -1402,6 +1703,7 @@ int xfs_truncate_file(xfs_inode_t *ip, off_t size) {
             /* Free blocks beyond the new size */
             error = libxfs_bunmapi(tp, ip, new_size_fsb, len,
                                    0, 2, &first, &flist, NULL, &done);
+            xfs_extmap_drop(ip);
             if (error) {
                 libxfs_trans_cancel(tp, XFS_TRANS_ABORT);
                 return -error;
@@ -1427,7 +1729,11 @@ int xfs_truncate_file(xfs_inode_t *ip, off_t size) {
     
     /* Commit transaction */
     error = libxfs_trans_commit(tp, 0);
-    return error ? -error : 0;
+    if (error) {
+        return -error;
+    }
+    xfs_usage_update(ip);
+    return 0;
 }
 
 /*
@@ -1440,13 +1746,11 @@ int xfs_sync_file(xfs_inode_t *ip) {
     
     /*
      * In userspace libxfs, buffers are typically written immediately
-     * during transaction commit. For now, this is a no-op since data
-     * is already on disk after transaction commit.
-     *
-     * A full implementation would flush any cached inode metadata.
+     * during transaction commit, so the file itself is already on disk.
+     * What may not be is the superblock counter change its writes made,
+     * which is kept per AG until folded in.
      */
-    
-    return 0;
+    return xfs_sync_fs(ip->i_mount);
 }
 
 /*
@@ -1628,6 +1932,7 @@ int xfs_create_file(xfs_mount_t *mp, xfs_inode_t *dp, const char *name,
     if (tp == NULL) {
         return -ENOMEM;
     }
+    libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, dp->i_ino));
     
     /*
      * CRITICAL FIX: Re-initialize xname here because compiler optimizations
@@ -1721,6 +2026,7 @@ int xfs_create_file(xfs_mount_t *mp, xfs_inode_t *dp, const char *name,
      * directory data and make newly created files invisible.
      */
     
+    xfs_usage_create(dp, ip, name);
     *ipp = ip;
     return 0;
 }
@@ -1763,6 +2069,7 @@ ssize_t xfs_write_file(xfs_inode_t *ip, const char *buf, off_t offset, size_t si
     if (!S_ISREG(ip->i_d.di_mode)) {
         return -EINVAL;
     }
+    xfs_bmap_cursor_drop(ip);
     
     cur_offset = offset;
     cur_buf = buf;
@@ -1789,6 +2096,7 @@ ssize_t xfs_write_file(xfs_inode_t *ip, const char *buf, off_t offset, size_t si
         if (tp == NULL) {
             return bytes_written > 0 ? (ssize_t)bytes_written : -ENOMEM;
         }
+        libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, ip->i_ino));
         
         /* Reserve space */
         error = libxfs_trans_reserve(tp,
@@ -1813,6 +2121,7 @@ ssize_t xfs_write_file(xfs_inode_t *ip, const char *buf, off_t offset, size_t si
         error = libxfs_bmapi(tp, ip, start_fsb, count_fsb,
                              XFS_BMAPI_WRITE, &first, count_fsb,
                              &map, &nmap, &flist, NULL);
+        xfs_extmap_drop(ip);
         if (error) {
             libxfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
             return bytes_written > 0 ? (ssize_t)bytes_written : -error;
@@ -1883,6 +2192,7 @@ ssize_t xfs_write_file(xfs_inode_t *ip, const char *buf, off_t offset, size_t si
         cur_buf += copy_len;
     }
     
+    xfs_usage_update(ip);
     return (ssize_t)bytes_written;
 }
 
@@ -1896,14 +2206,15 @@ int xfs_sync_fs(xfs_mount_t *mp) {
     
     /*
      * In userspace libxfs, buffers are written immediately during
-     * transaction commit. This function is primarily a no-op since
-     * the superblock is kept in-memory and flushed on unmount.
-     *
-     * The libxfs_umount() function will handle writing the final
-     * superblock state to disk.
+     * transaction commit. The free space and inode counters of
+     * transactions run in an AG context are kept per AG, so fold
+     * them into the superblock and write it back here.
      */
+    if (xfs_is_readonly(mp)) {
+        return 0;
+    }
     
-    return 0;
+    return -libxfs_icsb_sync_counters(mp);
 }
 
 /*
@@ -1971,7 +2282,6 @@ int xfs_create_dir(xfs_mount_t *mp, xfs_inode_t *dp, const char *name,
     if (tp == NULL) {
         return -ENOMEM;
     }
-    
     /* Reserve space for mkdir operation */
     error = libxfs_trans_reserve(tp,
                                  XFS_MKDIR_SPACE_RES(mp, xname.len),
@@ -1990,6 +2300,8 @@ int xfs_create_dir(xfs_mount_t *mp, xfs_inode_t *dp, const char *name,
         libxfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
         return -error;
     }
+    /* The counters go to whichever AG the directory inode landed in */
+    libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, ip->i_ino));
     
     /* New directory has link count 2 (. and parent's entry) */
     /* libxfs_inode_alloc sets it to 1, we need to increment for . */
@@ -2056,6 +2368,7 @@ int xfs_create_dir(xfs_mount_t *mp, xfs_inode_t *dp, const char *name,
      * race conditions with concurrent operations.
      */
     
+    xfs_usage_create(dp, ip, name);
     *ipp = ip;
     return 0;
 }
@@ -2179,6 +2492,7 @@ int xfs_remove_file(xfs_mount_t *mp, xfs_inode_t *dp, const char *name,
         }
         return -ENOMEM;
     }
+    libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, dp->i_ino));
     
     /* Reserve space */
     error = libxfs_trans_reserve(tp,
@@ -2245,6 +2559,10 @@ int xfs_remove_file(xfs_mount_t *mp, xfs_inode_t *dp, const char *name,
      * race conditions with concurrent operations.
      */
     
+    if (error == 0) {
+        xfs_usage_update(dp);
+        xfs_usage_update(ip);
+    }
     if (lookup_ip) {
         libxfs_iput(ip, 0);
     }
@@ -2346,6 +2664,7 @@ int xfs_remove_dir(xfs_mount_t *mp, xfs_inode_t *dp, const char *name,
         }
         return -ENOMEM;
     }
+    libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, dp->i_ino));
     
     /* Reserve space */
     error = libxfs_trans_reserve(tp,
@@ -2415,6 +2734,10 @@ int xfs_remove_dir(xfs_mount_t *mp, xfs_inode_t *dp, const char *name,
      * race conditions with concurrent operations.
      */
     
+    if (error == 0) {
+        xfs_usage_update(dp);
+        xfs_usage_update(ip);
+    }
     if (lookup_ip) {
         libxfs_iput(ip, 0);
     }
@@ -2527,6 +2850,7 @@ int xfs_rename_entry(xfs_mount_t *mp, xfs_inode_t *src_dp,
         if (dst_ip) libxfs_iput(dst_ip, 0);
         return -ENOMEM;
     }
+    libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, src_dp->i_ino));
     
     /* Reserve space */
     error = libxfs_trans_reserve(tp,
@@ -2645,6 +2969,9 @@ int xfs_rename_entry(xfs_mount_t *mp, xfs_inode_t *src_dp,
      * race conditions with concurrent operations.
      */
     
+    if (error == 0) {
+        xfs_usage_rename(src_dp, dst_dp, src_ip, dst_ip);
+    }
     libxfs_iput(src_ip, 0);
     if (dst_ip) libxfs_iput(dst_ip, 0);
     
@@ -2719,6 +3046,7 @@ int xfs_create_link(xfs_mount_t *mp, xfs_inode_t *ip, xfs_inode_t *newparent,
     if (tp == NULL) {
         return -ENOMEM;
     }
+    libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, newparent->i_ino));
     
     /* Reserve space for link operation */
     error = libxfs_trans_reserve(tp,
@@ -2777,6 +3105,9 @@ int xfs_create_link(xfs_mount_t *mp, xfs_inode_t *ip, xfs_inode_t *newparent,
      * race conditions with concurrent operations.
      */
     
+    if (error == 0) {
+        xfs_usage_update(newparent);
+    }
     return error ? -error : 0;
 }
 
@@ -2851,6 +3182,7 @@ int xfs_create_symlink(xfs_mount_t *mp, xfs_inode_t *parent, const char *name,
     if (tp == NULL) {
         return -ENOMEM;
     }
+    libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, parent->i_ino));
     
     /* Reserve space for symlink operation */
     error = libxfs_trans_reserve(tp,
@@ -2989,6 +3321,8 @@ int xfs_create_symlink(xfs_mount_t *mp, xfs_inode_t *parent, const char *name,
      * race conditions with concurrent operations.
      */
     
+    xfs_usage_create(parent, ip, name);
+
     /* Return the new symlink inode if requested */
     if (ipp != NULL) {
         *ipp = ip;
@@ -2998,3 +3332,2521 @@ int xfs_create_symlink(xfs_mount_t *mp, xfs_inode_t *parent, const char *name,
     
     return 0;
 }
+
+/*
+ * Online defragmentation (Phase 5)
+ *
+ * Works the way xfs_fsr does, but without the kernel: space for the whole
+ * file is allocated to a donor inode with libxfs_bmapi, the data is copied
+ * across with large reads and writes on the device, and the data forks of
+ * the two inodes are swapped in a single transaction.  The donor is a
+ * scratch file in the root directory.  Emptying it after each swap frees
+ * the old, fragmented extents; it stays behind, empty, between passes,
+ * as libxfs can't free an inode and unlinking it would only orphan it.
+ * A trusted attribute marks it as ours, so a file that only happens to
+ * have its name is never emptied.  Ours is left out of root directory
+ * listings and path lookups, and one a pass left holding blocks, because
+ * the process died, is emptied when the filesystem is next mounted
+ * read-write.
+ */
+
+#define XFS_DEFRAG_DONOR    ".xfs_defrag"
+#define XFS_DEFRAG_MARK     "trusted.xfs_defrag"
+#define XFS_DEFRAG_IOSIZE   (1024 * 1024)
+#define XFS_DEFRAG_NMAP     8
+
+struct xfs_defrag_ctx {
+    xfs_mount_t                 *mp;
+    xfs_inode_t                 *donor;
+    char                        *buf;
+    struct xfs_defrag_opts      *opts;
+    struct xfs_defrag_stats     *stats;
+};
+
+/*
+ * Count the data extents and blocks of a file, loading its extent list.
+ * Returns 0 for anything the defragmenter should leave alone.
+ */
+static xfs_extnum_t xfs_defrag_extents(xfs_inode_t *ip, xfs_filblks_t *blocks) {
+    xfs_ifork_t     *ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+    xfs_bmbt_irec_t rec;
+    xfs_extnum_t    nextents;
+    xfs_extnum_t    i;
+
+    *blocks = 0;
+    if (!S_ISREG(ip->i_d.di_mode)) {
+        return 0;
+    }
+    if (ip->i_d.di_format != XFS_DINODE_FMT_EXTENTS &&
+        ip->i_d.di_format != XFS_DINODE_FMT_BTREE) {
+        return 0;
+    }
+    /* Attribute fork blocks would have to be carried across the swap */
+    if (XFS_IFORK_Q(ip) && ip->i_d.di_aformat != XFS_DINODE_FMT_LOCAL) {
+        return 0;
+    }
+    if (!(ifp->if_flags & XFS_IFEXTENTS) &&
+        xfs_iread_extents(NULL, ip, XFS_DATA_FORK)) {
+        return 0;
+    }
+
+    nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
+    for (i = 0; i < nextents; i++) {
+        xfs_bmbt_get_all(xfs_iext_get_ext(ifp, i), &rec);
+        /* Preallocated space would be copied as written zeroes */
+        if (rec.br_state == XFS_EXT_UNWRITTEN) {
+            return 0;
+        }
+        *blocks += rec.br_blockcount;
+    }
+    return nextents;
+}
+
+/*
+ * Allocate blocks to the donor for the file range [off, off + len)
+ */
+static int xfs_defrag_alloc(xfs_inode_t *donor, xfs_fileoff_t off,
+                            xfs_filblks_t len) {
+    xfs_mount_t     *mp = donor->i_mount;
+    xfs_trans_t     *tp;
+    xfs_bmap_free_t flist;
+    xfs_fsblock_t   first;
+    xfs_bmbt_irec_t map[XFS_DEFRAG_NMAP];
+    xfs_filblks_t   count;
+    xfs_filblks_t   mapped;
+    uint            resblks;
+    int             nmap;
+    int             committed;
+    int             error;
+
+    xfs_bmap_cursor_drop(donor);
+    while (len > 0) {
+        count = MIN(len, MAXEXTLEN);
+        resblks = XFS_DIOSTRAT_SPACE_RES(mp, count);
+
+        tp = libxfs_trans_alloc(mp, XFS_TRANS_DIOSTRAT);
+        if (tp == NULL) {
+            return -ENOMEM;
+        }
+        libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, donor->i_ino));
+
+        error = libxfs_trans_reserve(tp, resblks,
+                                     XFS_WRITE_LOG_RES(mp),
+                                     0, XFS_TRANS_PERM_LOG_RES,
+                                     XFS_WRITE_LOG_COUNT);
+        if (error) {
+            libxfs_trans_cancel(tp, 0);
+            return -error;
+        }
+
+        libxfs_trans_ijoin(tp, donor, 0);
+        libxfs_trans_ihold(tp, donor);
+
+        XFS_BMAP_INIT(&flist, &first);
+
+        nmap = XFS_DEFRAG_NMAP;
+        error = libxfs_bmapi(tp, donor, off, count, XFS_BMAPI_WRITE,
+                             &first, resblks, map, &nmap, &flist, NULL);
+        xfs_extmap_drop(donor);
+        if (error == 0 && nmap == 0) {
+            error = ENOSPC;
+        }
+        if (error) {
+            libxfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
+            return -error;
+        }
+
+        libxfs_trans_log_inode(tp, donor, XFS_ILOG_CORE);
+
+        error = libxfs_bmap_finish(&tp, &flist, &committed);
+        if (error) {
+            libxfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
+            return -error;
+        }
+
+        error = libxfs_trans_commit(tp, XFS_TRANS_RELEASE_LOG_RES);
+        if (error) {
+            return -error;
+        }
+
+        mapped = map[nmap - 1].br_startoff + map[nmap - 1].br_blockcount - off;
+        off += mapped;
+        len -= mapped;
+    }
+    return 0;
+}
+
+/*
+ * Free every block of the donor, leaving it empty for the next file
+ */
+static int xfs_defrag_clear(xfs_inode_t *donor) {
+    xfs_mount_t     *mp = donor->i_mount;
+    xfs_trans_t     *tp;
+    xfs_bmap_free_t flist;
+    xfs_fsblock_t   first;
+    xfs_fileoff_t   last;
+    int             committed;
+    int             done = 0;
+    int             error;
+
+    xfs_bmap_cursor_drop(donor);
+    error = libxfs_bmap_last_offset(NULL, donor, &last, XFS_DATA_FORK);
+    if (error) {
+        return -error;
+    }
+    done = (last == 0);
+
+    while (!done) {
+        tp = libxfs_trans_alloc(mp, XFS_TRANS_SETATTR_SIZE);
+        if (tp == NULL) {
+            return -ENOMEM;
+        }
+        libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, donor->i_ino));
+
+        error = libxfs_trans_reserve(tp, 0, XFS_ITRUNCATE_LOG_RES(mp),
+                                     0, XFS_TRANS_PERM_LOG_RES,
+                                     XFS_ITRUNCATE_LOG_COUNT);
+        if (error) {
+            libxfs_trans_cancel(tp, 0);
+            return -error;
+        }
+
+        libxfs_trans_ijoin(tp, donor, 0);
+        libxfs_trans_ihold(tp, donor);
+
+        XFS_BMAP_INIT(&flist, &first);
+
+        /* A couple of extents at a time keeps the transaction bounded */
+        error = libxfs_bunmapi(tp, donor, 0, last, 0, 2,
+                               &first, &flist, NULL, &done);
+        xfs_extmap_drop(donor);
+        if (error) {
+            libxfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
+            return -error;
+        }
+
+        donor->i_d.di_size = 0;
+        libxfs_trans_log_inode(tp, donor, XFS_ILOG_CORE);
+
+        error = libxfs_bmap_finish(&tp, &flist, &committed);
+        if (error) {
+            libxfs_trans_cancel(tp, XFS_TRANS_RELEASE_LOG_RES | XFS_TRANS_ABORT);
+            return -error;
+        }
+
+        error = libxfs_trans_commit(tp, XFS_TRANS_RELEASE_LOG_RES);
+        if (error) {
+            return -error;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copy the file's data to the same offsets in the donor.  Walks the two
+ * extent lists side by side; the donor is only mapped where the file is.
+ */
+static int xfs_defrag_copy(struct xfs_defrag_ctx *ctx, xfs_inode_t *ip) {
+    xfs_mount_t     *mp = ctx->mp;
+    xfs_ifork_t     *ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+    xfs_ifork_t     *dfp = XFS_IFORK_PTR(ctx->donor, XFS_DATA_FORK);
+    xfs_extnum_t    ni = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
+    xfs_extnum_t    nd = dfp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
+    xfs_extnum_t    i = 0;
+    xfs_extnum_t    d = 0;
+    xfs_bmbt_irec_t src;
+    xfs_bmbt_irec_t dst;
+    xfs_fileoff_t   start;
+    xfs_fileoff_t   end;
+    off_t           from;
+    off_t           to;
+    size_t          left;
+    size_t          len;
+    int             fd = libxfs_device_to_fd(mp->m_dev);
+
+    if (ni == 0 || nd == 0) {
+        return 0;
+    }
+    xfs_bmbt_get_all(xfs_iext_get_ext(ifp, 0), &src);
+    xfs_bmbt_get_all(xfs_iext_get_ext(dfp, 0), &dst);
+
+    for (;;) {
+        start = MAX(src.br_startoff, dst.br_startoff);
+        end = MIN(src.br_startoff + src.br_blockcount,
+                  dst.br_startoff + dst.br_blockcount);
+        if (start < end) {
+            from = BBTOB(XFS_FSB_TO_DADDR(mp, src.br_startblock +
+                                          (start - src.br_startoff)));
+            to = BBTOB(XFS_FSB_TO_DADDR(mp, dst.br_startblock +
+                                        (start - dst.br_startoff)));
+            left = XFS_FSB_TO_B(mp, end - start);
+            while (left > 0) {
+                len = MIN(left, XFS_DEFRAG_IOSIZE);
+                if (pread(fd, ctx->buf, len, from) != (ssize_t)len ||
+                    pwrite(fd, ctx->buf, len, to) != (ssize_t)len) {
+                    return -EIO;
+                }
+                from += len;
+                to += len;
+                left -= len;
+                ctx->stats->bytes_moved += len;
+            }
+        }
+
+        if (src.br_startoff + src.br_blockcount <=
+            dst.br_startoff + dst.br_blockcount) {
+            if (++i == ni)
+                break;
+            xfs_bmbt_get_all(xfs_iext_get_ext(ifp, i), &src);
+        } else {
+            if (++d == nd)
+                break;
+            xfs_bmbt_get_all(xfs_iext_get_ext(dfp, d), &dst);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Point an inline extent list back at its own inode after a fork swap and
+ * work out what needs logging.
+ */
+static int xfs_defrag_fixfork(xfs_inode_t *ip) {
+    xfs_ifork_t     *ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+
+    if (ifp->if_bytes && ifp->if_real_bytes == 0) {
+        ifp->if_u1.if_extents = ifp->if_u2.if_inline_ext;
+    }
+    ifp->if_ext_max = XFS_IFORK_DSIZE(ip) / (uint)sizeof(xfs_bmbt_rec_t);
+
+    if (ip->i_d.di_format == XFS_DINODE_FMT_BTREE) {
+        return XFS_ILOG_CORE | XFS_ILOG_DBROOT;
+    }
+    return XFS_ILOG_CORE | XFS_ILOG_DEXT;
+}
+
+/*
+ * Can the data fork of from be given to to?  The same rules as the
+ * kernel's extent swap: an extent list has to fit inline, and a btree
+ * root has to fit but hold more extents than would fit inline.
+ */
+static int xfs_defrag_fits(xfs_inode_t *from, xfs_inode_t *to) {
+    xfs_ifork_t     *ifp = XFS_IFORK_PTR(from, XFS_DATA_FORK);
+    xfs_extnum_t    nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
+    xfs_extnum_t    maxext = XFS_IFORK_DSIZE(to) / (uint)sizeof(xfs_bmbt_rec_t);
+
+    if (from->i_d.di_format == XFS_DINODE_FMT_EXTENTS) {
+        return nextents <= maxext;
+    }
+    return nextents > maxext &&
+           XFS_BMDR_SPACE_CALC(be16_to_cpu(ifp->if_broot->bb_numrecs)) <=
+           XFS_IFORK_DSIZE(to);
+}
+
+/*
+ * Swap the data forks of the file and the donor in one transaction
+ */
+static int xfs_defrag_swap(xfs_inode_t *ip, xfs_inode_t *donor) {
+    xfs_mount_t     *mp = ip->i_mount;
+    xfs_trans_t     *tp;
+    xfs_ifork_t     tmp;
+    xfs_drfsbno_t   nblocks;
+    xfs_extnum_t    nextents;
+    __int8_t        format;
+    int             error;
+
+    tp = libxfs_trans_alloc(mp, XFS_TRANS_SWAPEXT);
+    if (tp == NULL) {
+        return -ENOMEM;
+    }
+    libxfs_trans_agctx(tp, XFS_INO_TO_AGNO(mp, ip->i_ino));
+
+    error = libxfs_trans_reserve(tp, 0, XFS_ICHANGE_LOG_RES(mp), 0, 0, 0);
+    if (error) {
+        libxfs_trans_cancel(tp, 0);
+        return -error;
+    }
+
+    libxfs_trans_ijoin(tp, ip, 0);
+    libxfs_trans_ijoin(tp, donor, 0);
+    libxfs_trans_ihold(tp, ip);
+    libxfs_trans_ihold(tp, donor);
+
+    tmp = ip->i_df;
+    ip->i_df = donor->i_df;
+    donor->i_df = tmp;
+
+    /* Neither inode has attribute fork blocks, see xfs_defrag_extents() */
+    nblocks = ip->i_d.di_nblocks;
+    ip->i_d.di_nblocks = donor->i_d.di_nblocks;
+    donor->i_d.di_nblocks = nblocks;
+
+    nextents = ip->i_d.di_nextents;
+    ip->i_d.di_nextents = donor->i_d.di_nextents;
+    donor->i_d.di_nextents = nextents;
+
+    format = ip->i_d.di_format;
+    ip->i_d.di_format = donor->i_d.di_format;
+    donor->i_d.di_format = format;
+
+    libxfs_trans_log_inode(tp, ip, xfs_defrag_fixfork(ip));
+    libxfs_trans_log_inode(tp, donor, xfs_defrag_fixfork(donor));
+
+    error = libxfs_trans_commit(tp, 0);
+
+    /* Both forks are now the other's, so both cached maps are stale */
+    xfs_bmap_cursor_drop(ip);
+    xfs_extmap_drop(ip);
+    xfs_bmap_cursor_drop(donor);
+    xfs_extmap_drop(donor);
+    return error ? -error : 0;
+}
+
+/*
+ * Rewrite one file if it has more than the allowed extents per gigabyte.
+ * Returns 1 if it was rewritten, 0 if it was left alone.
+ */
+static int xfs_defrag_file(struct xfs_defrag_ctx *ctx, xfs_inode_t *ip) {
+    xfs_mount_t     *mp = ctx->mp;
+    xfs_inode_t     *donor = ctx->donor;
+    xfs_ifork_t     *ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+    xfs_bmbt_irec_t rec;
+    xfs_extnum_t    nextents;
+    xfs_extnum_t    newextents;
+    xfs_extnum_t    i;
+    xfs_filblks_t   blocks;
+    xfs_fileoff_t   off;
+    xfs_filblks_t   len;
+    __uint64_t      per_gb;
+    int             error;
+
+    ctx->stats->files_scanned++;
+
+    nextents = xfs_defrag_extents(ip, &blocks);
+    if (nextents < 2 || ip->i_ino == donor->i_ino) {
+        return 0;
+    }
+    per_gb = ((__uint64_t)nextents << 30) / XFS_FSB_TO_B(mp, blocks);
+    if (per_gb <= ctx->opts->max_extents_per_gb) {
+        return 0;
+    }
+
+    /*
+     * The copy goes straight to the device, so get any data still in the
+     * buffer cache out first, and drop cached blocks the donor may reuse.
+     */
+    libxfs_bcache_flush();
+    libxfs_bcache_purge();
+
+    /* Map the donor wherever the file is mapped, keeping any holes */
+    xfs_bmbt_get_all(xfs_iext_get_ext(ifp, 0), &rec);
+    off = rec.br_startoff;
+    len = rec.br_blockcount;
+    for (i = 1; i <= nextents; i++) {
+        if (i < nextents) {
+            xfs_bmbt_get_all(xfs_iext_get_ext(ifp, i), &rec);
+            if (rec.br_startoff == off + len) {
+                len += rec.br_blockcount;
+                continue;
+            }
+        }
+        error = xfs_defrag_alloc(donor, off, len);
+        if (error) {
+            goto out_clear;
+        }
+        off = rec.br_startoff;
+        len = rec.br_blockcount;
+    }
+
+    /*
+     * Only swap if it is a real improvement and each fork fits in the
+     * other inode.  The donor's attribute fork leaves it a smaller data
+     * fork than a file without one.
+     */
+    newextents = XFS_IFORK_PTR(donor, XFS_DATA_FORK)->if_bytes /
+                 (uint)sizeof(xfs_bmbt_rec_t);
+    if (newextents >= nextents || !xfs_defrag_fits(donor, ip) ||
+        !xfs_defrag_fits(ip, donor)) {
+        ctx->stats->files_skipped++;
+        return xfs_defrag_clear(donor);
+    }
+
+    error = xfs_defrag_copy(ctx, ip);
+    if (error) {
+        goto out_clear;
+    }
+
+    error = xfs_defrag_swap(ip, donor);
+    if (error) {
+        goto out_clear;
+    }
+    xfs_usage_update(ip);
+
+    ctx->stats->files_defragged++;
+    ctx->stats->extents_before += nextents;
+    ctx->stats->extents_after += newextents;
+
+    /* The donor now holds the old extents */
+    error = xfs_defrag_clear(donor);
+    return error ? error : 1;
+
+out_clear:
+    xfs_defrag_clear(donor);
+    if (error == -ENOSPC) {
+        ctx->stats->files_skipped++;
+        return 0;
+    }
+    return error;
+}
+
+static void xfs_defrag_lock(struct xfs_defrag_ctx *ctx) {
+    if (ctx->opts->lock) {
+        pthread_mutex_lock(ctx->opts->lock);
+    }
+}
+
+static void xfs_defrag_unlock(struct xfs_defrag_ctx *ctx) {
+    if (ctx->opts->lock) {
+        pthread_mutex_unlock(ctx->opts->lock);
+    }
+}
+
+struct xfs_defrag_dirents {
+    xfs_ino_t       *inos;
+    char            **names;
+    size_t          count;
+    size_t          size;
+};
+
+static int xfs_defrag_filldir(void *priv, const char *name, int namelen,
+                              off_t offset, uint64_t inumber, unsigned flags) {
+    struct xfs_defrag_dirents *de = priv;
+
+    if ((namelen == 1 && name[0] == '.') ||
+        (namelen == 2 && name[0] == '.' && name[1] == '.')) {
+        return 0;
+    }
+    if (de->count == de->size) {
+        de->size = de->size ? de->size * 2 : 64;
+        de->inos = realloc(de->inos, de->size * sizeof(xfs_ino_t));
+        de->names = realloc(de->names, de->size * sizeof(char *));
+        if (de->inos == NULL || de->names == NULL) {
+            return ENOMEM;
+        }
+    }
+    de->inos[de->count] = inumber;
+    de->names[de->count] = strndup(name, namelen);
+    if (de->names[de->count] == NULL) {
+        return ENOMEM;
+    }
+    de->count++;
+    return 0;
+}
+
+static int xfs_defrag_inode(struct xfs_defrag_ctx *ctx, xfs_inode_t *ip,
+                            const char *path);
+
+/*
+ * Read the whole directory before working on any of it, so no directory
+ * state is held across the defragmentation transactions.  The lock is
+ * only held for one directory read or one file at a time.
+ */
+static int xfs_defrag_dir(struct xfs_defrag_ctx *ctx, xfs_inode_t *dp,
+                          const char *path) {
+    struct xfs_defrag_dirents de;
+    xfs_inode_t     *ip;
+    xfs_off_t       ofs = 0;
+    char            *child;
+    size_t          i;
+    int             error;
+
+    memset(&de, 0, sizeof(de));
+    xfs_defrag_lock(ctx);
+    error = -xfs_readdir(dp, &de, 102400, &ofs, xfs_defrag_filldir);
+    xfs_defrag_unlock(ctx);
+    if (de.count != 0 && (de.inos == NULL || de.names == NULL)) {
+        error = -ENOMEM;
+    }
+
+    for (i = 0; error == 0 && i < de.count; i++) {
+        if (ctx->opts->stop && *ctx->opts->stop) {
+            break;
+        }
+        if (de.inos[i] == ctx->donor->i_ino) {
+            continue;
+        }
+        child = malloc(strlen(path) + strlen(de.names[i]) + 2);
+        if (child == NULL) {
+            error = -ENOMEM;
+            break;
+        }
+        sprintf(child, "%s/%s", strcmp(path, "/") ? path : "", de.names[i]);
+
+        xfs_defrag_lock(ctx);
+        if (libxfs_iget(ctx->mp, NULL, de.inos[i], 0, &ip, 0) == 0) {
+            error = xfs_defrag_inode(ctx, ip, child);
+            libxfs_iput(ip, 0);
+        }
+        xfs_defrag_unlock(ctx);
+        free(child);
+    }
+
+    for (i = 0; i < de.count && de.names; i++) {
+        free(de.names[i]);
+    }
+    free(de.names);
+    free(de.inos);
+    return error;
+}
+
+/*
+ * Called with the lock held; it is dropped while a directory is walked
+ */
+static int xfs_defrag_inode(struct xfs_defrag_ctx *ctx, xfs_inode_t *ip,
+                            const char *path) {
+    int             r;
+
+    if (xfs_is_dir(ip)) {
+        xfs_defrag_unlock(ctx);
+        r = xfs_defrag_dir(ctx, ip, path);
+        xfs_defrag_lock(ctx);
+        return r;
+    }
+    if (!xfs_is_regular(ip)) {
+        return 0;
+    }
+
+    r = xfs_defrag_file(ctx, ip);
+    if (r > 0 && ctx->opts->verbose) {
+        printf("%s\n", path);
+    }
+    if (r > 0 && ctx->opts->rewritten) {
+        /* Cache invalidation may wait on writes that need the lock */
+        xfs_defrag_unlock(ctx);
+        ctx->opts->rewritten(path);
+        xfs_defrag_lock(ctx);
+    } else if (r < 0) {
+        fprintf(stderr, "defrag %s: %s\n", path, strerror(-r));
+        ctx->stats->files_skipped++;
+    }
+    /* One file failing doesn't stop the pass */
+    return 0;
+}
+
+static int xfs_defrag_is_donor(xfs_inode_t *ip) {
+    return xfs_is_regular(ip) && XFS_IFORK_Q(ip) &&
+           ip->i_d.di_aformat == XFS_DINODE_FMT_LOCAL &&
+           xfs_getxattr(ip, XFS_DEFRAG_MARK, NULL, 0) == 0;
+}
+
+/*
+ * Whether a root directory entry is our donor, and so not to be seen
+ */
+static int xfs_defrag_hidden(xfs_inode_t *dp, const char *name, int namelen,
+                             xfs_ino_t ino) {
+    xfs_inode_t     *ip;
+    int             hidden;
+
+    if (dp->i_ino != dp->i_mount->m_sb.sb_rootino ||
+        namelen != strlen(XFS_DEFRAG_DONOR) ||
+        memcmp(name, XFS_DEFRAG_DONOR, namelen) != 0) {
+        return 0;
+    }
+    if (libxfs_iget(dp->i_mount, NULL, ino, 0, &ip, 0) != 0) {
+        return 0;
+    }
+    hidden = xfs_defrag_is_donor(ip);
+    libxfs_iput(ip, 0);
+    return hidden;
+}
+
+/*
+ * Empty a donor left holding blocks by a pass that never finished
+ */
+static void xfs_defrag_reclaim(xfs_mount_t *mp) {
+    struct xfs_name xname;
+    xfs_inode_t     *rootdir;
+    xfs_inode_t     *donor;
+    xfs_ino_t       inum;
+
+    if (libxfs_iget(mp, NULL, mp->m_sb.sb_rootino, 0, &rootdir, 0) != 0) {
+        return;
+    }
+    xname.name = XFS_DEFRAG_DONOR;
+    xname.len = strlen(XFS_DEFRAG_DONOR);
+    if (libxfs_dir_lookup(NULL, rootdir, &xname, &inum, NULL) == 0 &&
+        libxfs_iget(mp, NULL, inum, 0, &donor, 0) == 0) {
+        if (xfs_defrag_is_donor(donor) && donor->i_d.di_nblocks != 0) {
+            xfs_defrag_clear(donor);
+        }
+        libxfs_iput(donor, 0);
+    }
+    libxfs_iput(rootdir, 0);
+}
+
+/*
+ * Find the donor left by an earlier pass, or make a new one.  An existing
+ * /.xfs_defrag without our mark is left alone and the pass refused.
+ */
+static int xfs_defrag_donor(xfs_mount_t *mp, xfs_inode_t *rootdir,
+                            xfs_inode_t **donorp) {
+    struct xfs_name xname;
+    xfs_ino_t       inum;
+    int             error;
+
+    xname.name = XFS_DEFRAG_DONOR;
+    xname.len = strlen(XFS_DEFRAG_DONOR);
+
+    if (libxfs_dir_lookup(NULL, rootdir, &xname, &inum, NULL) != 0) {
+        error = xfs_create_file(mp, rootdir, XFS_DEFRAG_DONOR,
+                                S_IFREG | 0600, 0, donorp);
+        if (error) {
+            return error;
+        }
+        error = xfs_setxattr(*donorp, XFS_DEFRAG_MARK, "", 0,
+                             XFS_XATTR_CREATE);
+        if (error) {
+            libxfs_iput(*donorp, 0);
+        }
+        return error;
+    }
+
+    error = libxfs_iget(mp, NULL, inum, 0, donorp, 0);
+    if (error) {
+        return -error;
+    }
+    if (!xfs_defrag_is_donor(*donorp)) {
+        libxfs_iput(*donorp, 0);
+        return -EEXIST;
+    }
+    return xfs_defrag_clear(*donorp);
+}
+
+int xfs_defrag(xfs_mount_t *mp, const char *path,
+               struct xfs_defrag_opts *opts,
+               struct xfs_defrag_stats *stats) {
+    struct xfs_defrag_ctx ctx;
+    xfs_inode_t     *rootdir = NULL;
+    xfs_inode_t     *ip = NULL;
+    int             error;
+
+    if (mp == NULL || path == NULL || opts == NULL || stats == NULL) {
+        return -EINVAL;
+    }
+    if (xfs_is_readonly(mp)) {
+        return -EROFS;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.mp = mp;
+    ctx.opts = opts;
+    ctx.stats = stats;
+
+    ctx.buf = memalign(getpagesize(), XFS_DEFRAG_IOSIZE);
+    if (ctx.buf == NULL) {
+        return -ENOMEM;
+    }
+
+    xfs_defrag_lock(&ctx);
+    error = find_path(mp, path, &ip);
+    if (error) {
+        xfs_defrag_unlock(&ctx);
+        free(ctx.buf);
+        return -ENOENT;
+    }
+
+    error = -libxfs_iget(mp, NULL, mp->m_sb.sb_rootino, 0, &rootdir, 0);
+    if (error == 0) {
+        error = xfs_defrag_donor(mp, rootdir, &ctx.donor);
+    }
+
+    if (error == 0) {
+        error = xfs_defrag_inode(&ctx, ip, path);
+
+        /*
+         * The donor is left behind, empty, for the next pass: libxfs can't
+         * free an inode, so unlinking it would only orphan it.
+         */
+        xfs_defrag_clear(ctx.donor);
+        libxfs_iput(ctx.donor, 0);
+    }
+
+    if (rootdir) {
+        libxfs_iput(rootdir, 0);
+    }
+    libxfs_iput(ip, 0);
+    xfs_defrag_unlock(&ctx);
+    free(ctx.buf);
+    return error;
+}
+
+/*
+ * Bulk inode scan (Phase 6)
+ *
+ * Reads the inode btree of each AG and then every allocated inode chunk
+ * in one I/O, decoding the inodes straight from the chunk buffer rather
+ * than going through libxfs_iget.  Worker threads scan AGs in order, each
+ * into a bounded queue of its own, and the calling thread drains the
+ * queues AG by AG so the callback sees inodes in inode number order.
+ */
+
+#define XFS_BULKSTAT_QUEUE  4096    /* decoded inodes buffered per AG */
+#define XFS_BULKSTAT_BATCH  256     /* handed to the callback per wakeup */
+
+struct xfs_bulkstat_ag {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    struct xfs_bulkstat_rec    *ring;
+    unsigned int        head;
+    unsigned int        count;
+    int                 done;
+    int                 error;
+};
+
+struct xfs_bulkstat_ctx {
+    xfs_mount_t             *mp;
+    struct xfs_bulkstat_ag  *ags;
+    pthread_mutex_t         lock;
+    xfs_agnumber_t          next_ag;
+    volatile int            stop;
+};
+
+/*
+ * Queue a chunk's worth of inodes, waiting for the consumer to make room
+ */
+static int xfs_bulkstat_push(struct xfs_bulkstat_ctx *ctx,
+                             struct xfs_bulkstat_ag *ag,
+                             struct xfs_bulkstat_rec *recs, int n) {
+    int             i;
+
+    pthread_mutex_lock(&ag->lock);
+    while (XFS_BULKSTAT_QUEUE - ag->count < (unsigned int)n && !ctx->stop) {
+        pthread_cond_wait(&ag->cond, &ag->lock);
+    }
+    if (ctx->stop) {
+        pthread_mutex_unlock(&ag->lock);
+        return -ECANCELED;
+    }
+    for (i = 0; i < n; i++) {
+        ag->ring[(ag->head + ag->count) % XFS_BULKSTAT_QUEUE] = recs[i];
+        ag->count++;
+    }
+    pthread_cond_broadcast(&ag->cond);
+    pthread_mutex_unlock(&ag->lock);
+    return 0;
+}
+
+/*
+ * Decode the allocated inodes of one inode chunk
+ */
+static int xfs_bulkstat_chunk(struct xfs_bulkstat_ctx *ctx, xfs_agnumber_t agno,
+                              xfs_inobt_rec_t *rec, xfs_buf_t *cbp,
+                              struct xfs_bulkstat_rec *out) {
+    xfs_mount_t     *mp = ctx->mp;
+    xfs_agino_t     startino = be32_to_cpu(rec->ir_startino);
+    xfs_agblock_t   agbno = XFS_AGINO_TO_AGBNO(mp, startino);
+    int             first = XFS_AGINO_TO_OFFSET(mp, startino);
+    xfs_dinode_t    *dip;
+    xfs_icdinode_t  dic;
+    int             error;
+    int             i;
+    int             n = 0;
+
+    if (be32_to_cpu(rec->ir_freecount) == XFS_INODES_PER_CHUNK) {
+        return 0;
+    }
+
+    error = libxfs_readbufr(mp->m_dev, XFS_AGB_TO_DADDR(mp, agno, agbno), cbp,
+                            XFS_FSB_TO_BB(mp, XFS_IALLOC_BLOCKS(mp)), 0);
+    if (error) {
+        return -error;
+    }
+
+    for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
+        if (XFS_INOBT_IS_FREE_DISK(rec, i)) {
+            continue;
+        }
+        dip = (xfs_dinode_t *)((char *)XFS_BUF_PTR(cbp) +
+                               ((first + i) << mp->m_sb.sb_inodelog));
+        if (be16_to_cpu(dip->di_core.di_magic) != XFS_DINODE_MAGIC) {
+            continue;
+        }
+        libxfs_dinode_from_disk(&dic, &dip->di_core);
+        if (dic.di_mode == 0) {
+            continue;
+        }
+        memset(&out[n], 0, sizeof(out[n]));
+        xfs_dinode_to_stat(XFS_AGINO_TO_INO(mp, agno, startino + i), &dic,
+                           &out[n].bs_stat);
+        out[n].bs_extents = dic.di_nextents;
+        out[n].bs_aextents = dic.di_anextents;
+        out[n].bs_projid = xfs_get_projid(dic);
+        n++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    return xfs_bulkstat_push(ctx, &ctx->ags[agno], out, n);
+}
+
+/*
+ * Walk down the left edge of the AG's inode btree, then along the leaves
+ */
+static int xfs_bulkstat_ag(struct xfs_bulkstat_ctx *ctx, xfs_agnumber_t agno,
+                           xfs_buf_t *cbp, xfs_inobt_rec_t *recs,
+                           struct xfs_bulkstat_rec *out) {
+    xfs_mount_t     *mp = ctx->mp;
+    xfs_buf_t       *bp;
+    xfs_agi_t       *agi;
+    struct xfs_btree_block *block;
+    xfs_agblock_t   bno;
+    int             level;
+    int             numrecs;
+    int             error;
+    int             i;
+
+    bp = libxfs_readbuf(mp->m_dev, XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+                        XFS_FSS_TO_BB(mp, 1), 0);
+    if (bp == NULL) {
+        return -EIO;
+    }
+    agi = XFS_BUF_TO_AGI(bp);
+    if (be32_to_cpu(agi->agi_magicnum) != XFS_AGI_MAGIC) {
+        libxfs_putbuf(bp);
+        return -EIO;
+    }
+    bno = be32_to_cpu(agi->agi_root);
+    libxfs_putbuf(bp);
+
+    while (bno != NULLAGBLOCK && !ctx->stop) {
+        bp = libxfs_readbuf(mp->m_dev, XFS_AGB_TO_DADDR(mp, agno, bno),
+                            XFS_FSB_TO_BB(mp, 1), 0);
+        if (bp == NULL) {
+            return -EIO;
+        }
+        block = XFS_BUF_TO_BLOCK(bp);
+        level = be16_to_cpu(block->bb_level);
+        numrecs = be16_to_cpu(block->bb_numrecs);
+        if (be32_to_cpu(block->bb_magic) != XFS_IBT_MAGIC ||
+            numrecs > mp->m_inobt_mxr[level != 0]) {
+            libxfs_putbuf(bp);
+            return -EIO;
+        }
+
+        if (level > 0) {
+            bno = be32_to_cpu(*XFS_INOBT_PTR_ADDR(mp, block, 1,
+                                                  mp->m_inobt_mxr[1]));
+            libxfs_putbuf(bp);
+            continue;
+        }
+
+        /* Don't hold the leaf while the chunks are read */
+        memcpy(recs, XFS_INOBT_REC_ADDR(mp, block, 1),
+               numrecs * sizeof(xfs_inobt_rec_t));
+        bno = be32_to_cpu(block->bb_u.s.bb_rightsib);
+        libxfs_putbuf(bp);
+
+        for (i = 0; i < numrecs; i++) {
+            error = xfs_bulkstat_chunk(ctx, agno, &recs[i], cbp, out);
+            if (error) {
+                return error;
+            }
+        }
+    }
+    return 0;
+}
+
+static void *xfs_bulkstat_worker(void *arg) {
+    struct xfs_bulkstat_ctx *ctx = arg;
+    xfs_mount_t     *mp = ctx->mp;
+    struct xfs_bulkstat_ag *ag;
+    xfs_inobt_rec_t *recs;
+    struct xfs_bulkstat_rec *out;
+    xfs_buf_t       *cbp;
+    xfs_agnumber_t  agno;
+    int             error;
+
+    cbp = libxfs_getbufr(mp->m_dev, 0, XFS_FSB_TO_BB(mp, XFS_IALLOC_BLOCKS(mp)));
+    recs = malloc(mp->m_inobt_mxr[0] * sizeof(xfs_inobt_rec_t));
+    out = malloc(XFS_INODES_PER_CHUNK * sizeof(struct xfs_bulkstat_rec));
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        agno = ctx->next_ag++;
+        pthread_mutex_unlock(&ctx->lock);
+        if (agno >= mp->m_sb.sb_agcount) {
+            break;
+        }
+        ag = &ctx->ags[agno];
+
+        error = -ENOMEM;
+        ag->ring = malloc(XFS_BULKSTAT_QUEUE * sizeof(struct xfs_bulkstat_rec));
+        if (cbp != NULL && recs != NULL && out != NULL && ag->ring != NULL) {
+            error = xfs_bulkstat_ag(ctx, agno, cbp, recs, out);
+        }
+
+        pthread_mutex_lock(&ag->lock);
+        ag->error = error;
+        ag->done = 1;
+        pthread_cond_broadcast(&ag->cond);
+        pthread_mutex_unlock(&ag->lock);
+    }
+
+    if (cbp != NULL) {
+        libxfs_putbufr(cbp);
+    }
+    free(recs);
+    free(out);
+    return NULL;
+}
+
+/*
+ * Stop the workers, waking any waiting for room in a queue
+ */
+static void xfs_bulkstat_stop(struct xfs_bulkstat_ctx *ctx) {
+    xfs_agnumber_t  agno;
+
+    ctx->stop = 1;
+    for (agno = 0; agno < ctx->mp->m_sb.sb_agcount; agno++) {
+        pthread_mutex_lock(&ctx->ags[agno].lock);
+        pthread_cond_broadcast(&ctx->ags[agno].cond);
+        pthread_mutex_unlock(&ctx->ags[agno].lock);
+    }
+}
+
+int xfs_bulkstat(xfs_mount_t *mp, int nthreads, xfs_bulkstat_fn fn, void *priv) {
+    struct xfs_bulkstat_ctx ctx;
+    struct xfs_bulkstat_ag *ag;
+    struct xfs_bulkstat_rec *batch;
+    pthread_t       *threads;
+    xfs_agnumber_t  agcount;
+    xfs_agnumber_t  agno;
+    unsigned int    n;
+    unsigned int    i;
+    int             started;
+    int             r = 0;
+
+    if (mp == NULL || fn == NULL) {
+        return -EINVAL;
+    }
+    agcount = mp->m_sb.sb_agcount;
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if ((xfs_agnumber_t)nthreads > agcount) {
+        nthreads = agcount;
+    }
+
+    /* The chunks are read from disk, so write back anything newer first */
+    if (!xfs_is_readonly(mp)) {
+        libxfs_bcache_flush();
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.mp = mp;
+    pthread_mutex_init(&ctx.lock, NULL);
+    ctx.ags = calloc(agcount, sizeof(struct xfs_bulkstat_ag));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    batch = malloc(XFS_BULKSTAT_BATCH * sizeof(struct xfs_bulkstat_rec));
+    if (ctx.ags == NULL || threads == NULL || batch == NULL) {
+        free(ctx.ags);
+        free(threads);
+        free(batch);
+        return -ENOMEM;
+    }
+    for (agno = 0; agno < agcount; agno++) {
+        pthread_mutex_init(&ctx.ags[agno].lock, NULL);
+        pthread_cond_init(&ctx.ags[agno].cond, NULL);
+    }
+
+    for (started = 0; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, xfs_bulkstat_worker,
+                           &ctx) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        r = -EAGAIN;
+    }
+
+    for (agno = 0; agno < agcount && r == 0; agno++) {
+        ag = &ctx.ags[agno];
+        for (;;) {
+            pthread_mutex_lock(&ag->lock);
+            while (ag->count == 0 && !ag->done) {
+                pthread_cond_wait(&ag->cond, &ag->lock);
+            }
+            if (ag->count == 0) {
+                /* The worker is finished with this AG */
+                r = ag->error;
+                free(ag->ring);
+                ag->ring = NULL;
+                pthread_mutex_unlock(&ag->lock);
+                break;
+            }
+            n = MIN(ag->count, XFS_BULKSTAT_BATCH);
+            for (i = 0; i < n; i++) {
+                batch[i] = ag->ring[(ag->head + i) % XFS_BULKSTAT_QUEUE];
+            }
+            ag->head = (ag->head + n) % XFS_BULKSTAT_QUEUE;
+            ag->count -= n;
+            pthread_cond_broadcast(&ag->cond);
+            pthread_mutex_unlock(&ag->lock);
+
+            for (i = 0; i < n && r == 0; i++) {
+                r = fn(priv, &batch[i]);
+            }
+            if (r) {
+                break;
+            }
+        }
+    }
+
+    xfs_bulkstat_stop(&ctx);
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+
+    for (agno = 0; agno < agcount; agno++) {
+        free(ctx.ags[agno].ring);
+        pthread_mutex_destroy(&ctx.ags[agno].lock);
+        pthread_cond_destroy(&ctx.ags[agno].cond);
+    }
+    pthread_mutex_destroy(&ctx.lock);
+    free(ctx.ags);
+    free(threads);
+    free(batch);
+    return r;
+}
+
+/*
+ * Space usage index (Phase 7)
+ *
+ * Space and inodes in use per top-level directory, uid, gid and project,
+ * so questions du would answer by stat'ing every inode are answered from
+ * memory.  The index is built on first use from a bulk inode scan, plus
+ * a walk of the directories alone to find which top-level directory each
+ * inode is under, and is then kept current by the operations in this
+ * file.  Each indexed inode remembers what it was charged, so operations
+ * just hand over the inodes they touched and the difference is charged.
+ *
+ * Hard links are charged to the first subtree they are found in.  Moving
+ * a directory between subtrees, or in or out of the top level, marks the
+ * index stale and the next report rebuilds it.
+ */
+
+#define XFS_USAGE_NODIR     (-1)    /* not reached from the root */
+#define XFS_USAGE_NEWDIR    (-2)    /* while building: a directory */
+#define XFS_USAGE_NEWFILE   (-3)    /* while building: anything else */
+
+struct xfs_usage_ino {
+    xfs_ino_t       ino;            /* 0 for a free slot */
+    xfs_drfsbno_t   blocks;         /* di_nblocks charged */
+    __uint32_t      uid;
+    __uint32_t      gid;
+    __uint32_t      projid;
+    __int32_t       dir;            /* index into dirs, or XFS_USAGE_* */
+};
+
+struct xfs_usage_count {
+    __uint32_t      id;
+    __uint64_t      blocks;
+    __uint64_t      inodes;
+};
+
+struct xfs_usage_ids {
+    struct xfs_usage_count  *ents;  /* sorted by id */
+    size_t          count;
+    size_t          size;
+};
+
+struct xfs_usage_dir {
+    xfs_ino_t       ino;
+    char            *name;          /* "" for the root */
+    __uint64_t      blocks;
+    __uint64_t      inodes;
+};
+
+struct xfs_usage {
+    struct xfs_usage        *next;
+    xfs_mount_t             *mp;
+    pthread_mutex_t         lock;
+    int                     valid;
+    struct xfs_usage_ino    *inos;  /* linear probing, power of two size */
+    size_t                  ino_count;
+    size_t                  ino_size;
+    struct xfs_usage_dir    *dirs;  /* dirs[0] is the root */
+    size_t                  ndirs;
+    size_t                  dir_size;
+    struct xfs_usage_ids    uids;
+    struct xfs_usage_ids    gids;
+    struct xfs_usage_ids    projids;
+};
+
+static struct xfs_usage *xfs_usage_list = NULL;
+static pthread_mutex_t xfs_usage_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t xfs_usage_slot(struct xfs_usage *u, xfs_ino_t ino) {
+    return (size_t)((ino * 0x9e3779b97f4a7c15ULL) >> 32) & (u->ino_size - 1);
+}
+
+static struct xfs_usage_ino *xfs_usage_ino_find(struct xfs_usage *u,
+                                                xfs_ino_t ino) {
+    size_t          i;
+
+    if (u->ino_size == 0) {
+        return NULL;
+    }
+    for (i = xfs_usage_slot(u, ino); u->inos[i].ino != 0;
+         i = (i + 1) & (u->ino_size - 1)) {
+        if (u->inos[i].ino == ino) {
+            return &u->inos[i];
+        }
+    }
+    return NULL;
+}
+
+static int xfs_usage_ino_grow(struct xfs_usage *u) {
+    struct xfs_usage_ino *old = u->inos;
+    size_t          oldsize = u->ino_size;
+    size_t          i, j;
+
+    u->ino_size = oldsize ? oldsize * 2 : 1024;
+    u->inos = calloc(u->ino_size, sizeof(struct xfs_usage_ino));
+    if (u->inos == NULL) {
+        u->inos = old;
+        u->ino_size = oldsize;
+        return -ENOMEM;
+    }
+    for (i = 0; i < oldsize; i++) {
+        if (old[i].ino == 0) {
+            continue;
+        }
+        for (j = xfs_usage_slot(u, old[i].ino); u->inos[j].ino != 0;
+             j = (j + 1) & (u->ino_size - 1)) {
+        }
+        u->inos[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/*
+ * Returns a zeroed slot for an inode not in the index yet.  Earlier
+ * slot pointers are stale afterwards, as the table may have grown.
+ */
+static struct xfs_usage_ino *xfs_usage_ino_add(struct xfs_usage *u,
+                                               xfs_ino_t ino) {
+    size_t          i;
+
+    if ((u->ino_count + 1) * 4 > u->ino_size * 3 && xfs_usage_ino_grow(u)) {
+        return NULL;
+    }
+    for (i = xfs_usage_slot(u, ino); u->inos[i].ino != 0;
+         i = (i + 1) & (u->ino_size - 1)) {
+    }
+    memset(&u->inos[i], 0, sizeof(struct xfs_usage_ino));
+    u->inos[i].ino = ino;
+    u->ino_count++;
+    return &u->inos[i];
+}
+
+static void xfs_usage_ino_del(struct xfs_usage *u, struct xfs_usage_ino *e) {
+    size_t          mask = u->ino_size - 1;
+    size_t          i = e - u->inos;
+    size_t          j = i;
+    size_t          k;
+
+    /* Move back any later entry whose probe sequence passes through i */
+    for (;;) {
+        j = (j + 1) & mask;
+        if (u->inos[j].ino == 0) {
+            break;
+        }
+        k = xfs_usage_slot(u, u->inos[j].ino);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        u->inos[i] = u->inos[j];
+        i = j;
+    }
+    u->inos[i].ino = 0;
+    u->ino_count--;
+}
+
+static struct xfs_usage_count *xfs_usage_id(struct xfs_usage_ids *ids,
+                                            __uint32_t id) {
+    struct xfs_usage_count *ents;
+    size_t          lo = 0;
+    size_t          hi = ids->count;
+    size_t          mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ids->ents[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < ids->count && ids->ents[lo].id == id) {
+        return &ids->ents[lo];
+    }
+
+    if (ids->count == ids->size) {
+        ents = realloc(ids->ents, (ids->size ? ids->size * 2 : 16) *
+                                  sizeof(struct xfs_usage_count));
+        if (ents == NULL) {
+            return NULL;
+        }
+        ids->ents = ents;
+        ids->size = ids->size ? ids->size * 2 : 16;
+    }
+    memmove(&ids->ents[lo + 1], &ids->ents[lo],
+            (ids->count - lo) * sizeof(struct xfs_usage_count));
+    memset(&ids->ents[lo], 0, sizeof(struct xfs_usage_count));
+    ids->ents[lo].id = id;
+    ids->count++;
+    return &ids->ents[lo];
+}
+
+static int xfs_usage_add_dir(struct xfs_usage *u, xfs_ino_t ino,
+                             const char *name) {
+    struct xfs_usage_dir *dirs;
+
+    if (u->ndirs == u->dir_size) {
+        dirs = realloc(u->dirs, (u->dir_size ? u->dir_size * 2 : 16) *
+                                sizeof(struct xfs_usage_dir));
+        if (dirs == NULL) {
+            return -ENOMEM;
+        }
+        u->dirs = dirs;
+        u->dir_size = u->dir_size ? u->dir_size * 2 : 16;
+    }
+    memset(&u->dirs[u->ndirs], 0, sizeof(struct xfs_usage_dir));
+    u->dirs[u->ndirs].ino = ino;
+    u->dirs[u->ndirs].name = strdup(name);
+    if (u->dirs[u->ndirs].name == NULL) {
+        return -ENOMEM;
+    }
+    return u->ndirs++;
+}
+
+/*
+ * Add what an inode is charged to its totals (sign 1) or take it away
+ */
+static int xfs_usage_charge(struct xfs_usage *u, struct xfs_usage_ino *e,
+                            int sign) {
+    struct xfs_usage_count *c;
+    __uint64_t      blocks = sign > 0 ? e->blocks : -(__uint64_t)e->blocks;
+    __uint64_t      inodes = sign > 0 ? 1 : -(__uint64_t)1;
+
+    if (e->dir >= 0) {
+        u->dirs[e->dir].blocks += blocks;
+        u->dirs[e->dir].inodes += inodes;
+    }
+    if ((c = xfs_usage_id(&u->uids, e->uid)) == NULL) {
+        return -ENOMEM;
+    }
+    c->blocks += blocks;
+    c->inodes += inodes;
+    if ((c = xfs_usage_id(&u->gids, e->gid)) == NULL) {
+        return -ENOMEM;
+    }
+    c->blocks += blocks;
+    c->inodes += inodes;
+    if ((c = xfs_usage_id(&u->projids, e->projid)) == NULL) {
+        return -ENOMEM;
+    }
+    c->blocks += blocks;
+    c->inodes += inodes;
+    return 0;
+}
+
+static void xfs_usage_set(struct xfs_usage_ino *e, xfs_inode_t *ip) {
+    e->blocks = ip->i_d.di_nblocks;
+    e->uid = ip->i_d.di_uid;
+    e->gid = ip->i_d.di_gid;
+    e->projid = xfs_get_projid(ip->i_d);
+}
+
+/*
+ * Returns the mount's index locked, or NULL if it has none to keep up
+ */
+static struct xfs_usage *xfs_usage_get(xfs_mount_t *mp) {
+    struct xfs_usage *u;
+
+    if (xfs_usage_list == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&xfs_usage_list_lock);
+    for (u = xfs_usage_list; u != NULL && u->mp != mp; u = u->next) {
+    }
+    pthread_mutex_unlock(&xfs_usage_list_lock);
+    if (u == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&u->lock);
+    if (!u->valid) {
+        pthread_mutex_unlock(&u->lock);
+        return NULL;
+    }
+    return u;
+}
+
+/*
+ * Charge the difference between what ip was charged and what it has now.
+ * An inode whose last link is gone leaves the index.
+ */
+static void xfs_usage_reconcile(struct xfs_usage *u, xfs_inode_t *ip) {
+    struct xfs_usage_ino *e;
+
+    e = xfs_usage_ino_find(u, ip->i_ino);
+    if (e == NULL) {
+        return;
+    }
+    if (xfs_usage_charge(u, e, -1)) {
+        u->valid = 0;
+        return;
+    }
+    if (ip->i_d.di_nlink == 0) {
+        xfs_usage_ino_del(u, e);
+        return;
+    }
+    xfs_usage_set(e, ip);
+    if (xfs_usage_charge(u, e, 1)) {
+        u->valid = 0;
+    }
+}
+
+static void xfs_usage_update(xfs_inode_t *ip) {
+    struct xfs_usage *u;
+
+    if ((u = xfs_usage_get(ip->i_mount)) == NULL) {
+        return;
+    }
+    xfs_usage_reconcile(u, ip);
+    pthread_mutex_unlock(&u->lock);
+}
+
+/*
+ * A new inode ip, linked into dp as name
+ */
+static void xfs_usage_create(xfs_inode_t *dp, xfs_inode_t *ip,
+                             const char *name) {
+    struct xfs_usage *u;
+    struct xfs_usage_ino *e;
+    int             dir;
+
+    if ((u = xfs_usage_get(ip->i_mount)) == NULL) {
+        return;
+    }
+    xfs_usage_reconcile(u, dp);
+
+    e = xfs_usage_ino_find(u, dp->i_ino);
+    dir = e ? e->dir : XFS_USAGE_NODIR;
+    if (dp->i_ino == ip->i_mount->m_sb.sb_rootino && S_ISDIR(ip->i_d.di_mode)) {
+        dir = xfs_usage_add_dir(u, ip->i_ino, name);
+    }
+    if ((e = xfs_usage_ino_find(u, ip->i_ino)) != NULL) {
+        xfs_usage_charge(u, e, -1);
+        xfs_usage_ino_del(u, e);
+    }
+    e = dir >= XFS_USAGE_NODIR ? xfs_usage_ino_add(u, ip->i_ino) : NULL;
+    if (e == NULL) {
+        u->valid = 0;
+    } else {
+        xfs_usage_set(e, ip);
+        e->dir = dir;
+        if (xfs_usage_charge(u, e, 1)) {
+            u->valid = 0;
+        }
+    }
+    pthread_mutex_unlock(&u->lock);
+}
+
+/*
+ * ip moved from src_dp to dst_dp, replacing target if that is not NULL
+ */
+static void xfs_usage_rename(xfs_inode_t *src_dp, xfs_inode_t *dst_dp,
+                             xfs_inode_t *ip, xfs_inode_t *target) {
+    struct xfs_usage *u;
+    struct xfs_usage_ino *e;
+    xfs_ino_t       rootino = ip->i_mount->m_sb.sb_rootino;
+    int             src_dir, dst_dir;
+
+    if ((u = xfs_usage_get(ip->i_mount)) == NULL) {
+        return;
+    }
+    e = xfs_usage_ino_find(u, src_dp->i_ino);
+    src_dir = e ? e->dir : XFS_USAGE_NODIR;
+    e = xfs_usage_ino_find(u, dst_dp->i_ino);
+    dst_dir = e ? e->dir : XFS_USAGE_NODIR;
+
+    if (S_ISDIR(ip->i_d.di_mode)) {
+        if (src_dir != dst_dir || src_dp->i_ino == rootino ||
+            dst_dp->i_ino == rootino) {
+            u->valid = 0;
+            pthread_mutex_unlock(&u->lock);
+            return;
+        }
+    } else if (src_dir != dst_dir &&
+               (e = xfs_usage_ino_find(u, ip->i_ino)) != NULL &&
+               e->dir == src_dir) {
+        if (xfs_usage_charge(u, e, -1) == 0) {
+            e->dir = dst_dir;
+            if (xfs_usage_charge(u, e, 1) != 0) {
+                u->valid = 0;
+            }
+        } else {
+            u->valid = 0;
+        }
+    }
+
+    xfs_usage_reconcile(u, src_dp);
+    xfs_usage_reconcile(u, dst_dp);
+    xfs_usage_reconcile(u, ip);
+    if (target != NULL) {
+        xfs_usage_reconcile(u, target);
+    }
+    pthread_mutex_unlock(&u->lock);
+}
+
+static int xfs_usage_scan_fn(void *priv, const struct xfs_bulkstat_rec *bs) {
+    struct xfs_usage *u = priv;
+    xfs_sb_t        *sbp = &u->mp->m_sb;
+    xfs_ino_t       ino = bs->bs_stat.st_ino;
+    struct xfs_usage_ino *e;
+
+    /* Unlinked inodes, and the ones the superblock points at */
+    if (bs->bs_stat.st_nlink == 0 || ino == sbp->sb_rbmino ||
+        ino == sbp->sb_rsumino || ino == sbp->sb_uquotino ||
+        ino == sbp->sb_gquotino) {
+        return 0;
+    }
+    if ((e = xfs_usage_ino_add(u, ino)) == NULL) {
+        return -ENOMEM;
+    }
+    e->blocks = bs->bs_stat.st_blocks;
+    e->uid = bs->bs_stat.st_uid;
+    e->gid = bs->bs_stat.st_gid;
+    e->projid = bs->bs_projid;
+    e->dir = S_ISDIR(bs->bs_stat.st_mode) ? XFS_USAGE_NEWDIR : XFS_USAGE_NEWFILE;
+    return 0;
+}
+
+/*
+ * Find the subtree each inode is in, reading only the directories
+ */
+static int xfs_usage_walk(struct xfs_usage *u) {
+    xfs_mount_t     *mp = u->mp;
+    xfs_ino_t       rootino = mp->m_sb.sb_rootino;
+    struct xfs_defrag_dirents de;
+    struct xfs_usage_ino *e;
+    xfs_inode_t     *dp;
+    xfs_ino_t       *stack;
+    xfs_ino_t       *newstack;
+    xfs_ino_t       ino;
+    xfs_off_t       ofs;
+    size_t          depth = 0;
+    size_t          stack_size = 64;
+    size_t          i;
+    int             isdir;
+    int             dir;
+    int             error = 0;
+
+    if ((e = xfs_usage_ino_find(u, rootino)) == NULL) {
+        return -EIO;
+    }
+    e->dir = xfs_usage_add_dir(u, rootino, "");
+    if (e->dir < 0) {
+        return e->dir;
+    }
+    stack = malloc(stack_size * sizeof(xfs_ino_t));
+    if (stack == NULL) {
+        return -ENOMEM;
+    }
+    stack[depth++] = rootino;
+
+    while (depth > 0 && error == 0) {
+        ino = stack[--depth];
+        dir = xfs_usage_ino_find(u, ino)->dir;
+
+        memset(&de, 0, sizeof(de));
+        error = -libxfs_iget(mp, NULL, ino, 0, &dp, 0);
+        if (error) {
+            break;
+        }
+        ofs = 0;
+        error = -xfs_readdir(dp, &de, 102400, &ofs, xfs_defrag_filldir);
+        libxfs_iput(dp, 0);
+        if (de.count != 0 && (de.inos == NULL || de.names == NULL)) {
+            error = -ENOMEM;
+        }
+
+        for (i = 0; error == 0 && i < de.count; i++) {
+            /* Already placed (a hard link), or not found by the scan */
+            e = xfs_usage_ino_find(u, de.inos[i]);
+            if (e == NULL || e->dir >= 0) {
+                continue;
+            }
+            isdir = e->dir == XFS_USAGE_NEWDIR;
+            if (ino != rootino) {
+                e->dir = dir;
+            } else if (isdir) {
+                e->dir = xfs_usage_add_dir(u, de.inos[i], de.names[i]);
+            } else {
+                e->dir = 0;
+            }
+            if (e->dir < 0) {
+                error = e->dir;
+                break;
+            }
+            if (!isdir) {
+                continue;
+            }
+            if (depth == stack_size) {
+                newstack = realloc(stack, stack_size * 2 * sizeof(xfs_ino_t));
+                if (newstack == NULL) {
+                    error = -ENOMEM;
+                    break;
+                }
+                stack = newstack;
+                stack_size *= 2;
+            }
+            stack[depth++] = de.inos[i];
+        }
+
+        for (i = 0; i < de.count && de.names; i++) {
+            free(de.names[i]);
+        }
+        free(de.names);
+        free(de.inos);
+    }
+    free(stack);
+    return error;
+}
+
+static void xfs_usage_clear(struct xfs_usage *u) {
+    size_t          i;
+
+    for (i = 0; i < u->ndirs; i++) {
+        free(u->dirs[i].name);
+    }
+    free(u->dirs);
+    free(u->inos);
+    free(u->uids.ents);
+    free(u->gids.ents);
+    free(u->projids.ents);
+    u->valid = 0;
+    u->inos = NULL;
+    u->ino_count = u->ino_size = 0;
+    u->dirs = NULL;
+    u->ndirs = u->dir_size = 0;
+    memset(&u->uids, 0, sizeof(u->uids));
+    memset(&u->gids, 0, sizeof(u->gids));
+    memset(&u->projids, 0, sizeof(u->projids));
+}
+
+static int xfs_usage_build(struct xfs_usage *u, int nthreads) {
+    size_t          i;
+    int             r;
+
+    xfs_usage_clear(u);
+    r = xfs_bulkstat(u->mp, nthreads, xfs_usage_scan_fn, u);
+    if (r == 0) {
+        r = xfs_usage_walk(u);
+    }
+    for (i = 0; r == 0 && i < u->ino_size; i++) {
+        if (u->inos[i].ino == 0) {
+            continue;
+        }
+        if (u->inos[i].dir < 0) {
+            u->inos[i].dir = XFS_USAGE_NODIR;
+        }
+        r = xfs_usage_charge(u, &u->inos[i], 1);
+    }
+    if (r) {
+        xfs_usage_clear(u);
+        return r;
+    }
+    u->valid = 1;
+    return 0;
+}
+
+struct xfs_usage_buf {
+    char            *buf;
+    size_t          len;
+    size_t          size;
+    int             error;
+};
+
+static void xfs_usage_printf(struct xfs_usage_buf *b, const char *fmt, ...) {
+    va_list         ap;
+    char            *buf;
+    int             n;
+
+    while (b->error == 0) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            b->error = -EINVAL;
+        } else if (b->len + n < b->size) {
+            b->len += n;
+            return;
+        } else if ((buf = realloc(b->buf, b->size * 2)) == NULL) {
+            b->error = -ENOMEM;
+        } else {
+            b->buf = buf;
+            b->size *= 2;
+        }
+    }
+}
+
+static void xfs_usage_print_ids(struct xfs_usage_buf *b, xfs_mount_t *mp,
+                                const char *type, struct xfs_usage_ids *ids) {
+    size_t          i;
+
+    for (i = 0; i < ids->count; i++) {
+        if (ids->ents[i].inodes == 0) {
+            continue;
+        }
+        xfs_usage_printf(b, "%s\t%u\t%llu\t%llu\n", type, ids->ents[i].id,
+                         (unsigned long long)XFS_FSB_TO_B(mp, ids->ents[i].blocks),
+                         (unsigned long long)ids->ents[i].inodes);
+    }
+}
+
+int xfs_usage_report(xfs_mount_t *mp, int nthreads, char **bufp, size_t *lenp) {
+    struct xfs_usage *u;
+    struct xfs_usage_buf b;
+    size_t          i;
+    int             r;
+
+    if (mp == NULL || bufp == NULL || lenp == NULL) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&xfs_usage_list_lock);
+    for (u = xfs_usage_list; u != NULL && u->mp != mp; u = u->next) {
+    }
+    if (u == NULL) {
+        u = calloc(1, sizeof(struct xfs_usage));
+        if (u == NULL) {
+            pthread_mutex_unlock(&xfs_usage_list_lock);
+            return -ENOMEM;
+        }
+        u->mp = mp;
+        pthread_mutex_init(&u->lock, NULL);
+        u->next = xfs_usage_list;
+        xfs_usage_list = u;
+    }
+    pthread_mutex_unlock(&xfs_usage_list_lock);
+
+    pthread_mutex_lock(&u->lock);
+    if (!u->valid && (r = xfs_usage_build(u, nthreads)) != 0) {
+        pthread_mutex_unlock(&u->lock);
+        return r;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.size = 4096;
+    b.buf = malloc(b.size);
+    if (b.buf == NULL) {
+        pthread_mutex_unlock(&u->lock);
+        return -ENOMEM;
+    }
+    xfs_usage_printf(&b, "# type\tname\tbytes\tinodes\n");
+    for (i = 0; i < u->ndirs; i++) {
+        if (i > 0 && u->dirs[i].inodes == 0) {
+            continue;       /* removed since */
+        }
+        xfs_usage_printf(&b, "dir\t/%s\t%llu\t%llu\n", u->dirs[i].name,
+                         (unsigned long long)XFS_FSB_TO_B(mp, u->dirs[i].blocks),
+                         (unsigned long long)u->dirs[i].inodes);
+    }
+    xfs_usage_print_ids(&b, mp, "uid", &u->uids);
+    xfs_usage_print_ids(&b, mp, "gid", &u->gids);
+    xfs_usage_print_ids(&b, mp, "projid", &u->projids);
+    pthread_mutex_unlock(&u->lock);
+
+    if (b.error) {
+        free(b.buf);
+        return b.error;
+    }
+    *bufp = b.buf;
+    *lenp = b.len;
+    return 0;
+}
+
+void xfs_usage_free(xfs_mount_t *mp) {
+    struct xfs_usage **up;
+    struct xfs_usage *u;
+
+    pthread_mutex_lock(&xfs_usage_list_lock);
+    for (up = &xfs_usage_list; *up != NULL && (*up)->mp != mp;
+         up = &(*up)->next) {
+    }
+    u = *up;
+    if (u != NULL) {
+        *up = u->next;
+    }
+    pthread_mutex_unlock(&xfs_usage_list_lock);
+
+    if (u == NULL) {
+        return;
+    }
+    xfs_usage_clear(u);
+    pthread_mutex_destroy(&u->lock);
+    free(u);
+}
+
+/*
+ * Extended attributes (Phase 8)
+ *
+ * Names carry their namespace as a prefix: "trusted." and "security." go
+ * to the root and secure namespaces, and "user." to the user namespace.
+ * Darwin has no prefixes, so there any other name is a user attribute.
+ *
+ * Shortform attribute forks are answered from the in-core fork, and an
+ * inode without an attribute fork needs no lookup at all.  Lookups in
+ * leaf and node forks go through a small cache of recent values and
+ * misses, so the probes made for every file don't read the attribute
+ * blocks again.  Updates drop the entry before and after they change
+ * the fork, and each drop bumps a generation; a lookup only fills the
+ * cache if no drop happened while it was reading, so a value read
+ * across an update is never cached.
+ */
+
+#ifdef __APPLE__
+#define XFS_XATTR_USER_PREFIX   ""
+#else
+#define XFS_XATTR_USER_PREFIX   "user."
+#endif
+#define XFS_XATTR_SIZE_MAX      65536   /* as XATTR_SIZE_MAX */
+
+#define XFS_XATTR_CACHE_SIZE    256     /* entries, direct mapped */
+#define XFS_XATTR_CACHE_VALMAX  256     /* larger values are not cached */
+
+struct xfs_xattr_cent {
+    xfs_mount_t     *mp;
+    xfs_ino_t       ino;                /* 0 for an empty entry */
+    int             flags;              /* namespace */
+    int             valuelen;           /* -1 for an attribute not there */
+    char            name[MAXNAMELEN];
+    char            value[XFS_XATTR_CACHE_VALMAX];
+};
+
+static struct xfs_xattr_cent xfs_xattr_cache[XFS_XATTR_CACHE_SIZE];
+static pthread_mutex_t xfs_xattr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long xfs_xattr_cache_gen;   /* bumped by every drop */
+
+/*
+ * Split a name into its namespace flags and the name stored on disk
+ */
+static int xfs_xattr_name(const char *name, const char **attrname,
+                          int *flags) {
+    if (strncmp(name, "trusted.", 8) == 0) {
+        *attrname = name + 8;
+        *flags = LIBXFS_ATTR_ROOT;
+    } else if (strncmp(name, "security.", 9) == 0) {
+        *attrname = name + 9;
+        *flags = LIBXFS_ATTR_SECURE;
+    } else if (strncmp(name, XFS_XATTR_USER_PREFIX,
+                       strlen(XFS_XATTR_USER_PREFIX)) == 0) {
+        *attrname = name + strlen(XFS_XATTR_USER_PREFIX);
+        *flags = 0;
+    } else {
+        return -ENOTSUP;
+    }
+    if (**attrname == '\0') {
+        return -EINVAL;
+    }
+    if (strlen(*attrname) >= MAXNAMELEN) {
+        return -ERANGE;
+    }
+    return 0;
+}
+
+static struct xfs_xattr_cent *xfs_xattr_cache_slot(xfs_inode_t *ip,
+                                                   const char *attrname,
+                                                   int flags) {
+    xfs_dahash_t    hash = xfs_da_hashname((const uchar_t *)attrname,
+                                           strlen(attrname));
+
+    return &xfs_xattr_cache[(hash ^ (ip->i_ino * 0x9e3779b1) ^ flags) %
+                            XFS_XATTR_CACHE_SIZE];
+}
+
+static int xfs_xattr_cache_match(struct xfs_xattr_cent *ce, xfs_inode_t *ip,
+                                 const char *attrname, int flags) {
+    return ce->ino == ip->i_ino && ce->mp == ip->i_mount &&
+           ce->flags == flags && strcmp(ce->name, attrname) == 0;
+}
+
+static void xfs_xattr_cache_drop(xfs_inode_t *ip, const char *attrname,
+                                 int flags) {
+    struct xfs_xattr_cent *ce = xfs_xattr_cache_slot(ip, attrname, flags);
+
+    pthread_mutex_lock(&xfs_xattr_cache_lock);
+    if (xfs_xattr_cache_match(ce, ip, attrname, flags)) {
+        ce->ino = 0;
+    }
+    xfs_xattr_cache_gen++;
+    pthread_mutex_unlock(&xfs_xattr_cache_lock);
+}
+
+/*
+ * Forget a mount's entries, before its xfs_mount_t goes away
+ */
+static void xfs_xattr_cache_purge(xfs_mount_t *mp) {
+    int             i;
+
+    pthread_mutex_lock(&xfs_xattr_cache_lock);
+    for (i = 0; i < XFS_XATTR_CACHE_SIZE; i++) {
+        if (xfs_xattr_cache[i].mp == mp) {
+            xfs_xattr_cache[i].ino = 0;
+        }
+    }
+    pthread_mutex_unlock(&xfs_xattr_cache_lock);
+}
+
+/*
+ * Hand a value to the caller: its length when size is 0, as getxattr(2)
+ */
+static int xfs_xattr_copyout(void *value, size_t size, const char *buf,
+                             int len) {
+    if (size == 0) {
+        return len;
+    }
+    if ((size_t)len > size) {
+        return -ERANGE;
+    }
+    memcpy(value, buf, len);
+    return len;
+}
+
+int xfs_getxattr(xfs_inode_t *ip, const char *name, void *value, size_t size) {
+    struct xfs_xattr_cent *ce;
+    const char      *attrname;
+    char            buf[XFS_XATTR_CACHE_VALMAX];
+    unsigned long   gen;
+    int             flags;
+    int             len;
+    int             error;
+
+    if (ip == NULL || name == NULL || (value == NULL && size != 0)) {
+        return -EINVAL;
+    }
+    error = xfs_xattr_name(name, &attrname, &flags);
+    if (error) {
+        return error;
+    }
+    if (!XFS_IFORK_Q(ip)) {
+        return -ENOATTR;
+    }
+    if (size > XFS_XATTR_SIZE_MAX) {
+        size = XFS_XATTR_SIZE_MAX;
+    }
+
+    /* Shortform: straight from the in-core fork */
+    if (ip->i_d.di_aformat == XFS_DINODE_FMT_LOCAL) {
+        len = size;
+        error = libxfs_attr_get(ip, attrname, value, &len, flags);
+        if (error == ERANGE && size == 0) {
+            return len;
+        }
+        return error ? -error : len;
+    }
+
+    ce = xfs_xattr_cache_slot(ip, attrname, flags);
+    pthread_mutex_lock(&xfs_xattr_cache_lock);
+    if (xfs_xattr_cache_match(ce, ip, attrname, flags)) {
+        if (ce->valuelen < 0) {
+            len = -ENOATTR;
+        } else {
+            len = xfs_xattr_copyout(value, size, ce->value, ce->valuelen);
+        }
+        pthread_mutex_unlock(&xfs_xattr_cache_lock);
+        return len;
+    }
+    gen = xfs_xattr_cache_gen;
+    pthread_mutex_unlock(&xfs_xattr_cache_lock);
+
+    len = sizeof(buf);
+    error = libxfs_attr_get(ip, attrname, buf, &len, flags);
+    if (error == 0 || error == ENOATTR) {
+        pthread_mutex_lock(&xfs_xattr_cache_lock);
+        if (gen == xfs_xattr_cache_gen) {
+            ce->mp = ip->i_mount;
+            ce->ino = ip->i_ino;
+            ce->flags = flags;
+            ce->valuelen = error ? -1 : len;
+            strcpy(ce->name, attrname);
+            memcpy(ce->value, buf, error ? 0 : len);
+        }
+        pthread_mutex_unlock(&xfs_xattr_cache_lock);
+        return error ? -ENOATTR : xfs_xattr_copyout(value, size, buf, len);
+    }
+    if (error != ERANGE) {
+        return -error;
+    }
+
+    /* Too big to cache, len is now its length */
+    if (size == 0) {
+        return len;
+    }
+    len = size;
+    error = libxfs_attr_get(ip, attrname, value, &len, flags);
+    return error ? -error : len;
+}
+
+int xfs_setxattr(xfs_inode_t *ip, const char *name, const void *value,
+                 size_t size, int flags) {
+    const char      *attrname;
+    int             attrflags;
+    int             error;
+
+    if (ip == NULL || name == NULL || (value == NULL && size != 0)) {
+        return -EINVAL;
+    }
+    if (xfs_is_readonly(ip->i_mount)) {
+        return -EROFS;
+    }
+    error = xfs_xattr_name(name, &attrname, &attrflags);
+    if (error) {
+        return error;
+    }
+    if (size > XFS_XATTR_SIZE_MAX) {
+        return -E2BIG;
+    }
+    if (flags & XFS_XATTR_CREATE) {
+        attrflags |= LIBXFS_ATTR_CREATE;
+    }
+    if (flags & XFS_XATTR_REPLACE) {
+        attrflags |= LIBXFS_ATTR_REPLACE;
+    }
+
+    xfs_xattr_cache_drop(ip, attrname, attrflags & ~(LIBXFS_ATTR_CREATE |
+                                                     LIBXFS_ATTR_REPLACE));
+    error = libxfs_attr_set(ip, attrname, (char *)value, size, attrflags);
+    xfs_xattr_cache_drop(ip, attrname, attrflags & ~(LIBXFS_ATTR_CREATE |
+                                                     LIBXFS_ATTR_REPLACE));
+    if (error) {
+        return -error;
+    }
+    xfs_usage_update(ip);
+    return 0;
+}
+
+int xfs_removexattr(xfs_inode_t *ip, const char *name) {
+    const char      *attrname;
+    int             flags;
+    int             error;
+
+    if (ip == NULL || name == NULL) {
+        return -EINVAL;
+    }
+    if (xfs_is_readonly(ip->i_mount)) {
+        return -EROFS;
+    }
+    error = xfs_xattr_name(name, &attrname, &flags);
+    if (error) {
+        return error;
+    }
+
+    xfs_xattr_cache_drop(ip, attrname, flags);
+    error = libxfs_attr_remove(ip, attrname, flags);
+    xfs_xattr_cache_drop(ip, attrname, flags);
+    if (error) {
+        return -error;
+    }
+    xfs_usage_update(ip);
+    return 0;
+}
+
+struct xfs_xattr_list {
+    char            *list;
+    size_t          size;
+    size_t          len;
+};
+
+static void xfs_xattr_list_add(struct xfs_xattr_list *xl, int ondisk_flags,
+                               const unsigned char *name, int namelen) {
+    const char      *prefix;
+    size_t          plen;
+
+    if (ondisk_flags & XFS_ATTR_INCOMPLETE) {
+        return;
+    }
+    if (ondisk_flags & XFS_ATTR_ROOT) {
+        prefix = "trusted.";
+    } else if (ondisk_flags & XFS_ATTR_SECURE) {
+        prefix = "security.";
+    } else {
+        prefix = XFS_XATTR_USER_PREFIX;
+    }
+    plen = strlen(prefix);
+
+    if (xl->size != 0 && xl->len + plen + namelen + 1 <= xl->size) {
+        memcpy(xl->list + xl->len, prefix, plen);
+        memcpy(xl->list + xl->len + plen, name, namelen);
+        xl->list[xl->len + plen + namelen] = '\0';
+    }
+    xl->len += plen + namelen + 1;
+}
+
+static void xfs_xattr_list_leaf(struct xfs_xattr_list *xl,
+                                xfs_attr_leafblock_t *leaf) {
+    xfs_attr_leaf_entry_t       *entry = &leaf->entries[0];
+    xfs_attr_leaf_name_local_t  *name_loc;
+    xfs_attr_leaf_name_remote_t *name_rmt;
+    int             i;
+
+    for (i = 0; i < be16_to_cpu(leaf->hdr.count); i++, entry++) {
+        if (entry->flags & XFS_ATTR_LOCAL) {
+            name_loc = XFS_ATTR_LEAF_NAME_LOCAL(leaf, i);
+            xfs_xattr_list_add(xl, entry->flags, name_loc->nameval,
+                               name_loc->namelen);
+        } else {
+            name_rmt = XFS_ATTR_LEAF_NAME_REMOTE(leaf, i);
+            xfs_xattr_list_add(xl, entry->flags, name_rmt->name,
+                               name_rmt->namelen);
+        }
+    }
+}
+
+/*
+ * List the names, each with its prefix and a NUL, as listxattr(2)
+ */
+int xfs_listxattr(xfs_inode_t *ip, char *list, size_t size) {
+    struct xfs_xattr_list xl;
+    xfs_attr_shortform_t *sf;
+    xfs_attr_sf_entry_t *sfe;
+    xfs_da_intnode_t *node;
+    xfs_dabuf_t     *bp;
+    xfs_dablk_t     blkno = 0;
+    int             error;
+    int             i;
+
+    if (ip == NULL || (list == NULL && size != 0)) {
+        return -EINVAL;
+    }
+    xl.list = list;
+    xl.size = size;
+    xl.len = 0;
+
+    if (!XFS_IFORK_Q(ip) ||
+        (ip->i_d.di_aformat == XFS_DINODE_FMT_EXTENTS &&
+         ip->i_d.di_anextents == 0)) {
+        return 0;
+    }
+
+    if (ip->i_d.di_aformat == XFS_DINODE_FMT_LOCAL) {
+        sf = (xfs_attr_shortform_t *)ip->i_afp->if_u1.if_data;
+        sfe = &sf->list[0];
+        for (i = 0; i < sf->hdr.count; i++) {
+            xfs_xattr_list_add(&xl, sfe->flags, sfe->nameval, sfe->namelen);
+            sfe = XFS_ATTR_SF_NEXTENTRY(sfe);
+        }
+    } else {
+        /* Down the left edge of the btree, then along the leaves */
+        for (;;) {
+            error = xfs_da_read_buf(NULL, ip, blkno, -1, &bp, XFS_ATTR_FORK);
+            if (error) {
+                return -error;
+            }
+            node = bp->data;
+            if (be16_to_cpu(node->hdr.info.magic) != XFS_DA_NODE_MAGIC) {
+                break;
+            }
+            blkno = be32_to_cpu(node->btree[0].before);
+            xfs_da_brelse(NULL, bp);
+        }
+        for (;;) {
+            if (be16_to_cpu(node->hdr.info.magic) != XFS_ATTR_LEAF_MAGIC) {
+                xfs_da_brelse(NULL, bp);
+                return -EIO;
+            }
+            xfs_xattr_list_leaf(&xl, bp->data);
+            blkno = be32_to_cpu(node->hdr.info.forw);
+            xfs_da_brelse(NULL, bp);
+            if (blkno == 0) {
+                break;
+            }
+            error = xfs_da_read_buf(NULL, ip, blkno, -1, &bp, XFS_ATTR_FORK);
+            if (error) {
+                return -error;
+            }
+            node = bp->data;
+        }
+    }
+
+    if (size != 0 && xl.len > size) {
+        return -ERANGE;
+    }
+    return xl.len;
+}
+
+/*
+ * Extent map (Phase 9)
+ *
+ * The in-core fork keeps each extent packed into a 128 bit record, in
+ * pages for large files, and every lookup goes through xfs_iext_get_ext()
+ * and xfs_bmbt_get_all() to unpack one.  Readers that only look extents
+ * up get them unpacked once into a separate array per field, which they
+ * can binary search.  The records are decoded a run at a time with no
+ * branches, which the compiler turns into vector code.
+ *
+ * Maps are kept for recently used inodes and rebuilt when the file's
+ * mapping changes.  Whatever changes the data fork drops the inode's map
+ * once it has, which also gives the inode a new fork generation; a map
+ * is only used, or cached, if it was built at the inode's current
+ * generation, so one built while the fork was changing never is.
+ *
+ * A btree format file whose extents are not in core is mapped straight
+ * from its bmap btree leaves, leaving the fork alone.
+ */
+#define XFS_EXTMAP_CACHE_SIZE   64
+
+struct xfs_extmap_cent {
+    xfs_mount_t         *mp;
+    xfs_ino_t           ino;            /* 0 if unused */
+    unsigned long       gen;            /* i_forkgen it was built at */
+    struct xfs_extmap   *map;
+};
+
+static struct xfs_extmap_cent xfs_extmap_cache[XFS_EXTMAP_CACHE_SIZE];
+static pthread_mutex_t xfs_extmap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long xfs_extmap_gen;    /* last fork generation handed out */
+
+static inline void xfs_extmap_set(struct xfs_extmap *map, xfs_extnum_t i,
+                                  __uint64_t l0, __uint64_t l1) {
+    map->em_startoff[i] = (l0 & XFS_MASK64LO(64 - BMBT_EXNTFLAG_BITLEN)) >> 9;
+    map->em_startblock[i] = ((l0 & XFS_MASK64LO(9)) << 43) | (l1 >> 21);
+    map->em_blockcount[i] = l1 & XFS_MASK64LO(21);
+    map->em_unwritten[i] = l0 >> (64 - BMBT_EXNTFLAG_BITLEN);
+}
+
+static void xfs_extmap_decode(struct xfs_extmap *map, xfs_extnum_t idx,
+                              const xfs_bmbt_rec_host_t *recs, xfs_extnum_t n) {
+    xfs_extnum_t    i;
+
+    for (i = 0; i < n; i++) {
+        xfs_extmap_set(map, idx + i, recs[i].l0, recs[i].l1);
+    }
+}
+
+static void xfs_extmap_decode_disk(struct xfs_extmap *map, xfs_extnum_t idx,
+                                   const xfs_bmbt_rec_t *recs, xfs_extnum_t n) {
+    xfs_extnum_t    i;
+
+    for (i = 0; i < n; i++) {
+        xfs_extmap_set(map, idx + i, be64_to_cpu(recs[i].l0),
+                       be64_to_cpu(recs[i].l1));
+    }
+}
+
+static struct xfs_extmap *xfs_extmap_alloc(xfs_extnum_t nextents) {
+    struct xfs_extmap *map;
+    size_t          n = nextents ? nextents : 1;
+
+    map = calloc(1, sizeof(*map));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->em_nextents = nextents;
+    map->em_startoff = malloc(n * sizeof(xfs_fileoff_t));
+    map->em_startblock = malloc(n * sizeof(xfs_fsblock_t));
+    map->em_blockcount = malloc(n * sizeof(xfs_filblks_t));
+    map->em_unwritten = malloc(n);
+    map->em_refs = 1;
+    if (map->em_startoff == NULL || map->em_startblock == NULL ||
+        map->em_blockcount == NULL || map->em_unwritten == NULL) {
+        xfs_extmap_put(map);
+        return NULL;
+    }
+    return map;
+}
+
+/*
+ * Read the records from the bmap btree leaves, left to right
+ */
+static int xfs_extmap_read_btree(xfs_inode_t *ip, struct xfs_extmap *map) {
+    xfs_mount_t     *mp = ip->i_mount;
+    xfs_ifork_t     *ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+    struct xfs_btree_block *block = ifp->if_broot;
+    xfs_fsblock_t   fsbno;
+    xfs_extnum_t    n = 0;
+    xfs_buf_t       *bp;
+    int             numrecs;
+    int             level;
+    int             error;
+
+    level = be16_to_cpu(block->bb_level);
+    if (level == 0) {
+        return XFS_ERROR(EFSCORRUPTED);
+    }
+    fsbno = be64_to_cpu(*XFS_BMAP_BROOT_PTR_ADDR(mp, block, 1,
+                                                 ifp->if_broot_bytes));
+    while (level-- > 0) {
+        error = xfs_bmap_read_block(mp, fsbno, level, &bp);
+        if (error) {
+            return error;
+        }
+        if (level == 0) {
+            break;
+        }
+        fsbno = be64_to_cpu(*XFS_BMBT_PTR_ADDR(mp, XFS_BUF_TO_BLOCK(bp), 1,
+                                               mp->m_bmap_dmxr[1]));
+        libxfs_putbuf(bp);
+    }
+
+    for (;;) {
+        block = XFS_BUF_TO_BLOCK(bp);
+        numrecs = be16_to_cpu(block->bb_numrecs);
+        if (n + numrecs > map->em_nextents) {
+            libxfs_putbuf(bp);
+            return XFS_ERROR(EFSCORRUPTED);
+        }
+        xfs_extmap_decode_disk(map, n, XFS_BMBT_REC_ADDR(mp, block, 1),
+                               numrecs);
+        n += numrecs;
+        fsbno = be64_to_cpu(block->bb_u.l.bb_rightsib);
+        libxfs_putbuf(bp);
+        if (fsbno == NULLFSBLOCK) {
+            break;
+        }
+        error = xfs_bmap_read_block(mp, fsbno, 0, &bp);
+        if (error) {
+            return error;
+        }
+    }
+    return n == map->em_nextents ? 0 : XFS_ERROR(EFSCORRUPTED);
+}
+
+static int xfs_extmap_build(xfs_inode_t *ip, struct xfs_extmap **mapp) {
+    xfs_ifork_t     *ifp = XFS_IFORK_PTR(ip, XFS_DATA_FORK);
+    xfs_ext_irec_t  *erp;
+    struct xfs_extmap *map;
+    xfs_extnum_t    nextents = 0;
+    xfs_extnum_t    n = 0;
+    int             nlists;
+    int             i;
+    int             error = 0;
+
+    if (ip->i_d.di_format == XFS_DINODE_FMT_EXTENTS ||
+        ip->i_d.di_format == XFS_DINODE_FMT_BTREE) {
+        nextents = XFS_IFORK_NEXTENTS(ip, XFS_DATA_FORK);
+    }
+    map = xfs_extmap_alloc(nextents);
+    if (map == NULL) {
+        return -ENOMEM;
+    }
+
+    if (nextents == 0) {
+        /* local format, or nothing allocated */
+    } else if (!(ifp->if_flags & XFS_IFEXTENTS)) {
+        error = xfs_extmap_read_btree(ip, map);
+    } else if (ifp->if_flags & XFS_IFEXTIREC) {
+        nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
+        for (i = 0; i < nlists && n < nextents; i++) {
+            erp = &ifp->if_u1.if_ext_irec[i];
+            xfs_extmap_decode(map, n, erp->er_extbuf,
+                              MIN(erp->er_extcount, nextents - n));
+            n += erp->er_extcount;
+        }
+    } else {
+        xfs_extmap_decode(map, 0, ifp->if_u1.if_extents, nextents);
+    }
+    if (error) {
+        xfs_extmap_put(map);
+        return -error;
+    }
+    *mapp = map;
+    return 0;
+}
+
+static struct xfs_extmap_cent *xfs_extmap_slot(xfs_inode_t *ip) {
+    return &xfs_extmap_cache[(ip->i_ino * 0x9e3779b1) % XFS_EXTMAP_CACHE_SIZE];
+}
+
+static void xfs_extmap_drop(xfs_inode_t *ip) {
+    struct xfs_extmap_cent *ce = xfs_extmap_slot(ip);
+    struct xfs_extmap *map = NULL;
+
+    pthread_mutex_lock(&xfs_extmap_cache_lock);
+    ip->i_forkgen = ++xfs_extmap_gen;
+    if (ce->ino == ip->i_ino && ce->mp == ip->i_mount) {
+        map = ce->map;
+        ce->ino = 0;
+        ce->map = NULL;
+    }
+    pthread_mutex_unlock(&xfs_extmap_cache_lock);
+    if (map) {
+        xfs_extmap_put(map);
+    }
+}
+
+static void xfs_extmap_purge(xfs_mount_t *mp) {
+    struct xfs_extmap *map;
+    int             i;
+
+    for (i = 0; i < XFS_EXTMAP_CACHE_SIZE; i++) {
+        map = NULL;
+        pthread_mutex_lock(&xfs_extmap_cache_lock);
+        if (xfs_extmap_cache[i].mp == mp) {
+            map = xfs_extmap_cache[i].map;
+            xfs_extmap_cache[i].ino = 0;
+            xfs_extmap_cache[i].map = NULL;
+        }
+        pthread_mutex_unlock(&xfs_extmap_cache_lock);
+        if (map) {
+            xfs_extmap_put(map);
+        }
+    }
+}
+
+int xfs_extmap_get(xfs_inode_t *ip, struct xfs_extmap **mapp) {
+    struct xfs_extmap_cent *ce = xfs_extmap_slot(ip);
+    struct xfs_extmap *map = NULL;
+    struct xfs_extmap *old = NULL;
+    unsigned long   gen;
+    int             error;
+
+    /* An inode just read in may have any mapping: give it a generation */
+    pthread_mutex_lock(&xfs_extmap_cache_lock);
+    if (ip->i_forkgen == 0) {
+        ip->i_forkgen = ++xfs_extmap_gen;
+    }
+    gen = ip->i_forkgen;
+    if (ce->ino == ip->i_ino && ce->mp == ip->i_mount && ce->gen == gen) {
+        map = ce->map;
+        map->em_refs++;
+    }
+    pthread_mutex_unlock(&xfs_extmap_cache_lock);
+    if (map) {
+        *mapp = map;
+        return 0;
+    }
+
+    error = xfs_extmap_build(ip, &map);
+    if (error) {
+        return error;
+    }
+
+    pthread_mutex_lock(&xfs_extmap_cache_lock);
+    if (ip->i_forkgen == gen) {
+        old = ce->map;
+        ce->mp = ip->i_mount;
+        ce->ino = ip->i_ino;
+        ce->gen = gen;
+        ce->map = map;
+        map->em_refs++;
+    }
+    pthread_mutex_unlock(&xfs_extmap_cache_lock);
+    if (old) {
+        xfs_extmap_put(old);
+    }
+
+    *mapp = map;
+    return 0;
+}
+
+void xfs_extmap_put(struct xfs_extmap *map) {
+    int             refs;
+
+    pthread_mutex_lock(&xfs_extmap_cache_lock);
+    refs = --map->em_refs;
+    pthread_mutex_unlock(&xfs_extmap_cache_lock);
+    if (refs > 0) {
+        return;
+    }
+    free(map->em_startoff);
+    free(map->em_startblock);
+    free(map->em_blockcount);
+    free(map->em_unwritten);
+    free(map);
+}
+
+xfs_extnum_t xfs_extmap_lookup(const struct xfs_extmap *map, xfs_fileoff_t bno) {
+    xfs_extnum_t    lo = 0;
+    xfs_extnum_t    hi = map->em_nextents;
+    xfs_extnum_t    mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (map->em_startoff[mid] + map->em_blockcount[mid] <= bno) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int xfs_fiemap(xfs_inode_t *ip, __uint64_t start, __uint64_t len,
+               struct xfs_fiemap_extent *ext, unsigned int count) {
+    xfs_mount_t     *mp = ip->i_mount;
+    struct xfs_extmap *map;
+    xfs_fileoff_t   end;
+    xfs_extnum_t    i;
+    unsigned int    n = 0;
+    int             error;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (start + len < start) {
+        len = ~0ULL - start;
+    }
+
+    if (ip->i_d.di_format == XFS_DINODE_FMT_LOCAL) {
+        if (start >= ip->i_d.di_size) {
+            return 0;
+        }
+        if (ext && count) {
+            ext->fe_logical = 0;
+            ext->fe_physical = 0;
+            ext->fe_length = ip->i_d.di_size;
+            ext->fe_flags = XFS_FIEMAP_EXTENT_DATA_INLINE |
+                            XFS_FIEMAP_EXTENT_NOT_ALIGNED |
+                            XFS_FIEMAP_EXTENT_LAST;
+        }
+        return ext && count == 0 ? 0 : 1;
+    }
+
+    error = xfs_extmap_get(ip, &map);
+    if (error) {
+        return error;
+    }
+    i = xfs_extmap_lookup(map, XFS_B_TO_FSBT(mp, start));
+    end = XFS_B_TO_FSBT(mp, start + len - 1) + 1;
+
+    if (ext == NULL) {
+        n = xfs_extmap_lookup(map, end) - i;
+        if (n < map->em_nextents - i && map->em_startoff[i + n] < end) {
+            n++;
+        }
+        xfs_extmap_put(map);
+        return n;
+    }
+
+    for (; i < map->em_nextents && map->em_startoff[i] < end && n < count;
+         i++, n++) {
+        ext[n].fe_logical = XFS_FSB_TO_B(mp, map->em_startoff[i]);
+        ext[n].fe_physical = BBTOB(XFS_FSB_TO_DADDR(mp, map->em_startblock[i]));
+        ext[n].fe_length = XFS_FSB_TO_B(mp, map->em_blockcount[i]);
+        ext[n].fe_flags = 0;
+        if (map->em_unwritten[i]) {
+            ext[n].fe_flags |= XFS_FIEMAP_EXTENT_UNWRITTEN;
+        }
+        if (i == map->em_nextents - 1) {
+            ext[n].fe_flags |= XFS_FIEMAP_EXTENT_LAST;
+        }
+    }
+    xfs_extmap_put(map);
+    return n;
+}
@@ -1,10 +1,22 @@
 #ifndef __XFSUTIL_H__
 #define __XFSUTIL_H__
 
+#ifdef __APPLE__
 #include <libc.h>
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#endif
 #include <xfs/libxfs.h>
 #include <sys/stat.h>
+#ifdef __APPLE__
 #include <sys/dirent.h>
+#else
+#include <dirent.h>
+#endif
+#include <pthread.h>
 
 /*
  * Convert XFS directory file type (XFS_DIR3_FT_*) to POSIX DT_* type.
@@ -177,6 +189,170 @@ int xfs_create_link(xfs_mount_t *mp, xfs_inode_t *ip, xfs_inode_t *newparent,
 int xfs_create_symlink(xfs_mount_t *mp, xfs_inode_t *parent, const char *name,
                        const char *target, xfs_inode_t **ipp);
 
+/*
+ * Online defragmentation (Phase 5)
+ */
+struct xfs_defrag_opts {
+    unsigned int    max_extents_per_gb; /* leave files at or under this */
+    pthread_mutex_t *lock;              /* taken around each step, or NULL */
+    volatile int    *stop;              /* set to end the pass early, or NULL */
+    int             verbose;            /* print the files rewritten */
+    void            (*rewritten)(const char *path); /* called unlocked, or NULL */
+};
+
+struct xfs_defrag_stats {
+    __uint64_t      files_scanned;
+    __uint64_t      files_defragged;
+    __uint64_t      files_skipped;      /* no contiguous space, or errors */
+    __uint64_t      extents_before;     /* of the files defragmented */
+    __uint64_t      extents_after;
+    __uint64_t      bytes_moved;
+};
+
+/* Defragment the regular file at path, or every one below it
+ * @param mp      - Mount point (must be read-write)
+ * @param path    - File or directory to start from
+ * @param opts    - Threshold and how to run alongside other users
+ * @param stats   - Output: what was done
+ * Leaves an empty scratch file, /.xfs_defrag, which later passes reuse.
+ * Returns 0 on success, negative errno on failure (-EEXIST if a
+ * /.xfs_defrag exists that an earlier pass did not create) */
+int xfs_defrag(xfs_mount_t *mp, const char *path,
+               struct xfs_defrag_opts *opts,
+               struct xfs_defrag_stats *stats);
+
+/*
+ * Bulk inode scan (Phase 6)
+ */
+struct xfs_bulkstat_rec {
+    struct stat     bs_stat;            /* st_ino is the inode number */
+    xfs_extnum_t    bs_extents;         /* data fork extents */
+    xfs_aextnum_t   bs_aextents;        /* attribute fork extents */
+    __uint32_t      bs_projid;          /* project id */
+};
+
+/* Called for each inode in use; a nonzero return ends the scan */
+typedef int (*xfs_bulkstat_fn)(void *priv, const struct xfs_bulkstat_rec *bs);
+
+/* Read every inode in use straight from the inode btrees and chunks
+ * @param mp       - Mount point
+ * @param nthreads - Number of AGs read at once
+ * @param fn       - Called on the calling thread, in inode number order
+ * @param priv     - Passed to fn
+ * Returns 0 on success, fn's nonzero return, or negative errno on failure */
+int xfs_bulkstat(xfs_mount_t *mp, int nthreads, xfs_bulkstat_fn fn, void *priv);
+
+/*
+ * Space usage index (Phase 7)
+ */
+/* Report the space and inodes in use below each top-level directory and
+ * by each uid, gid and project, as tab separated lines of
+ *     type  name  bytes  inodes
+ * where type is dir, uid, gid or projid.  The dir line for "/" covers the
+ * root itself and whatever in it is not a directory.  The first call
+ * builds an index that the operations above keep current, so later calls
+ * are answered from memory.
+ * @param mp       - Mount point
+ * @param nthreads - Scan threads, when the index has to be built
+ * @param bufp     - Output: the report (caller must free)
+ * @param lenp     - Output: its length
+ * Returns 0 on success, negative errno on failure */
+int xfs_usage_report(xfs_mount_t *mp, int nthreads, char **bufp, size_t *lenp);
+
+/* Drop the mount's usage index, if it has one (unmount_xfs does this) */
+void xfs_usage_free(xfs_mount_t *mp);
+
+/*
+ * Extended attributes (Phase 8)
+ */
+#define XFS_XATTR_CREATE    0x1     /* fail if the attribute exists */
+#define XFS_XATTR_REPLACE   0x2     /* fail if it doesn't */
+
+/* Get an extended attribute
+ * @param ip      - Inode
+ * @param name    - Name with its "user.", "trusted." or "security." prefix
+ *                  (on Darwin, a name with neither of the last two is a
+ *                  user attribute)
+ * @param value   - Output buffer, or NULL
+ * @param size    - Size of value; 0 to just get the length
+ * Returns the value's length, or negative errno (-ENOATTR, -ERANGE) */
+int xfs_getxattr(xfs_inode_t *ip, const char *name, void *value, size_t size);
+
+/* Set an extended attribute
+ * @param ip      - Inode
+ * @param name    - Name with its prefix, as for xfs_getxattr
+ * @param value   - Value
+ * @param size    - Its length, up to 64KB
+ * @param flags   - XFS_XATTR_CREATE, XFS_XATTR_REPLACE or 0
+ * Returns 0 on success, negative errno on failure */
+int xfs_setxattr(xfs_inode_t *ip, const char *name, const void *value,
+                 size_t size, int flags);
+
+/* List extended attribute names, each with its prefix and a NUL
+ * @param ip      - Inode
+ * @param list    - Output buffer, or NULL
+ * @param size    - Size of list; 0 to just get the length needed
+ * Returns the length of the list, or negative errno (-ERANGE) */
+int xfs_listxattr(xfs_inode_t *ip, char *list, size_t size);
+
+/* Remove an extended attribute
+ * @param ip      - Inode
+ * @param name    - Name with its prefix, as for xfs_getxattr
+ * Returns 0 on success, negative errno (-ENOATTR) on failure */
+int xfs_removexattr(xfs_inode_t *ip, const char *name);
+
+/*
+ * Extent map (Phase 9)
+ */
+struct xfs_extmap {
+    xfs_extnum_t    em_nextents;
+    xfs_fileoff_t   *em_startoff;       /* file blocks, ascending */
+    xfs_fsblock_t   *em_startblock;
+    xfs_filblks_t   *em_blockcount;
+    unsigned char   *em_unwritten;      /* preallocated, reads as zeroes */
+    int             em_refs;
+};
+
+/* Get the data fork's extents, unpacked into one array per field
+ * @param ip      - Inode
+ * @param mapp    - Output: the map, to be released with xfs_extmap_put
+ * Returns 0 on success, negative errno on failure */
+int xfs_extmap_get(xfs_inode_t *ip, struct xfs_extmap **mapp);
+
+/* Release a map from xfs_extmap_get */
+void xfs_extmap_put(struct xfs_extmap *map);
+
+/* Find the first extent ending after a file block
+ * @param map     - Extent map
+ * @param bno     - File block
+ * Returns its index, or em_nextents if there is none */
+xfs_extnum_t xfs_extmap_lookup(const struct xfs_extmap *map, xfs_fileoff_t bno);
+
+/* Flags of an xfs_fiemap_extent, with the values FIEMAP gives them */
+#define XFS_FIEMAP_EXTENT_LAST          0x0001  /* last extent of the file */
+#define XFS_FIEMAP_EXTENT_NOT_ALIGNED   0x0100
+#define XFS_FIEMAP_EXTENT_DATA_INLINE   0x0200  /* data is in the inode */
+#define XFS_FIEMAP_EXTENT_UNWRITTEN     0x0800  /* allocated, reads as zeroes */
+
+struct xfs_fiemap_extent {
+    __uint64_t      fe_logical;         /* bytes from the start of the file */
+    __uint64_t      fe_physical;        /* bytes from the start of the device */
+    __uint64_t      fe_length;          /* bytes */
+    __uint32_t      fe_flags;
+};
+
+/* Map the extents overlapping a byte range of a file, as FIEMAP does
+ * @param ip      - Inode
+ * @param start   - First byte of the range
+ * @param len     - Its length
+ * @param ext     - Output: whole extents, in file order; NULL to count them
+ * @param count   - Room in ext
+ * Returns the number of extents stored, or found if ext is NULL, or
+ * negative errno on failure.  Continue a long map from the end of the last
+ * extent returned. */
+int xfs_fiemap(xfs_inode_t *ip, __uint64_t start, __uint64_t len,
+               struct xfs_fiemap_extent *ext, unsigned int count);
+
 struct xfs_name first_name(const char *path);
 struct xfs_name next_name(struct xfs_name current);
 
@@ -0,0 +1,70 @@
+#!/bin/bash
+#
+# common.sh - Helpers shared by the image tests
+#
+# Source this after setting SCRIPT_DIR, then call setup_work_dir with a
+# short name for the scratch directory.  A test that has more to undo than
+# the scratch directory (a mount, say) defines test_cleanup, which runs
+# first on exit.
+#
+
+TESTS_PASSED=0
+TESTS_FAILED=0
+
+if [ -t 1 ]; then
+    RED='\033[0;31m'
+    GREEN='\033[0;32m'
+    BLUE='\033[0;34m'
+    NC='\033[0m'
+else
+    RED=''
+    GREEN=''
+    BLUE=''
+    NC=''
+fi
+
+log() {
+    echo -e "${BLUE}[INFO]${NC} $1"
+}
+
+pass() {
+    TESTS_PASSED=$((TESTS_PASSED + 1))
+    echo -e "${GREEN}[PASS]${NC} $1"
+}
+
+fail() {
+    TESTS_FAILED=$((TESTS_FAILED + 1))
+    echo -e "${RED}[FAIL]${NC} $1"
+}
+
+cleanup() {
+    if declare -F test_cleanup > /dev/null; then
+        test_cleanup
+    fi
+    [ -n "$WORK_DIR" ] && rm -rf "$WORK_DIR"
+}
+
+# Arguments: name used in the scratch directory
+setup_work_dir() {
+    WORK_DIR="$(mktemp -d "/tmp/fusexfs_$1_XXXXXX")" || exit 2
+    trap cleanup EXIT
+}
+
+# Exit with status 2 unless every program named is in BIN_DIR
+require_bins() {
+    local prog
+
+    for prog in "$@"; do
+        if [ ! -x "${BIN_DIR}/${prog}" ]; then
+            echo "${BIN_DIR}/${prog} not found, build fuse-xfs first" >&2
+            exit 2
+        fi
+    done
+}
+
+# Print the totals and return non-zero if anything failed
+report() {
+    echo
+    echo "Passed: ${TESTS_PASSED}  Failed: ${TESTS_FAILED}"
+    [ "$TESTS_FAILED" -eq 0 ]
+}
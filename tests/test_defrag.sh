@@ -0,0 +1,139 @@
+#!/bin/bash
+#
+# test_defrag.sh - Tests for the xfs-defrag donor file
+#
+# The defragmenter keeps an empty scratch file, /.xfs_defrag, between
+# passes.  This script checks that it reuses the donor it created itself,
+# that its own donor is hidden from the root directory and holds no
+# blocks afterwards, and that it refuses to touch a /.xfs_defrag it did
+# not create.
+#
+# Usage: ./test_defrag.sh [bin_dir]
+#
+# bin_dir holds mkfs.xfs, xfs-cli and xfs-defrag (default: ../build/bin).
+# xfs_repair and xfs_db are used to check the images when they are in the
+# PATH.
+#
+
+set -o pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+BIN_DIR="${1:-${SCRIPT_DIR}/../build/bin}"
+
+. "${SCRIPT_DIR}/common.sh"
+setup_work_dir defrag
+
+# Make a 64MB image from a protofile listing the given root entries
+# Arguments: image, then "name source" pairs
+make_image() {
+    local image="$1"
+    local proto="${WORK_DIR}/proto"
+    shift
+
+    {
+        echo "/dev/null"
+        echo "0 0"
+        echo "d--755 0 0"
+        while [ $# -gt 0 ]; do
+            echo "$1 ---644 0 0 $2"
+            shift 2
+        done
+        echo "\$"
+    } > "$proto"
+
+    rm -f "$image"
+    dd if=/dev/zero of="$image" bs=1M count=0 seek=64 2>/dev/null &&
+        "${BIN_DIR}/mkfs.xfs" -q -f -p "$proto" "$image" \
+            > "${WORK_DIR}/mkfs.log" 2>&1
+}
+
+# Copy a file out of an image into the current directory with xfs-cli
+get_file() {
+    echo "get $2" | "${BIN_DIR}/xfs-cli" "$1" > /dev/null 2>&1
+}
+
+# Print the free block count from the superblock, or nothing without xfs_db
+free_blocks() {
+    if command -v xfs_db > /dev/null 2>&1; then
+        xfs_db -r -c "sb 0" -c "p fdblocks" "$1" 2>/dev/null |
+            sed -n 's/^fdblocks = //p'
+    fi
+}
+
+check_repair() {
+    if ! command -v xfs_repair > /dev/null 2>&1; then
+        return
+    fi
+    if xfs_repair -n -f "$1" > /dev/null 2>&1; then
+        pass "$2: xfs_repair -n finds nothing"
+    else
+        fail "$2: xfs_repair -n reports problems"
+    fi
+}
+
+require_bins mkfs.xfs xfs-cli xfs-defrag
+
+head -c 300000 /dev/urandom > "${WORK_DIR}/data"
+cd "$WORK_DIR" || exit 2
+
+# ----------------------------------------------------------------------------
+log "A /.xfs_defrag the defragmenter did not create is left alone"
+
+make_image stray.img .xfs_defrag "${WORK_DIR}/data" file "${WORK_DIR}/data" ||
+    exit 2
+out=$("${BIN_DIR}/xfs-defrag" stray.img / 2>&1)
+if [ $? -ne 0 ] && echo "$out" | grep -q "File exists"; then
+    pass "stray donor: pass refused with EEXIST"
+else
+    fail "stray donor: expected EEXIST, got: $out"
+fi
+
+mkdir stray && (cd stray && get_file ../stray.img .xfs_defrag)
+if cmp -s "${WORK_DIR}/data" stray/.xfs_defrag; then
+    pass "stray donor: contents untouched"
+else
+    fail "stray donor: contents changed"
+fi
+check_repair stray.img "stray donor"
+
+# ----------------------------------------------------------------------------
+log "The donor made by one pass is reused by the next"
+
+make_image own.img file "${WORK_DIR}/data" || exit 2
+free_before=$(free_blocks own.img)
+for pass_no in 1 2; do
+    out=$("${BIN_DIR}/xfs-defrag" own.img / 2>&1)
+    if [ $? -eq 0 ]; then
+        pass "own donor: pass ${pass_no} succeeds"
+    else
+        fail "own donor: pass ${pass_no} failed: $out"
+    fi
+done
+
+mkdir own && (cd own && get_file ../own.img .xfs_defrag && get_file ../own.img file)
+if [ ! -e own/.xfs_defrag ]; then
+    pass "own donor: hidden from lookups"
+else
+    fail "own donor: /.xfs_defrag can be looked up"
+fi
+if ! echo ls | "${BIN_DIR}/xfs-cli" own.img 2>/dev/null | grep -q "xfs_defrag"; then
+    pass "own donor: hidden from the root listing"
+else
+    fail "own donor: /.xfs_defrag listed in the root directory"
+fi
+free_after=$(free_blocks own.img)
+if [ -n "$free_before" ]; then
+    if [ "$free_before" = "$free_after" ]; then
+        pass "own donor: left behind empty"
+    else
+        fail "own donor: ${free_before} free blocks before, ${free_after} after"
+    fi
+fi
+if cmp -s "${WORK_DIR}/data" own/file; then
+    pass "own donor: file contents kept"
+else
+    fail "own donor: file contents changed"
+fi
+check_repair own.img "own donor"
+
+report
@@ -0,0 +1,179 @@
+#!/bin/bash
+#
+# test_fiemap.sh - Compare extent maps from xfs-cli and the mount
+#
+# Writes a few files through a read-write mount, then checks that the map
+# FUSE_XFS_IOC_FIEMAP returns on a read-only mount is the one xfs-cli's
+# bmap command prints from the image.  One file has more extents than fit
+# in a single ioctl reply, so the map has to be continued.
+#
+# Usage: ./test_fiemap.sh [bin_dir]
+#
+# bin_dir holds mkfs.xfs, xfs-cli and fuse-xfs (default: ../build/bin).
+# Needs python3 to issue the ioctl, and FUSE.
+#
+
+set -o pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+BIN_DIR="${1:-${SCRIPT_DIR}/../build/bin}"
+
+. "${SCRIPT_DIR}/common.sh"
+setup_work_dir fiemap
+
+IMAGE="${WORK_DIR}/fiemap.img"
+MNT="${WORK_DIR}/mnt"
+FUSEXFS_PID=""
+
+# Arguments: extra fuse-xfs options
+mount_image() {
+    local i
+
+    "${BIN_DIR}/fuse-xfs" "$@" "$IMAGE" -- "$MNT" -f \
+        > "${WORK_DIR}/fuse-xfs.log" 2>&1 &
+    FUSEXFS_PID=$!
+    for i in $(seq 1 30); do
+        if mountpoint -q "$MNT" 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.5
+    done
+    echo "fuse-xfs did not mount ${IMAGE}" >&2
+    return 1
+}
+
+unmount_image() {
+    [ -n "$FUSEXFS_PID" ] || return 0
+    sync
+    fusermount -u "$MNT" 2>/dev/null || umount "$MNT" 2>/dev/null
+    wait "$FUSEXFS_PID" 2>/dev/null
+    FUSEXFS_PID=""
+}
+
+test_cleanup() {
+    unmount_image
+}
+
+# Print a file's map from the mount in xfs-cli's bmap format
+# Arguments: file, extents to ask for per ioctl (0 only counts them)
+ioctl_bmap() {
+    python3 - "$1" "$2" << 'EOF'
+import fcntl, os, struct, sys
+
+EXTENTS = 64                            # FUSE_XFS_FIEMAP_EXTENTS
+HDR = struct.Struct("=QQIIII")
+EXT = struct.Struct("=QQQ16xI12x")
+SIZE = HDR.size + EXTENTS * EXT.size
+IOC_FIEMAP = (3 << 30) | (SIZE << 16) | (ord("X") << 8) | 200
+FLAG_LAST, FLAG_UNWRITTEN, FLAG_INLINE = 0x1, 0x800, 0x200
+
+path, count = sys.argv[1], int(sys.argv[2])
+fd = os.open(path, os.O_RDONLY)
+
+def fiemap(start):
+    buf = bytearray(SIZE)
+    HDR.pack_into(buf, 0, start, 2**64 - 1 - start, 0, 0, count, 0)
+    fcntl.ioctl(fd, IOC_FIEMAP, buf)
+    n = HDR.unpack_from(buf, 0)[3]
+    return n, [EXT.unpack_from(buf, HDR.size + i * EXT.size)
+               for i in range(min(n, count))]
+
+if count == 0:
+    print(fiemap(0)[0])
+    sys.exit(0)
+
+print(path + ":")
+size = os.fstat(fd).st_size
+pos = index = 0
+done = False
+while not done:
+    n, exts = fiemap(pos)
+    if n > count:
+        sys.exit("%d extents returned for %d asked" % (n, count))
+    if not exts:
+        break
+    for logical, physical, length, flags in exts:
+        if logical > pos:
+            print("\t%d: [%d..%d]: hole" % (index, pos >> 9, (logical >> 9) - 1))
+            index += 1
+        if flags & FLAG_INLINE:
+            print("\t%d: [%d..%d]: inline" % (index, logical >> 9,
+                  ((logical + length + 511) >> 9) - 1))
+        else:
+            print("\t%d: [%d..%d]: %d..%d%s" % (index, logical >> 9,
+                  ((logical + length) >> 9) - 1, physical >> 9,
+                  ((physical + length) >> 9) - 1,
+                  " unwritten" if flags & FLAG_UNWRITTEN else ""))
+        index += 1
+        pos = logical + length
+        done = flags & FLAG_LAST
+if pos < size:
+    print("\t%d: [%d..%d]: hole" % (index, pos >> 9, ((size + 511) >> 9) - 1))
+EOF
+}
+
+# The same map from the image, with xfs-cli
+cli_bmap() {
+    echo "bmap $1" | "${BIN_DIR}/xfs-cli" "$IMAGE" 2>/dev/null |
+        sed -n -e '/^\//{/^\/> /!p}' -e '/^\t/p'
+}
+
+require_bins mkfs.xfs xfs-cli fuse-xfs
+if ! command -v python3 > /dev/null 2>&1; then
+    echo "python3 is needed to issue the ioctl" >&2
+    exit 2
+fi
+
+mkdir -p "$MNT"
+dd if=/dev/zero of="$IMAGE" bs=1M count=0 seek=64 2>/dev/null &&
+    "${BIN_DIR}/mkfs.xfs" -q -f "$IMAGE" > "${WORK_DIR}/mkfs.log" 2>&1 ||
+    exit 2
+
+# ----------------------------------------------------------------------------
+log "Writing test files"
+
+mount_image -rw || exit 2
+dd if=/dev/urandom of="${MNT}/dense" bs=64k count=16 2>/dev/null
+: > "${MNT}/empty"
+# 100 blocks with a hole after each, and a hole at the end
+for i in $(seq 0 99); do
+    dd if=/dev/urandom of="${MNT}/sparse" bs=4k count=1 seek=$((i * 2)) \
+        conv=notrunc 2>/dev/null
+done
+truncate -s 1M "${MNT}/sparse"
+unmount_image
+
+# ----------------------------------------------------------------------------
+log "Comparing maps"
+
+mount_image || exit 2
+for f in dense empty sparse; do
+    expected=$(cli_bmap "$f")
+    actual=$(ioctl_bmap "${MNT}/${f}" 64 | sed "1s|.*|/${f}:|")
+    if [ -n "$expected" ] && [ "$expected" = "$actual" ]; then
+        pass "${f}: ioctl map matches xfs-cli bmap"
+    else
+        fail "${f}: maps differ"
+        diff <(echo "$expected") <(echo "$actual")
+    fi
+done
+
+# A short array makes the sparse file take many replies
+expected=$(cli_bmap sparse)
+actual=$(ioctl_bmap "${MNT}/sparse" 7 | sed "1s|.*|/sparse:|")
+if [ "$expected" = "$actual" ]; then
+    pass "sparse: map continued 7 extents at a time"
+else
+    fail "sparse: continued map differs"
+fi
+
+extents=$(cli_bmap sparse | grep -vc "hole\|:$")
+counted=$(ioctl_bmap "${MNT}/sparse" 0)
+if [ "$extents" = "$counted" ]; then
+    pass "sparse: fm_extent_count 0 counts ${counted} extents"
+else
+    fail "sparse: counted ${counted} extents, xfs-cli shows ${extents}"
+fi
+unmount_image
+
+report